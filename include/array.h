@@ -0,0 +1,206 @@
+/*******************************************************************************
+ * Copyright (c) 2022 Craig Jacobson
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ ******************************************************************************/
+/**
+ * @file array.h
+ * @author Craig Jacobson
+ * @brief Packed arrays of fixed width values.
+ *
+ * A DATA_ARR holds elements of one fixed width type (DATA_U1 through
+ * DATA_F8, or DATA_BOOL) unboxed and contiguous. Elementwise arithmetic,
+ * comparisons and reductions run through SIMD kernels picked at runtime,
+ * the same ISA choice as the byte kernels (memops_set_isa).
+ *
+ * Integer arithmetic wraps at the element width like C unsigned math.
+ * Float min and max propagate NaN.
+ *
+ * arr_pmap, arr_pfilter and arr_preduce spread a function over the
+ * elements across a scheduler's workers, keeping the element order in
+ * what they return.
+ */
+#ifndef SYMBOLSCRIPT_ARRAY_H_
+#define SYMBOLSCRIPT_ARRAY_H_
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+
+#include "data.h"
+#include "scheduler.h"
+
+
+#define ARR_LEN_MAX UINT32_MAX
+
+enum arr_op
+{
+    ARR_ADD,
+    ARR_SUB,
+    ARR_MUL,
+    ARR_DIV,
+    ARR_MIN,
+    ARR_MAX,
+};
+
+enum arr_cmp
+{
+    ARR_EQ,
+    ARR_NE,
+    ARR_LT,
+    ARR_LE,
+    ARR_GT,
+    ARR_GE,
+};
+
+enum arr_reduce
+{
+    ARR_SUM,
+    ARR_LEAST,
+    ARR_MOST,
+};
+
+/**
+ * A function over boxed elements, with ctx passed through.
+ * Only one declared pure, with no side effects and a result that
+ * depends on nothing but its arguments, is run in parallel; any other
+ * runs over the elements in order on the caller's thread.
+ * A reduction also needs combine, merging two accumulators, to run in
+ * parallel.
+ */
+typedef struct
+{
+    error_t (*fn)(data_t *r, const data_t *args, const void *ctx);
+    const void *ctx;
+    bool pure;
+    error_t (*combine)(data_t *r, const data_t *args, const void *ctx);
+} arr_fn_t;
+
+/**
+ * @return Bytes per element, zero if the type can't be packed.
+ */
+size_t
+arr_width(enum data_type elem);
+
+/**
+ * @brief Make an array of len elements, copied from init or zeroed if NULL.
+ * @return EINVAL if elem can't be packed, E2BIG past ARR_LEN_MAX.
+ */
+error_t
+mk_arr(data_t *d, enum data_type elem, size_t len, const void *init);
+
+enum data_type
+arr_elem(data_t a);
+size_t
+arr_len(data_t a);
+
+/**
+ * @brief Read only view of the elements.
+ */
+const void *
+arr_data(data_t a);
+
+/**
+ * @brief Writable elements; copies first if the array is shared.
+ */
+error_t
+arr_mut(data_t *a, void **v);
+
+/**
+ * @brief Box element i. ERANGE out of bounds.
+ */
+error_t
+arr_get(data_t *v, data_t a, size_t i);
+
+/**
+ * @brief Store v, which must be the element type (EINVAL), at i.
+ */
+error_t
+arr_set(data_t *a, size_t i, data_t v);
+error_t
+arr_push(data_t *a, data_t v);
+
+/**
+ * @brief r = a op b, elementwise.
+ * b is an array of the same type (EINVAL) and length (ERANGE), or a
+ * scalar of the element type applied to every element.
+ * Integer division by zero is EDOM.
+ * DATA_BOOL arrays don't do arithmetic (EINVAL).
+ */
+error_t
+arr_binop(data_t *r, enum arr_op op, data_t a, data_t b);
+
+/**
+ * @brief DATA_BOOL array of a cmp b, with b as for arr_binop.
+ */
+error_t
+arr_compare(data_t *mask, enum arr_cmp cmp, data_t a, data_t b);
+
+/**
+ * @brief Sum, least or most element.
+ * Sums of integers are DATA_I8/DATA_U8 (wrapping); DATA_BOOL sums count
+ * the true elements. Floats accumulate in double across SIMD lanes, so
+ * the result may differ in the last bits from a sequential sum.
+ * Least and most of DATA_BOOL are all and any; empty arrays are EDOM.
+ */
+error_t
+arr_reduce(data_t *r, enum arr_reduce red, data_t a);
+
+/**
+ * @brief r[i] = a[idx[i]]; idx is any integer array. ERANGE out of bounds.
+ */
+error_t
+arr_gather(data_t *r, data_t a, data_t idx);
+
+/**
+ * @brief Elements of a where the DATA_BOOL mask of the same length is true.
+ */
+error_t
+arr_filter(data_t *r, data_t a, data_t mask);
+
+/**
+ * @brief r[i] = fn(a[i]), each result of type elem (EINVAL).
+ * @param s Where to run fn; NULL runs it on the caller.
+ * @return The error from the first element fn failed on.
+ */
+error_t
+arr_pmap(data_t *r, sched_t *s, enum data_type elem, data_t a, const arr_fn_t *fn);
+
+/**
+ * @brief Elements of a for which fn, returning DATA_BOOL, is true.
+ */
+error_t
+arr_pfilter(data_t *r, sched_t *s, data_t a, const arr_fn_t *fn);
+
+/**
+ * @brief Fold a into init with fn(acc, element).
+ * With a pure fn and a combine, every chunk of a is folded from init in
+ * parallel and the chunk results are merged in order with
+ * combine(acc, acc). So combine must be associative with init as its
+ * identity (0 for a sum), but need not commute. Otherwise the fold runs
+ * in order on the caller's thread.
+ */
+error_t
+arr_preduce(data_t *r, sched_t *s, data_t a, data_t init, const arr_fn_t *fn);
+
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* SYMBOLSCRIPT_ARRAY_H_ */
@@ -0,0 +1,142 @@
+/*******************************************************************************
+ * Copyright (c) 2022 Craig Jacobson
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ ******************************************************************************/
+/**
+ * @file channel.h
+ * @author Craig Jacobson
+ * @brief Bounded channels between tasks.
+ *
+ * A channel is a fixed size ring any number of threads send to and
+ * receive from without locks; each slot carries a sequence number
+ * telling senders and receivers whose turn it is. Sending to a full
+ * channel or receiving from an empty one waits through the scheduler,
+ * which is what gives a pipeline of tasks its backpressure:
+ * ```
+ * chan_init(&c, &s, 64);
+ * // producer                   // consumer
+ * chan_send(&c, v);             while (!chan_recv(&c, &v)) { ... }
+ * chan_close(&c);
+ * ```
+ * Values are shared by reference, like task captures, so they must not
+ * change while in flight.
+ */
+#ifndef SYMBOLSCRIPT_CHANNEL_H_
+#define SYMBOLSCRIPT_CHANNEL_H_
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+
+#include "data.h"
+#include "scheduler.h"
+#include "symio.h"
+
+
+#define CHAN_LINE 64
+
+typedef struct
+{
+    uint64_t seq;
+    data_t v;
+} chanslot_t;
+
+typedef struct
+{
+    chanslot_t *slots;
+    size_t mask;
+    sched_t *sched;
+    uint32_t waiting; // Senders and receivers in sched_wait
+    bool closed;
+    uint8_t pad[CHAN_LINE];
+    uint64_t head; // Next to send
+    uint8_t pad2[CHAN_LINE - sizeof(uint64_t)];
+    uint64_t tail; // Next to receive
+} chan_t;
+
+typedef struct
+{
+    chan_t *chan;
+    bool send;
+    data_t v; // Sent, or where the received value goes
+} chan_op_t;
+
+/**
+ * @brief Channel holding up to cap values, rounded up to a power of two.
+ * @param s Whose threads wait on the channel.
+ */
+error_t
+chan_init(chan_t *c, sched_t *s, size_t cap);
+
+/**
+ * @brief Release the channel and any values still in it.
+ */
+void
+chan_destroy(chan_t *c);
+
+/**
+ * @brief No more sends. Receivers drain what is left.
+ */
+void
+chan_close(chan_t *c);
+
+/**
+ * @brief Send a reference to v, waiting while the channel is full.
+ * @return EPIPE if the channel is closed.
+ */
+error_t
+chan_send(chan_t *c, data_t v);
+
+/**
+ * @brief Receive into v, waiting while the channel is empty.
+ * @return EPIPE once the channel is closed and empty.
+ */
+error_t
+chan_recv(chan_t *c, data_t *v);
+
+/**
+ * @brief Send without waiting. EAGAIN if the channel is full.
+ */
+error_t
+chan_trysend(chan_t *c, data_t v);
+
+/**
+ * @brief Receive without waiting. EAGAIN if the channel is empty.
+ */
+error_t
+chan_tryrecv(chan_t *c, data_t *v);
+
+/**
+ * @brief Do whichever of the operations can go first, waiting for one.
+ * Ready operations are taken in turn across calls so none starves.
+ * Every channel must wait through the same scheduler.
+ * @param which Set to the index of the operation done.
+ * @return EPIPE if that operation found its channel closed, EINVAL if
+ *         the channels are bound to different schedulers.
+ */
+error_t
+chan_select(size_t n, chan_op_t *ops, size_t *which);
+
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* SYMBOLSCRIPT_CHANNEL_H_ */
+
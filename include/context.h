@@ -33,16 +33,14 @@ extern "C" {
 #endif
 
 
-#include <stdbool.h>
-#include <stdint.h>
+#include "map.h"
 
 
 /*******************************************************************************
  * CONTEXT
  *
- * Basically a map.
- * Since most contexts are small and lookup is done at binding time
- * we will start by using an array.
+ * Symbol bindings, looked up through the same map scripts use.
+ * Bindings stay in the order they were made.
  ******************************************************************************/
 
 // Immutability
@@ -51,49 +49,37 @@ extern "C" {
 typedef struct
 {
     int flags;
-    const char *name;
+    data_t name; // DATA_SYM
     void *bound;
     void *meta; // aka annotations, but meta is shorter
 } binding_t;
 
 typedef struct
 {
-    char quicklist[8];
+    map_t names; // Symbol to index in bindings
     binding_t *bindings;
     size_t bindingslen;
+    size_t bindingscap;
 } context_t;
 
+void
+context_init(context_t *c);
+void
+context_destroy(context_t *c);
+
 /**
- * Tokenizer.
- * Assumes that input buffers are a valid stream of UTF-8 characters.
- * ```
- * tokenizer_init(t);
- * while (line = get_line())
- * {
- *   tokenizer_set_line(t, line, linelen);
- *   while (tokenize(t, &tok)) { // stuff; }
- * }
- * tokenizer_destroy(t);
- * ```
+ * @brief Bind name in this context.
+ * @return EEXIST if already bound.
  */
-typedef struct
-{
-    enum tokstate state;
-    const uint8_t *line;
-    size_t linelen;
-    uint64_t linenum; // Updated with each set line call
-    uint64_t colindex; // Updated after each token is output
-    uint64_t colprevindex;
-} tokenizer_t;
+error_t
+context_bind(context_t *c, size_t len, const uint8_t *name, int flags,
+             void *bound, void *meta);
 
-void
-tokenizer_init(tokenizer_t *t);
-void
-tokenizer_destroy(tokenizer_t *t);
-void
-tokenizer_set_line(tokenizer_t *t, const uint8_t *line, size_t linelen);
-bool
-tokenize(tokenizer_t *t, token_t *tok);
+/**
+ * @return NULL if unbound.
+ */
+binding_t *
+context_lookup(const context_t *c, size_t len, const uint8_t *name);
 
 #ifdef __cplusplus
 }
@@ -24,14 +24,17 @@
  * @author Craig Jacobson
  * @brief Primitive data types for the language.
  */
-#ifndef SYMBOLSCRIPT_BINARY_H_
-#define SYMBOLSCRIPT_BINARY_H_
+#ifndef SYMBOLSCRIPT_DATA_H_
+#define SYMBOLSCRIPT_DATA_H_
 #ifdef __cplusplus
 extern "C" {
 #endif
 
 
+#include <string.h>
+
 #include "symcore.h"
+#include "symio.h"
 
 
 enum data_type
@@ -50,74 +53,591 @@ enum data_type
     DATA_F8,
     DATA_BIN,
     DATA_BOOL,
+    DATA_SYM,
+    DATA_ARR,
+    DATA_MAP,
 };
 
+/*******************************************************************************
+ * DATA
+ *
+ * Every value is one 64-bit word (NaN-boxed).
+ * Any bit pattern that is not a boxed NaN is an F8 and stored as is.
+ * Boxed values set the sign, all exponent bits, and the quiet bit;
+ * the next three bits are the tag and the low 48 bits are the payload:
+ *
+ *   [1][11111111111][1][tag:3][payload:48]
+ *
+ *   DATA_TAG_IMM   type in bits [40, 48), 32-bit value in bits [0, 32)
+ *   DATA_TAG_SYM   symbol of up to six bytes, NUL padded
+ *   DATA_TAG_INT   DATA_I that fits in 48 bits (signed)
+ *   DATA_TAG_UINT  DATA_U that fits in 48 bits
+ *   DATA_TAG_I8    DATA_I8 that fits in 48 bits (signed)
+ *   DATA_TAG_U8    DATA_U8 that fits in 48 bits
+ *   DATA_TAG_PTR   pointer to a refcounted heap object (dataobj_t)
+ *
+ * Tag zero is never produced since NaNs are canonicalized to DATA_NAN.
+ * F4 NaNs are likewise canonicalized to DATA_NAN4 so equal values share bits.
+ ******************************************************************************/
+
 typedef struct
 {
-    uint32_t info;
+    uint64_t bits;
 } data_t;
 
+#define DATA_BOXED    0xFFF8000000000000ULL
+#define DATA_PAYLOAD  0x0000FFFFFFFFFFFFULL
+#define DATA_NAN      0x7FF8000000000000ULL
+#define DATA_NAN4     0x7FC00000U
+
+#define DATA_TAG_IMM  1
+#define DATA_TAG_SYM  2
+#define DATA_TAG_INT  3
+#define DATA_TAG_UINT 4
+#define DATA_TAG_I8   5
+#define DATA_TAG_U8   6
+#define DATA_TAG_PTR  7
+
+#define DATA_INLINE_MAX ((int64_t)0x00007FFFFFFFFFFFLL)
+#define DATA_INLINE_MIN (-DATA_INLINE_MAX - 1)
+#define DATA_INLINE_UMAX ((uint64_t)DATA_PAYLOAD)
+#define DATA_SYM_INLINE 6
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define DATA_SYM_OFFSET 2
+#else
+#define DATA_SYM_OFFSET 0
+#endif
+
+/**
+ * Header of every heap allocated value.
+ * Values pointing here share it; the last un_data frees it.
+ * Counts are atomic so values can be shared between threads, but a
+ * shared value must not be changed.
+ */
 typedef struct
 {
-    uint32_t len;
-    uint8_t *s;
-} slice_t;
+    uint32_t type; // enum data_type
+    uint32_t refs;
+} dataobj_t;
 
-enum liner_either
+static inline void
+refs_inc(uint32_t *refs)
 {
-    LINER_LINE,
-    LINER_ERROR,
-};
+    __atomic_add_fetch(refs, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * @return True when that was the last reference.
+ */
+static inline bool
+refs_dec(uint32_t *refs)
+{
+    return 0 == __atomic_sub_fetch(refs, 1, __ATOMIC_ACQ_REL);
+}
+
+static inline uint32_t
+refs_get(const uint32_t *refs)
+{
+    return __atomic_load_n(refs, __ATOMIC_ACQUIRE);
+}
+
+static inline data_t
+data_box(unsigned tag, uint64_t payload)
+{
+    return (data_t){ DATA_BOXED | ((uint64_t)tag << 48) | (payload & DATA_PAYLOAD) };
+}
+
+static inline bool
+data_isboxed(data_t d)
+{
+    return DATA_BOXED == (d.bits & DATA_BOXED);
+}
+
+static inline unsigned
+data_tag(data_t d)
+{
+    return data_isboxed(d) ? (unsigned)((d.bits >> 48) & 0x7) : 0;
+}
+
+static inline bool
+data_isobj(data_t d)
+{
+    return DATA_TAG_PTR == data_tag(d);
+}
+
+static inline dataobj_t *
+data_obj(data_t d)
+{
+    return (dataobj_t *)(uintptr_t)(d.bits & DATA_PAYLOAD);
+}
+
+static inline int64_t
+data_payload_signed(data_t d)
+{
+    // Sign extend from 48 bits
+    return ((int64_t)(d.bits << 16)) >> 16;
+}
+
+enum data_type
+data_typeof(data_t d);
+
+/*******************************************************************************
+ * Inline scalars.
+ * These never allocate.
+ ******************************************************************************/
+
+static inline data_t
+mk_imm(enum data_type type, uint32_t v)
+{
+    return data_box(DATA_TAG_IMM, ((uint64_t)type << 40) | v);
+}
+
+static inline data_t
+mk_bool(bool v)
+{
+    return mk_imm(DATA_BOOL, v ? 1 : 0);
+}
+
+static inline data_t
+mk_i1(int8_t v)
+{
+    return mk_imm(DATA_I1, (uint32_t)(int32_t)v);
+}
+
+static inline data_t
+mk_i2(int16_t v)
+{
+    return mk_imm(DATA_I2, (uint32_t)(int32_t)v);
+}
+
+static inline data_t
+mk_i4(int32_t v)
+{
+    return mk_imm(DATA_I4, (uint32_t)v);
+}
+
+static inline data_t
+mk_u1(uint8_t v)
+{
+    return mk_imm(DATA_U1, v);
+}
+
+static inline data_t
+mk_u2(uint16_t v)
+{
+    return mk_imm(DATA_U2, v);
+}
+
+static inline data_t
+mk_u4(uint32_t v)
+{
+    return mk_imm(DATA_U4, v);
+}
+
+static inline data_t
+mk_f4(float v)
+{
+    uint32_t bits = DATA_NAN4;
+    if (v == v)
+    {
+        memcpy(&bits, &v, sizeof(bits));
+    }
+    return mk_imm(DATA_F4, bits);
+}
+
+static inline data_t
+mk_f8(double v)
+{
+    data_t d;
+    if (v != v)
+    {
+        d.bits = DATA_NAN;
+    }
+    else
+    {
+        memcpy(&d.bits, &v, sizeof(d.bits));
+    }
+    return d;
+}
 
+static inline uint32_t
+data_imm(data_t d)
+{
+    return (uint32_t)d.bits;
+}
+
+static inline bool
+data_bool(data_t d)
+{
+    return 0 != data_imm(d);
+}
+
+static inline int32_t
+data_i4(data_t d)
+{
+    return (int32_t)data_imm(d);
+}
+
+static inline uint32_t
+data_u4(data_t d)
+{
+    return data_imm(d);
+}
+
+static inline float
+data_f4(data_t d)
+{
+    float v;
+    uint32_t bits = data_imm(d);
+    memcpy(&v, &bits, sizeof(v));
+    return v;
+}
+
+static inline double
+data_f8(data_t d)
+{
+    double v;
+    memcpy(&v, &d.bits, sizeof(v));
+    return v;
+}
+
+/*******************************************************************************
+ * Values that may need the heap.
+ * Small values are stored inline, larger ones are boxed and refcounted.
+ * Return ENOMEM if the box cannot be allocated.
+ ******************************************************************************/
+
+error_t
+mk_i8(data_t *d, int64_t v);
+error_t
+mk_u8(data_t *d, uint64_t v);
+error_t
+mk_sym(data_t *d, size_t len, const uint8_t *s);
+
+int64_t
+data_i8(data_t d);
+uint64_t
+data_u8(data_t d);
+
+/**
+ * @brief Get the bytes of a symbol.
+ * Inline symbols point into the data_t itself, so keep it alive.
+ */
+const uint8_t *
+data_sym(const data_t *d, size_t *len);
+
+bool
+data_sym_eq(data_t a, data_t b);
+
+/**
+ * @brief Same type and value; binaries, symbols and arrays by content,
+ * maps by identity. Floats compare as numbers except NaN equals NaN.
+ */
+bool
+data_eq(data_t a, data_t b);
+
+/**
+ * @brief Hash consistent with data_eq; binaries hash with memhash.
+ */
+uint64_t
+data_hash(data_t d);
+
+/**
+ * @brief Share a value; no-op for inline values.
+ */
+data_t
+data_ref(data_t d);
+
+/**
+ * @brief Release a value; frees boxed values on the last reference.
+ */
+void
+un_data(data_t d);
+
+
+/*******************************************************************************
+ * INTEGERS
+ *
+ * DATA_I and DATA_U are arbitrary precision.
+ * Values fitting the 48-bit payload are inline and their arithmetic never
+ * allocates; results promote to heap limbs only when they overflow it,
+ * and demote back when they fit again.
+ * Operands must be the same type (EINVAL); DATA_U going negative is ERANGE.
+ ******************************************************************************/
+
+error_t
+mk_int(data_t *d, int64_t v);
+error_t
+mk_uint(data_t *d, uint64_t v);
+
+/**
+ * @brief Make DATA_I or DATA_U from a magnitude, 64-bit limbs, low first.
+ */
+error_t
+mk_int_limbs(data_t *d, enum data_type type, bool neg, size_t len,
+             const uint64_t *limbs);
+
+/**
+ * @brief Get sign and magnitude; inline values are expanded into one.
+ * @return Number of limbs, zero for zero.
+ */
+size_t
+data_int_limbs(const data_t *d, bool *neg, const uint64_t **limbs, uint64_t *one);
+
+/**
+ * @return False if the value does not fit.
+ */
+bool
+data_int_i8(data_t d, int64_t *v);
+bool
+data_int_u8(data_t d, uint64_t *v);
+
+error_t
+data_int_add(data_t *r, data_t a, data_t b);
+error_t
+data_int_sub(data_t *r, data_t a, data_t b);
+error_t
+data_int_mul(data_t *r, data_t a, data_t b);
+int
+data_int_cmp(data_t a, data_t b);
+
+/**
+ * @brief Divide by a machine word, truncating toward zero.
+ * The remainder is of the magnitude.
+ * @return EINVAL unless a is DATA_I or DATA_U, EDOM if div is zero.
+ */
+error_t
+data_int_divmod_small(data_t *q, uint64_t *rem, data_t a, uint64_t div);
+
+
+/**
+ * Borrowed view of bytes; does not own them.
+ */
 typedef struct
 {
+    uint32_t len;
     uint8_t *s;
-    size_t len;
-} line_t;
+} slice_t;
+
+/*******************************************************************************
+ * BINARY
+ *
+ * Owning binary value, 16 bytes, passed around by value.
+ * Up to BIN_SMALL bytes are stored inline in the bin itself.
+ * Longer payloads live in a refcounted binbuf_t and the bin is a window
+ * (off, len) into it, so substrings share the parent storage in O(1).
+ * Writers go through bin_mut, which copies if the buffer is shared.
+ * The length is stored first in both layouts and picks the layout.
+ ******************************************************************************/
+
+#define BIN_SMALL 12
+#define BIN_MAX UINT32_MAX
 
 typedef struct
 {
-    enum liner_either type;
-    union
+    uint32_t refs;
+    uint32_t cap;
+    uint8_t s[];
+} binbuf_t;
+
+typedef union
+{
+    struct
+    {
+        uint32_t len;
+        uint8_t s[BIN_SMALL];
+    } small;
+    struct
     {
-        line_t line;
-        error_t error;
-    } u;
-} line_io_t;
+        uint32_t len;
+        uint32_t off;
+        binbuf_t *buf;
+    } big;
+} bin_t;
 
-typedef error_t (*liner_open_t)(void *src);
-typedef line_io_t (*liner_get_line_t)(void *src, void *context);
-typedef void (*liner_free_line_t)(void *src, line_io_t line);
-typedef error_t (*liner_close_t)(void *src);
+static inline size_t
+bin_len(const bin_t *b)
+{
+    return b->small.len;
+}
 
-typedef struct
+static inline bool
+bin_issmall(const bin_t *b)
 {
-    void *src;
-    liner_open_t open;
-    liner_get_line_t get_line;
-    liner_free_line_t free_line;
-    liner_close_t close;
-} liner_t;
+    return b->small.len <= BIN_SMALL;
+}
 
-liner_t
-mk_liner_from_command_line(void);
-liner_t
-mk_liner_from_stdin(void);
-liner_t
-mk_liner_from_file(const char *filepath);
+static inline const uint8_t *
+bin_bytes(const bin_t *b)
+{
+    return bin_issmall(b) ? b->small.s : b->big.buf->s + b->big.off;
+}
 
+static inline slice_t
+bin_slice(const bin_t *b)
+{
+    return (slice_t){ b->small.len, (uint8_t *)bin_bytes(b) };
+}
 
+/**
+ * @brief Copy len bytes of s into a new binary.
+ * @return ENOMEM, E2BIG if longer than BIN_MAX, zero otherwise.
+ */
+error_t
+mk_bin(bin_t *b, size_t len, const uint8_t *s);
 
-slice_t
-mk_bin(size_t len, uint8_t *b);
+/**
+ * @brief Make a binary of len bytes for the caller to fill in through s.
+ */
+error_t
+mk_bin_buf(bin_t *b, size_t len, uint8_t **s);
 
 void
-un_bin(slice_t slice);
+un_bin(bin_t b);
 
+/**
+ * @brief Share a binary; the copy must be released with un_bin as well.
+ */
+bin_t
+bin_ref(bin_t b);
+
+/**
+ * @brief Take bytes [off, off + len) of b without copying large payloads.
+ * @return ERANGE if out of bounds, zero otherwise.
+ */
+error_t
+bin_sub(bin_t *sub, const bin_t *b, size_t off, size_t len);
+
+/**
+ * @brief Get writable bytes, copying first if the storage is shared.
+ * @return ENOMEM if the copy failed, zero otherwise.
+ */
+error_t
+bin_mut(bin_t *b, uint8_t **s);
+
+#define BIN_NPOS SIZE_MAX
+
+bool
+bin_eq(const bin_t *a, const bin_t *b);
+
+/**
+ * @brief Byte-wise order, see memorder.
+ */
+int
+bin_cmp(const bin_t *a, const bin_t *b);
+
+/**
+ * @return Index of the first needle at or after from, BIN_NPOS if none.
+ */
+size_t
+bin_find(const bin_t *hay, const bin_t *needle, size_t from);
+size_t
+bin_findbyte(const bin_t *b, uint8_t c, size_t from);
+
+/**
+ * @brief ASCII case mapping into a new binary.
+ */
+error_t
+bin_lower(bin_t *out, const bin_t *b);
+error_t
+bin_upper(bin_t *out, const bin_t *b);
+
+uint64_t
+bin_hash(const bin_t *b);
+
+/**
+ * @brief Append bytes to b.
+ * Grows in place when b is the only owner of its buffer, so repeated
+ * appends are amortized O(1); otherwise copies into a fresh buffer.
+ */
+error_t
+bin_cat(bin_t *b, size_t len, const uint8_t *s);
+
+/*******************************************************************************
+ * BUILDER
+ *
+ * Accumulates a binary from many pieces without recopying them.
+ * Small appends are copied into chunks that grow geometrically,
+ * large binaries are kept by reference.
+ * Everything is copied once, on binbuilder_finish.
+ * ```
+ * binbuilder_init(bb);
+ * binbuilder_add(bb, len, s);
+ * binbuilder_add_bin(bb, &b);
+ * binbuilder_finish(bb, &out);
+ * binbuilder_destroy(bb);
+ * ```
+ ******************************************************************************/
+
+#define BINBUILDER_CHUNK 64
+#define BINBUILDER_CHUNK_MAX (64 * 1024)
+#define BINBUILDER_SHARE 256
+
+struct binpiece;
+
+typedef struct
+{
+    struct binpiece *pieces;
+    size_t piecelen;
+    size_t piececap;
+    size_t len; // Total bytes
+    size_t chunk; // Size of the next chunk
+    bool open; // Last piece is a chunk still being filled
+} binbuilder_t;
+
+void
+binbuilder_init(binbuilder_t *bb);
+void
+binbuilder_destroy(binbuilder_t *bb);
+error_t
+binbuilder_add(binbuilder_t *bb, size_t len, const uint8_t *s);
+error_t
+binbuilder_add_bin(binbuilder_t *bb, const bin_t *b);
+
+/**
+ * @brief Flatten into one binary and reset the builder.
+ */
+error_t
+binbuilder_finish(binbuilder_t *bb, bin_t *b);
+
+/**
+ * @brief Write the pieces out in order without flattening.
+ */
+error_t
+binbuilder_write(const binbuilder_t *bb, FILE *f);
+
+/*******************************************************************************
+ * DATA_BIN values.
+ * Concatenation keeps a rope of pieces in the box and flattens it lazily,
+ * on the first data_bin call; data_bin_write never flattens.
+ ******************************************************************************/
+
+/**
+ * @brief Box a binary as a DATA_BIN value; takes ownership of b.
+ */
+error_t
+mk_bin_data(data_t *d, bin_t b);
+
+/**
+ * @brief Get the bytes of a DATA_BIN value, flattening it if needed.
+ * @return NULL if flattening ran out of memory.
+ */
+const bin_t *
+data_bin(data_t d);
+
+/**
+ * @brief Append b to the DATA_BIN value in d.
+ * If d is shared it is replaced with a new value, the old one released.
+ */
+error_t
+data_bin_cat(data_t *d, const bin_t *b);
+
+error_t
+data_bin_write(data_t d, FILE *f);
 
 
 #ifdef __cplusplus
 }
 #endif
-#endif /* SYMBOLSCRIPT_BINARY_H_ */
-
+#endif /* SYMBOLSCRIPT_DATA_H_ */
@@ -0,0 +1,129 @@
+/*******************************************************************************
+ * Copyright (c) 2022 Craig Jacobson
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ ******************************************************************************/
+/**
+ * @file evloop.h
+ * @author Craig Jacobson
+ * @brief Non-blocking I/O for tasks, on an epoll event loop.
+ *
+ * One thread sits in epoll_wait for every descriptor tasks are waiting
+ * on. The I/O calls here try the operation first, and only if it would
+ * block do they register with the loop and wait through the scheduler,
+ * which covers for the waiting thread with a spare, until the loop
+ * says the descriptor is ready:
+ * ```
+ * evloop_init(&ev, &s);
+ * // In any number of tasks
+ * err = ev_read(&ev, fd, buf, sizeof(buf), &n);
+ * err = ev_waitpid(&ev, pid, &status);
+ * evloop_destroy(&ev);
+ * ```
+ * Descriptors must be non-blocking (ev_nonblock). When several tasks
+ * wait on one, all are woken and race to go first, as with accept.
+ */
+#ifndef SYMBOLSCRIPT_EVLOOP_H_
+#define SYMBOLSCRIPT_EVLOOP_H_
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+
+#include <pthread.h>
+#include <sys/types.h>
+
+#include "scheduler.h"
+#include "symio.h"
+
+
+struct evwait;
+
+typedef struct
+{
+    struct evwait *in; // Lists of those waiting
+    struct evwait *out;
+    bool added; // To the epoll set, as far as we know
+} evfd_t;
+
+typedef struct
+{
+    sched_t *sched;
+    int epfd;
+    int wakefd; // Written to stop the loop
+    pthread_t thread;
+    pthread_mutex_t lock;
+    evfd_t *fds; // By descriptor
+    size_t nfds;
+    bool stop;
+} evloop_t;
+
+/**
+ * @brief Start the loop thread.
+ * @param s Whose threads wait on it.
+ */
+error_t
+evloop_init(evloop_t *ev, sched_t *s);
+
+/**
+ * @brief Stop the loop. Nothing may still be waiting on it.
+ */
+void
+evloop_destroy(evloop_t *ev);
+
+/**
+ * @brief Make fd non-blocking.
+ */
+error_t
+ev_nonblock(int fd);
+
+/**
+ * @brief Read up to len bytes, waiting until there are some.
+ * @param n Set to the bytes read, 0 at the end.
+ */
+error_t
+ev_read(evloop_t *ev, int fd, void *buf, size_t len, size_t *n);
+
+/**
+ * @brief Write all len bytes, waiting for room as needed.
+ * @param n Set to the bytes written, short only on error.
+ */
+error_t
+ev_write(evloop_t *ev, int fd, const void *buf, size_t len, size_t *n);
+
+/**
+ * @brief Accept a connection on a listening socket, waiting for one.
+ * @param conn Set to the new non-blocking socket.
+ */
+error_t
+ev_accept(evloop_t *ev, int fd, int *conn);
+
+/**
+ * @brief Reap child pid, waiting for it to exit.
+ * @return ENOSYS on kernels without pidfd_open (before Linux 5.3).
+ */
+error_t
+ev_waitpid(evloop_t *ev, pid_t pid, int *status);
+
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* SYMBOLSCRIPT_EVLOOP_H_ */
+
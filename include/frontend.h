@@ -0,0 +1,148 @@
+/*******************************************************************************
+ * Copyright (c) 2022 Craig Jacobson
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ ******************************************************************************/
+/**
+ * @file frontend.h
+ * @author Craig Jacobson
+ * @brief Pipelined front end.
+ *
+ * Runs the front end stages each on its own thread:
+ * ```
+ * Liner >>> UTF-8 Checker >>> Tokenizer >>> caller
+ * ```
+ * Lines travel in batches through single producer, single consumer
+ * rings. Reading the next lines overlaps checking and tokenizing the
+ * ones before, and each hand-off is one pointer. A batch goes out
+ * when it is full, or early when the next stage is idle, so slowly
+ * streamed input isn't held back.
+ */
+#ifndef SYMBOLSCRIPT_FRONTEND_H_
+#define SYMBOLSCRIPT_FRONTEND_H_
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+
+#include <pthread.h>
+
+#include "liner.h"
+#include "symio.h"
+#include "symmem.h"
+#include "tokenizer.h"
+
+
+#define RING_LINE 64
+
+/**
+ * Bounded single producer, single consumer queue of pointers.
+ * The lock is only taken to sleep on a full or empty ring.
+ */
+typedef struct
+{
+    void **slots;
+    size_t mask;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    uint32_t sleeping; // Either side, the other wakes it
+    bool closed; // By the producer, nothing more is coming
+    bool cancelled; // By the consumer, stop sending
+    uint8_t pad[RING_LINE];
+    uint64_t head;
+    uint8_t pad2[RING_LINE - sizeof(uint64_t)];
+    uint64_t tail;
+} ring_t;
+
+/**
+ * @param cap Rounded up to a power of two.
+ */
+error_t
+ring_init(ring_t *r, size_t cap);
+void
+ring_destroy(ring_t *r);
+
+/**
+ * @brief Queue p, waiting while the ring is full.
+ * @return False if the consumer cancelled.
+ */
+bool
+ring_push(ring_t *r, void *p);
+
+/**
+ * @brief Dequeue into p, waiting while the ring is empty.
+ * @return False once closed and empty.
+ */
+bool
+ring_pop(ring_t *r, void **p);
+
+/**
+ * @brief Dequeue without waiting.
+ */
+bool
+ring_trypop(ring_t *r, void **p);
+
+/**
+ * @brief Whether the consumer is asleep waiting for more.
+ */
+bool
+ring_starved(ring_t *r);
+
+void
+ring_close(ring_t *r);
+void
+ring_cancel(ring_t *r);
+
+/**
+ * Lines and their tokens, in order.
+ */
+typedef struct
+{
+    size_t nlines;
+    line_t *lines;
+    size_t *ends; // Tokens of line i end before ends[i]
+    token_t *tokens;
+    size_t ntokens;
+    error_t err; // Why the stream stops after this batch, 0 if it goes on
+} linebatch_t;
+
+typedef error_t (*frontend_sink_t)(const linebatch_t *batch, void *arg);
+
+typedef struct
+{
+    liner_t liner; // Opened and closed by the caller
+    void *context; // For get_line
+    tokenizer_t *tokenizer;
+    budget_t *budget; // Stages allocate from it and burn a step per token; NULL for none
+} frontend_t;
+
+/**
+ * @brief Feed every line through the stages to sink, on this thread.
+ * @return The first error from a stage or sink; EOF is not one.
+ * EILSEQ for a line that isn't UTF-8, ETIME when out of fuel.
+ */
+error_t
+frontend_run(const frontend_t *f, frontend_sink_t sink, void *arg);
+
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* SYMBOLSCRIPT_FRONTEND_H_ */
+
@@ -0,0 +1,114 @@
+/*******************************************************************************
+ * Copyright (c) 2022 Craig Jacobson
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ ******************************************************************************/
+/**
+ * @file interp.h
+ * @author Craig Jacobson
+ * @brief Interpreter instances for embedding.
+ *
+ * An interpreter owns everything it runs on: a memory budget that all of
+ * its allocations come from, a heap for its containers, its context and
+ * tokenizer, and the streams it writes to. Nothing is shared between
+ * instances, so each thread can run its own:
+ * ```
+ * sym_interp_t in;
+ * sym_config_t config = { .mem_limit = 64 << 20, .out = f };
+ * sym_interp_init(&in, &config);
+ * err = sym_interp_eval(&in, len, script);
+ * sym_interp_destroy(&in);
+ * ```
+ * An instance is used by one thread at a time, and values made by one
+ * must not be handed to another. A pipelined instance runs its front
+ * end stages on threads of its own while a run lasts.
+ */
+#ifndef SYMBOLSCRIPT_INTERP_H_
+#define SYMBOLSCRIPT_INTERP_H_
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+
+#include "context.h"
+#include "liner.h"
+#include "mmanager.h"
+#include "symmem.h"
+#include "tokenizer.h"
+
+
+typedef struct
+{
+    size_t mem_limit; // Bytes, 0 for no limit
+    uint64_t fuel; // Tokens to run, 0 for no limit
+    FILE *out; // NULL for stdout
+    FILE *err; // NULL for stderr
+    bool pipelined; // Read, check and tokenize on threads of their own
+} sym_config_t;
+
+typedef struct
+{
+    budget_t budget;
+    gcheap_t heap;
+    context_t context;
+    data_t machine; // The machine module, bound as machine
+    tokenizer_t tokenizer;
+    FILE *out;
+    FILE *err;
+    bool pipelined;
+} sym_interp_t;
+
+/**
+ * @brief Set up an interpreter.
+ * @param config NULL for no limits on the standard streams.
+ */
+error_t
+sym_interp_init(sym_interp_t *in, const sym_config_t *config);
+
+/**
+ * @brief Free everything the interpreter allocated.
+ */
+void
+sym_interp_destroy(sym_interp_t *in);
+
+/**
+ * @brief Print the interactive welcome.
+ */
+void
+sym_interp_banner(sym_interp_t *in);
+
+/**
+ * @brief Run every line from liner.
+ * @return ENOMEM past the memory limit, ETIME once out of fuel.
+ */
+error_t
+sym_interp_run(sym_interp_t *in, liner_t liner);
+
+/**
+ * @brief Run the lines of a buffer.
+ */
+error_t
+sym_interp_eval(sym_interp_t *in, size_t len, const uint8_t *src);
+
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* SYMBOLSCRIPT_INTERP_H_ */
+
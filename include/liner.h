@@ -77,7 +77,11 @@ mk_liner_from_command_line(void);
 liner_t
 mk_liner_from_stdin(void);
 liner_t
+mk_liner_from_stream(FILE *in);
+liner_t
 mk_liner_from_file(const char *filepath);
+liner_t
+mk_liner_from_buffer(size_t len, const uint8_t *s);
 
 
 #ifdef __cplusplus
@@ -0,0 +1,112 @@
+/*******************************************************************************
+ * Copyright (c) 2022 Craig Jacobson
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ ******************************************************************************/
+/**
+ * @file machine.h
+ * @author Craig Jacobson
+ * @brief What the machine we run on has: cores, caches and memory.
+ *
+ * Probed once, from the CPU affinity mask, sysfs cache topology,
+ * /proc/meminfo and cpuid, falling back to sysconf and then to typical
+ * values for anything missing. The runtime sizes itself from it:
+ * ```
+ * sched_init(&s, 0); // machine()->cores workers
+ * size_t grain = machine_grain(sizeof(double));
+ * ```
+ * Scripts see the same numbers as the machine module (machine_data).
+ */
+#ifndef SYMBOLSCRIPT_MACHINE_H_
+#define SYMBOLSCRIPT_MACHINE_H_
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+
+#include <stdint.h>
+
+#include "data.h"
+#include "symio.h"
+
+
+// Used when the machine won't say
+#define MACHINE_LINE 64
+#define MACHINE_L1D (32 * 1024)
+#define MACHINE_L2 (256 * 1024)
+
+// Instruction set extensions
+#define MACHINE_SSE42  0x01
+#define MACHINE_AVX2   0x02
+#define MACHINE_AVX512 0x04
+
+typedef struct
+{
+    size_t cores; // Logical, that we may run on
+    size_t physical; // Of those, counting SMT siblings once
+    size_t line; // Cache line bytes
+    size_t l1d; // Cache bytes per core, 0 where there is none
+    size_t l2;
+    size_t l3; // Shared, usually
+    size_t page;
+    size_t huge_page; // 0 without huge pages
+    uint64_t memory; // Bytes installed
+    uint64_t available; // Bytes free for us when probed
+    unsigned features;
+    char vendor[16]; // From cpuid, empty elsewhere
+} machine_t;
+
+/**
+ * @brief Probe now, rather than use what was found first.
+ */
+error_t
+machine_probe(machine_t *m);
+
+/**
+ * @brief The machine as first probed.
+ */
+const machine_t *
+machine(void);
+
+/**
+ * @brief Elements of width bytes that fill half of L1, for loop grains.
+ * @return Between min and max.
+ */
+size_t
+machine_grain(size_t width, size_t min, size_t max);
+
+/**
+ * @brief Bytes of work to hand between threads at once: half of L2.
+ */
+size_t
+machine_batch(void);
+
+/**
+ * @brief Make the machine module: a map from symbol to each figure,
+ *        and a bool for each extension.
+ */
+error_t
+machine_data(data_t *d);
+
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* SYMBOLSCRIPT_MACHINE_H_ */
+
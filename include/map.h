@@ -0,0 +1,130 @@
+/*******************************************************************************
+ * Copyright (c) 2022 Craig Jacobson
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ ******************************************************************************/
+/**
+ * @file map.h
+ * @author Craig Jacobson
+ * @brief Hash map of data_t to data_t.
+ *
+ * Open addressing Swiss table: one control byte per slot holds seven bits
+ * of the hash, and a whole group of sixteen control bytes is matched at
+ * once (SSE2 where available). Slots point into a dense entry array, so
+ * iteration is in insertion order and the table itself stays small.
+ * Keys hash with data_hash, which is memhash for binaries.
+ */
+#ifndef SYMBOLSCRIPT_MAP_H_
+#define SYMBOLSCRIPT_MAP_H_
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+
+#include "data.h"
+
+
+#define MAP_GROUP 16
+
+typedef struct
+{
+    data_t key;
+    data_t value;
+    uint64_t hash;
+} mapentry_t;
+
+/**
+ * The map holds its own reference to every key and value.
+ * Arrays and maps are mutable and can't be keys (EINVAL).
+ * ```
+ * map_init(m);
+ * map_set(m, key, value);
+ * if (map_get(m, key, &value)) { // borrowed value }
+ * size_t it = 0;
+ * while (map_next(m, &it, &key, &value)) { // in insertion order }
+ * map_destroy(m);
+ * ```
+ */
+typedef struct
+{
+    uint8_t *ctrl; // cap + MAP_GROUP - 1, the first group mirrored at the end
+    uint32_t *slots; // Entry index of each full slot
+    mapentry_t *entries; // Insertion order, removed ones are holes
+    size_t cap; // Slots, zero or a power of two >= MAP_GROUP
+    size_t len; // Live entries
+    size_t used; // Entries including holes
+    size_t entcap; // cap * 7/8, a full entry array means rehash
+} map_t;
+
+void
+map_init(map_t *m);
+void
+map_destroy(map_t *m);
+
+static inline size_t
+map_len(const map_t *m)
+{
+    return m->len;
+}
+
+/**
+ * @brief Make room for n entries in total.
+ */
+error_t
+map_reserve(map_t *m, size_t n);
+
+/**
+ * @brief Insert or replace; a replaced entry keeps its position.
+ */
+error_t
+map_set(map_t *m, data_t key, data_t value);
+
+/**
+ * @brief Borrow the value of key.
+ * @return False if absent.
+ */
+bool
+map_get(const map_t *m, data_t key, data_t *value);
+
+/**
+ * @brief Remove key, releasing the entry.
+ * @return False if absent.
+ */
+bool
+map_del(map_t *m, data_t key);
+
+/**
+ * @brief Borrow the next entry in insertion order; *it starts at zero.
+ */
+bool
+map_next(const map_t *m, size_t *it, data_t *key, data_t *value);
+
+/**
+ * @brief Boxed map value, shared by reference like any other object.
+ */
+error_t
+mk_map(data_t *d);
+map_t *
+data_map(data_t d);
+
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* SYMBOLSCRIPT_MAP_H_ */
@@ -24,79 +24,227 @@
  * @author Craig Jacobson
  * @brief Symbol Script memory manager.
  *
- * The memory manager has different ways of organizing
+ * The memory manager has different ways of organizing memory.
  */
-#ifndef SYMBOLSCRIPT_CONTEXT_H_
-#define SYMBOLSCRIPT_CONTEXT_H_
+#ifndef SYMBOLSCRIPT_MMANAGER_H_
+#define SYMBOLSCRIPT_MMANAGER_H_
 #ifdef __cplusplus
 extern "C" {
 #endif
 
 
-#include <stdbool.h>
-#include <stdint.h>
+#include <pthread.h>
+
+#include "data.h"
+#include "symcore.h"
+#include "symio.h"
 
 
 /*******************************************************************************
- * CONTEXT
+ * REGION
  *
- * Basically a map.
- * Since most contexts are small and lookup is done at binding time
- * we will start by using an array.
+ * Bump pointer arena for things that die together: the tokens of a line,
+ * a grouped block, a module, one REPL eval.
+ * Allocation is a pointer bump; nothing is freed on its own.
+ * A mark records the current top and region_reset releases everything
+ * after it in O(1), so nested lifetimes are nested marks:
+ * ```
+ * region_init(r);
+ * region_mark_t module = region_mark(r);
+ * while (line = get_line())
+ * {
+ *   region_mark_t m = region_mark(r);
+ *   // tokens = region_get(r, ...)
+ *   region_reset(r, m);
+ * }
+ * region_destroy(r);
+ * ```
+ * Lifetimes that don't nest take a region each.
+ * Blocks start at the L1 data cache size, REGION_BLOCK at least, and
+ * double up to REGION_BLOCK_MAX.
+ * Blocks released by a reset are kept for reuse until region_destroy.
+ * Under MEMPAGES_HUGE, blocks of REGION_BLOCK_MAX and up are mapped as
+ * whole huge pages.
+ * Anything holding resources elsewhere (refcounted values, files) can
+ * register a cleanup that runs when its allocation is released.
  ******************************************************************************/
 
-// Immutability
-#define BINDFLAG_LET  0x00000000
+#define REGION_ALIGN 16
+#define REGION_BLOCK (16 * 1024)
+#define REGION_BLOCK_MAX (1024 * 1024)
+
+struct regionblock;
+struct regioncleanup;
 
 typedef struct
 {
-    int flags;
-    const char *name;
-    void *bound;
-    void *meta; // aka annotations, but meta is shorter
-} binding_t;
+    struct regionblock *block; // Newest block, older ones chained behind
+    struct regionblock *spare; // Released blocks to reuse
+    struct regioncleanup *cleanups; // Newest first
+    uint8_t *top;
+    uint8_t *end;
+    size_t next; // Size of the next block
+} region_t;
 
 typedef struct
 {
-    char quicklist[8];
-    binding_t *bindings;
-    size_t bindingslen;
-} context_t;
+    struct regionblock *block;
+    struct regioncleanup *cleanups;
+    uint8_t *top;
+} region_mark_t;
+
+void
+region_init(region_t *r);
 
 /**
- * Tokenizer.
- * Assumes that input buffers are a valid stream of UTF-8 characters.
- * ```
- * tokenizer_init(t);
- * while (line = get_line())
- * {
- *   tokenizer_set_line(t, line, linelen);
- *   while (tokenize(t, &tok)) { // stuff; }
- * }
- * tokenizer_destroy(t);
- * ```
+ * @brief Run every cleanup and free all blocks.
+ */
+void
+region_destroy(region_t *r);
+
+/**
+ * @brief Allocate size bytes aligned to REGION_ALIGN.
+ * @return NULL if out of memory.
+ */
+void *
+region_get(region_t *r, size_t size);
+
+/**
+ * @brief Copy of len bytes.
+ */
+void *
+region_dup(region_t *r, const void *s, size_t len);
+
+region_mark_t
+region_mark(const region_t *r);
+
+/**
+ * @brief Release everything allocated since the mark, newest first.
+ * Marks taken after this one become invalid.
+ */
+void
+region_reset(region_t *r, region_mark_t m);
+
+/**
+ * @brief Call fn(arg) when the current allocations are released.
+ */
+error_t
+region_defer(region_t *r, void (*fn)(void *), void *arg);
+
+
+/*******************************************************************************
+ * CYCLES
+ *
+ * Values are refcounted, which frees everything except cycles through
+ * containers (a map holding itself, two maps holding each other).
+ * Containers are tracked in generations; a collection finds the ones
+ * referenced only from inside the generation being collected, by
+ * subtracting internal references from the refcounts, and frees those.
+ * Collections run as containers are made: the youngest generation after
+ * GC_THRESHOLD new ones, each older one after GC_RATIO collections of
+ * the one below. Survivors move up a generation, so a pause scans only
+ * recent containers except for the rare full collection.
+ * Containers are tracked in the heap in use on the thread that made
+ * them; each interpreter uses its own, and every other thread has one
+ * of its own, freed at thread exit unless containers it made live on.
+ * A heap is used by one thread at a time, which makes and collects its
+ * containers. They may be freed on any thread; a collection leaves
+ * those already let go of to whoever is freeing them. A container
+ * must not be changed while another thread can see it.
+ ******************************************************************************/
+
+#define GC_GENS 3
+#define GC_THRESHOLD 700
+#define GC_RATIO 10
+
+struct gcheap;
+
+typedef struct gcnode
+{
+    struct gcnode *prev;
+    struct gcnode *next;
+    struct gcheap *heap;
+    size_t gcrefs; // Scratch during a collection
+    uint8_t gen;
+    uint8_t state;
+} gcnode_t;
+
+typedef struct
+{
+    gcnode_t head; // Circular, head is a sentinel
+    size_t count;
+    size_t collections; // Of the generation below, since the last of this
+} gcgen_t;
+
+typedef struct gcheap
+{
+    pthread_mutex_t lock;
+    gcgen_t gens[GC_GENS];
+    size_t young_made;
+    bool collecting;
+} gcheap_t;
+
+typedef void (*gcvisit_fn)(data_t child, void *ctx);
+
+/**
+ * How to walk and empty one container type.
  */
 typedef struct
 {
-    enum tokstate state;
-    const uint8_t *line;
-    size_t linelen;
-    uint64_t linenum; // Updated with each set line call
-    uint64_t colindex; // Updated after each token is output
-    uint64_t colprevindex;
-} tokenizer_t;
+    void (*traverse)(dataobj_t *o, gcvisit_fn visit, void *ctx);
+    void (*clear)(dataobj_t *o); // Release every value held
+    size_t offset; // Of its gcnode_t from the dataobj_t
+} gctype_t;
+
+void
+gcheap_init(gcheap_t *h);
+
+/**
+ * @brief Collect everything collectable and stop tracking the rest.
+ */
+void
+gcheap_destroy(gcheap_t *h);
+
+/**
+ * @brief Track new containers in h on this thread, NULL for the default.
+ * @return The heap that was in use, to put back afterwards.
+ */
+gcheap_t *
+gc_use(gcheap_t *h);
 
+/**
+ * @brief Register a container type; its objects embed a gcnode_t.
+ */
 void
-tokenizer_init(tokenizer_t *t);
+gc_register(enum data_type type, const gctype_t *ops);
+
+/**
+ * @brief Start tracking a new container, possibly collecting first.
+ */
 void
-tokenizer_destroy(tokenizer_t *t);
+gc_track(dataobj_t *o);
+
+/**
+ * @brief Stop tracking; called before a container is freed.
+ */
 void
-tokenizer_set_line(tokenizer_t *t, const uint8_t *line, size_t linelen);
-bool
-tokenize(tokenizer_t *t, token_t *tok);
+gc_untrack(dataobj_t *o);
+
+/**
+ * @brief Collect generations 0 through gen of the heap in use.
+ * @return Number of containers freed.
+ */
+size_t
+gc_collect(unsigned gen);
+
+/**
+ * @brief Containers tracked in gen of the heap in use.
+ */
+size_t
+gc_count(unsigned gen);
+
 
 #ifdef __cplusplus
 }
 #endif
-#endif /* SYMBOLSCRIPT_CONTEXT_H_ */
-
+#endif /* SYMBOLSCRIPT_MMANAGER_H_ */
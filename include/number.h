@@ -0,0 +1,85 @@
+/*******************************************************************************
+ * Copyright (c) 2022 Craig Jacobson
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ ******************************************************************************/
+/**
+ * @file number.h
+ * @author Craig Jacobson
+ * @brief Parsing and printing numbers.
+ *
+ * Floats parse with Eisel-Lemire and print the shortest text that reads
+ * back to the same value (Ryu), in the same style as Python's repr.
+ * Integers of every width parse and print eight/two digits at a time.
+ */
+#ifndef SYMBOLSCRIPT_NUMBER_H_
+#define SYMBOLSCRIPT_NUMBER_H_
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+
+#include "data.h"
+
+
+// Room for any fixed width number, sign included
+#define FMT_MAX 32
+
+/**
+ * @brief Parse text as a number of the given type.
+ * Integers are [+-]digits, floats also take a fraction, an exponent,
+ * inf, infinity and nan (any case).
+ * @return EINVAL on bad syntax or type, ERANGE if an integer doesn't fit.
+ */
+error_t
+parse_data(data_t *d, enum data_type type, size_t len, const uint8_t *s);
+
+error_t
+parse_u8(uint64_t *v, size_t len, const uint8_t *s);
+error_t
+parse_i8(int64_t *v, size_t len, const uint8_t *s);
+error_t
+parse_f8(double *v, size_t len, const uint8_t *s);
+error_t
+parse_f4(float *v, size_t len, const uint8_t *s);
+
+/**
+ * @brief Print into buf, which has at least FMT_MAX bytes.
+ * @return Number of bytes written, no terminator.
+ */
+size_t
+fmt_u8(uint8_t *buf, uint64_t v);
+size_t
+fmt_i8(uint8_t *buf, int64_t v);
+size_t
+fmt_f8(uint8_t *buf, double v);
+size_t
+fmt_f4(uint8_t *buf, float v);
+
+/**
+ * @brief Text of any value, as printed to the console.
+ */
+error_t
+data_format(bin_t *out, data_t d);
+
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* SYMBOLSCRIPT_NUMBER_H_ */
@@ -0,0 +1,112 @@
+/*******************************************************************************
+ * Copyright (c) 2022 Craig Jacobson
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ ******************************************************************************/
+/**
+ * @file pipeline.h
+ * @author Craig Jacobson
+ * @brief Shell-style pipelines of child processes.
+ *
+ * Each stage is spawned with posix_spawnp and joined to the next by a
+ * pipe, just as a shell would:
+ * ```
+ * char *const *argvs[] = { (char *[]){ "sort", NULL }, (char *[]){ "uniq", NULL } };
+ * pipeline_start(&p, 2, argvs, PIPELINE_PIPE, PIPELINE_INHERIT);
+ * // Feed p.in, or move a whole stream in with pipe_forward
+ * err = pipeline_wait(&p, NULL, true, &code);
+ * pipeline_destroy(&p);
+ * ```
+ * Data the script only passes along is moved with splice and tee, so it
+ * stays in the kernel instead of being copied through our buffers.
+ */
+#ifndef SYMBOLSCRIPT_PIPELINE_H_
+#define SYMBOLSCRIPT_PIPELINE_H_
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+
+#include <stdbool.h>
+#include <sys/types.h>
+
+#include "evloop.h"
+#include "symio.h"
+
+
+/// Leave stdin or stdout as ours.
+#define PIPELINE_INHERIT (-1)
+/// Give us the other end of a new pipe.
+#define PIPELINE_PIPE (-2)
+
+typedef struct
+{
+    size_t n;
+    pid_t *pids;
+    int *codes; // Shell style, 128 + signal when killed
+    int in; // Write end for the first stage, or -1
+    int out; // Read end from the last stage, or -1
+} pipeline_t;
+
+/**
+ * @brief Spawn the stages, each argv searched for on PATH.
+ * @param in Descriptor for the first stage to read, or PIPELINE_*.
+ * @param out Descriptor for the last stage to write, or PIPELINE_*.
+ * @return Error from the first stage that failed to start; the ones
+ *         already started are sent SIGTERM and reaped before returning.
+ */
+error_t
+pipeline_start(pipeline_t *p, size_t n, char *const *const *argvs, int in, int out);
+
+/**
+ * @brief Reap every stage.
+ * @param ev Wait on this loop, letting the thread run other tasks; or NULL.
+ * @param pipefail As in bash: the code is the last non-zero one, rather
+ *        than just the last stage's.
+ * @param code Set to the pipeline's exit code.
+ */
+error_t
+pipeline_wait(pipeline_t *p, evloop_t *ev, bool pipefail, int *code);
+
+/**
+ * @brief Close our ends and release the pipeline.
+ */
+void
+pipeline_destroy(pipeline_t *p);
+
+/**
+ * @brief Move everything from one descriptor to another until the end.
+ * @param moved Set to the bytes moved.
+ * @return Without a pipe on either side it falls back to copying.
+ */
+error_t
+pipe_forward(int from, int to, size_t *moved);
+
+/**
+ * @brief Forward from pipe to pipe until the end, copying it all to copy.
+ */
+error_t
+pipe_tee(int from, int to, int copy, size_t *moved);
+
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* SYMBOLSCRIPT_PIPELINE_H_ */
+
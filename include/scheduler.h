@@ -0,0 +1,162 @@
+/*******************************************************************************
+ * Copyright (c) 2022 Craig Jacobson
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ ******************************************************************************/
+/**
+ * @file scheduler.h
+ * @author Craig Jacobson
+ * @brief Work-stealing task scheduler.
+ *
+ * One worker thread per core, each with a deque of tasks. A worker
+ * pushes and pops its own tasks at the bottom, newest first, and idle
+ * workers steal the oldest from the top of someone else's. Tasks
+ * spawned from outside the workers queue centrally.
+ * A task is a function over values captured when it was spawned:
+ * ```
+ * sched_init(&s, 0);
+ * sched_spawn(&s, &t, fn, 2, (data_t[]){ a, b });
+ * // ...
+ * err = sched_await(t, &result);
+ * sched_destroy(&s);
+ * ```
+ * Captured values are shared, not copied, so they must not be changed
+ * while the task can see them. A task awaiting another runs other
+ * tasks until that one is done, so tasks may spawn and await tasks of
+ * their own; threads outside the scheduler just wait. Every task must
+ * be awaited exactly once.
+ *
+ * Tasks run on their worker's stack, so one that has to block on
+ * something other than a task, like a channel, can't be set aside.
+ * It blocks its thread in sched_wait instead, and a spare thread runs
+ * tasks in its place until it wakes. A task blocked like this may be
+ * one picked up by a task awaiting another, which then waits under it,
+ * so a task shouldn't await while others block on what it does next.
+ */
+#ifndef SYMBOLSCRIPT_SCHEDULER_H_
+#define SYMBOLSCRIPT_SCHEDULER_H_
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+
+#include <pthread.h>
+
+#include "data.h"
+#include "symio.h"
+
+
+/**
+ * Computes result from the captured values.
+ */
+typedef error_t (*task_fn_t)(data_t *result, size_t ncaptured, const data_t *captured);
+
+/**
+ * Does the work for indexes [lo, hi).
+ */
+typedef error_t (*sched_body_t)(size_t lo, size_t hi, void *arg);
+
+struct spare;
+struct task;
+struct worker;
+
+typedef struct task task_t;
+
+typedef struct
+{
+    struct worker *workers;
+    size_t nworkers;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    struct task *queue; // Spawned from outside, oldest first
+    struct task *queue_tail;
+    uint64_t epoch; // Bumped whenever there is new work or a task is done
+    size_t sleepers;
+    size_t blocked; // Pool threads in sched_wait
+    struct spare *spares;
+    size_t nspares;
+    bool stop;
+} sched_t;
+
+/**
+ * @brief Start the workers.
+ * @param workers 0 for one per online core.
+ */
+error_t
+sched_init(sched_t *s, size_t workers);
+
+/**
+ * @brief Finish every task, then stop the workers.
+ */
+void
+sched_destroy(sched_t *s);
+
+/**
+ * @brief Queue fn to run over captured values, taking a reference to each.
+ */
+error_t
+sched_spawn(sched_t *s, task_t **t, task_fn_t fn, size_t ncaptured, const data_t *captured);
+
+/**
+ * @brief Wait for t, running other tasks meanwhile, and release it.
+ * @param result Takes the task's result, if it succeeded.
+ * @return The error the task returned.
+ */
+error_t
+sched_await(task_t *t, data_t *result);
+
+/**
+ * @brief Run body over [0, n) in ranges of up to grain, in parallel.
+ *
+ * Splits lazily: the caller works through the range a grain at a time
+ * and hands off half of what is left only while some worker is idle,
+ * so the ranges adapt to the load and a busy pool pays little for them.
+ * Every range runs, even after one fails.
+ * @return The error from the lowest range that failed.
+ */
+error_t
+sched_for(sched_t *s, size_t n, size_t grain, sched_body_t body, void *arg);
+
+/**
+ * @brief Block until done(arg), covering for the caller if it's one of
+ * s's threads.
+ * done is checked again after every sched_notify, which whatever makes
+ * it true must call.
+ */
+void
+sched_wait(sched_t *s, bool (*done)(void *arg), void *arg);
+
+/**
+ * @brief Wake sched_wait callers to check again.
+ */
+void
+sched_notify(sched_t *s);
+
+/**
+ * @brief Number of workers.
+ */
+size_t
+sched_workers(const sched_t *s);
+
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* SYMBOLSCRIPT_SCHEDULER_H_ */
+
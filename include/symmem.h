@@ -30,9 +30,22 @@
 extern "C" {
 #endif
 
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include "symio.h"
+
+
+/*******************************************************************************
+ * ALLOCATION
+ *
+ * Pool allocator with per-thread caches; blocks may be freed from any
+ * thread. Define SYM_LIBC_MALLOC (automatic under AddressSanitizer) to
+ * pass straight through to malloc and free.
+ ******************************************************************************/
 
 void *
 memget(size_t);
@@ -44,6 +57,257 @@ size_t
 meminc(size_t);
 
 
+/*******************************************************************************
+ * PAGES
+ *
+ * Whole pages straight from the system, for arenas and heap slabs.
+ * With MEMPAGES_HUGE, mappings are rounded to MEMPAGES_HUGE_SIZE, aligned
+ * to it and advised for transparent huge pages, which saves TLB misses
+ * on big heaps. MEMPAGES_POPULATE asks for mapped files to be read in
+ * up front. Both start from the SYM_HUGEPAGES and SYM_POPULATE
+ * environment variables (set and not "0").
+ ******************************************************************************/
+
+#define MEMPAGES_HUGE_SIZE (2 * 1024 * 1024)
+
+enum mempages_flags
+{
+    MEMPAGES_HUGE = 1,
+    MEMPAGES_POPULATE = 2,
+};
+
+unsigned
+mempages(void);
+
+void
+mempages_set(unsigned flags);
+
+/**
+ * @brief Map at least *size bytes of zeroed memory.
+ * @param size Rounded up to what was mapped, to pass to mempages_put.
+ */
+void *
+mempages_get(size_t *size);
+
+void
+mempages_put(void *p, size_t size);
+
+/**
+ * @brief Bytes currently mapped by mempages_get.
+ */
+size_t
+mempages_mapped(void);
+
+
+/*******************************************************************************
+ * BUDGETS
+ *
+ * A budget caps the memory and steps one sandbox may use. While a budget
+ * is in use on a thread, memget takes memory from it and returns NULL,
+ * which callers already report as ENOMEM, once the cap would be passed.
+ * Blocks stay charged to the budget they came from wherever they are
+ * freed or grown. Destroying a budget frees everything still allocated
+ * from it, so a sandbox can be dropped whole.
+ * Fuel is the step counter an evaluator burns as it goes.
+ ******************************************************************************/
+
+#define BUDGET_CLASSES 28
+
+typedef struct budget
+{
+    size_t limit; // Bytes
+    size_t used;
+    uint64_t fuel; // Steps left
+    pthread_mutex_t lock;
+    void *spans;
+    void *free[BUDGET_CLASSES];
+} budget_t;
+
+error_t
+budget_init(budget_t *b, size_t limit, uint64_t fuel);
+
+void
+budget_destroy(budget_t *b);
+
+/**
+ * @brief Allocate from b on this thread, NULL for no budget.
+ * @return The budget that was in use, to put back afterwards.
+ */
+budget_t *
+budget_use(budget_t *b);
+
+/**
+ * @brief Bytes charged, counted in whole slabs for small blocks.
+ */
+size_t
+budget_used(budget_t *b);
+
+/**
+ * @brief Spend steps of fuel.
+ * @return False once the fuel has run out.
+ */
+static inline bool
+budget_burn(budget_t *b, uint64_t steps)
+{
+    if (b->fuel < steps)
+    {
+        b->fuel = 0;
+        return false;
+    }
+    b->fuel -= steps;
+    return true;
+}
+
+
+/*******************************************************************************
+ * ACCOUNTING
+ *
+ * Build with SYM_MEM_STATS to have every block recorded against the line
+ * that called memget or memreget and the subsystem that line belongs to,
+ * worked out from its source file. Each block then carries a small header
+ * naming its call site, so memput gives the bytes back to the right
+ * counters. A memreget moves the block to its own call site.
+ * Without SYM_MEM_STATS nothing is recorded and the queries report zeros.
+ ******************************************************************************/
+
+enum memtag
+{
+    MEMTAG_OTHER,
+    MEMTAG_LINER,
+    MEMTAG_TOKENIZER,
+    MEMTAG_CONTEXT,
+    MEMTAG_DATA,
+    MEMTAG_VM,
+    MEMTAG_COUNT,
+};
+
+typedef struct
+{
+    size_t live; // Bytes
+    size_t peak; // Most live bytes at once
+    size_t count; // Allocations made
+} memstat_t;
+
+typedef struct memsite
+{
+    const char *file;
+    unsigned line;
+    unsigned tag;
+    struct memsite *next;
+    memstat_t stat;
+    bool listed;
+} memsite_t;
+
+bool
+memstats_enabled(void);
+
+const char *
+memtag_name(enum memtag);
+
+/**
+ * @brief Totals for one subsystem.
+ */
+memstat_t
+memstats_tag(enum memtag);
+
+/**
+ * @brief Print subsystem totals and the call sites with the highest peaks.
+ */
+void
+memstats_report(FILE *out);
+
+/**
+ * @brief Write every call site with its live, peak and count to path.
+ *
+ * One tab separated line per site, so snapshots diff cleanly.
+ */
+error_t
+memstats_dump(const char *path);
+
+void *
+memget_at(size_t, memsite_t *);
+void *
+memreget_at(void *, size_t, memsite_t *);
+
+#if defined(SYM_MEM_STATS) && !defined(SYMMEM_RAW)
+#define MEMSITE() \
+    ({ static memsite_t _memsite = { __FILE__, __LINE__, 0, NULL, { 0, 0, 0 }, false }; &_memsite; })
+#define memget(x) memget_at((x), MEMSITE())
+#define memreget(p, l) memreget_at((p), (l), MEMSITE())
+#endif
+
+
+/*******************************************************************************
+ * BINARY OPS
+ *
+ * Byte kernels used by the data layer.
+ * The implementation is picked once at runtime from what the CPU supports
+ * (AVX2, SSE2, or plain C); define SYM_NO_SIMD to build only plain C.
+ * All implementations give identical results, memhash included.
+ ******************************************************************************/
+
+enum memops_isa
+{
+    MEMOPS_SCALAR,
+    MEMOPS_SSE2,
+    MEMOPS_AVX2,
+};
+
+enum memops_isa
+memops_isa(void);
+
+/**
+ * @brief Force an implementation, mostly for testing.
+ * @return False if the CPU or build does not support it.
+ */
+bool
+memops_set_isa(enum memops_isa isa);
+
+bool
+memeq(const void *a, const void *b, size_t len);
+
+/**
+ * @brief Lexicographic byte order, shorter sorts first on a common prefix.
+ * @return Negative, zero, or positive like memcmp.
+ */
+int
+memorder(const void *a, size_t alen, const void *b, size_t blen);
+
+/**
+ * @return Pointer to the first c in s, NULL if none.
+ */
+const uint8_t *
+membyte(const uint8_t *s, size_t len, uint8_t c);
+
+/**
+ * @return Pointer to the first occurrence of needle in hay, NULL if none.
+ */
+const uint8_t *
+memfind(const uint8_t *hay, size_t haylen, const uint8_t *needle, size_t nlen);
+
+/**
+ * @brief ASCII case mapping; other bytes, UTF-8 included, are untouched.
+ * dst may equal src.
+ */
+void
+memlower(uint8_t *dst, const uint8_t *src, size_t len);
+void
+memupper(uint8_t *dst, const uint8_t *src, size_t len);
+
+/**
+ * @brief Whether s is well formed UTF-8: shortest encodings only, no
+ * surrogates, nothing past U+10FFFF.
+ */
+bool
+memutf8(const uint8_t *s, size_t len);
+
+/**
+ * @brief Fast non-cryptographic 64-bit hash.
+ */
+uint64_t
+memhash(const void *s, size_t len, uint64_t seed);
+
+
 #ifdef __cplusplus
 }
 #endif
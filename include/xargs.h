@@ -0,0 +1,88 @@
+/*******************************************************************************
+ * Copyright (c) 2022 Craig Jacobson
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ ******************************************************************************/
+/**
+ * @file xargs.h
+ * @author Craig Jacobson
+ * @brief Run a command over a stream of arguments, several at a time.
+ *
+ * Like xargs -P, but spawning each child directly rather than through a
+ * shell. Records are appended to the command, as many per child as fit
+ * in ARG_MAX (or max_args), unless the command has a "{}" argument, in
+ * which case each record replaces it in a child of its own:
+ * ```
+ * xargs_t x = { .cmd = (char *[]){ "gzip", "-9", NULL }, .next = next_file, ... };
+ * err = xargs_run(&x, &failed);
+ * ```
+ * Output comes back in pieces tagged with the job, the index of the
+ * child in the order they were started; ordered holds pieces back so
+ * that each job's output arrives whole and in that order, otherwise
+ * they arrive as read.
+ */
+#ifndef SYMBOLSCRIPT_XARGS_H_
+#define SYMBOLSCRIPT_XARGS_H_
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "symio.h"
+
+
+/// Jobs run ahead of the oldest unfinished one per parallel slot, when ordered.
+#define XARGS_AHEAD 4
+/// Left out of ARG_MAX, as xargs does.
+#define XARGS_HEADROOM 2048
+
+typedef struct
+{
+    char *const *cmd; // Ends in NULL
+    size_t jobs; // At once, 0 for one per core
+    size_t max_args; // Records per job, 0 for as many as fit
+    bool ordered;
+    /// Next record, or NULL at the end; valid until the call after.
+    const char *(*next)(void *arg);
+    /// Output from a job; NULL to throw it away.
+    error_t (*output)(void *arg, size_t job, const uint8_t *buf, size_t len);
+    /// Called last for each job, with its shell style exit code; or NULL.
+    error_t (*done)(void *arg, size_t job, int code);
+    void *arg;
+} xargs_t;
+
+/**
+ * @brief Run every record, returning once all the children have exited.
+ * @param failed Set to the jobs whose code was not 0.
+ * @return E2BIG if a record will not fit on any command line, or is longer
+ *         than the kernel takes for one argument; on that or any other
+ *         error no more jobs start and the running ones are waited for.
+ */
+error_t
+xargs_run(const xargs_t *x, size_t *failed);
+
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* SYMBOLSCRIPT_XARGS_H_ */
+
@@ -0,0 +1,1312 @@
+/*******************************************************************************
+ * Copyright (c) 2022 Craig Jacobson
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ ******************************************************************************/
+/**
+ * @file array.c
+ * @author Craig Jacobson
+ * @brief Packed arrays and their SIMD kernels.
+ *
+ * Kernels are written once with GCC vector extensions and instantiated
+ * per element type at two widths: 16 byte vectors compiled for the
+ * baseline ISA, which the compiler lowers to SSE2, NEON or scalar code,
+ * and 32 byte vectors compiled for AVX2 and picked at runtime.
+ * Partial vectors at the end go through a zeroed scratch vector so every
+ * element sees exactly the same arithmetic.
+ */
+#include <errno.h>
+
+#include "array.h"
+#include "machine.h"
+#include "symmem.h"
+
+
+#if !defined(SYM_NO_SIMD) && (defined(__x86_64__) || defined(__i386__)) \
+    && defined(__SSE2__)
+#define ARRAY_X86 1
+#endif
+
+typedef struct
+{
+    dataobj_t h;
+    uint32_t elem; // enum data_type
+    uint32_t len;
+    uint32_t cap;
+    uint32_t pad;
+    uint8_t v[];
+} dataarr_t;
+
+typedef void (*binop_fn)(void *r, const void *a, const void *b, size_t n, bool scalar);
+typedef void (*cmp_fn)(uint8_t *r, const void *a, const void *b, size_t n, bool scalar);
+typedef void (*reduce_fn)(void *r, const void *a, size_t n);
+
+/**
+ * Kernels for one element type.
+ * Division is NULL for integers, which go through _intdiv instead.
+ */
+typedef struct
+{
+    binop_fn op[ARR_MAX + 1];
+    cmp_fn cmp[ARR_GE + 1];
+    reduce_fn reduce[ARR_MOST + 1];
+} arrkern_t;
+
+
+/*******************************************************************************
+ * VECTOR TYPES
+ ******************************************************************************/
+
+#define ARR_V(T, W) ARR_V_(T, W)
+#define ARR_V_(T, W) T##_v##W
+
+#define ARR_VEC(T, W) typedef T T##_v##W __attribute__((vector_size(W)));
+
+#define ARR_VECS(W) \
+    ARR_VEC(uint8_t, W) ARR_VEC(uint16_t, W) ARR_VEC(uint32_t, W) \
+    ARR_VEC(uint64_t, W) ARR_VEC(int8_t, W) ARR_VEC(int16_t, W) \
+    ARR_VEC(int32_t, W) ARR_VEC(int64_t, W) ARR_VEC(float, W) \
+    ARR_VEC(double, W)
+
+// Elements, masks and bytes per lane
+ARR_VECS(16)
+ARR_VECS(32)
+ARR_VEC(int8_t, 2)
+ARR_VEC(int8_t, 4)
+ARR_VEC(int8_t, 8)
+
+// Sums, widened to 64 bits per lane
+ARR_VECS(64)
+ARR_VECS(128)
+ARR_VECS(256)
+
+/**
+ * Lanewise COND ? b : a, through the integer mask type M.
+ */
+#define ARR_SELECT(T, M, W, a, b, COND) \
+    ((T##_v##W)((((M##_v##W)(a)) & ~((M##_v##W)(COND))) \
+                | (((M##_v##W)(b)) & ((M##_v##W)(COND)))))
+
+
+/*******************************************************************************
+ * KERNELS
+ ******************************************************************************/
+
+/**
+ * r = EXPR(x, y) over a and b, or b[0] for every element if scalar.
+ */
+#define ARR_BINOP(ISA, ATTR, W, T, NAME, EXPR) \
+ATTR static void \
+_##NAME##_##T##_##ISA(void *r, const void *a, const void *b, size_t n, \
+                      bool scalar) \
+{ \
+    const size_t lanes = W / sizeof(T); \
+    uint8_t *rp = r; \
+    const uint8_t *ap = a; \
+    const uint8_t *bp = b; \
+    T##_v##W x; \
+    T##_v##W y = { 0 }; \
+    if (scalar) \
+    { \
+        T s; \
+        memcpy(&s, b, sizeof(s)); \
+        for (size_t k = 0; k < lanes; ++k) \
+        { \
+            y[k] = s; \
+        } \
+    } \
+    size_t i = 0; \
+    for (; i + lanes <= n; i += lanes) \
+    { \
+        memcpy(&x, ap + i * sizeof(T), W); \
+        if (!scalar) \
+        { \
+            memcpy(&y, bp + i * sizeof(T), W); \
+        } \
+        x = EXPR; \
+        memcpy(rp + i * sizeof(T), &x, W); \
+    } \
+    if (i < n) \
+    { \
+        size_t tail = (n - i) * sizeof(T); \
+        x = (T##_v##W){ 0 }; \
+        memcpy(&x, ap + i * sizeof(T), tail); \
+        if (!scalar) \
+        { \
+            y = (T##_v##W){ 0 }; \
+            memcpy(&y, bp + i * sizeof(T), tail); \
+        } \
+        x = EXPR; \
+        memcpy(rp + i * sizeof(T), &x, tail); \
+    } \
+}
+
+/**
+ * One byte per element, 1 where x OP y.
+ */
+#define ARR_CMP(ISA, ATTR, W, T, M, L, NAME, OP) \
+ATTR static void \
+_##NAME##_##T##_##ISA(uint8_t *r, const void *a, const void *b, size_t n, \
+                      bool scalar) \
+{ \
+    const uint8_t *ap = a; \
+    const uint8_t *bp = b; \
+    T##_v##W x; \
+    T##_v##W y = { 0 }; \
+    int8_t_v##L m; \
+    if (scalar) \
+    { \
+        T s; \
+        memcpy(&s, b, sizeof(s)); \
+        for (size_t k = 0; k < L; ++k) \
+        { \
+            y[k] = s; \
+        } \
+    } \
+    size_t i = 0; \
+    for (; i + L <= n; i += L) \
+    { \
+        memcpy(&x, ap + i * sizeof(T), W); \
+        if (!scalar) \
+        { \
+            memcpy(&y, bp + i * sizeof(T), W); \
+        } \
+        m = -__builtin_convertvector((M##_v##W)(x OP y), int8_t_v##L); \
+        memcpy(r + i, &m, L); \
+    } \
+    if (i < n) \
+    { \
+        x = (T##_v##W){ 0 }; \
+        memcpy(&x, ap + i * sizeof(T), (n - i) * sizeof(T)); \
+        if (!scalar) \
+        { \
+            y = (T##_v##W){ 0 }; \
+            memcpy(&y, bp + i * sizeof(T), (n - i) * sizeof(T)); \
+        } \
+        m = -__builtin_convertvector((M##_v##W)(x OP y), int8_t_v##L); \
+        memcpy(r + i, &m, n - i); \
+    } \
+}
+
+/**
+ * Sum with every lane widened to E and added as ACC.
+ */
+#define ARR_SUM(ISA, ATTR, W, T, L, E, ACC, EW) \
+ATTR static void \
+_sum_##T##_##ISA(void *r, const void *a, size_t n) \
+{ \
+    const uint8_t *ap = a; \
+    T##_v##W x; \
+    ARR_V(ACC, EW) acc = { 0 }; \
+    size_t i = 0; \
+    for (; i + L <= n; i += L) \
+    { \
+        memcpy(&x, ap + i * sizeof(T), W); \
+        acc += (ARR_V(ACC, EW))__builtin_convertvector(x, ARR_V(E, EW)); \
+    } \
+    if (i < n) \
+    { \
+        x = (T##_v##W){ 0 }; \
+        memcpy(&x, ap + i * sizeof(T), (n - i) * sizeof(T)); \
+        acc += (ARR_V(ACC, EW))__builtin_convertvector(x, ARR_V(E, EW)); \
+    } \
+    ACC s = 0; \
+    for (size_t k = 0; k < L; ++k) \
+    { \
+        s += acc[k]; \
+    } \
+    memcpy(r, &s, sizeof(s)); \
+}
+
+/**
+ * Least or most element for OP < or >; n is not zero.
+ * A NaN wins over everything so it propagates.
+ */
+#define ARR_PICK(ISA, ATTR, W, T, M, L, NAME, OP) \
+ATTR static void \
+_##NAME##_##T##_##ISA(void *r, const void *a, size_t n) \
+{ \
+    const uint8_t *ap = a; \
+    T first; \
+    memcpy(&first, a, sizeof(first)); \
+    T##_v##W acc; \
+    T##_v##W x; \
+    for (size_t k = 0; k < L; ++k) \
+    { \
+        acc[k] = first; \
+    } \
+    size_t i = 0; \
+    for (; i + L <= n; i += L) \
+    { \
+        memcpy(&x, ap + i * sizeof(T), W); \
+        acc = ARR_SELECT(T, M, W, acc, x, (x OP acc) | (x != x)); \
+    } \
+    if (i < n) \
+    { \
+        x = acc; \
+        memcpy(&x, ap + i * sizeof(T), (n - i) * sizeof(T)); \
+        acc = ARR_SELECT(T, M, W, acc, x, (x OP acc) | (x != x)); \
+    } \
+    T best = acc[0]; \
+    for (size_t k = 1; k < L; ++k) \
+    { \
+        if (acc[k] OP best || acc[k] != acc[k]) \
+        { \
+            best = acc[k]; \
+        } \
+    } \
+    memcpy(r, &best, sizeof(best)); \
+}
+
+// Wrapping integer arithmetic is the same for signed, so unsigned only
+#define ARR_ARITH(ISA, ATTR, W, T) \
+    ARR_BINOP(ISA, ATTR, W, T, add, x + y) \
+    ARR_BINOP(ISA, ATTR, W, T, sub, x - y) \
+    ARR_BINOP(ISA, ATTR, W, T, mul, x * y)
+
+#define ARR_ORDER(ISA, ATTR, W, T, M, L) \
+    ARR_BINOP(ISA, ATTR, W, T, min, \
+              ARR_SELECT(T, M, W, x, y, (y < x) | (y != y))) \
+    ARR_BINOP(ISA, ATTR, W, T, max, \
+              ARR_SELECT(T, M, W, x, y, (y > x) | (y != y))) \
+    ARR_CMP(ISA, ATTR, W, T, M, L, eq, ==) \
+    ARR_CMP(ISA, ATTR, W, T, M, L, ne, !=) \
+    ARR_CMP(ISA, ATTR, W, T, M, L, lt, <) \
+    ARR_CMP(ISA, ATTR, W, T, M, L, le, <=) \
+    ARR_CMP(ISA, ATTR, W, T, M, L, gt, >) \
+    ARR_CMP(ISA, ATTR, W, T, M, L, ge, >=) \
+    ARR_PICK(ISA, ATTR, W, T, M, L, least, <) \
+    ARR_PICK(ISA, ATTR, W, T, M, L, most, >)
+
+/**
+ * Every kernel for one vector width, L lanes per element size.
+ */
+#define ARR_KERNELS(ISA, ATTR, W, L1, L2, L4, L8) \
+    ARR_ARITH(ISA, ATTR, W, uint8_t) \
+    ARR_ARITH(ISA, ATTR, W, uint16_t) \
+    ARR_ARITH(ISA, ATTR, W, uint32_t) \
+    ARR_ARITH(ISA, ATTR, W, uint64_t) \
+    ARR_ARITH(ISA, ATTR, W, float) \
+    ARR_ARITH(ISA, ATTR, W, double) \
+    ARR_BINOP(ISA, ATTR, W, float, div, x / y) \
+    ARR_BINOP(ISA, ATTR, W, double, div, x / y) \
+    ARR_ORDER(ISA, ATTR, W, uint8_t, int8_t, L1) \
+    ARR_ORDER(ISA, ATTR, W, uint16_t, int16_t, L2) \
+    ARR_ORDER(ISA, ATTR, W, uint32_t, int32_t, L4) \
+    ARR_ORDER(ISA, ATTR, W, uint64_t, int64_t, L8) \
+    ARR_ORDER(ISA, ATTR, W, int8_t, int8_t, L1) \
+    ARR_ORDER(ISA, ATTR, W, int16_t, int16_t, L2) \
+    ARR_ORDER(ISA, ATTR, W, int32_t, int32_t, L4) \
+    ARR_ORDER(ISA, ATTR, W, int64_t, int64_t, L8) \
+    ARR_ORDER(ISA, ATTR, W, float, int32_t, L4) \
+    ARR_ORDER(ISA, ATTR, W, double, int64_t, L8) \
+    ARR_SUM(ISA, ATTR, W, uint8_t, L1, uint64_t, uint64_t, ARR_EW(L1)) \
+    ARR_SUM(ISA, ATTR, W, uint16_t, L2, uint64_t, uint64_t, ARR_EW(L2)) \
+    ARR_SUM(ISA, ATTR, W, uint32_t, L4, uint64_t, uint64_t, ARR_EW(L4)) \
+    ARR_SUM(ISA, ATTR, W, uint64_t, L8, uint64_t, uint64_t, ARR_EW(L8)) \
+    ARR_SUM(ISA, ATTR, W, int8_t, L1, int64_t, uint64_t, ARR_EW(L1)) \
+    ARR_SUM(ISA, ATTR, W, int16_t, L2, int64_t, uint64_t, ARR_EW(L2)) \
+    ARR_SUM(ISA, ATTR, W, int32_t, L4, int64_t, uint64_t, ARR_EW(L4)) \
+    ARR_SUM(ISA, ATTR, W, int64_t, L8, int64_t, uint64_t, ARR_EW(L8)) \
+    ARR_SUM(ISA, ATTR, W, float, L4, double, double, ARR_EW(L4)) \
+    ARR_SUM(ISA, ATTR, W, double, L8, double, double, ARR_EW(L8))
+
+#define ARR_KERN(ISA, T, A, DIV) \
+    { \
+        { _add_##A##_##ISA, _sub_##A##_##ISA, _mul_##A##_##ISA, DIV, \
+          _min_##T##_##ISA, _max_##T##_##ISA }, \
+        { _eq_##T##_##ISA, _ne_##T##_##ISA, _lt_##T##_##ISA, \
+          _le_##T##_##ISA, _gt_##T##_##ISA, _ge_##T##_##ISA }, \
+        { _sum_##T##_##ISA, _least_##T##_##ISA, _most_##T##_##ISA }, \
+    }
+
+#define ARR_TABLE(ISA) \
+    { \
+        [DATA_U1] = ARR_KERN(ISA, uint8_t, uint8_t, NULL), \
+        [DATA_U2] = ARR_KERN(ISA, uint16_t, uint16_t, NULL), \
+        [DATA_U4] = ARR_KERN(ISA, uint32_t, uint32_t, NULL), \
+        [DATA_U8] = ARR_KERN(ISA, uint64_t, uint64_t, NULL), \
+        [DATA_I1] = ARR_KERN(ISA, int8_t, uint8_t, NULL), \
+        [DATA_I2] = ARR_KERN(ISA, int16_t, uint16_t, NULL), \
+        [DATA_I4] = ARR_KERN(ISA, int32_t, uint32_t, NULL), \
+        [DATA_I8] = ARR_KERN(ISA, int64_t, uint64_t, NULL), \
+        [DATA_F4] = ARR_KERN(ISA, float, float, _div_float_##ISA), \
+        [DATA_F8] = ARR_KERN(ISA, double, double, _div_double_##ISA), \
+        [DATA_BOOL] = ARR_KERN(ISA, uint8_t, uint8_t, NULL), \
+    }
+
+// Bytes of the widened sum vector for L lanes
+#define ARR_EW(L) ARR_EW_##L
+#define ARR_EW_2 16
+#define ARR_EW_4 32
+#define ARR_EW_8 64
+#define ARR_EW_16 128
+#define ARR_EW_32 256
+
+ARR_KERNELS(base, , 16, 16, 8, 4, 2)
+
+static const arrkern_t _kern_base[DATA_ARR] = ARR_TABLE(base);
+
+#ifdef ARRAY_X86
+#define AVX2 __attribute__((target("avx2")))
+
+ARR_KERNELS(avx2, AVX2, 32, 32, 16, 8, 4)
+
+static const arrkern_t _kern_avx2[DATA_ARR] = ARR_TABLE(avx2);
+#endif
+
+static const arrkern_t *
+_kern(enum data_type elem)
+{
+#ifdef ARRAY_X86
+    if (MEMOPS_AVX2 == memops_isa())
+    {
+        return &_kern_avx2[elem];
+    }
+#endif
+    return &_kern_base[elem];
+}
+
+/**
+ * Integer division has no SIMD form; checked for zero and the one
+ * signed overflow, which wraps like the rest.
+ */
+#define ARR_INTDIV(T, U, SIGNED) \
+static error_t \
+_div_##T(void *r, const void *a, const void *b, size_t n, bool scalar) \
+{ \
+    T *rp = r; \
+    const T *ap = a; \
+    const T *bp = b; \
+    for (size_t i = 0; i < n; ++i) \
+    { \
+        T y = bp[scalar ? 0 : i]; \
+        if (!y) \
+        { \
+            return EDOM; \
+        } \
+        rp[i] = SIGNED && (T)-1 == y ? (T)(0 - (U)ap[i]) : (T)(ap[i] / y); \
+    } \
+    return 0; \
+}
+
+ARR_INTDIV(uint8_t, uint8_t, 0)
+ARR_INTDIV(uint16_t, uint16_t, 0)
+ARR_INTDIV(uint32_t, uint32_t, 0)
+ARR_INTDIV(uint64_t, uint64_t, 0)
+ARR_INTDIV(int8_t, uint8_t, 1)
+ARR_INTDIV(int16_t, uint16_t, 1)
+ARR_INTDIV(int32_t, uint32_t, 1)
+ARR_INTDIV(int64_t, uint64_t, 1)
+
+static error_t
+_intdiv(enum data_type elem, void *r, const void *a, const void *b, size_t n,
+        bool scalar)
+{
+    switch (elem)
+    {
+        case DATA_U1:
+            return _div_uint8_t(r, a, b, n, scalar);
+        case DATA_U2:
+            return _div_uint16_t(r, a, b, n, scalar);
+        case DATA_U4:
+            return _div_uint32_t(r, a, b, n, scalar);
+        case DATA_U8:
+            return _div_uint64_t(r, a, b, n, scalar);
+        case DATA_I1:
+            return _div_int8_t(r, a, b, n, scalar);
+        case DATA_I2:
+            return _div_int16_t(r, a, b, n, scalar);
+        case DATA_I4:
+            return _div_int32_t(r, a, b, n, scalar);
+        case DATA_I8:
+            return _div_int64_t(r, a, b, n, scalar);
+        default:
+            return EINVAL;
+    }
+}
+
+
+/*******************************************************************************
+ * ARRAYS
+ ******************************************************************************/
+
+size_t
+arr_width(enum data_type elem)
+{
+    switch (elem)
+    {
+        case DATA_U1:
+        case DATA_I1:
+        case DATA_BOOL:
+            return 1;
+        case DATA_U2:
+        case DATA_I2:
+            return 2;
+        case DATA_U4:
+        case DATA_I4:
+        case DATA_F4:
+            return 4;
+        case DATA_U8:
+        case DATA_I8:
+        case DATA_F8:
+            return 8;
+        default:
+            return 0;
+    }
+}
+
+static dataarr_t *
+_arr(data_t a)
+{
+    if (data_isobj(a) && DATA_ARR == data_obj(a)->type)
+    {
+        return (dataarr_t *)data_obj(a);
+    }
+    return NULL;
+}
+
+/**
+ * Uninitialized array of len elements with room for cap.
+ */
+static error_t
+_arr_new(data_t *d, dataarr_t **arr, enum data_type elem, size_t len,
+         size_t cap)
+{
+    size_t w = arr_width(elem);
+    if (!w)
+    {
+        return EINVAL;
+    }
+    if (len > ARR_LEN_MAX || cap > ARR_LEN_MAX)
+    {
+        return E2BIG;
+    }
+
+    dataarr_t *a = memget(sizeof(*a) + cap * w);
+    if (!a)
+    {
+        return ENOMEM;
+    }
+    a->h.type = DATA_ARR;
+    a->h.refs = 1;
+    a->elem = elem;
+    a->len = (uint32_t)len;
+    a->cap = (uint32_t)cap;
+    a->pad = 0;
+    *arr = a;
+    *d = data_box(DATA_TAG_PTR, (uint64_t)(uintptr_t)a);
+    return 0;
+}
+
+error_t
+mk_arr(data_t *d, enum data_type elem, size_t len, const void *init)
+{
+    dataarr_t *a;
+    error_t err = _arr_new(d, &a, elem, len, len);
+    if (err)
+    {
+        return err;
+    }
+
+    size_t w = arr_width(elem);
+    if (!init)
+    {
+        memset(a->v, 0, len * w);
+    }
+    else
+    {
+        memcpy(a->v, init, len * w);
+        // Masks hold exactly 0 or 1
+        if (DATA_BOOL == elem)
+        {
+            for (size_t i = 0; i < len; ++i)
+            {
+                a->v[i] = 0 != a->v[i];
+            }
+        }
+    }
+    return 0;
+}
+
+enum data_type
+arr_elem(data_t a)
+{
+    return (enum data_type)_arr(a)->elem;
+}
+
+size_t
+arr_len(data_t a)
+{
+    return _arr(a)->len;
+}
+
+const void *
+arr_data(data_t a)
+{
+    return _arr(a)->v;
+}
+
+error_t
+arr_mut(data_t *a, void **v)
+{
+    dataarr_t *arr = _arr(*a);
+    if (!arr)
+    {
+        return EINVAL;
+    }
+
+    if (refs_get(&arr->h.refs) > 1)
+    {
+        data_t copy;
+        error_t err = mk_arr(&copy, arr->elem, arr->len, arr->v);
+        if (err)
+        {
+            return err;
+        }
+        un_data(*a);
+        *a = copy;
+        arr = _arr(copy);
+    }
+
+    *v = arr->v;
+    return 0;
+}
+
+/**
+ * Box one element read from p.
+ */
+static error_t
+_box(data_t *d, enum data_type elem, const void *p)
+{
+    union
+    {
+        uint8_t u1;
+        uint16_t u2;
+        uint32_t u4;
+        uint64_t u8;
+        int8_t i1;
+        int16_t i2;
+        int32_t i4;
+        int64_t i8;
+        float f4;
+        double f8;
+    } v;
+    memcpy(&v, p, arr_width(elem));
+
+    switch (elem)
+    {
+        case DATA_U1:
+            *d = mk_u1(v.u1);
+            return 0;
+        case DATA_U2:
+            *d = mk_u2(v.u2);
+            return 0;
+        case DATA_U4:
+            *d = mk_u4(v.u4);
+            return 0;
+        case DATA_U8:
+            return mk_u8(d, v.u8);
+        case DATA_I1:
+            *d = mk_i1(v.i1);
+            return 0;
+        case DATA_I2:
+            *d = mk_i2(v.i2);
+            return 0;
+        case DATA_I4:
+            *d = mk_i4(v.i4);
+            return 0;
+        case DATA_I8:
+            return mk_i8(d, v.i8);
+        case DATA_F4:
+            *d = mk_f4(v.f4);
+            return 0;
+        case DATA_F8:
+            *d = mk_f8(v.f8);
+            return 0;
+        case DATA_BOOL:
+            *d = mk_bool(v.u1);
+            return 0;
+        default:
+            return EINVAL;
+    }
+}
+
+/**
+ * Unbox a scalar of type elem into p.
+ */
+static error_t
+_unbox(void *p, enum data_type elem, data_t d)
+{
+    if (data_typeof(d) != elem)
+    {
+        return EINVAL;
+    }
+
+    switch (elem)
+    {
+        case DATA_U1:
+        case DATA_I1:
+        case DATA_BOOL:
+            *(uint8_t *)p = (uint8_t)data_imm(d);
+            return 0;
+        case DATA_U2:
+        case DATA_I2:
+            {
+                uint16_t v = (uint16_t)data_imm(d);
+                memcpy(p, &v, sizeof(v));
+                return 0;
+            }
+        case DATA_U4:
+        case DATA_I4:
+        case DATA_F4:
+            {
+                uint32_t v = data_imm(d);
+                memcpy(p, &v, sizeof(v));
+                return 0;
+            }
+        case DATA_U8:
+            {
+                uint64_t v = data_u8(d);
+                memcpy(p, &v, sizeof(v));
+                return 0;
+            }
+        case DATA_I8:
+            {
+                int64_t v = data_i8(d);
+                memcpy(p, &v, sizeof(v));
+                return 0;
+            }
+        case DATA_F8:
+            {
+                double v = data_f8(d);
+                memcpy(p, &v, sizeof(v));
+                return 0;
+            }
+        default:
+            return EINVAL;
+    }
+}
+
+error_t
+arr_get(data_t *v, data_t a, size_t i)
+{
+    dataarr_t *arr = _arr(a);
+    if (!arr)
+    {
+        return EINVAL;
+    }
+    if (i >= arr->len)
+    {
+        return ERANGE;
+    }
+    return _box(v, arr->elem, arr->v + i * arr_width(arr->elem));
+}
+
+error_t
+arr_set(data_t *a, size_t i, data_t v)
+{
+    dataarr_t *arr = _arr(*a);
+    if (!arr)
+    {
+        return EINVAL;
+    }
+    if (i >= arr->len)
+    {
+        return ERANGE;
+    }
+
+    uint64_t raw;
+    error_t err = _unbox(&raw, arr->elem, v);
+    if (!err)
+    {
+        void *p;
+        err = arr_mut(a, &p);
+        if (!err)
+        {
+            size_t w = arr_width(arr->elem);
+            memcpy((uint8_t *)p + i * w, &raw, w);
+        }
+    }
+    return err;
+}
+
+error_t
+arr_push(data_t *a, data_t v)
+{
+    dataarr_t *arr = _arr(*a);
+    if (!arr)
+    {
+        return EINVAL;
+    }
+
+    uint64_t raw;
+    void *p;
+    error_t err = _unbox(&raw, arr->elem, v);
+    if (!err)
+    {
+        err = arr_mut(a, &p);
+    }
+    if (err)
+    {
+        return err;
+    }
+
+    arr = _arr(*a);
+    size_t w = arr_width(arr->elem);
+    if (arr->len == arr->cap)
+    {
+        if (ARR_LEN_MAX == arr->len)
+        {
+            return E2BIG;
+        }
+        size_t cap = arr->cap ? meminc(arr->cap) : 8;
+        if (cap > ARR_LEN_MAX)
+        {
+            cap = ARR_LEN_MAX;
+        }
+        dataarr_t *grown = memreget(arr, sizeof(*arr) + cap * w);
+        if (!grown)
+        {
+            return ENOMEM;
+        }
+        grown->cap = (uint32_t)cap;
+        arr = grown;
+        *a = data_box(DATA_TAG_PTR, (uint64_t)(uintptr_t)arr);
+    }
+
+    memcpy(arr->v + arr->len * w, &raw, w);
+    ++arr->len;
+    return 0;
+}
+
+/**
+ * Operand b as an array matching a, or a scalar of a's element type.
+ */
+static error_t
+_operand(const void **p, bool *scalar, uint64_t *raw, const dataarr_t *a,
+         data_t b)
+{
+    const dataarr_t *arr = _arr(b);
+    if (arr)
+    {
+        if (arr->elem != a->elem)
+        {
+            return EINVAL;
+        }
+        if (arr->len != a->len)
+        {
+            return ERANGE;
+        }
+        *p = arr->v;
+        *scalar = false;
+        return 0;
+    }
+
+    *p = raw;
+    *scalar = true;
+    return _unbox(raw, a->elem, b);
+}
+
+error_t
+arr_binop(data_t *r, enum arr_op op, data_t a, data_t b)
+{
+    const dataarr_t *arr = _arr(a);
+    if (!arr || DATA_BOOL == arr->elem || op > ARR_MAX)
+    {
+        return EINVAL;
+    }
+
+    const void *bp;
+    bool scalar;
+    uint64_t raw;
+    error_t err = _operand(&bp, &scalar, &raw, arr, b);
+    if (err)
+    {
+        return err;
+    }
+
+    dataarr_t *out;
+    data_t d;
+    err = _arr_new(&d, &out, arr->elem, arr->len, arr->len);
+    if (err)
+    {
+        return err;
+    }
+
+    binop_fn fn = _kern(arr->elem)->op[op];
+    if (fn)
+    {
+        fn(out->v, arr->v, bp, arr->len, scalar);
+    }
+    else
+    {
+        err = _intdiv(arr->elem, out->v, arr->v, bp, arr->len, scalar);
+        if (err)
+        {
+            un_data(d);
+            return err;
+        }
+    }
+
+    *r = d;
+    return 0;
+}
+
+error_t
+arr_compare(data_t *mask, enum arr_cmp cmp, data_t a, data_t b)
+{
+    const dataarr_t *arr = _arr(a);
+    if (!arr || cmp > ARR_GE)
+    {
+        return EINVAL;
+    }
+
+    const void *bp;
+    bool scalar;
+    uint64_t raw;
+    error_t err = _operand(&bp, &scalar, &raw, arr, b);
+    if (err)
+    {
+        return err;
+    }
+
+    dataarr_t *out;
+    err = _arr_new(mask, &out, DATA_BOOL, arr->len, arr->len);
+    if (!err)
+    {
+        _kern(arr->elem)->cmp[cmp](out->v, arr->v, bp, arr->len, scalar);
+    }
+    return err;
+}
+
+error_t
+arr_reduce(data_t *r, enum arr_reduce red, data_t a)
+{
+    const dataarr_t *arr = _arr(a);
+    if (!arr || red > ARR_MOST)
+    {
+        return EINVAL;
+    }
+
+    enum data_type elem = arr->elem;
+    if (ARR_SUM != red)
+    {
+        if (!arr->len)
+        {
+            return EDOM;
+        }
+        uint64_t v;
+        _kern(elem)->reduce[red](&v, arr->v, arr->len);
+        return _box(r, elem, &v);
+    }
+
+    union
+    {
+        uint64_t u;
+        double f;
+    } sum = { 0 };
+    if (arr->len)
+    {
+        _kern(elem)->reduce[ARR_SUM](&sum, arr->v, arr->len);
+    }
+
+    switch (elem)
+    {
+        case DATA_I1:
+        case DATA_I2:
+        case DATA_I4:
+        case DATA_I8:
+            return mk_i8(r, (int64_t)sum.u);
+        case DATA_F4:
+            *r = mk_f4((float)sum.f);
+            return 0;
+        case DATA_F8:
+            *r = mk_f8(sum.f);
+            return 0;
+        default:
+            return mk_u8(r, sum.u);
+    }
+}
+
+/**
+ * Index i of an integer array, UINT64_MAX for negatives.
+ */
+static uint64_t
+_index(const dataarr_t *idx, size_t i)
+{
+    const uint8_t *p = idx->v + i * arr_width(idx->elem);
+    switch (idx->elem)
+    {
+        case DATA_U1:
+            return *p;
+        case DATA_U2:
+            {
+                uint16_t v;
+                memcpy(&v, p, sizeof(v));
+                return v;
+            }
+        case DATA_U4:
+            {
+                uint32_t v;
+                memcpy(&v, p, sizeof(v));
+                return v;
+            }
+        case DATA_U8:
+            {
+                uint64_t v;
+                memcpy(&v, p, sizeof(v));
+                return v;
+            }
+        case DATA_I1:
+            return (int8_t)*p < 0 ? UINT64_MAX : *p;
+        case DATA_I2:
+            {
+                int16_t v;
+                memcpy(&v, p, sizeof(v));
+                return v < 0 ? UINT64_MAX : (uint64_t)v;
+            }
+        case DATA_I4:
+            {
+                int32_t v;
+                memcpy(&v, p, sizeof(v));
+                return v < 0 ? UINT64_MAX : (uint64_t)v;
+            }
+        case DATA_I8:
+            {
+                int64_t v;
+                memcpy(&v, p, sizeof(v));
+                return v < 0 ? UINT64_MAX : (uint64_t)v;
+            }
+        default:
+            return UINT64_MAX;
+    }
+}
+
+error_t
+arr_gather(data_t *r, data_t a, data_t idx)
+{
+    const dataarr_t *arr = _arr(a);
+    const dataarr_t *ix = _arr(idx);
+    if (!arr || !ix || DATA_BOOL == ix->elem || DATA_F4 == ix->elem
+        || DATA_F8 == ix->elem)
+    {
+        return EINVAL;
+    }
+
+    dataarr_t *out;
+    data_t d;
+    error_t err = _arr_new(&d, &out, arr->elem, ix->len, ix->len);
+    if (err)
+    {
+        return err;
+    }
+
+    size_t w = arr_width(arr->elem);
+    for (size_t i = 0; i < ix->len; ++i)
+    {
+        uint64_t k = _index(ix, i);
+        if (k >= arr->len)
+        {
+            un_data(d);
+            return ERANGE;
+        }
+        memcpy(out->v + i * w, arr->v + k * w, w);
+    }
+
+    *r = d;
+    return 0;
+}
+
+/**
+ * Branchless: every element is written and the cursor only moves past
+ * kept ones, so out needs room for one extra.
+ */
+#define ARR_COMPACT(W) \
+    for (size_t i = 0; i < n; ++i) \
+    { \
+        memcpy(out + j * W, in + i * W, W); \
+        j += m[i]; \
+    }
+
+error_t
+arr_filter(data_t *r, data_t a, data_t mask)
+{
+    const dataarr_t *arr = _arr(a);
+    const dataarr_t *ms = _arr(mask);
+    if (!arr || !ms || DATA_BOOL != ms->elem)
+    {
+        return EINVAL;
+    }
+    if (arr->len != ms->len)
+    {
+        return ERANGE;
+    }
+
+    uint64_t count = 0;
+    if (ms->len)
+    {
+        _kern(DATA_BOOL)->reduce[ARR_SUM](&count, ms->v, ms->len);
+    }
+
+    dataarr_t *res;
+    error_t err = _arr_new(r, &res, arr->elem, count, count + 1);
+    if (err)
+    {
+        return err;
+    }
+
+    const uint8_t *in = arr->v;
+    const uint8_t *m = ms->v;
+    uint8_t *out = res->v;
+    size_t n = arr->len;
+    size_t j = 0;
+    switch (arr_width(arr->elem))
+    {
+        case 1:
+            ARR_COMPACT(1)
+            break;
+        case 2:
+            ARR_COMPACT(2)
+            break;
+        case 4:
+            ARR_COMPACT(4)
+            break;
+        default:
+            ARR_COMPACT(8)
+            break;
+    }
+    return 0;
+}
+
+
+/*******************************************************************************
+ * PARALLEL
+ ******************************************************************************/
+
+// Elements per grain; between these it is as many as fill half of L1
+#define ARR_GRAIN 256
+#define ARR_GRAIN_MAX (16 * ARR_GRAIN)
+#define ARR_BLOCKS 8 // Per worker, for reductions
+
+typedef struct
+{
+    const arr_fn_t *fn;
+    const dataarr_t *in;
+    uint8_t *out;
+    enum data_type elem; // Of out
+    size_t block;
+    data_t init; // Each block folds from this
+    data_t *partial; // One per block
+} arrpar_t;
+
+static error_t
+_par(sched_t *s, const arr_fn_t *fn, size_t n, size_t grain, sched_body_t body,
+     void *arg)
+{
+    if (s && fn->pure)
+    {
+        return sched_for(s, n, grain, body, arg);
+    }
+    return n ? body(0, n, arg) : 0;
+}
+
+static error_t
+_par_map(size_t lo, size_t hi, void *arg)
+{
+    const arrpar_t *p = arg;
+    size_t win = arr_width(p->in->elem);
+    size_t wout = arr_width(p->elem);
+    for (size_t i = lo; i < hi; ++i)
+    {
+        data_t v;
+        data_t r;
+        error_t err = _box(&v, p->in->elem, p->in->v + i * win);
+        if (err)
+        {
+            return err;
+        }
+        err = p->fn->fn(&r, &v, p->fn->ctx);
+        un_data(v);
+        if (err)
+        {
+            return err;
+        }
+        err = _unbox(p->out + i * wout, p->elem, r);
+        un_data(r);
+        if (err)
+        {
+            return err;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Fold elements [lo, hi) into acc, which is released on failure.
+ */
+static error_t
+_fold(data_t *acc, const arrpar_t *p, size_t lo, size_t hi)
+{
+    size_t w = arr_width(p->in->elem);
+    for (size_t i = lo; i < hi; ++i)
+    {
+        data_t args[2] = { *acc };
+        data_t next;
+        error_t err = _box(&args[1], p->in->elem, p->in->v + i * w);
+        if (!err)
+        {
+            err = p->fn->fn(&next, args, p->fn->ctx);
+            un_data(args[1]);
+        }
+        if (err)
+        {
+            un_data(*acc);
+            return err;
+        }
+        un_data(*acc);
+        *acc = next;
+    }
+    return 0;
+}
+
+static error_t
+_par_reduce(size_t lo, size_t hi, void *arg)
+{
+    const arrpar_t *p = arg;
+    for (size_t b = lo; b < hi; ++b)
+    {
+        size_t first = b * p->block;
+        size_t last = first + p->block < p->in->len ? first + p->block : p->in->len;
+        data_t acc = data_ref(p->init);
+        error_t err = _fold(&acc, p, first, last);
+        if (err)
+        {
+            return err;
+        }
+        p->partial[b] = acc;
+    }
+    return 0;
+}
+
+error_t
+arr_pmap(data_t *r, sched_t *s, enum data_type elem, data_t a, const arr_fn_t *fn)
+{
+    const dataarr_t *arr = _arr(a);
+    if (!arr)
+    {
+        return EINVAL;
+    }
+
+    dataarr_t *res;
+    error_t err = _arr_new(r, &res, elem, arr->len, arr->len);
+    if (err)
+    {
+        return err;
+    }
+    arrpar_t p = { .fn = fn, .in = arr, .out = res->v, .elem = elem };
+    size_t grain = machine_grain(arr_width(arr->elem), ARR_GRAIN, ARR_GRAIN_MAX);
+    err = _par(s, fn, arr->len, grain, _par_map, &p);
+    if (err)
+    {
+        un_data(*r);
+    }
+    return err;
+}
+
+error_t
+arr_pfilter(data_t *r, sched_t *s, data_t a, const arr_fn_t *fn)
+{
+    data_t mask;
+    error_t err = arr_pmap(&mask, s, DATA_BOOL, a, fn);
+    if (!err)
+    {
+        err = arr_filter(r, a, mask);
+        un_data(mask);
+    }
+    return err;
+}
+
+error_t
+arr_preduce(data_t *r, sched_t *s, data_t a, data_t init, const arr_fn_t *fn)
+{
+    const dataarr_t *arr = _arr(a);
+    if (!arr)
+    {
+        return EINVAL;
+    }
+
+    arrpar_t p = { .fn = fn, .in = arr, .init = init };
+    data_t acc = data_ref(init);
+    if (!s || !fn->pure || !fn->combine)
+    {
+        error_t err = _fold(&acc, &p, 0, arr->len);
+        if (!err)
+        {
+            *r = acc;
+        }
+        return err;
+    }
+
+    // Enough blocks to keep every worker busy, none too small to be worth it
+    size_t blocks = sched_workers(s) * ARR_BLOCKS;
+    p.block = (arr->len + blocks - 1) / blocks;
+    size_t grain = machine_grain(arr_width(arr->elem), ARR_GRAIN, ARR_GRAIN_MAX);
+    p.block = p.block < grain ? grain : p.block;
+    blocks = (arr->len + p.block - 1) / p.block;
+    p.partial = memget((blocks ? blocks : 1) * sizeof(data_t));
+    if (!p.partial)
+    {
+        un_data(acc);
+        return ENOMEM;
+    }
+    for (size_t b = 0; b < blocks; ++b)
+    {
+        p.partial[b] = mk_bool(false);
+    }
+
+    error_t err = sched_for(s, blocks, 1, _par_reduce, &p);
+    for (size_t b = 0; b < blocks && !err; ++b)
+    {
+        data_t args[2] = { acc, p.partial[b] };
+        data_t next;
+        err = fn->combine(&next, args, fn->ctx);
+        if (!err)
+        {
+            un_data(acc);
+            acc = next;
+        }
+    }
+    for (size_t b = 0; b < blocks; ++b)
+    {
+        un_data(p.partial[b]);
+    }
+    memput(p.partial);
+
+    if (err)
+    {
+        un_data(acc);
+    }
+    else
+    {
+        *r = acc;
+    }
+    return err;
+}
+
@@ -0,0 +1,704 @@
+/*******************************************************************************
+ * Copyright (c) 2022 Craig Jacobson
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ ******************************************************************************/
+/**
+ * @file bigint.c
+ * @author Craig Jacobson
+ * @brief Arbitrary precision integers, DATA_I and DATA_U.
+ *
+ * Values that fit in the 48-bit payload stay inline in the data_t and are
+ * handled without touching the heap. Everything else is sign-magnitude
+ * with 64-bit limbs, least significant first.
+ */
+#include <errno.h>
+
+#include "data.h"
+#include "symmem.h"
+
+
+// Below this many limbs schoolbook multiplication is faster
+#define KARATSUBA_LIMBS 32
+
+typedef struct
+{
+    dataobj_t h;
+    uint32_t len;
+    bool neg;
+    uint64_t limbs[];
+} databig_t;
+
+/**
+ * Operand seen as sign and magnitude, inline values use one.
+ */
+typedef struct
+{
+    bool neg;
+    size_t len;
+    const uint64_t *limbs;
+    uint64_t one;
+} bigview_t;
+
+typedef unsigned __int128 u128_t;
+
+
+static bool
+_isint(data_t d)
+{
+    enum data_type t = data_typeof(d);
+    return DATA_I == t || DATA_U == t;
+}
+
+static void
+_view(bigview_t *v, data_t d)
+{
+    if (data_isobj(d))
+    {
+        databig_t *b = (databig_t *)data_obj(d);
+        v->neg = b->neg;
+        v->len = b->len;
+        v->limbs = b->limbs;
+        return;
+    }
+
+    if (DATA_TAG_INT == data_tag(d))
+    {
+        int64_t x = data_payload_signed(d);
+        v->neg = x < 0;
+        v->one = v->neg ? -(uint64_t)x : (uint64_t)x;
+    }
+    else
+    {
+        v->neg = false;
+        v->one = d.bits & DATA_PAYLOAD;
+    }
+    v->len = v->one ? 1 : 0;
+    v->limbs = &v->one;
+}
+
+static databig_t *
+_big_alloc(enum data_type type, size_t len)
+{
+    if (len > UINT32_MAX)
+    {
+        return NULL;
+    }
+    databig_t *b = memget(sizeof(*b) + len * sizeof(uint64_t));
+    if (b)
+    {
+        b->h.type = type;
+        b->h.refs = 1;
+        b->len = (uint32_t)len;
+        b->neg = false;
+    }
+    return b;
+}
+
+static size_t
+_trim(const uint64_t *a, size_t len)
+{
+    for (; len && !a[len - 1]; --len);
+    return len;
+}
+
+/**
+ * Normalize b into d, moving it inline when it fits.
+ */
+static void
+_big_finish(data_t *d, databig_t *b)
+{
+    b->len = (uint32_t)_trim(b->limbs, b->len);
+    if (!b->len)
+    {
+        b->neg = false;
+    }
+
+    uint64_t mag = b->len ? b->limbs[0] : 0;
+    if (b->len <= 1)
+    {
+        if (DATA_U == b->h.type && mag <= DATA_INLINE_UMAX)
+        {
+            *d = data_box(DATA_TAG_UINT, mag);
+            memput(b);
+            return;
+        }
+        if (DATA_I == b->h.type
+            && (b->neg ? mag <= (uint64_t)DATA_INLINE_MAX + 1 : mag <= (uint64_t)DATA_INLINE_MAX))
+        {
+            *d = data_box(DATA_TAG_INT, b->neg ? -mag : mag);
+            memput(b);
+            return;
+        }
+    }
+
+    *d = data_box(DATA_TAG_PTR, (uint64_t)(uintptr_t)b);
+}
+
+static error_t
+_mk(data_t *d, enum data_type type, bool neg, uint64_t mag)
+{
+    databig_t *b = _big_alloc(type, 1);
+    if (!b)
+    {
+        return ENOMEM;
+    }
+    b->neg = neg;
+    b->limbs[0] = mag;
+    _big_finish(d, b);
+    return 0;
+}
+
+error_t
+mk_int(data_t *d, int64_t v)
+{
+    if (v >= DATA_INLINE_MIN && v <= DATA_INLINE_MAX)
+    {
+        *d = data_box(DATA_TAG_INT, (uint64_t)v);
+        return 0;
+    }
+    return _mk(d, DATA_I, v < 0, v < 0 ? -(uint64_t)v : (uint64_t)v);
+}
+
+error_t
+mk_uint(data_t *d, uint64_t v)
+{
+    if (v <= DATA_INLINE_UMAX)
+    {
+        *d = data_box(DATA_TAG_UINT, v);
+        return 0;
+    }
+    return _mk(d, DATA_U, false, v);
+}
+
+error_t
+mk_int_limbs(data_t *d, enum data_type type, bool neg, size_t len,
+             const uint64_t *limbs)
+{
+    if (DATA_I != type && DATA_U != type)
+    {
+        return EINVAL;
+    }
+    if (DATA_U == type && neg && _trim(limbs, len))
+    {
+        return ERANGE;
+    }
+
+    databig_t *b = _big_alloc(type, len);
+    if (!b)
+    {
+        return ENOMEM;
+    }
+    b->neg = neg;
+    memcpy(b->limbs, limbs, len * sizeof(*limbs));
+    _big_finish(d, b);
+    return 0;
+}
+
+size_t
+data_int_limbs(const data_t *d, bool *neg, const uint64_t **limbs, uint64_t *one)
+{
+    if (data_isobj(*d))
+    {
+        databig_t *b = (databig_t *)data_obj(*d);
+        *neg = b->neg;
+        *limbs = b->limbs;
+        return b->len;
+    }
+
+    bigview_t v;
+    _view(&v, *d);
+    *one = v.one;
+    *neg = v.neg;
+    *limbs = one;
+    return v.len;
+}
+
+bool
+data_int_i8(data_t d, int64_t *v)
+{
+    bigview_t x;
+    _view(&x, d);
+    if (x.len > 1)
+    {
+        return false;
+    }
+    uint64_t mag = x.len ? x.limbs[0] : 0;
+    if (x.neg ? mag > (uint64_t)INT64_MAX + 1 : mag > (uint64_t)INT64_MAX)
+    {
+        return false;
+    }
+    *v = x.neg ? (int64_t)-mag : (int64_t)mag;
+    return true;
+}
+
+bool
+data_int_u8(data_t d, uint64_t *v)
+{
+    bigview_t x;
+    _view(&x, d);
+    if (x.neg || x.len > 1)
+    {
+        return false;
+    }
+    *v = x.len ? x.limbs[0] : 0;
+    return true;
+}
+
+
+/*******************************************************************************
+ * MAGNITUDE ARITHMETIC
+ ******************************************************************************/
+
+static int
+_mag_cmp(const uint64_t *a, size_t alen, const uint64_t *b, size_t blen)
+{
+    if (alen != blen)
+    {
+        return alen < blen ? -1 : 1;
+    }
+    while (alen--)
+    {
+        if (a[alen] != b[alen])
+        {
+            return a[alen] < b[alen] ? -1 : 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * r += a, r has rlen >= alen limbs; returns the carry out of r.
+ */
+static uint64_t
+_add_into(uint64_t *r, size_t rlen, const uint64_t *a, size_t alen)
+{
+    uint64_t carry = 0;
+    size_t i = 0;
+    for (; i < alen; ++i)
+    {
+        uint64_t s;
+        uint64_t c1 = __builtin_add_overflow(r[i], a[i], &s);
+        uint64_t c2 = __builtin_add_overflow(s, carry, &r[i]);
+        carry = c1 | c2;
+    }
+    for (; carry && i < rlen; ++i)
+    {
+        carry = __builtin_add_overflow(r[i], carry, &r[i]);
+    }
+    return carry;
+}
+
+/**
+ * r -= a, requires r >= a.
+ */
+static void
+_sub_into(uint64_t *r, size_t rlen, const uint64_t *a, size_t alen)
+{
+    uint64_t borrow = 0;
+    size_t i = 0;
+    for (; i < alen; ++i)
+    {
+        uint64_t s;
+        uint64_t b1 = __builtin_sub_overflow(r[i], a[i], &s);
+        uint64_t b2 = __builtin_sub_overflow(s, borrow, &r[i]);
+        borrow = b1 | b2;
+    }
+    for (; borrow && i < rlen; ++i)
+    {
+        borrow = __builtin_sub_overflow(r[i], borrow, &r[i]);
+    }
+}
+
+static void
+_mul_school(uint64_t *r, const uint64_t *a, size_t alen,
+            const uint64_t *b, size_t blen)
+{
+    memset(r, 0, (alen + blen) * sizeof(*r));
+    size_t i;
+    for (i = 0; i < alen; ++i)
+    {
+        uint64_t carry = 0;
+        size_t j;
+        for (j = 0; j < blen; ++j)
+        {
+            u128_t t = (u128_t)a[i] * b[j] + r[i + j] + carry;
+            r[i + j] = (uint64_t)t;
+            carry = (uint64_t)(t >> 64);
+        }
+        r[i + blen] = carry;
+    }
+}
+
+static error_t
+_mul(uint64_t *r, const uint64_t *a, size_t alen, const uint64_t *b, size_t blen);
+
+/**
+ * a = a1 B^m + a0, b = b1 B^m + b0
+ * ab = z2 B^2m + ((a0 + a1)(b0 + b1) - z2 - z0) B^m + z0
+ * Requires alen >= blen > m.
+ */
+static error_t
+_mul_karatsuba(uint64_t *r, const uint64_t *a, size_t alen,
+               const uint64_t *b, size_t blen)
+{
+    size_t m = alen / 2;
+    size_t a1len = alen - m;
+    size_t b1len = blen - m;
+    size_t salen = (a1len > m ? a1len : m) + 1;
+    size_t sblen = (b1len > m ? b1len : m) + 1;
+    size_t z1len = salen + sblen;
+    error_t err;
+
+    uint64_t *tmp = memget((salen + sblen + z1len) * sizeof(*tmp));
+    if (!tmp)
+    {
+        return ENOMEM;
+    }
+    uint64_t *sa = tmp;
+    uint64_t *sb = sa + salen;
+    uint64_t *z1 = sb + sblen;
+
+    // z0 and z2 go straight to their place in r
+    err = _mul(r, a, m, b, m);
+    if (!err)
+    {
+        err = _mul(r + 2 * m, a + m, a1len, b + m, b1len);
+    }
+    if (err)
+    {
+        memput(tmp);
+        return err;
+    }
+
+    memset(sa, 0, salen * sizeof(*sa));
+    memcpy(sa, a + m, a1len * sizeof(*sa));
+    _add_into(sa, salen, a, m);
+    memset(sb, 0, sblen * sizeof(*sb));
+    memcpy(sb, b + m, b1len * sizeof(*sb));
+    _add_into(sb, sblen, b, m);
+
+    size_t sal = _trim(sa, salen);
+    size_t sbl = _trim(sb, sblen);
+    memset(z1, 0, z1len * sizeof(*z1));
+    err = _mul(z1, sa, sal, sb, sbl);
+    if (err)
+    {
+        memput(tmp);
+        return err;
+    }
+
+    _sub_into(z1, z1len, r, 2 * m);
+    _sub_into(z1, z1len, r + 2 * m, a1len + b1len);
+    _add_into(r + m, alen + blen - m, z1, _trim(z1, z1len));
+
+    memput(tmp);
+    return 0;
+}
+
+/**
+ * r = a * b, r has room for alen + blen limbs.
+ */
+static error_t
+_mul(uint64_t *r, const uint64_t *a, size_t alen, const uint64_t *b, size_t blen)
+{
+    if (alen < blen)
+    {
+        const uint64_t *t = a;
+        a = b;
+        b = t;
+        size_t tlen = alen;
+        alen = blen;
+        blen = tlen;
+    }
+
+    if (blen < KARATSUBA_LIMBS)
+    {
+        _mul_school(r, a, alen, b, blen);
+        return 0;
+    }
+
+    if (alen < 2 * blen)
+    {
+        return _mul_karatsuba(r, a, alen, b, blen);
+    }
+
+    // Unbalanced, multiply b by blen sized chunks of a
+    uint64_t *part = memget(2 * blen * sizeof(*part));
+    if (!part)
+    {
+        return ENOMEM;
+    }
+    memset(r, 0, (alen + blen) * sizeof(*r));
+    size_t off;
+    for (off = 0; off < alen; off += blen)
+    {
+        size_t n = alen - off < blen ? alen - off : blen;
+        error_t err = _mul(part, a + off, n, b, blen);
+        if (err)
+        {
+            memput(part);
+            return err;
+        }
+        _add_into(r + off, alen + blen - off, part, n + blen);
+    }
+    memput(part);
+    return 0;
+}
+
+
+/*******************************************************************************
+ * OPERATIONS
+ ******************************************************************************/
+
+static error_t
+_types(data_t a, data_t b, enum data_type *type)
+{
+    *type = data_typeof(a);
+    if (!_isint(a) || *type != data_typeof(b))
+    {
+        return EINVAL;
+    }
+    return 0;
+}
+
+/**
+ * Signed add of views, b negated if negb.
+ */
+static error_t
+_add_slow(data_t *r, enum data_type type, data_t a, data_t b, bool negb)
+{
+    bigview_t x;
+    bigview_t y;
+    _view(&x, a);
+    _view(&y, b);
+    bool yneg = y.neg != negb;
+
+    size_t len = (x.len > y.len ? x.len : y.len) + 1;
+    databig_t *big = _big_alloc(type, len);
+    if (!big)
+    {
+        return ENOMEM;
+    }
+    memset(big->limbs, 0, len * sizeof(uint64_t));
+
+    if (x.neg == yneg)
+    {
+        memcpy(big->limbs, x.limbs, x.len * sizeof(uint64_t));
+        _add_into(big->limbs, len, y.limbs, y.len);
+        big->neg = x.neg;
+    }
+    else if (_mag_cmp(x.limbs, x.len, y.limbs, y.len) >= 0)
+    {
+        memcpy(big->limbs, x.limbs, x.len * sizeof(uint64_t));
+        _sub_into(big->limbs, len, y.limbs, y.len);
+        big->neg = x.neg;
+    }
+    else
+    {
+        memcpy(big->limbs, y.limbs, y.len * sizeof(uint64_t));
+        _sub_into(big->limbs, len, x.limbs, x.len);
+        big->neg = yneg;
+    }
+
+    if (DATA_U == type && big->neg && _trim(big->limbs, len))
+    {
+        memput(big);
+        return ERANGE;
+    }
+    _big_finish(r, big);
+    return 0;
+}
+
+error_t
+data_int_add(data_t *r, data_t a, data_t b)
+{
+    unsigned ta = data_tag(a);
+    unsigned tb = data_tag(b);
+
+    // 48-bit operands can't overflow 64 bits, only the payload
+    if (DATA_TAG_INT == ta && DATA_TAG_INT == tb)
+    {
+        int64_t x = data_payload_signed(a) + data_payload_signed(b);
+        if (x >= DATA_INLINE_MIN && x <= DATA_INLINE_MAX)
+        {
+            *r = data_box(DATA_TAG_INT, (uint64_t)x);
+            return 0;
+        }
+    }
+    else if (DATA_TAG_UINT == ta && DATA_TAG_UINT == tb)
+    {
+        uint64_t x = (a.bits & DATA_PAYLOAD) + (b.bits & DATA_PAYLOAD);
+        if (x <= DATA_INLINE_UMAX)
+        {
+            *r = data_box(DATA_TAG_UINT, x);
+            return 0;
+        }
+    }
+
+    enum data_type type;
+    error_t err = _types(a, b, &type);
+    return err ? err : _add_slow(r, type, a, b, false);
+}
+
+error_t
+data_int_sub(data_t *r, data_t a, data_t b)
+{
+    unsigned ta = data_tag(a);
+    unsigned tb = data_tag(b);
+
+    if (DATA_TAG_INT == ta && DATA_TAG_INT == tb)
+    {
+        int64_t x = data_payload_signed(a) - data_payload_signed(b);
+        if (x >= DATA_INLINE_MIN && x <= DATA_INLINE_MAX)
+        {
+            *r = data_box(DATA_TAG_INT, (uint64_t)x);
+            return 0;
+        }
+    }
+    else if (DATA_TAG_UINT == ta && DATA_TAG_UINT == tb)
+    {
+        uint64_t x;
+        if (__builtin_sub_overflow(a.bits & DATA_PAYLOAD, b.bits & DATA_PAYLOAD, &x))
+        {
+            return ERANGE;
+        }
+        *r = data_box(DATA_TAG_UINT, x);
+        return 0;
+    }
+
+    enum data_type type;
+    error_t err = _types(a, b, &type);
+    return err ? err : _add_slow(r, type, a, b, true);
+}
+
+error_t
+data_int_mul(data_t *r, data_t a, data_t b)
+{
+    unsigned ta = data_tag(a);
+    unsigned tb = data_tag(b);
+
+    if (DATA_TAG_INT == ta && DATA_TAG_INT == tb)
+    {
+        int64_t x;
+        if (!__builtin_mul_overflow(data_payload_signed(a), data_payload_signed(b), &x)
+            && x >= DATA_INLINE_MIN && x <= DATA_INLINE_MAX)
+        {
+            *r = data_box(DATA_TAG_INT, (uint64_t)x);
+            return 0;
+        }
+    }
+    else if (DATA_TAG_UINT == ta && DATA_TAG_UINT == tb)
+    {
+        uint64_t x;
+        if (!__builtin_mul_overflow(a.bits & DATA_PAYLOAD, b.bits & DATA_PAYLOAD, &x)
+            && x <= DATA_INLINE_UMAX)
+        {
+            *r = data_box(DATA_TAG_UINT, x);
+            return 0;
+        }
+    }
+
+    enum data_type type;
+    error_t err = _types(a, b, &type);
+    if (err)
+    {
+        return err;
+    }
+
+    bigview_t x;
+    bigview_t y;
+    _view(&x, a);
+    _view(&y, b);
+
+    size_t len = x.len + y.len;
+    databig_t *big = _big_alloc(type, len ? len : 1);
+    if (!big)
+    {
+        return ENOMEM;
+    }
+    big->limbs[0] = 0;
+    err = _mul(big->limbs, x.limbs, x.len, y.limbs, y.len);
+    if (err)
+    {
+        memput(big);
+        return err;
+    }
+    big->neg = x.neg != y.neg;
+    _big_finish(r, big);
+    return 0;
+}
+
+int
+data_int_cmp(data_t a, data_t b)
+{
+    if (DATA_TAG_INT == data_tag(a) && DATA_TAG_INT == data_tag(b))
+    {
+        int64_t x = data_payload_signed(a);
+        int64_t y = data_payload_signed(b);
+        return (x > y) - (x < y);
+    }
+
+    bigview_t x;
+    bigview_t y;
+    _view(&x, a);
+    _view(&y, b);
+    if (x.neg != y.neg)
+    {
+        return x.neg ? -1 : 1;
+    }
+    int c = _mag_cmp(x.limbs, x.len, y.limbs, y.len);
+    return x.neg ? -c : c;
+}
+
+error_t
+data_int_divmod_small(data_t *q, uint64_t *rem, data_t a, uint64_t div)
+{
+    if (!_isint(a))
+    {
+        return EINVAL;
+    }
+    if (!div)
+    {
+        return EDOM;
+    }
+
+    bigview_t x;
+    _view(&x, a);
+
+    databig_t *big = _big_alloc(data_typeof(a), x.len ? x.len : 1);
+    if (!big)
+    {
+        return ENOMEM;
+    }
+    big->limbs[0] = 0;
+
+    u128_t r = 0;
+    size_t i = x.len;
+    while (i--)
+    {
+        u128_t cur = (r << 64) | x.limbs[i];
+        big->limbs[i] = (uint64_t)(cur / div);
+        r = cur % div;
+    }
+    big->neg = x.neg;
+    _big_finish(q, big);
+    *rem = (uint64_t)r;
+    return 0;
+}
@@ -0,0 +1,299 @@
+/*******************************************************************************
+ * Copyright (c) 2022 Craig Jacobson
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ ******************************************************************************/
+/**
+ * @file channel.c
+ * @author Craig Jacobson
+ * @brief Bounded MPMC channels over a sequenced ring.
+ *
+ * Slot i starts with sequence i. A sender claiming position p waits for
+ * sequence p, writes and publishes p + 1; a receiver claiming p waits
+ * for p + 1, reads and frees the slot for the next lap with p + cap.
+ * Claims are a compare and swap on head or tail, so the only waiting is
+ * on a full or empty ring, never on another thread's hand-off.
+ */
+#include <errno.h>
+
+#include "channel.h"
+#include "symmem.h"
+
+
+typedef struct
+{
+    size_t n;
+    chan_op_t *ops;
+    size_t *which;
+    error_t err;
+} chanwait_t;
+
+static _Thread_local size_t _turn;
+
+
+/*******************************************************************************
+ * RING
+ ******************************************************************************/
+
+static bool
+_put(chan_t *c, data_t v)
+{
+    uint64_t pos = __atomic_load_n(&c->head, __ATOMIC_RELAXED);
+    chanslot_t *slot;
+    for (;;)
+    {
+        slot = &c->slots[pos & c->mask];
+        uint64_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        int64_t diff = (int64_t)(seq - pos);
+        if (0 == diff)
+        {
+            if (__atomic_compare_exchange_n(&c->head, &pos, pos + 1, true,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            {
+                break;
+            }
+        }
+        else if (diff < 0)
+        {
+            return false;
+        }
+        else
+        {
+            pos = __atomic_load_n(&c->head, __ATOMIC_RELAXED);
+        }
+    }
+    slot->v = data_ref(v);
+    __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+static bool
+_take(chan_t *c, data_t *v)
+{
+    uint64_t pos = __atomic_load_n(&c->tail, __ATOMIC_RELAXED);
+    chanslot_t *slot;
+    for (;;)
+    {
+        slot = &c->slots[pos & c->mask];
+        uint64_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        int64_t diff = (int64_t)(seq - (pos + 1));
+        if (0 == diff)
+        {
+            if (__atomic_compare_exchange_n(&c->tail, &pos, pos + 1, true,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            {
+                break;
+            }
+        }
+        else if (diff < 0)
+        {
+            return false;
+        }
+        else
+        {
+            pos = __atomic_load_n(&c->tail, __ATOMIC_RELAXED);
+        }
+    }
+    *v = slot->v;
+    __atomic_store_n(&slot->seq, pos + c->mask + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+/**
+ * Wake anyone waiting on c. They count themselves in before checking
+ * the ring, so either they see what just changed or we see them.
+ */
+static void
+_notify(chan_t *c)
+{
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&c->waiting, __ATOMIC_RELAXED))
+    {
+        sched_notify(c->sched);
+    }
+}
+
+
+/*******************************************************************************
+ * CHANNELS
+ ******************************************************************************/
+
+error_t
+chan_init(chan_t *c, sched_t *s, size_t cap)
+{
+    if (!cap || cap > SIZE_MAX / 2 / sizeof(chanslot_t))
+    {
+        return EINVAL;
+    }
+    size_t n = 2;
+    while (n < cap)
+    {
+        n *= 2;
+    }
+
+    c->slots = memget(n * sizeof(chanslot_t));
+    if (!c->slots)
+    {
+        return ENOMEM;
+    }
+    for (size_t i = 0; i < n; ++i)
+    {
+        c->slots[i].seq = i;
+    }
+    c->mask = n - 1;
+    c->sched = s;
+    c->waiting = 0;
+    c->closed = false;
+    c->head = 0;
+    c->tail = 0;
+    return 0;
+}
+
+void
+chan_destroy(chan_t *c)
+{
+    data_t v;
+    while (_take(c, &v))
+    {
+        un_data(v);
+    }
+    memput(c->slots);
+}
+
+void
+chan_close(chan_t *c)
+{
+    __atomic_store_n(&c->closed, true, __ATOMIC_SEQ_CST);
+    sched_notify(c->sched);
+}
+
+error_t
+chan_trysend(chan_t *c, data_t v)
+{
+    if (__atomic_load_n(&c->closed, __ATOMIC_ACQUIRE))
+    {
+        return EPIPE;
+    }
+    if (!_put(c, v))
+    {
+        return EAGAIN;
+    }
+    _notify(c);
+    return 0;
+}
+
+error_t
+chan_tryrecv(chan_t *c, data_t *v)
+{
+    if (!_take(c, v))
+    {
+        if (!__atomic_load_n(&c->closed, __ATOMIC_ACQUIRE))
+        {
+            return EAGAIN;
+        }
+        // Sends that beat the close are still in the ring
+        if (!_take(c, v))
+        {
+            return EPIPE;
+        }
+    }
+    _notify(c);
+    return 0;
+}
+
+error_t
+chan_send(chan_t *c, data_t v)
+{
+    size_t which;
+    chan_op_t op = { c, true, v };
+    return chan_select(1, &op, &which);
+}
+
+error_t
+chan_recv(chan_t *c, data_t *v)
+{
+    size_t which;
+    chan_op_t op = { c, false, mk_bool(false) };
+    error_t err = chan_select(1, &op, &which);
+    if (!err)
+    {
+        *v = op.v;
+    }
+    return err;
+}
+
+/**
+ * Try each operation once, starting from a different one each time.
+ */
+static bool
+_try(void *arg)
+{
+    chanwait_t *w = arg;
+    size_t start = _turn++;
+    for (size_t k = 0; k < w->n; ++k)
+    {
+        size_t i = (start + k) % w->n;
+        chan_op_t *op = &w->ops[i];
+        error_t err = op->send ? chan_trysend(op->chan, op->v)
+                               : chan_tryrecv(op->chan, &op->v);
+        if (EAGAIN != err)
+        {
+            *w->which = i;
+            w->err = err;
+            return true;
+        }
+    }
+    return false;
+}
+
+error_t
+chan_select(size_t n, chan_op_t *ops, size_t *which)
+{
+    if (!n)
+    {
+        return EINVAL;
+    }
+    // The wait parks on one scheduler, which must see every wake up
+    for (size_t i = 1; i < n; ++i)
+    {
+        if (ops[i].chan->sched != ops[0].chan->sched)
+        {
+            return EINVAL;
+        }
+    }
+
+    chanwait_t w = { n, ops, which, 0 };
+    if (_try(&w))
+    {
+        return w.err;
+    }
+
+    for (size_t i = 0; i < n; ++i)
+    {
+        __atomic_add_fetch(&ops[i].chan->waiting, 1, __ATOMIC_SEQ_CST);
+    }
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    sched_wait(ops[0].chan->sched, _try, &w);
+    for (size_t i = 0; i < n; ++i)
+    {
+        __atomic_sub_fetch(&ops[i].chan->waiting, 1, __ATOMIC_SEQ_CST);
+    }
+    return w.err;
+}
+
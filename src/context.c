@@ -24,9 +24,88 @@
  * @author Craig Jacobson
  * @brief Symbol Script context implementation.
  */
+#include <errno.h>
+
 #include "context.h"
+#include "symmem.h"
+
+
+void
+context_init(context_t *c)
+{
+    map_init(&c->names);
+    c->bindings = NULL;
+    c->bindingslen = 0;
+    c->bindingscap = 0;
+}
+
+void
+context_destroy(context_t *c)
+{
+    for (size_t i = 0; i < c->bindingslen; ++i)
+    {
+        un_data(c->bindings[i].name);
+    }
+    memput(c->bindings);
+    map_destroy(&c->names);
+    context_init(c);
+}
 
+error_t
+context_bind(context_t *c, size_t len, const uint8_t *name, int flags,
+             void *bound, void *meta)
+{
+    data_t sym;
+    data_t index;
+    error_t err = mk_sym(&sym, len, name);
+    if (err)
+    {
+        return err;
+    }
+    if (map_get(&c->names, sym, &index))
+    {
+        un_data(sym);
+        return EEXIST;
+    }
 
+    if (c->bindingslen == c->bindingscap)
+    {
+        size_t cap = c->bindingscap ? meminc(c->bindingscap) : 8;
+        binding_t *b = memreget(c->bindings, cap * sizeof(*b));
+        if (!b)
+        {
+            un_data(sym);
+            return ENOMEM;
+        }
+        c->bindings = b;
+        c->bindingscap = cap;
+    }
 
+    err = mk_u8(&index, c->bindingslen);
+    if (!err)
+    {
+        err = map_set(&c->names, sym, index);
+    }
+    if (err)
+    {
+        un_data(sym);
+        return err;
+    }
 
+    c->bindings[c->bindingslen++] = (binding_t){ flags, sym, bound, meta };
+    return 0;
+}
 
+binding_t *
+context_lookup(const context_t *c, size_t len, const uint8_t *name)
+{
+    data_t sym;
+    data_t index;
+    if (mk_sym(&sym, len, name))
+    {
+        return NULL;
+    }
+    bool found = map_get(&c->names, sym, &index);
+    un_data(sym);
+    return found ? &c->bindings[data_u8(index)] : NULL;
+}
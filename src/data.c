@@ -20,41 +20,904 @@
  * SOFTWARE.
  ******************************************************************************/
 /**
- * @file blob.c
+ * @file data.c
  * @author Craig Jacobson
- * @brief Binary objects.
+ * @brief Primitive data types and binary objects.
  */
-#include "bin.h"
-
-
-static const uint8_t [128] =
-{
-    0, 1, 2, 3, 4, 5, 6, 7,
-    8, 9, 10, 11, 12, 13, 14, 15,
-    16, 17, 18, 19, 20, 21, 22, 23,
-    24, 25, 26, 27, 28, 29, 30, 31,
-    32, 33, 34, 35, 36, 37, 38, 39,
-    40, 41, 42, 43, 44, 45, 46, 47,
-    48, 49, 50, 51, 52, 53, 54, 55,
-    56, 57, 58, 59, 60, 61, 62, 63,
-    64, 65, 66, 67, 68, 69, 70, 71,
-    72, 73, 74, 75, 76, 77, 78, 79,
-    80, 81, 82, 83, 84, 85, 86, 87,
-    88, 89, 90, 91, 92, 93, 94, 95,
-    96, 97, 98, 99, 100, 101, 102, 103,
-    104, 105, 106, 107, 108, 109, 110, 111,
-    112, 113, 114, 115, 116, 117, 118, 119,
-    120, 121, 122, 123, 124, 125, 126, 127,
+#include <errno.h>
+#include <pthread.h>
+
+#include "array.h"
+#include "data.h"
+#include "map.h"
+#include "mmanager.h"
+#include "symmem.h"
+
+
+#ifndef memzero
+static void
+memzero(void *p, size_t plen)
+{
+    memset(p, 0, plen);
+}
+#endif
+
+/**
+ * Boxed 64-bit integer, used when the value does not fit in 48 bits.
+ */
+typedef struct
+{
+    dataobj_t h;
+    uint64_t v;
+} databox_t;
+
+/**
+ * Boxed binary.
+ */
+typedef struct
+{
+    dataobj_t h;
+    bin_t bin;
+    binbuilder_t *rope; // Pending concatenation, flattened on access
+} databin_t;
+
+// Shared binaries are flattened under one of these, picked by address
+#define DATA_FLATTEN_LOCKS 16
+static pthread_mutex_t _flatten[DATA_FLATTEN_LOCKS] =
+{
+    [0 ... DATA_FLATTEN_LOCKS - 1] = PTHREAD_MUTEX_INITIALIZER
 };
 
-slice_t
-mk_bin(size_t len, uint8_t *b)
+/**
+ * Window into a buffer held by a builder.
+ */
+struct binpiece
+{
+    binbuf_t *buf;
+    uint32_t off;
+    uint32_t len;
+};
+
+/**
+ * Symbol too long to be stored inline.
+ */
+typedef struct
+{
+    dataobj_t h;
+    size_t len;
+    uint8_t s[];
+} datasym_t;
+
+static void *
+_obj_alloc(enum data_type type, size_t size)
+{
+    dataobj_t *o = memget(size);
+    if (o)
+    {
+        o->type = type;
+        o->refs = 1;
+    }
+    return o;
+}
+
+static data_t
+_obj_data(void *o)
+{
+    return data_box(DATA_TAG_PTR, (uint64_t)(uintptr_t)o);
+}
+
+enum data_type
+data_typeof(data_t d)
+{
+    switch (data_tag(d))
+    {
+        case DATA_TAG_IMM:
+            return (enum data_type)((d.bits >> 40) & 0xFF);
+        case DATA_TAG_SYM:
+            return DATA_SYM;
+        case DATA_TAG_INT:
+            return DATA_I;
+        case DATA_TAG_UINT:
+            return DATA_U;
+        case DATA_TAG_I8:
+            return DATA_I8;
+        case DATA_TAG_U8:
+            return DATA_U8;
+        case DATA_TAG_PTR:
+            return (enum data_type)data_obj(d)->type;
+        default:
+            return DATA_F8;
+    }
+}
+
+error_t
+mk_i8(data_t *d, int64_t v)
+{
+    if (v >= DATA_INLINE_MIN && v <= DATA_INLINE_MAX)
+    {
+        *d = data_box(DATA_TAG_I8, (uint64_t)v);
+        return 0;
+    }
+
+    databox_t *box = _obj_alloc(DATA_I8, sizeof(*box));
+    if (!box)
+    {
+        return ENOMEM;
+    }
+    box->v = (uint64_t)v;
+    *d = _obj_data(box);
+    return 0;
+}
+
+error_t
+mk_u8(data_t *d, uint64_t v)
+{
+    if (v <= DATA_INLINE_UMAX)
+    {
+        *d = data_box(DATA_TAG_U8, v);
+        return 0;
+    }
+
+    databox_t *box = _obj_alloc(DATA_U8, sizeof(*box));
+    if (!box)
+    {
+        return ENOMEM;
+    }
+    box->v = v;
+    *d = _obj_data(box);
+    return 0;
+}
+
+int64_t
+data_i8(data_t d)
+{
+    if (data_isobj(d))
+    {
+        return (int64_t)((databox_t *)data_obj(d))->v;
+    }
+    return data_payload_signed(d);
+}
+
+uint64_t
+data_u8(data_t d)
+{
+    if (data_isobj(d))
+    {
+        return ((databox_t *)data_obj(d))->v;
+    }
+    return d.bits & DATA_PAYLOAD;
+}
+
+error_t
+mk_sym(data_t *d, size_t len, const uint8_t *s)
+{
+    if (len <= DATA_SYM_INLINE && !memchr(s, 0, len))
+    {
+        data_t sym = data_box(DATA_TAG_SYM, 0);
+        memcpy((uint8_t *)&sym.bits + DATA_SYM_OFFSET, s, len);
+        *d = sym;
+        return 0;
+    }
+
+    datasym_t *sym = _obj_alloc(DATA_SYM, sizeof(*sym) + len);
+    if (!sym)
+    {
+        return ENOMEM;
+    }
+    sym->len = len;
+    memcpy(sym->s, s, len);
+    *d = _obj_data(sym);
+    return 0;
+}
+
+const uint8_t *
+data_sym(const data_t *d, size_t *len)
 {
+    if (data_isobj(*d))
+    {
+        datasym_t *sym = (datasym_t *)data_obj(*d);
+        *len = sym->len;
+        return sym->s;
+    }
+
+    const uint8_t *s = (const uint8_t *)&d->bits + DATA_SYM_OFFSET;
+    size_t n = 0;
+    for (; n < DATA_SYM_INLINE && s[n]; ++n);
+    *len = n;
+    return s;
+}
+
+bool
+data_sym_eq(data_t a, data_t b)
+{
+    if (a.bits == b.bits)
+    {
+        return true;
+    }
+    // Inline symbols are canonical, so only two boxed symbols can match
+    if (!data_isobj(a) || !data_isobj(b))
+    {
+        return false;
+    }
+
+    size_t alen;
+    size_t blen;
+    const uint8_t *as = data_sym(&a, &alen);
+    const uint8_t *bs = data_sym(&b, &blen);
+    return alen == blen && !memcmp(as, bs, alen);
+}
+
+bool
+data_eq(data_t a, data_t b)
+{
+    if (a.bits == b.bits)
+    {
+        return true;
+    }
+
+    enum data_type type = data_typeof(a);
+    if (type != data_typeof(b))
+    {
+        return false;
+    }
+
+    switch (type)
+    {
+        case DATA_U:
+        case DATA_I:
+            return 0 == data_int_cmp(a, b);
+        case DATA_U8:
+            return data_u8(a) == data_u8(b);
+        case DATA_I8:
+            return data_i8(a) == data_i8(b);
+        case DATA_F4:
+            return data_f4(a) == data_f4(b);
+        case DATA_F8:
+            return data_f8(a) == data_f8(b);
+        case DATA_SYM:
+            return data_sym_eq(a, b);
+        case DATA_BIN:
+            {
+                const bin_t *x = data_bin(a);
+                const bin_t *y = data_bin(b);
+                return x && y && bin_eq(x, y);
+            }
+        case DATA_ARR:
+            return arr_elem(a) == arr_elem(b) && arr_len(a) == arr_len(b)
+                   && memeq(arr_data(a), arr_data(b),
+                            arr_len(a) * arr_width(arr_elem(a)));
+        default:
+            // Other inline values are canonical, maps are by identity
+            return false;
+    }
+}
+
+uint64_t
+data_hash(data_t d)
+{
+    enum data_type type = data_typeof(d);
+    uint64_t v = d.bits;
+
+    switch (type)
+    {
+        case DATA_U:
+        case DATA_I:
+            if (data_isobj(d))
+            {
+                bool neg;
+                const uint64_t *limbs;
+                uint64_t one;
+                size_t len = data_int_limbs(&d, &neg, &limbs, &one);
+                return memhash(limbs, len * sizeof(*limbs), type + neg);
+            }
+            break;
+        case DATA_U8:
+            v = data_u8(d);
+            break;
+        case DATA_I8:
+            v = (uint64_t)data_i8(d);
+            break;
+        case DATA_F4:
+            // Zero of either sign
+            if (0.0f == data_f4(d))
+            {
+                v = 0;
+            }
+            break;
+        case DATA_F8:
+            if (0.0 == data_f8(d))
+            {
+                v = 0;
+            }
+            break;
+        case DATA_SYM:
+            {
+                size_t len;
+                const uint8_t *s = data_sym(&d, &len);
+                return memhash(s, len, type);
+            }
+        case DATA_BIN:
+            {
+                const bin_t *b = data_bin(d);
+                return b ? bin_hash(b) : 0;
+            }
+        case DATA_ARR:
+            return memhash(arr_data(d), arr_len(d) * arr_width(arr_elem(d)),
+                           arr_elem(d));
+        default:
+            break;
+    }
+
+    return memhash(&v, sizeof(v), type);
+}
+
+data_t
+data_ref(data_t d)
+{
+    if (data_isobj(d))
+    {
+        refs_inc(&data_obj(d)->refs);
+    }
+    return d;
+}
+
+void
+un_data(data_t d)
+{
+    if (!data_isobj(d))
+    {
+        return;
+    }
+
+    dataobj_t *o = data_obj(d);
+    if (refs_dec(&o->refs))
+    {
+        if (DATA_BIN == o->type)
+        {
+            databin_t *box = (databin_t *)o;
+            un_bin(box->bin);
+            if (box->rope)
+            {
+                binbuilder_destroy(box->rope);
+                memput(box->rope);
+            }
+        }
+        else if (DATA_MAP == o->type)
+        {
+            gc_untrack(o);
+            map_destroy(data_map(d));
+        }
+        memput(o);
+    }
+}
+
+static binbuf_t *
+_binbuf_alloc(size_t cap)
+{
+    binbuf_t *buf = memget(sizeof(*buf) + cap);
+    if (buf)
+    {
+        buf->refs = 1;
+        buf->cap = (uint32_t)cap;
+    }
+    return buf;
+}
+
+error_t
+mk_bin_buf(bin_t *b, size_t len, uint8_t **s)
+{
+    if (len > BIN_MAX)
+    {
+        return E2BIG;
+    }
+
+    if (len <= BIN_SMALL)
+    {
+        memzero(b, sizeof(*b));
+        b->small.len = (uint32_t)len;
+        *s = b->small.s;
+        return 0;
+    }
+
+    binbuf_t *buf = _binbuf_alloc(len);
+    if (!buf)
+    {
+        return ENOMEM;
+    }
+    b->big.len = (uint32_t)len;
+    b->big.off = 0;
+    b->big.buf = buf;
+    *s = buf->s;
+    return 0;
+}
+
+error_t
+mk_bin(bin_t *b, size_t len, const uint8_t *s)
+{
+    uint8_t *dst;
+    error_t err = mk_bin_buf(b, len, &dst);
+    if (!err && len)
+    {
+        memcpy(dst, s, len);
+    }
+    return err;
 }
 
 void
-un_bin(slice_t slice)
+un_bin(bin_t b)
 {
+    if (!bin_issmall(&b) && refs_dec(&b.big.buf->refs))
+    {
+        memput(b.big.buf);
+    }
 }
 
+bin_t
+bin_ref(bin_t b)
+{
+    if (!bin_issmall(&b))
+    {
+        refs_inc(&b.big.buf->refs);
+    }
+    return b;
+}
+
+error_t
+bin_sub(bin_t *sub, const bin_t *b, size_t off, size_t len)
+{
+    size_t blen = bin_len(b);
+    if (off > blen || len > blen - off)
+    {
+        return ERANGE;
+    }
+
+    // Short results are copied so they don't pin a large parent
+    if (len <= BIN_SMALL)
+    {
+        return mk_bin(sub, len, bin_bytes(b) + off);
+    }
+
+    sub->big.len = (uint32_t)len;
+    sub->big.off = b->big.off + (uint32_t)off;
+    sub->big.buf = b->big.buf;
+    refs_inc(&sub->big.buf->refs);
+    return 0;
+}
+
+error_t
+bin_mut(bin_t *b, uint8_t **s)
+{
+    if (bin_issmall(b))
+    {
+        *s = b->small.s;
+        return 0;
+    }
+
+    if (refs_get(&b->big.buf->refs) > 1)
+    {
+        bin_t copy;
+        error_t err = mk_bin(&copy, bin_len(b), bin_bytes(b));
+        if (err)
+        {
+            return err;
+        }
+        un_bin(*b);
+        *b = copy;
+    }
+
+    *s = b->big.buf->s + b->big.off;
+    return 0;
+}
+
+bool
+bin_eq(const bin_t *a, const bin_t *b)
+{
+    size_t len = bin_len(a);
+    return len == bin_len(b) && memeq(bin_bytes(a), bin_bytes(b), len);
+}
+
+int
+bin_cmp(const bin_t *a, const bin_t *b)
+{
+    return memorder(bin_bytes(a), bin_len(a), bin_bytes(b), bin_len(b));
+}
+
+size_t
+bin_find(const bin_t *hay, const bin_t *needle, size_t from)
+{
+    size_t len = bin_len(hay);
+    if (from > len)
+    {
+        return BIN_NPOS;
+    }
+
+    const uint8_t *s = bin_bytes(hay);
+    const uint8_t *p = memfind(s + from, len - from, bin_bytes(needle), bin_len(needle));
+    return p ? (size_t)(p - s) : BIN_NPOS;
+}
+
+size_t
+bin_findbyte(const bin_t *b, uint8_t c, size_t from)
+{
+    size_t len = bin_len(b);
+    if (from >= len)
+    {
+        return BIN_NPOS;
+    }
+
+    const uint8_t *s = bin_bytes(b);
+    const uint8_t *p = membyte(s + from, len - from, c);
+    return p ? (size_t)(p - s) : BIN_NPOS;
+}
+
+static error_t
+_bin_fold(bin_t *out, const bin_t *b, void (*fold)(uint8_t *, const uint8_t *, size_t))
+{
+    uint8_t *dst;
+    size_t len = bin_len(b);
+    error_t err = mk_bin_buf(out, len, &dst);
+    if (!err)
+    {
+        fold(dst, bin_bytes(b), len);
+    }
+    return err;
+}
+
+error_t
+bin_lower(bin_t *out, const bin_t *b)
+{
+    return _bin_fold(out, b, memlower);
+}
+
+error_t
+bin_upper(bin_t *out, const bin_t *b)
+{
+    return _bin_fold(out, b, memupper);
+}
+
+uint64_t
+bin_hash(const bin_t *b)
+{
+    return memhash(bin_bytes(b), bin_len(b), 0);
+}
+
+error_t
+bin_cat(bin_t *b, size_t len, const uint8_t *s)
+{
+    size_t blen = bin_len(b);
+    if (len > BIN_MAX - blen)
+    {
+        return E2BIG;
+    }
+    if (!len)
+    {
+        return 0;
+    }
+
+    size_t newlen = blen + len;
+    if (newlen <= BIN_SMALL)
+    {
+        memcpy(b->small.s + blen, s, len);
+        b->small.len = (uint32_t)newlen;
+        return 0;
+    }
+
+    if (!bin_issmall(b) && 1 == refs_get(&b->big.buf->refs)
+        && b->big.buf->cap - b->big.off - blen >= len)
+    {
+        memcpy(b->big.buf->s + b->big.off + blen, s, len);
+        b->big.len = (uint32_t)newlen;
+        return 0;
+    }
+
+    size_t cap = meminc(blen);
+    if (cap < newlen || cap > BIN_MAX)
+    {
+        cap = newlen;
+    }
+    binbuf_t *buf = _binbuf_alloc(cap);
+    if (!buf)
+    {
+        return ENOMEM;
+    }
+    memcpy(buf->s, bin_bytes(b), blen);
+    memcpy(buf->s + blen, s, len);
+    un_bin(*b);
+    b->big.len = (uint32_t)newlen;
+    b->big.off = 0;
+    b->big.buf = buf;
+    return 0;
+}
+
+void
+binbuilder_init(binbuilder_t *bb)
+{
+    memzero(bb, sizeof(*bb));
+    bb->chunk = BINBUILDER_CHUNK;
+}
+
+void
+binbuilder_destroy(binbuilder_t *bb)
+{
+    size_t i;
+    for (i = 0; i < bb->piecelen; ++i)
+    {
+        binbuf_t *buf = bb->pieces[i].buf;
+        if (refs_dec(&buf->refs))
+        {
+            memput(buf);
+        }
+    }
+    memput(bb->pieces);
+    memzero(bb, sizeof(*bb));
+}
+
+static error_t
+_binbuilder_push(binbuilder_t *bb, binbuf_t *buf, uint32_t off, uint32_t len)
+{
+    if (bb->piecelen == bb->piececap)
+    {
+        size_t cap = bb->piececap ? meminc(bb->piececap) : 4;
+        struct binpiece *pieces = memreget(bb->pieces, cap * sizeof(*pieces));
+        if (!pieces)
+        {
+            return ENOMEM;
+        }
+        bb->pieces = pieces;
+        bb->piececap = cap;
+    }
+
+    bb->pieces[bb->piecelen++] = (struct binpiece){ buf, off, len };
+    return 0;
+}
+
+error_t
+binbuilder_add(binbuilder_t *bb, size_t len, const uint8_t *s)
+{
+    if (len > BIN_MAX - bb->len)
+    {
+        return E2BIG;
+    }
+
+    while (len)
+    {
+        if (bb->open)
+        {
+            struct binpiece *tail = bb->pieces + bb->piecelen - 1;
+            size_t room = tail->buf->cap - tail->len;
+            size_t n = room < len ? room : len;
+            memcpy(tail->buf->s + tail->len, s, n);
+            tail->len += (uint32_t)n;
+            bb->len += n;
+            s += n;
+            len -= n;
+            if (!len)
+            {
+                break;
+            }
+        }
+
+        size_t cap = bb->chunk > len ? bb->chunk : len;
+        binbuf_t *buf = _binbuf_alloc(cap);
+        if (!buf)
+        {
+            return ENOMEM;
+        }
+        error_t err = _binbuilder_push(bb, buf, 0, 0);
+        if (err)
+        {
+            memput(buf);
+            return err;
+        }
+        bb->open = true;
+        if (bb->chunk < BINBUILDER_CHUNK_MAX)
+        {
+            bb->chunk = meminc(bb->chunk);
+        }
+    }
+
+    return 0;
+}
+
+error_t
+binbuilder_add_bin(binbuilder_t *bb, const bin_t *b)
+{
+    size_t len = bin_len(b);
+    if (len < BINBUILDER_SHARE)
+    {
+        return binbuilder_add(bb, len, bin_bytes(b));
+    }
+    if (len > BIN_MAX - bb->len)
+    {
+        return E2BIG;
+    }
+
+    error_t err = _binbuilder_push(bb, b->big.buf, b->big.off, b->big.len);
+    if (err)
+    {
+        return err;
+    }
+    refs_inc(&b->big.buf->refs);
+    bb->len += len;
+    // Can't append into someone else's buffer
+    bb->open = false;
+    return 0;
+}
+
+error_t
+binbuilder_finish(binbuilder_t *bb, bin_t *b)
+{
+    if (1 == bb->piecelen && bb->len > BIN_SMALL)
+    {
+        // Hand over the only piece as is
+        struct binpiece *p = bb->pieces;
+        b->big.len = p->len;
+        b->big.off = p->off;
+        b->big.buf = p->buf;
+        bb->piecelen = 0;
+    }
+    else
+    {
+        uint8_t *dst;
+        error_t err = mk_bin_buf(b, bb->len, &dst);
+        if (err)
+        {
+            return err;
+        }
+        size_t i;
+        for (i = 0; i < bb->piecelen; ++i)
+        {
+            struct binpiece *p = bb->pieces + i;
+            memcpy(dst, p->buf->s + p->off, p->len);
+            dst += p->len;
+        }
+    }
+
+    binbuilder_destroy(bb);
+    binbuilder_init(bb);
+    return 0;
+}
+
+error_t
+binbuilder_write(const binbuilder_t *bb, FILE *f)
+{
+    size_t i;
+    for (i = 0; i < bb->piecelen; ++i)
+    {
+        struct binpiece *p = bb->pieces + i;
+        if (p->len != fwrite(p->buf->s + p->off, 1, p->len, f))
+        {
+            return EIO;
+        }
+    }
+    return 0;
+}
+
+error_t
+mk_bin_data(data_t *d, bin_t b)
+{
+    databin_t *box = _obj_alloc(DATA_BIN, sizeof(*box));
+    if (!box)
+    {
+        return ENOMEM;
+    }
+    box->bin = b;
+    box->rope = NULL;
+    *d = _obj_data(box);
+    return 0;
+}
+
+const bin_t *
+data_bin(data_t d)
+{
+    databin_t *box = (databin_t *)data_obj(d);
+    if (!__atomic_load_n(&box->rope, __ATOMIC_ACQUIRE))
+    {
+        return &box->bin;
+    }
+
+    // The value may be shared, so only one thread flattens it
+    pthread_mutex_t *lock = &_flatten[((uintptr_t)box >> 4) % DATA_FLATTEN_LOCKS];
+    const bin_t *b = &box->bin;
+    pthread_mutex_lock(lock);
+    if (box->rope)
+    {
+        bin_t flat;
+        if (binbuilder_finish(box->rope, &flat))
+        {
+            b = NULL;
+        }
+        else
+        {
+            memput(box->rope);
+            box->bin = flat;
+            __atomic_store_n(&box->rope, NULL, __ATOMIC_RELEASE);
+        }
+    }
+    pthread_mutex_unlock(lock);
+    return b;
+}
+
+/**
+ * Make the binary of d an unshared rope, ready to take more.
+ */
+static error_t
+_data_rope(data_t *d)
+{
+    databin_t *box = (databin_t *)data_obj(*d);
+    error_t err = 0;
+
+    if (refs_get(&box->h.refs) > 1)
+    {
+        const bin_t *flat = data_bin(*d);
+        if (!flat)
+        {
+            return ENOMEM;
+        }
+        data_t copy;
+        err = mk_bin_data(&copy, bin_ref(*flat));
+        if (err)
+        {
+            un_bin(*flat);
+            return err;
+        }
+        un_data(*d);
+        *d = copy;
+        box = (databin_t *)data_obj(copy);
+    }
+
+    if (!box->rope)
+    {
+        binbuilder_t *rope = memget(sizeof(*rope));
+        if (!rope)
+        {
+            return ENOMEM;
+        }
+        binbuilder_init(rope);
+        err = binbuilder_add_bin(rope, &box->bin);
+        if (err)
+        {
+            memput(rope);
+            return err;
+        }
+        un_bin(box->bin);
+        memzero(&box->bin, sizeof(box->bin));
+        box->rope = rope;
+    }
+    return 0;
+}
+
+error_t
+data_bin_cat(data_t *d, const bin_t *b)
+{
+    // b may be the binary of d itself, which moves into the rope
+    bin_t held = bin_ref(*b);
+    error_t err = _data_rope(d);
+    if (!err)
+    {
+        databin_t *box = (databin_t *)data_obj(*d);
+        err = binbuilder_add_bin(box->rope, &held);
+    }
+    un_bin(held);
+    return err;
+}
+
+error_t
+data_bin_write(data_t d, FILE *f)
+{
+    databin_t *box = (databin_t *)data_obj(d);
+    // Another holder could be flattening a shared one under us
+    if (box->rope && 1 == refs_get(&box->h.refs))
+    {
+        return binbuilder_write(box->rope, f);
+    }
+
+    const bin_t *b = data_bin(d);
+    if (!b)
+    {
+        return ENOMEM;
+    }
+    size_t len = bin_len(b);
+    return len == fwrite(bin_bytes(b), 1, len, f) ? 0 : EIO;
+}
 
@@ -0,0 +1,401 @@
+/*******************************************************************************
+ * Copyright (c) 2022 Craig Jacobson
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ ******************************************************************************/
+/**
+ * @file evloop.c
+ * @author Craig Jacobson
+ * @brief epoll loop thread and the I/O calls that wait on it.
+ *
+ * Descriptors are registered one-shot with the directions someone waits
+ * for. When an event comes the loop hands it to the waiters, forgets
+ * them, and rearms for whatever is still wanted.
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "evloop.h"
+#include "symmem.h"
+
+
+#define EV_BATCH 64
+
+typedef struct evwait
+{
+    bool ready;
+    struct evwait *next;
+} evwait_t;
+
+
+/*******************************************************************************
+ * LOOP
+ ******************************************************************************/
+
+/**
+ * Arm fd for the waiters it has; lock held.
+ */
+static error_t
+_arm(evloop_t *ev, int fd)
+{
+    evfd_t *f = &ev->fds[fd];
+    struct epoll_event e = { 0 };
+    e.events = EPOLLONESHOT | (f->in ? EPOLLIN | EPOLLRDHUP : 0) | (f->out ? EPOLLOUT : 0);
+    e.data.fd = fd;
+
+    // A closed descriptor leaves the set without telling us
+    int op = f->added ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+    int rc = epoll_ctl(ev->epfd, op, fd, &e);
+    if (rc && ENOENT == errno)
+    {
+        rc = epoll_ctl(ev->epfd, EPOLL_CTL_ADD, fd, &e);
+    }
+    else if (rc && EEXIST == errno)
+    {
+        rc = epoll_ctl(ev->epfd, EPOLL_CTL_MOD, fd, &e);
+    }
+    if (rc)
+    {
+        return errno;
+    }
+    f->added = true;
+    return 0;
+}
+
+/**
+ * Wake all waiting one way, who try again and maybe wait again.
+ */
+static void
+_wake(evwait_t *w)
+{
+    while (w)
+    {
+        // Gone once it sees ready
+        evwait_t *next = w->next;
+        __atomic_store_n(&w->ready, true, __ATOMIC_RELEASE);
+        w = next;
+    }
+}
+
+static void *
+_loop(void *arg)
+{
+    evloop_t *ev = arg;
+    struct epoll_event events[EV_BATCH];
+
+    while (!__atomic_load_n(&ev->stop, __ATOMIC_ACQUIRE))
+    {
+        int n = epoll_wait(ev->epfd, events, EV_BATCH, -1);
+        if (n < 0)
+        {
+            continue;
+        }
+
+        pthread_mutex_lock(&ev->lock);
+        for (int i = 0; i < n; ++i)
+        {
+            int fd = events[i].data.fd;
+            if (fd == ev->wakefd)
+            {
+                continue;
+            }
+            evfd_t *f = &ev->fds[fd];
+            uint32_t got = events[i].events;
+            // Errors and hangups wake both sides to see for themselves
+            bool bad = got & (EPOLLERR | EPOLLHUP);
+            if (f->in && (bad || got & (EPOLLIN | EPOLLRDHUP)))
+            {
+                _wake(f->in);
+                f->in = NULL;
+            }
+            if (f->out && (bad || got & EPOLLOUT))
+            {
+                _wake(f->out);
+                f->out = NULL;
+            }
+            if (f->in || f->out)
+            {
+                _arm(ev, fd);
+            }
+        }
+        pthread_mutex_unlock(&ev->lock);
+        sched_notify(ev->sched);
+    }
+    return NULL;
+}
+
+error_t
+evloop_init(evloop_t *ev, sched_t *s)
+{
+    ev->sched = s;
+    ev->fds = NULL;
+    ev->nfds = 0;
+    ev->stop = false;
+    ev->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (ev->epfd < 0)
+    {
+        return errno;
+    }
+    ev->wakefd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (ev->wakefd < 0)
+    {
+        error_t err = errno;
+        close(ev->epfd);
+        return err;
+    }
+    struct epoll_event e = { .events = EPOLLIN };
+    e.data.fd = ev->wakefd;
+    epoll_ctl(ev->epfd, EPOLL_CTL_ADD, ev->wakefd, &e);
+    pthread_mutex_init(&ev->lock, NULL);
+
+    error_t err = pthread_create(&ev->thread, NULL, _loop, ev);
+    if (err)
+    {
+        pthread_mutex_destroy(&ev->lock);
+        close(ev->wakefd);
+        close(ev->epfd);
+    }
+    return err;
+}
+
+void
+evloop_destroy(evloop_t *ev)
+{
+    __atomic_store_n(&ev->stop, true, __ATOMIC_RELEASE);
+    uint64_t one = 1;
+    while (write(ev->wakefd, &one, sizeof(one)) < 0 && EINTR == errno)
+    {
+    }
+    pthread_join(ev->thread, NULL);
+    pthread_mutex_destroy(&ev->lock);
+    close(ev->wakefd);
+    close(ev->epfd);
+    memput(ev->fds);
+}
+
+
+/*******************************************************************************
+ * WAITING
+ ******************************************************************************/
+
+static bool
+_ready(void *arg)
+{
+    evwait_t *w = arg;
+    return __atomic_load_n(&w->ready, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * Wait until fd is ready to read (or accept), or to write.
+ */
+static error_t
+_wait(evloop_t *ev, int fd, bool out)
+{
+    if (fd < 0)
+    {
+        return EBADF;
+    }
+
+    evwait_t w = { false, NULL };
+    pthread_mutex_lock(&ev->lock);
+    if ((size_t)fd >= ev->nfds)
+    {
+        size_t n = ev->nfds ? ev->nfds : 64;
+        while (n <= (size_t)fd)
+        {
+            n *= 2;
+        }
+        evfd_t *fds = memreget(ev->fds, n * sizeof(fds[0]));
+        if (!fds)
+        {
+            pthread_mutex_unlock(&ev->lock);
+            return ENOMEM;
+        }
+        memset(fds + ev->nfds, 0, (n - ev->nfds) * sizeof(fds[0]));
+        ev->fds = fds;
+        ev->nfds = n;
+    }
+
+    evfd_t *f = &ev->fds[fd];
+    evwait_t **slot = out ? &f->out : &f->in;
+    w.next = *slot;
+    *slot = &w;
+    error_t err = _arm(ev, fd);
+    if (err)
+    {
+        *slot = w.next;
+    }
+    pthread_mutex_unlock(&ev->lock);
+
+    if (!err)
+    {
+        sched_wait(ev->sched, _ready, &w);
+    }
+    return err;
+}
+
+
+/*******************************************************************************
+ * I/O
+ ******************************************************************************/
+
+error_t
+ev_nonblock(int fd)
+{
+    int flags = fcntl(fd, F_GETFL);
+    if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0)
+    {
+        return errno;
+    }
+    return 0;
+}
+
+error_t
+ev_read(evloop_t *ev, int fd, void *buf, size_t len, size_t *n)
+{
+    for (;;)
+    {
+        ssize_t got = read(fd, buf, len);
+        if (got >= 0)
+        {
+            *n = (size_t)got;
+            return 0;
+        }
+        if (EINTR == errno)
+        {
+            continue;
+        }
+        if (EAGAIN != errno && EWOULDBLOCK != errno)
+        {
+            return errno;
+        }
+        error_t err = _wait(ev, fd, false);
+        if (err)
+        {
+            return err;
+        }
+    }
+}
+
+error_t
+ev_write(evloop_t *ev, int fd, const void *buf, size_t len, size_t *n)
+{
+    const uint8_t *p = buf;
+    *n = 0;
+    while (*n < len)
+    {
+        ssize_t put = write(fd, p + *n, len - *n);
+        if (put >= 0)
+        {
+            *n += (size_t)put;
+            continue;
+        }
+        if (EINTR == errno)
+        {
+            continue;
+        }
+        if (EAGAIN != errno && EWOULDBLOCK != errno)
+        {
+            return errno;
+        }
+        error_t err = _wait(ev, fd, true);
+        if (err)
+        {
+            return err;
+        }
+    }
+    return 0;
+}
+
+error_t
+ev_accept(evloop_t *ev, int fd, int *conn)
+{
+    for (;;)
+    {
+        int c = accept4(fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (c >= 0)
+        {
+            *conn = c;
+            return 0;
+        }
+        if (EINTR == errno || ECONNABORTED == errno)
+        {
+            continue;
+        }
+        if (EAGAIN != errno && EWOULDBLOCK != errno)
+        {
+            return errno;
+        }
+        error_t err = _wait(ev, fd, false);
+        if (err)
+        {
+            return err;
+        }
+    }
+}
+
+error_t
+ev_waitpid(evloop_t *ev, pid_t pid, int *status)
+{
+#ifdef SYS_pidfd_open
+    int pidfd = (int)syscall(SYS_pidfd_open, pid, 0);
+#else
+    int pidfd = -1;
+    errno = ENOSYS;
+#endif
+    if (pidfd < 0)
+    {
+        return errno;
+    }
+
+    error_t err = 0;
+    for (;;)
+    {
+        pid_t got = waitpid(pid, status, WNOHANG);
+        if (got == pid)
+        {
+            break;
+        }
+        if (got < 0 && EINTR != errno)
+        {
+            err = errno;
+            break;
+        }
+        if (0 == got)
+        {
+            // Readable once the child has exited
+            err = _wait(ev, pidfd, false);
+            if (err)
+            {
+                break;
+            }
+        }
+    }
+    close(pidfd);
+    return err;
+}
+
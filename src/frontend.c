@@ -0,0 +1,590 @@
+/*******************************************************************************
+ * Copyright (c) 2022 Craig Jacobson
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ ******************************************************************************/
+/**
+ * @file frontend.c
+ * @author Craig Jacobson
+ * @brief Front end stages on their own threads.
+ *
+ * A stage that stops, at the end of the stream or on an error, closes
+ * its output so the stages after finish what they have, and cancels
+ * its input so the ones before stop sending. Whatever is left in the
+ * rings is freed once every thread has been joined.
+ */
+#include <errno.h>
+#include <string.h>
+
+#include "frontend.h"
+#include "machine.h"
+
+
+#define FRONT_LINES 256
+// Text per batch, bounding a quarter of L2 so its tokens fit beside it
+#define FRONT_BYTES (16 * 1024)
+#define FRONT_BYTES_MAX (256 * 1024)
+#define FRONT_RING 8
+#define FRONT_TOKENS 8 // Guessed per line
+
+enum
+{
+    STAGE_READ,
+    STAGE_CHECK,
+    STAGE_TOKENIZE,
+    STAGES,
+};
+
+typedef struct
+{
+    linebatch_t b;
+    uint8_t *text;
+    size_t textlen;
+    size_t textcap;
+    size_t *starts; // Where each line is in text, until sealed
+    size_t linecap;
+    size_t tokcap;
+} batch_t;
+
+typedef struct
+{
+    const frontend_t *f;
+    ring_t rings[STAGES]; // Each stage's output
+    error_t lost; // A stop that no batch could carry
+} front_t;
+
+
+/*******************************************************************************
+ * RING
+ ******************************************************************************/
+
+error_t
+ring_init(ring_t *r, size_t cap)
+{
+    size_t n = 1;
+    while (n < cap)
+    {
+        n *= 2;
+    }
+    r->slots = memget(n * sizeof(r->slots[0]));
+    if (!r->slots)
+    {
+        return ENOMEM;
+    }
+    r->mask = n - 1;
+    pthread_mutex_init(&r->lock, NULL);
+    pthread_cond_init(&r->wake, NULL);
+    r->sleeping = 0;
+    r->closed = false;
+    r->cancelled = false;
+    r->head = 0;
+    r->tail = 0;
+    return 0;
+}
+
+void
+ring_destroy(ring_t *r)
+{
+    pthread_cond_destroy(&r->wake);
+    pthread_mutex_destroy(&r->lock);
+    memput(r->slots);
+}
+
+/**
+ * Wake the other side if it sleeps. It says so before looking at the
+ * ring again, so either it sees what we did or we see it.
+ */
+static void
+_ring_wake(ring_t *r)
+{
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&r->sleeping, __ATOMIC_RELAXED))
+    {
+        pthread_mutex_lock(&r->lock);
+        pthread_cond_broadcast(&r->wake);
+        pthread_mutex_unlock(&r->lock);
+    }
+}
+
+/**
+ * Sleep until the ring has room (to push) or something in it.
+ */
+static void
+_ring_sleep(ring_t *r, bool push)
+{
+    pthread_mutex_lock(&r->lock);
+    __atomic_add_fetch(&r->sleeping, 1, __ATOMIC_SEQ_CST);
+    for (;;)
+    {
+        uint64_t head = __atomic_load_n(&r->head, __ATOMIC_SEQ_CST);
+        uint64_t tail = __atomic_load_n(&r->tail, __ATOMIC_SEQ_CST);
+        bool ready = push ? head - tail <= r->mask || r->cancelled
+                          : head != tail || r->closed;
+        if (ready)
+        {
+            break;
+        }
+        pthread_cond_wait(&r->wake, &r->lock);
+    }
+    __atomic_sub_fetch(&r->sleeping, 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&r->lock);
+}
+
+bool
+ring_push(ring_t *r, void *p)
+{
+    uint64_t head = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+    for (;;)
+    {
+        if (__atomic_load_n(&r->cancelled, __ATOMIC_ACQUIRE))
+        {
+            return false;
+        }
+        if (head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) <= r->mask)
+        {
+            break;
+        }
+        _ring_sleep(r, true);
+    }
+    r->slots[head & r->mask] = p;
+    __atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+    _ring_wake(r);
+    return true;
+}
+
+bool
+ring_trypop(ring_t *r, void **p)
+{
+    uint64_t tail = __atomic_load_n(&r->tail, __ATOMIC_RELAXED);
+    if (tail == __atomic_load_n(&r->head, __ATOMIC_ACQUIRE))
+    {
+        return false;
+    }
+    *p = r->slots[tail & r->mask];
+    __atomic_store_n(&r->tail, tail + 1, __ATOMIC_RELEASE);
+    _ring_wake(r);
+    return true;
+}
+
+bool
+ring_pop(ring_t *r, void **p)
+{
+    while (!ring_trypop(r, p))
+    {
+        if (__atomic_load_n(&r->closed, __ATOMIC_ACQUIRE))
+        {
+            // Pushes before the close are still there
+            return ring_trypop(r, p);
+        }
+        _ring_sleep(r, false);
+    }
+    return true;
+}
+
+bool
+ring_starved(ring_t *r)
+{
+    return __atomic_load_n(&r->sleeping, __ATOMIC_RELAXED)
+           && __atomic_load_n(&r->head, __ATOMIC_RELAXED)
+              == __atomic_load_n(&r->tail, __ATOMIC_RELAXED);
+}
+
+void
+ring_close(ring_t *r)
+{
+    pthread_mutex_lock(&r->lock);
+    __atomic_store_n(&r->closed, true, __ATOMIC_RELEASE);
+    pthread_cond_broadcast(&r->wake);
+    pthread_mutex_unlock(&r->lock);
+}
+
+void
+ring_cancel(ring_t *r)
+{
+    pthread_mutex_lock(&r->lock);
+    __atomic_store_n(&r->cancelled, true, __ATOMIC_RELEASE);
+    pthread_cond_broadcast(&r->wake);
+    pthread_mutex_unlock(&r->lock);
+}
+
+
+/*******************************************************************************
+ * BATCHES
+ ******************************************************************************/
+
+static batch_t *
+_batch(void)
+{
+    batch_t *b = memget(sizeof(*b));
+    if (!b)
+    {
+        return NULL;
+    }
+    memset(b, 0, sizeof(*b));
+    return b;
+}
+
+static void
+_batch_free(batch_t *b)
+{
+    memput(b->text);
+    memput(b->starts);
+    memput(b->b.lines);
+    memput(b->b.ends);
+    memput(b->b.tokens);
+    memput(b);
+}
+
+static error_t
+_batch_add(batch_t *b, line_t line)
+{
+    if (b->b.nlines == b->linecap)
+    {
+        size_t cap = b->linecap ? 2 * b->linecap : 16;
+        size_t *starts = memreget(b->starts, cap * sizeof(starts[0]));
+        if (!starts)
+        {
+            return ENOMEM;
+        }
+        b->starts = starts;
+        line_t *lines = memreget(b->b.lines, cap * sizeof(lines[0]));
+        if (!lines)
+        {
+            return ENOMEM;
+        }
+        b->b.lines = lines;
+        b->linecap = cap;
+    }
+    if (line.len > b->textcap - b->textlen)
+    {
+        size_t cap = b->textcap ? b->textcap : 1024;
+        while (line.len > cap - b->textlen)
+        {
+            cap *= 2;
+        }
+        uint8_t *text = memreget(b->text, cap);
+        if (!text)
+        {
+            return ENOMEM;
+        }
+        b->text = text;
+        b->textcap = cap;
+    }
+
+    memcpy(b->text + b->textlen, line.s, line.len);
+    b->starts[b->b.nlines] = b->textlen;
+    b->b.lines[b->b.nlines].len = line.len;
+    b->textlen += line.len;
+    ++b->b.nlines;
+    return 0;
+}
+
+/**
+ * Point the lines into the text, which won't move again.
+ */
+static void
+_batch_seal(batch_t *b)
+{
+    for (size_t i = 0; i < b->b.nlines; ++i)
+    {
+        b->b.lines[i].s = b->text + b->starts[i];
+    }
+}
+
+static error_t
+_batch_token(batch_t *b, const token_t *tok)
+{
+    if (b->b.ntokens == b->tokcap)
+    {
+        size_t cap = b->tokcap ? 2 * b->tokcap : FRONT_TOKENS * b->b.nlines;
+        token_t *tokens = memreget(b->b.tokens, cap * sizeof(tokens[0]));
+        if (!tokens)
+        {
+            return ENOMEM;
+        }
+        b->b.tokens = tokens;
+        b->tokcap = cap;
+    }
+    b->b.tokens[b->b.ntokens++] = *tok;
+    return 0;
+}
+
+
+/*******************************************************************************
+ * STAGES
+ ******************************************************************************/
+
+/**
+ * Pass b on; false if the next stage has stopped, which frees it.
+ */
+static bool
+_send(ring_t *out, batch_t *b)
+{
+    if (ring_push(out, b))
+    {
+        return true;
+    }
+    _batch_free(b);
+    return false;
+}
+
+static void *
+_read_stage(void *arg)
+{
+    front_t *fr = arg;
+    const frontend_t *f = fr->f;
+    ring_t *out = &fr->rings[STAGE_READ];
+    budget_t *prev = budget_use(f->budget);
+
+    size_t bytes = machine_batch() / 2;
+    bytes = bytes < FRONT_BYTES ? FRONT_BYTES : bytes > FRONT_BYTES_MAX ? FRONT_BYTES_MAX : bytes;
+    batch_t *b = NULL;
+    error_t err = 0;
+    while (!err)
+    {
+        if (b && (b->b.nlines >= FRONT_LINES || b->textlen >= bytes
+                  || ring_starved(out)))
+        {
+            _batch_seal(b);
+            err = _send(out, b) ? 0 : ECANCELED;
+            b = NULL;
+            continue;
+        }
+
+        line_io_t io = f->liner.get_line(f->liner.src, f->context);
+        if (LINER_LINE == io.type)
+        {
+            b = b ? b : _batch();
+            err = b ? _batch_add(b, io.u.line) : ENOMEM;
+            f->liner.free_line(f->liner.src, io.u.line);
+        }
+        else
+        {
+            err = LINER_ERROR == io.type ? io.u.error : EIO;
+        }
+    }
+
+    // The last batch says why the stream stopped
+    if (ECANCELED != err)
+    {
+        b = b ? b : _batch();
+        if (b)
+        {
+            _batch_seal(b);
+            b->b.err = err;
+            _send(out, b);
+        }
+        else
+        {
+            fr->lost = err;
+        }
+    }
+    else
+    {
+        if (b)
+        {
+            _batch_free(b);
+        }
+    }
+    ring_close(out);
+    budget_use(prev);
+    return NULL;
+}
+
+static void *
+_check_stage(void *arg)
+{
+    front_t *fr = arg;
+    ring_t *in = &fr->rings[STAGE_READ];
+    ring_t *out = &fr->rings[STAGE_CHECK];
+    budget_t *prev = budget_use(fr->f->budget);
+
+    void *p;
+    while (ring_pop(in, &p))
+    {
+        batch_t *b = p;
+        for (size_t i = 0; i < b->b.nlines; ++i)
+        {
+            if (!memutf8(b->b.lines[i].s, b->b.lines[i].len))
+            {
+                b->b.nlines = i;
+                b->b.err = EILSEQ;
+            }
+        }
+        bool stop = 0 != b->b.err;
+        if (!_send(out, b) || stop)
+        {
+            break;
+        }
+    }
+    ring_close(out);
+    ring_cancel(in);
+    budget_use(prev);
+    return NULL;
+}
+
+static error_t
+_tokenize_batch(batch_t *b, tokenizer_t *t, budget_t *budget)
+{
+    b->b.ends = memget((b->b.nlines ? b->b.nlines : 1) * sizeof(b->b.ends[0]));
+    if (!b->b.ends)
+    {
+        return ENOMEM;
+    }
+    for (size_t i = 0; i < b->b.nlines; ++i)
+    {
+        token_t tok;
+        error_t err = 0;
+        tokenizer_set_line(t, b->b.lines[i].len, b->b.lines[i].s);
+        while (!err && tokenize(t, &tok))
+        {
+            err = !budget || budget_burn(budget, 1) ? _batch_token(b, &tok) : ETIME;
+        }
+        b->b.ends[i] = b->b.ntokens;
+        if (err)
+        {
+            b->b.nlines = i + 1;
+            return err;
+        }
+    }
+    return 0;
+}
+
+static void *
+_tokenize_stage(void *arg)
+{
+    front_t *fr = arg;
+    ring_t *in = &fr->rings[STAGE_CHECK];
+    ring_t *out = &fr->rings[STAGE_TOKENIZE];
+    budget_t *prev = budget_use(fr->f->budget);
+
+    void *p;
+    while (ring_pop(in, &p))
+    {
+        batch_t *b = p;
+        error_t err = _tokenize_batch(b, fr->f->tokenizer, fr->f->budget);
+        if (err)
+        {
+            if (!b->b.ends)
+            {
+                b->b.nlines = 0;
+            }
+            b->b.err = err;
+        }
+        bool stop = 0 != b->b.err;
+        if (!_send(out, b) || stop)
+        {
+            break;
+        }
+    }
+    ring_close(out);
+    ring_cancel(in);
+    budget_use(prev);
+    return NULL;
+}
+
+
+/*******************************************************************************
+ * FRONT END
+ ******************************************************************************/
+
+error_t
+frontend_run(const frontend_t *f, frontend_sink_t sink, void *arg)
+{
+    static void *(*const stages[STAGES])(void *) =
+    {
+        _read_stage,
+        _check_stage,
+        _tokenize_stage,
+    };
+
+    front_t fr = { .f = f, .lost = 0 };
+    size_t rings;
+    error_t err = 0;
+    for (rings = 0; rings < STAGES && !err; ++rings)
+    {
+        err = ring_init(&fr.rings[rings], FRONT_RING);
+    }
+    if (err)
+    {
+        for (size_t i = 0; i + 1 < rings; ++i)
+        {
+            ring_destroy(&fr.rings[i]);
+        }
+        return err;
+    }
+
+    pthread_t threads[STAGES];
+    size_t started;
+    for (started = 0; started < STAGES && !err; ++started)
+    {
+        err = pthread_create(&threads[started], NULL, stages[started], &fr);
+    }
+    if (err)
+    {
+        // Stop the ones that started as if the sink had
+        --started;
+        for (size_t i = 0; i < started; ++i)
+        {
+            ring_cancel(&fr.rings[i]);
+        }
+    }
+    else
+    {
+        ring_t *in = &fr.rings[STAGES - 1];
+        void *p;
+        bool ended = false;
+        while (!err && ring_pop(in, &p))
+        {
+            batch_t *b = p;
+            err = sink(&b->b, arg);
+            if (!err && b->b.err)
+            {
+                err = EOF == b->b.err ? 0 : b->b.err;
+                ended = true;
+            }
+            _batch_free(b);
+            if (ended)
+            {
+                break;
+            }
+        }
+        if (!ended && !err)
+        {
+            err = fr.lost;
+        }
+        ring_cancel(in);
+    }
+
+    for (size_t i = 0; i < started; ++i)
+    {
+        pthread_join(threads[i], NULL);
+    }
+    for (size_t i = 0; i < STAGES; ++i)
+    {
+        void *p;
+        while (ring_trypop(&fr.rings[i], &p))
+        {
+            _batch_free(p);
+        }
+        ring_destroy(&fr.rings[i]);
+    }
+    return err;
+}
+
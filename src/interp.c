@@ -0,0 +1,257 @@
+/*******************************************************************************
+ * Copyright (c) 2022 Craig Jacobson
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ ******************************************************************************/
+/**
+ * @file interp.c
+ * @author Craig Jacobson
+ * @brief Interpreter instances.
+ */
+#include <errno.h>
+#include <string.h>
+
+#include "frontend.h"
+#include "interp.h"
+#include "machine.h"
+
+
+typedef struct
+{
+    budget_t *budget;
+    gcheap_t *heap;
+} entered_t;
+
+/**
+ * Make the interpreter's budget and heap the ones this thread uses.
+ */
+static entered_t
+_enter(sym_interp_t *in)
+{
+    return (entered_t){ budget_use(&in->budget), gc_use(&in->heap) };
+}
+
+static void
+_leave(entered_t prev)
+{
+    budget_use(prev.budget);
+    gc_use(prev.heap);
+}
+
+error_t
+sym_interp_init(sym_interp_t *in, const sym_config_t *config)
+{
+    sym_config_t none = { 0, 0, NULL, NULL, false };
+    config = config ? config : &none;
+
+    error_t err = budget_init(&in->budget,
+                              config->mem_limit ? config->mem_limit : SIZE_MAX,
+                              config->fuel ? config->fuel : UINT64_MAX);
+    if (err)
+    {
+        return err;
+    }
+    gcheap_init(&in->heap);
+    in->out = config->out ? config->out : stdout;
+    in->err = config->err ? config->err : stderr;
+    in->pipelined = config->pipelined;
+
+    entered_t prev = _enter(in);
+    context_init(&in->context);
+    tokenizer_init(&in->tokenizer);
+    _leave(prev);
+
+    // The runtime's, so not counted against the script's limit
+    err = machine_data(&in->machine);
+    if (!err)
+    {
+        err = context_bind(&in->context, 7, (const uint8_t *)"machine",
+                           BINDFLAG_LET, &in->machine, NULL);
+        if (err)
+        {
+            un_data(in->machine);
+        }
+    }
+    if (err)
+    {
+        in->machine = mk_bool(false);
+        sym_interp_destroy(in);
+    }
+    return err;
+}
+
+void
+sym_interp_destroy(sym_interp_t *in)
+{
+    entered_t prev = _enter(in);
+    tokenizer_destroy(&in->tokenizer);
+    context_destroy(&in->context);
+    _leave(prev);
+    un_data(in->machine);
+    gcheap_destroy(&in->heap);
+    budget_destroy(&in->budget);
+}
+
+void
+sym_interp_banner(sym_interp_t *in)
+{
+    fputs("Welcome to SymbolScript!\n"
+          "Type 'tutorial-syntax' for a tutorial on the syntax\n"
+          "Type 'tutorial-core' for a tutorial on the core library\n"
+          "Type 'help <symbol>' for help with that symbol\n"
+          "Type 'doc <symbol>' for the technical documentation for that symbol\n",
+          in->out);
+}
+
+/**
+ * @brief Chop the line up into tokens.
+ */
+static error_t
+_tokenize_line(sym_interp_t *in, line_t line)
+{
+    token_t token;
+    tokenizer_set_line(&in->tokenizer, line.len, line.s);
+    while (tokenize(&in->tokenizer, &token))
+    {
+        if (!budget_burn(&in->budget, 1))
+        {
+            return ETIME;
+        }
+        fprintf(in->out, "Token: type:%s, c:%lu, l:%lu, value:\"%.*s\"\n",
+                toktype_name(token.type), token.col, token.line,
+                (int)token.toklen, (const char *)token.tok);
+    }
+    return 0;
+}
+
+/**
+ * @brief Takes batches from the pipelined front end.
+ */
+static error_t
+_sink_batch(const linebatch_t *batch, void *arg)
+{
+    sym_interp_t *in = arg;
+    size_t t = 0;
+    for (size_t i = 0; i < batch->nlines; ++i)
+    {
+        line_t line = batch->lines[i];
+        fprintf(in->out, "Line: %.*s\n", (int)line.len, (char *)line.s);
+        for (; t < batch->ends[i]; ++t)
+        {
+            const token_t *token = &batch->tokens[t];
+            fprintf(in->out, "Token: type:%s, c:%lu, l:%lu, value:\"%.*s\"\n",
+                    toktype_name(token->type), token->col, token->line,
+                    (int)token->toklen, (const char *)token->tok);
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Reads lines from the liner and feeds them into the tokenizer.
+ */
+static error_t
+_read_lines(sym_interp_t *in, liner_t liner)
+{
+    error_t err = liner.open(liner.src);
+    if (err)
+    {
+        liner.close(liner.src);
+        return err;
+    }
+
+    if (in->pipelined)
+    {
+        frontend_t f = { liner, &in->context, &in->tokenizer, &in->budget };
+        err = frontend_run(&f, _sink_batch, in);
+        error_t err2 = liner.close(liner.src);
+        return err ? err : err2;
+    }
+
+    bool done = false;
+    while (!done)
+    {
+        line_io_t either_line = liner.get_line(liner.src, &in->context);
+
+        switch (either_line.type)
+        {
+            case LINER_LINE:
+                {
+                    line_t line = either_line.u.line;
+                    if (!memutf8(line.s, line.len))
+                    {
+                        err = EILSEQ;
+                    }
+                    else
+                    {
+                        fprintf(in->out, "Line: %.*s\n", (int)line.len, (char *)line.s);
+                        err = _tokenize_line(in, line);
+                    }
+                    if (err)
+                    {
+                        done = true;
+                    }
+                    liner.free_line(liner.src, line);
+                }
+                break;
+            case LINER_ERROR:
+                err = either_line.u.error;
+                if (EOF == err)
+                {
+                    err = 0;
+                }
+                done = true;
+                break;
+            default:
+                {
+                    fputs("Fatal error: unknown type in either_line\n", in->err);
+                    err = EIO;
+                    done = true;
+                }
+                break;
+        }
+    }
+
+    error_t err2 = liner.close(liner.src);
+    if (!err)
+    {
+        err = err2;
+    }
+
+    return err;
+}
+
+error_t
+sym_interp_run(sym_interp_t *in, liner_t liner)
+{
+    entered_t prev = _enter(in);
+    error_t err = _read_lines(in, liner);
+    _leave(prev);
+    return err;
+}
+
+error_t
+sym_interp_eval(sym_interp_t *in, size_t len, const uint8_t *src)
+{
+    entered_t prev = _enter(in);
+    error_t err = _read_lines(in, mk_liner_from_buffer(len, src));
+    _leave(prev);
+    return err;
+}
+
@@ -28,6 +28,10 @@
 
 // TODO why doesn't include in symio not work?
 #include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "symcore.h"
 #include "symio.h"
@@ -39,17 +43,16 @@ _liner_stdin_open(void *src)
     return 0;
 }
 
-line_io_t
-_liner_stdin_get_line(void *src, void *context)
+/**
+ * Read a line of any length from in, without the newline.
+ */
+static line_io_t
+_read_line(FILE *in)
 {
-    error_t err = 0;
     const size_t BUFLEN = 128;
     uint8_t *buf = memget(BUFLEN);
     size_t buflen = BUFLEN;
-    uint8_t *seg = buf;
-    size_t seglen = BUFLEN;
-    uint8_t *nl = NULL; // Newline
-    size_t linelen = 0;
+    size_t have = 0;
 
     if (!buf)
     {
@@ -58,51 +61,62 @@ _liner_stdin_get_line(void *src, void *context)
 
     for (;;)
     {
-        // Try to get a line
-        seg = (uint8_t *)fgets((char *)seg, seglen, stdin);
-
-        if (!seg)
+        if (!fgets((char *)buf + have, (int)(buflen - have), in))
         {
-            // Ignoring err output because we already encountered an error
-            if (errno)
+            if (have && !ferror(in))
             {
-                fputs("\nAn error occurred on stdin, exiting...\n", stderr);
-                err = errno;
+                // Last line without a newline
+                break;
             }
-            else
-            {
-                fputs("\nExiting\n", stdout);
-                err = EOF;
-            }
-            break;
+            error_t err = ferror(in) ? (errno ? errno : EIO) : EOF;
+            memput(buf);
+            return (line_io_t){ LINER_ERROR, { .error=err } };
         }
 
-        nl = memchr(seg, '\n', seglen);
-
+        size_t got = strlen((char *)buf + have);
+        uint8_t *nl = memchr(buf + have, '\n', got);
         if (nl)
         {
             *nl = '\0';
-            linelen = (nl - buf);
-            break;
+            have = (size_t)(nl - buf);
+            return (line_io_t){ LINER_LINE, { .line.s=buf, .line.len=have } };
         }
-        else
-        {
-            buflen = meminc(buflen);
-            buf = memreget(buf, buflen);
 
-            seg = seg + (seglen - 1);
-            seglen = buflen - (seg - buf);
+        have += got;
+        if (have + 1 < buflen)
+        {
+            // Hit the end of the input
+            continue;
+        }
+        buflen = meminc(buflen);
+        uint8_t *more = memreget(buf, buflen);
+        if (!more)
+        {
+            memput(buf);
+            return (line_io_t){ LINER_ERROR, { .error=ENOMEM } };
         }
+        buf = more;
     }
 
-    if (err)
-    {
-        return (line_io_t){ LINER_ERROR, { .error=err } };
-    }
-    else
+    return (line_io_t){ LINER_LINE, { .line.s=buf, .line.len=have } };
+}
+
+line_io_t
+_liner_stdin_get_line(void *src, void *context)
+{
+    line_io_t either_line = _read_line(stdin);
+    if (LINER_ERROR == either_line.type)
     {
-        return (line_io_t){ LINER_LINE, { .line.s=buf, .line.len=linelen } };
+        if (EOF == either_line.u.error)
+        {
+            fputs("\nExiting\n", stdout);
+        }
+        else
+        {
+            fputs("\nAn error occurred on stdin, exiting...\n", stderr);
+        }
     }
+    return either_line;
 }
 
 void
@@ -131,20 +145,29 @@ mk_liner_from_stdin(void)
     return liner;
 }
 
-static void
-_print_header(void)
+line_io_t
+_liner_stream_get_line(void *src, void *context)
 {
-    printf("Welcome to SymbolScript!\n");
-    printf("Type 'tutorial-syntax' for a tutorial on the syntax\n");
-    printf("Type 'tutorial-core' for a tutorial on the core library\n");
-    printf("Type 'help <symbol>' for help with that symbol\n");
-    printf("Type 'doc <symbol>' for the technical documentation for that symbol\n");
+    return _read_line(src);
+}
+
+liner_t
+mk_liner_from_stream(FILE *in)
+{
+    liner_t liner =
+    {
+        in,
+        _liner_stdin_open,
+        _liner_stream_get_line,
+        _liner_stdin_free_line,
+        _liner_stdin_close,
+    };
+    return liner;
 }
 
 error_t
 _liner_cl_open(void *src)
 {
-    _print_header();
     return 0;
 }
 
@@ -188,10 +211,152 @@ mk_liner_from_command_line(void)
     return liner;
 }
 
+typedef struct
+{
+    const char *path; // NULL for a buffer
+    uint8_t *map;
+    size_t size;
+    size_t at;
+} filesrc_t;
+
+/**
+ * Map the whole file; lines are handed out in place.
+ */
+error_t
+_liner_file_open(void *src)
+{
+    filesrc_t *f = src;
+    if (!f)
+    {
+        return ENOMEM;
+    }
+
+    int fd = open(f->path, O_RDONLY);
+    if (fd < 0)
+    {
+        return errno;
+    }
+    struct stat st;
+    if (fstat(fd, &st))
+    {
+        error_t err = errno;
+        close(fd);
+        return err;
+    }
+
+    f->size = (size_t)st.st_size;
+    f->at = 0;
+    f->map = NULL;
+    if (f->size)
+    {
+        int flags = MAP_PRIVATE;
+#ifdef MAP_POPULATE
+        if (mempages() & MEMPAGES_POPULATE)
+        {
+            flags |= MAP_POPULATE;
+        }
+#endif
+        void *map = mmap(NULL, f->size, PROT_READ, flags, fd, 0);
+        if (MAP_FAILED == map)
+        {
+            error_t err = errno;
+            close(fd);
+            return err;
+        }
+        f->map = map;
+        madvise(f->map, f->size, MADV_SEQUENTIAL);
+    }
+    close(fd);
+    return 0;
+}
+
+line_io_t
+_liner_file_get_line(void *src, void *context)
+{
+    filesrc_t *f = src;
+    if (f->at >= f->size)
+    {
+        return (line_io_t){ LINER_ERROR, { .error=EOF } };
+    }
+
+    uint8_t *s = f->map + f->at;
+    uint8_t *nl = memchr(s, '\n', f->size - f->at);
+    size_t len = nl ? (size_t)(nl - s) : f->size - f->at;
+    f->at += len + (nl ? 1 : 0);
+    return (line_io_t){ LINER_LINE, { .line.s=s, .line.len=len } };
+}
+
+void
+_liner_file_free_line(void *src, line_t line)
+{
+    // Lines point into the mapping
+}
+
+error_t
+_liner_file_close(void *src)
+{
+    filesrc_t *f = src;
+    error_t err = 0;
+    if (f && f->path && f->map && munmap(f->map, f->size))
+    {
+        err = errno;
+    }
+    memput(f);
+    return err;
+}
+
 liner_t
 mk_liner_from_file(const char *filepath)
 {
-    // TODO implement this
-    return (liner_t){ 0 };
+    filesrc_t *f = memget(sizeof(*f));
+    if (f)
+    {
+        f->path = filepath;
+        f->map = NULL;
+        f->size = 0;
+    }
+    liner_t liner =
+    {
+        f,
+        _liner_file_open,
+        _liner_file_get_line,
+        _liner_file_free_line,
+        _liner_file_close,
+    };
+    return liner;
+}
+
+error_t
+_liner_buffer_open(void *src)
+{
+    filesrc_t *f = src;
+    if (!f)
+    {
+        return ENOMEM;
+    }
+    f->at = 0;
+    return 0;
+}
+
+liner_t
+mk_liner_from_buffer(size_t len, const uint8_t *s)
+{
+    filesrc_t *f = memget(sizeof(*f));
+    if (f)
+    {
+        f->path = NULL;
+        f->map = (uint8_t *)s;
+        f->size = len;
+        f->at = 0;
+    }
+    liner_t liner =
+    {
+        f,
+        _liner_buffer_open,
+        _liner_file_get_line,
+        _liner_file_free_line,
+        _liner_file_close,
+    };
+    return liner;
 }
 
@@ -0,0 +1,378 @@
+/*******************************************************************************
+ * Copyright (c) 2022 Craig Jacobson
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ ******************************************************************************/
+/**
+ * @file machine.c
+ * @author Craig Jacobson
+ * @brief Probing the machine, Linux first.
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#endif
+
+#include "machine.h"
+#include "map.h"
+
+
+#define SYSFS_CPU "/sys/devices/system/cpu/cpu"
+
+static machine_t _machine;
+static pthread_once_t _probed = PTHREAD_ONCE_INIT;
+
+
+/*******************************************************************************
+ * FILES
+ ******************************************************************************/
+
+/**
+ * Read a small file whole, NUL terminated.
+ */
+static bool
+_slurp(const char *path, char *buf, size_t cap)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        return false;
+    }
+    size_t len = 0;
+    ssize_t n;
+    while (len + 1 < cap && (n = read(fd, buf + len, cap - 1 - len)) > 0)
+    {
+        len += (size_t)n;
+    }
+    close(fd);
+    buf[len] = 0;
+    return len > 0;
+}
+
+/**
+ * Sizes as sysfs writes them: 48K, 2048K, 32M.
+ */
+static size_t
+_size(const char *s)
+{
+    char *end;
+    size_t v = (size_t)strtoull(s, &end, 10);
+    switch (*end)
+    {
+        case 'K':
+            return v << 10;
+        case 'M':
+            return v << 20;
+        case 'G':
+            return v << 30;
+        default:
+            return v;
+    }
+}
+
+
+/*******************************************************************************
+ * PROBES
+ ******************************************************************************/
+
+static void
+_cores(machine_t *m)
+{
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (!sched_getaffinity(0, sizeof(set), &set) && CPU_COUNT(&set) > 0)
+    {
+        m->cores = (size_t)CPU_COUNT(&set);
+    }
+    else
+    {
+        long n = sysconf(_SC_NPROCESSORS_ONLN);
+        m->cores = n > 0 ? (size_t)n : 1;
+        m->physical = m->cores;
+        return;
+    }
+
+    // A core is known by the first of its hardware threads
+    cpu_set_t cores;
+    CPU_ZERO(&cores);
+    char path[128];
+    char buf[256];
+    for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+    {
+        if (!CPU_ISSET(cpu, &set))
+        {
+            continue;
+        }
+        int first = cpu;
+        snprintf(path, sizeof(path), SYSFS_CPU "%d/topology/thread_siblings_list", cpu);
+        if (_slurp(path, buf, sizeof(buf)))
+        {
+            first = atoi(buf);
+        }
+        if (first >= 0 && first < CPU_SETSIZE)
+        {
+            CPU_SET(first, &cores);
+        }
+    }
+    m->physical = (size_t)CPU_COUNT(&cores);
+}
+
+static void
+_caches(machine_t *m)
+{
+    char path[128];
+    char buf[64];
+    for (int i = 0;; ++i)
+    {
+        snprintf(path, sizeof(path), SYSFS_CPU "0/cache/index%d/level", i);
+        if (!_slurp(path, buf, sizeof(buf)))
+        {
+            break;
+        }
+        int level = atoi(buf);
+        snprintf(path, sizeof(path), SYSFS_CPU "0/cache/index%d/type", i);
+        if (!_slurp(path, buf, sizeof(buf)) || !strncmp("Instruction", buf, 11))
+        {
+            continue;
+        }
+        snprintf(path, sizeof(path), SYSFS_CPU "0/cache/index%d/size", i);
+        size_t size = _slurp(path, buf, sizeof(buf)) ? _size(buf) : 0;
+        snprintf(path, sizeof(path), SYSFS_CPU "0/cache/index%d/coherency_line_size", i);
+        if (!m->line && _slurp(path, buf, sizeof(buf)))
+        {
+            m->line = _size(buf);
+        }
+        switch (level)
+        {
+            case 1:
+                m->l1d = size;
+                break;
+            case 2:
+                m->l2 = size;
+                break;
+            case 3:
+                m->l3 = size;
+                break;
+        }
+    }
+
+#ifdef _SC_LEVEL1_DCACHE_SIZE
+    long n;
+    if (!m->l1d && (n = sysconf(_SC_LEVEL1_DCACHE_SIZE)) > 0)
+    {
+        m->l1d = (size_t)n;
+    }
+    if (!m->l2 && (n = sysconf(_SC_LEVEL2_CACHE_SIZE)) > 0)
+    {
+        m->l2 = (size_t)n;
+    }
+    if (!m->l3 && (n = sysconf(_SC_LEVEL3_CACHE_SIZE)) > 0)
+    {
+        m->l3 = (size_t)n;
+    }
+    if (!m->line && (n = sysconf(_SC_LEVEL1_DCACHE_LINESIZE)) > 0)
+    {
+        m->line = (size_t)n;
+    }
+#endif
+    m->line = m->line ? m->line : MACHINE_LINE;
+    m->l1d = m->l1d ? m->l1d : MACHINE_L1D;
+    m->l2 = m->l2 ? m->l2 : MACHINE_L2;
+}
+
+static void
+_memory(machine_t *m)
+{
+    long page = sysconf(_SC_PAGESIZE);
+    m->page = page > 0 ? (size_t)page : 4096;
+
+    char buf[4096];
+    if (_slurp("/proc/meminfo", buf, sizeof(buf)))
+    {
+        char *line = buf;
+        while (line)
+        {
+            unsigned long long kb;
+            if (1 == sscanf(line, "MemTotal: %llu kB", &kb))
+            {
+                m->memory = (uint64_t)kb << 10;
+            }
+            else if (1 == sscanf(line, "MemAvailable: %llu kB", &kb))
+            {
+                m->available = (uint64_t)kb << 10;
+            }
+            else if (1 == sscanf(line, "Hugepagesize: %llu kB", &kb))
+            {
+                m->huge_page = (size_t)kb << 10;
+            }
+            line = strchr(line, '\n');
+            line = line ? line + 1 : NULL;
+        }
+    }
+
+    long pages;
+    if (!m->memory && (pages = sysconf(_SC_PHYS_PAGES)) > 0)
+    {
+        m->memory = (uint64_t)pages * m->page;
+    }
+#ifdef _SC_AVPHYS_PAGES
+    if (!m->available && (pages = sysconf(_SC_AVPHYS_PAGES)) > 0)
+    {
+        m->available = (uint64_t)pages * m->page;
+    }
+#endif
+}
+
+static void
+_cpuid(machine_t *m)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    unsigned a, b, c, d;
+    if (__get_cpuid(0, &a, &b, &c, &d))
+    {
+        memcpy(m->vendor, &b, 4);
+        memcpy(m->vendor + 4, &d, 4);
+        memcpy(m->vendor + 8, &c, 4);
+        m->vendor[12] = 0;
+    }
+    __builtin_cpu_init();
+    m->features |= __builtin_cpu_supports("sse4.2") ? MACHINE_SSE42 : 0;
+    m->features |= __builtin_cpu_supports("avx2") ? MACHINE_AVX2 : 0;
+    m->features |= __builtin_cpu_supports("avx512f") ? MACHINE_AVX512 : 0;
+#else
+    (void)m;
+#endif
+}
+
+error_t
+machine_probe(machine_t *m)
+{
+    memset(m, 0, sizeof(*m));
+    _cores(m);
+    _caches(m);
+    _memory(m);
+    _cpuid(m);
+    return 0;
+}
+
+static void
+_probe_once(void)
+{
+    machine_probe(&_machine);
+}
+
+const machine_t *
+machine(void)
+{
+    pthread_once(&_probed, _probe_once);
+    return &_machine;
+}
+
+
+/*******************************************************************************
+ * SIZING
+ ******************************************************************************/
+
+size_t
+machine_grain(size_t width, size_t min, size_t max)
+{
+    size_t n = machine()->l1d / 2 / (width ? width : 1);
+    return n < min ? min : n > max ? max : n;
+}
+
+size_t
+machine_batch(void)
+{
+    return machine()->l2 / 2;
+}
+
+
+/*******************************************************************************
+ * MODULE
+ ******************************************************************************/
+
+static error_t
+_put(map_t *map, const char *key, data_t v)
+{
+    data_t k;
+    error_t err = mk_sym(&k, strlen(key), (const uint8_t *)key);
+    if (!err)
+    {
+        err = map_set(map, k, v);
+        un_data(k);
+    }
+    un_data(v);
+    return err;
+}
+
+static error_t
+_put_u8(map_t *map, const char *key, uint64_t v)
+{
+    data_t d;
+    error_t err = mk_u8(&d, v);
+    return err ? err : _put(map, key, d);
+}
+
+error_t
+machine_data(data_t *d)
+{
+    const machine_t *m = machine();
+    error_t err = mk_map(d);
+    if (err)
+    {
+        return err;
+    }
+    map_t *map = data_map(*d);
+
+    bin_t b;
+    data_t vendor;
+    err = mk_bin(&b, strlen(m->vendor), (const uint8_t *)m->vendor);
+    if (!err && (err = mk_bin_data(&vendor, b)))
+    {
+        un_bin(b);
+    }
+    err = err ? err : _put(map, "vendor", vendor);
+    err = err ? err : _put_u8(map, "cores", m->cores);
+    err = err ? err : _put_u8(map, "physical", m->physical);
+    err = err ? err : _put_u8(map, "line", m->line);
+    err = err ? err : _put_u8(map, "l1d", m->l1d);
+    err = err ? err : _put_u8(map, "l2", m->l2);
+    err = err ? err : _put_u8(map, "l3", m->l3);
+    err = err ? err : _put_u8(map, "page", m->page);
+    err = err ? err : _put_u8(map, "huge-page", m->huge_page);
+    err = err ? err : _put_u8(map, "memory", m->memory);
+    err = err ? err : _put_u8(map, "available", m->available);
+    err = err ? err : _put(map, "sse4.2", mk_bool(m->features & MACHINE_SSE42));
+    err = err ? err : _put(map, "avx2", mk_bool(m->features & MACHINE_AVX2));
+    err = err ? err : _put(map, "avx512", mk_bool(m->features & MACHINE_AVX512));
+    if (err)
+    {
+        un_data(*d);
+    }
+    return err;
+}
+
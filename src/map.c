@@ -0,0 +1,437 @@
+/*******************************************************************************
+ * Copyright (c) 2022 Craig Jacobson
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ ******************************************************************************/
+/**
+ * @file map.c
+ * @author Craig Jacobson
+ * @brief Swiss table implementation.
+ */
+#include <errno.h>
+#include <stddef.h>
+
+#include "map.h"
+#include "mmanager.h"
+#include "symmem.h"
+
+
+#if !defined(SYM_NO_SIMD) && defined(__SSE2__)
+#define MAP_SSE2 1
+#include <emmintrin.h>
+#endif
+
+// Full slots hold the low seven hash bits, the others have the top bit set
+#define CTRL_EMPTY 0x80
+#define CTRL_DELETED 0xFE
+
+// Key of a removed entry; tag zero is never produced
+#define HOLE_BITS DATA_BOXED
+
+#define NPOS SIZE_MAX
+
+typedef struct
+{
+    dataobj_t h;
+    gcnode_t gc;
+    map_t map;
+} datamap_t;
+
+
+/*******************************************************************************
+ * GROUPS
+ ******************************************************************************/
+
+#ifdef MAP_SSE2
+static uint32_t
+_match(const uint8_t *g, uint8_t c)
+{
+    __m128i ctrl = _mm_loadu_si128((const __m128i *)g);
+    return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(ctrl, _mm_set1_epi8((char)c)));
+}
+
+static uint32_t
+_match_free(const uint8_t *g)
+{
+    return (uint32_t)_mm_movemask_epi8(_mm_loadu_si128((const __m128i *)g));
+}
+#else
+static uint32_t
+_match(const uint8_t *g, uint8_t c)
+{
+    uint32_t bits = 0;
+    for (unsigned i = 0; i < MAP_GROUP; ++i)
+    {
+        bits |= (uint32_t)(c == g[i]) << i;
+    }
+    return bits;
+}
+
+static uint32_t
+_match_free(const uint8_t *g)
+{
+    uint32_t bits = 0;
+    for (unsigned i = 0; i < MAP_GROUP; ++i)
+    {
+        bits |= (uint32_t)(g[i] >> 7) << i;
+    }
+    return bits;
+}
+#endif
+
+
+/*******************************************************************************
+ * TABLE
+ ******************************************************************************/
+
+static uint8_t
+_h2(uint64_t hash)
+{
+    return hash & 0x7F;
+}
+
+static size_t
+_h1(uint64_t hash)
+{
+    return (size_t)(hash >> 7);
+}
+
+static bool
+_ishole(const mapentry_t *e)
+{
+    return HOLE_BITS == e->key.bits;
+}
+
+static bool
+_iskey(data_t key)
+{
+    enum data_type type = data_typeof(key);
+    return DATA_ARR != type && DATA_MAP != type;
+}
+
+static void
+_set_ctrl(map_t *m, size_t i, uint8_t c)
+{
+    m->ctrl[i] = c;
+    if (i < MAP_GROUP - 1)
+    {
+        m->ctrl[m->cap + i] = c;
+    }
+}
+
+/**
+ * Probe group by group; the triangular steps visit every group once.
+ */
+static size_t
+_find(const map_t *m, data_t key, uint64_t hash)
+{
+    if (!m->len)
+    {
+        return NPOS;
+    }
+
+    const size_t mask = m->cap - 1;
+    const uint8_t h2 = _h2(hash);
+    size_t pos = _h1(hash) & mask;
+    size_t step = 0;
+    for (;;)
+    {
+        const uint8_t *g = m->ctrl + pos;
+        uint32_t bits = _match(g, h2);
+        while (bits)
+        {
+            size_t s = (pos + (size_t)__builtin_ctz(bits)) & mask;
+            const mapentry_t *e = &m->entries[m->slots[s]];
+            if (e->hash == hash && data_eq(e->key, key))
+            {
+                return s;
+            }
+            bits &= bits - 1;
+        }
+        if (_match(g, CTRL_EMPTY))
+        {
+            return NPOS;
+        }
+        step += MAP_GROUP;
+        pos = (pos + step) & mask;
+    }
+}
+
+/**
+ * First empty or deleted slot on the probe path; there always is one.
+ */
+static size_t
+_free_slot(const map_t *m, uint64_t hash)
+{
+    const size_t mask = m->cap - 1;
+    size_t pos = _h1(hash) & mask;
+    size_t step = 0;
+    for (;;)
+    {
+        uint32_t bits = _match_free(m->ctrl + pos);
+        if (bits)
+        {
+            return (pos + (size_t)__builtin_ctz(bits)) & mask;
+        }
+        step += MAP_GROUP;
+        pos = (pos + step) & mask;
+    }
+}
+
+/**
+ * Slots for n live entries at 7/8 load.
+ */
+static size_t
+_cap_for(size_t n)
+{
+    size_t cap = MAP_GROUP;
+    while (cap / 8 * 7 < n)
+    {
+        cap <<= 1;
+    }
+    return cap;
+}
+
+/**
+ * Move to cap slots, dropping holes from the entries.
+ * The entries hold at most cap * 7/8 even counting holes, so at least
+ * an eighth of the slots stay empty and every probe ends.
+ */
+static error_t
+_rebuild(map_t *m, size_t cap)
+{
+    if (cap > UINT32_MAX)
+    {
+        return E2BIG;
+    }
+
+    size_t entcap = cap / 8 * 7;
+    uint8_t *ctrl = memget(cap + MAP_GROUP - 1);
+    uint32_t *slots = memget(cap * sizeof(*slots));
+    mapentry_t *entries = memget(entcap * sizeof(*entries));
+    if (!ctrl || !slots || !entries)
+    {
+        memput(ctrl);
+        memput(slots);
+        memput(entries);
+        return ENOMEM;
+    }
+    memset(ctrl, CTRL_EMPTY, cap + MAP_GROUP - 1);
+
+    mapentry_t *old = m->entries;
+    size_t used = m->used;
+    memput(m->ctrl);
+    memput(m->slots);
+    m->ctrl = ctrl;
+    m->slots = slots;
+    m->entries = entries;
+    m->cap = cap;
+    m->entcap = entcap;
+    m->used = 0;
+
+    for (size_t i = 0; i < used; ++i)
+    {
+        if (_ishole(&old[i]))
+        {
+            continue;
+        }
+        size_t s = _free_slot(m, old[i].hash);
+        _set_ctrl(m, s, _h2(old[i].hash));
+        m->slots[s] = (uint32_t)m->used;
+        m->entries[m->used++] = old[i];
+    }
+    memput(old);
+    return 0;
+}
+
+void
+map_init(map_t *m)
+{
+    memset(m, 0, sizeof(*m));
+}
+
+void
+map_destroy(map_t *m)
+{
+    for (size_t i = 0; i < m->used; ++i)
+    {
+        if (!_ishole(&m->entries[i]))
+        {
+            un_data(m->entries[i].key);
+            un_data(m->entries[i].value);
+        }
+    }
+    memput(m->ctrl);
+    memput(m->slots);
+    memput(m->entries);
+    map_init(m);
+}
+
+error_t
+map_reserve(map_t *m, size_t n)
+{
+    size_t cap = _cap_for(n);
+    return cap > m->cap ? _rebuild(m, cap) : 0;
+}
+
+error_t
+map_set(map_t *m, data_t key, data_t value)
+{
+    if (!_iskey(key))
+    {
+        return EINVAL;
+    }
+
+    uint64_t hash = data_hash(key);
+    size_t s = _find(m, key, hash);
+    if (NPOS != s)
+    {
+        // The old value may be all that keeps the new one alive
+        mapentry_t *e = &m->entries[m->slots[s]];
+        data_t old = e->value;
+        e->value = data_ref(value);
+        un_data(old);
+        return 0;
+    }
+
+    if (m->used == m->entcap)
+    {
+        // Double when full of live entries, else just drop the holes
+        error_t err = _rebuild(m, _cap_for(2 * (m->len + 1)));
+        if (err)
+        {
+            return err;
+        }
+    }
+
+    s = _free_slot(m, hash);
+    _set_ctrl(m, s, _h2(hash));
+    m->slots[s] = (uint32_t)m->used;
+    m->entries[m->used++] = (mapentry_t){ data_ref(key), data_ref(value), hash };
+    ++m->len;
+    return 0;
+}
+
+bool
+map_get(const map_t *m, data_t key, data_t *value)
+{
+    size_t s = _find(m, key, data_hash(key));
+    if (NPOS == s)
+    {
+        return false;
+    }
+    *value = m->entries[m->slots[s]].value;
+    return true;
+}
+
+bool
+map_del(map_t *m, data_t key)
+{
+    size_t s = _find(m, key, data_hash(key));
+    if (NPOS == s)
+    {
+        return false;
+    }
+
+    size_t i = m->slots[s];
+    mapentry_t *e = &m->entries[i];
+    un_data(e->key);
+    un_data(e->value);
+    e->key.bits = HOLE_BITS;
+    _set_ctrl(m, s, CTRL_DELETED);
+    // The entry stays counted in used until a rebuild, as the slot stays
+    // deleted, so empty slots remain for probes to end on
+    --m->len;
+    return true;
+}
+
+bool
+map_next(const map_t *m, size_t *it, data_t *key, data_t *value)
+{
+    while (*it < m->used)
+    {
+        const mapentry_t *e = &m->entries[(*it)++];
+        if (!_ishole(e))
+        {
+            *key = e->key;
+            *value = e->value;
+            return true;
+        }
+    }
+    return false;
+}
+
+
+/*******************************************************************************
+ * DATA_MAP
+ ******************************************************************************/
+
+static void
+_traverse(dataobj_t *o, gcvisit_fn visit, void *ctx)
+{
+    // Containers can't be keys, only values need a look
+    const map_t *m = &((datamap_t *)o)->map;
+    for (size_t i = 0; i < m->used; ++i)
+    {
+        if (!_ishole(&m->entries[i]))
+        {
+            visit(m->entries[i].value, ctx);
+        }
+    }
+}
+
+static void
+_clear(dataobj_t *o)
+{
+    map_destroy(&((datamap_t *)o)->map);
+}
+
+static const gctype_t _gctype =
+{
+    .traverse = _traverse,
+    .clear = _clear,
+    .offset = offsetof(datamap_t, gc),
+};
+
+error_t
+mk_map(data_t *d)
+{
+    datamap_t *box = memget(sizeof(*box));
+    if (!box)
+    {
+        return ENOMEM;
+    }
+    box->h.type = DATA_MAP;
+    box->h.refs = 1;
+    map_init(&box->map);
+    gc_register(DATA_MAP, &_gctype);
+    gc_track(&box->h);
+    *d = data_box(DATA_TAG_PTR, (uint64_t)(uintptr_t)box);
+    return 0;
+}
+
+map_t *
+data_map(data_t d)
+{
+    if (!data_isobj(d) || DATA_MAP != data_obj(d)->type)
+    {
+        return NULL;
+    }
+    return &((datamap_t *)data_obj(d))->map;
+}
@@ -0,0 +1,683 @@
+/*******************************************************************************
+ * Copyright (c) 2022 Craig Jacobson
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ ******************************************************************************/
+/**
+ * @file memops.c
+ * @author Craig Jacobson
+ * @brief Byte kernels with SIMD implementations picked at runtime.
+ */
+#include <stdatomic.h>
+
+#include "symmem.h"
+
+
+#if !defined(SYM_NO_SIMD) && (defined(__x86_64__) || defined(__i386__)) \
+    && defined(__SSE2__)
+#define MEMOPS_X86 1
+#include <immintrin.h>
+#endif
+
+
+// ASCII case mapping, bytes >= 128 are left alone
+static const uint8_t _ascii_lower[128] =
+{
+    0, 1, 2, 3, 4, 5, 6, 7,
+    8, 9, 10, 11, 12, 13, 14, 15,
+    16, 17, 18, 19, 20, 21, 22, 23,
+    24, 25, 26, 27, 28, 29, 30, 31,
+    32, 33, 34, 35, 36, 37, 38, 39,
+    40, 41, 42, 43, 44, 45, 46, 47,
+    48, 49, 50, 51, 52, 53, 54, 55,
+    56, 57, 58, 59, 60, 61, 62, 63,
+    64, 97, 98, 99, 100, 101, 102, 103,
+    104, 105, 106, 107, 108, 109, 110, 111,
+    112, 113, 114, 115, 116, 117, 118, 119,
+    120, 121, 122, 91, 92, 93, 94, 95,
+    96, 97, 98, 99, 100, 101, 102, 103,
+    104, 105, 106, 107, 108, 109, 110, 111,
+    112, 113, 114, 115, 116, 117, 118, 119,
+    120, 121, 122, 123, 124, 125, 126, 127,
+};
+
+static const uint8_t _ascii_upper[128] =
+{
+    0, 1, 2, 3, 4, 5, 6, 7,
+    8, 9, 10, 11, 12, 13, 14, 15,
+    16, 17, 18, 19, 20, 21, 22, 23,
+    24, 25, 26, 27, 28, 29, 30, 31,
+    32, 33, 34, 35, 36, 37, 38, 39,
+    40, 41, 42, 43, 44, 45, 46, 47,
+    48, 49, 50, 51, 52, 53, 54, 55,
+    56, 57, 58, 59, 60, 61, 62, 63,
+    64, 65, 66, 67, 68, 69, 70, 71,
+    72, 73, 74, 75, 76, 77, 78, 79,
+    80, 81, 82, 83, 84, 85, 86, 87,
+    88, 89, 90, 91, 92, 93, 94, 95,
+    96, 65, 66, 67, 68, 69, 70, 71,
+    72, 73, 74, 75, 76, 77, 78, 79,
+    80, 81, 82, 83, 84, 85, 86, 87,
+    88, 89, 90, 123, 124, 125, 126, 127,
+};
+
+typedef struct
+{
+    enum memops_isa isa;
+    size_t (*mismatch)(const uint8_t *, const uint8_t *, size_t);
+    const uint8_t *(*byte)(const uint8_t *, size_t, uint8_t);
+    const uint8_t *(*find)(const uint8_t *, size_t, const uint8_t *, size_t);
+    void (*fold)(uint8_t *, const uint8_t *, size_t, uint8_t, const uint8_t *);
+} memops_t;
+
+
+/*******************************************************************************
+ * SCALAR
+ ******************************************************************************/
+
+static size_t
+_mismatch_c(const uint8_t *a, const uint8_t *b, size_t len)
+{
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8)
+    {
+        uint64_t x;
+        uint64_t y;
+        memcpy(&x, a + i, 8);
+        memcpy(&y, b + i, 8);
+        if (x != y)
+        {
+            break;
+        }
+    }
+    for (; i < len && a[i] == b[i]; ++i);
+    return i;
+}
+
+static const uint8_t *
+_byte_c(const uint8_t *s, size_t len, uint8_t c)
+{
+    return memchr(s, c, len);
+}
+
+static const uint8_t *
+_find_c(const uint8_t *hay, size_t haylen, const uint8_t *needle, size_t nlen)
+{
+    if (!nlen)
+    {
+        return hay;
+    }
+    if (nlen > haylen)
+    {
+        return NULL;
+    }
+
+    const uint8_t *end = hay + haylen - nlen + 1;
+    const uint8_t *p = hay;
+    while (p < end)
+    {
+        p = memchr(p, needle[0], end - p);
+        if (!p)
+        {
+            return NULL;
+        }
+        if (!memcmp(p + 1, needle + 1, nlen - 1))
+        {
+            return p;
+        }
+        ++p;
+    }
+    return NULL;
+}
+
+static void
+_fold_c(uint8_t *dst, const uint8_t *src, size_t len, uint8_t first,
+        const uint8_t *table)
+{
+    (void)first;
+    size_t i;
+    for (i = 0; i < len; ++i)
+    {
+        uint8_t c = src[i];
+        dst[i] = c < 128 ? table[c] : c;
+    }
+}
+
+static const memops_t _ops_scalar =
+{
+    MEMOPS_SCALAR,
+    _mismatch_c,
+    _byte_c,
+    _find_c,
+    _fold_c,
+};
+
+
+#ifdef MEMOPS_X86
+/*******************************************************************************
+ * SSE2
+ ******************************************************************************/
+
+static size_t
+_mismatch_sse2(const uint8_t *a, const uint8_t *b, size_t len)
+{
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16)
+    {
+        __m128i x = _mm_loadu_si128((const __m128i *)(a + i));
+        __m128i y = _mm_loadu_si128((const __m128i *)(b + i));
+        unsigned m = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(x, y)) ^ 0xFFFF;
+        if (m)
+        {
+            return i + (size_t)__builtin_ctz(m);
+        }
+    }
+    return i + _mismatch_c(a + i, b + i, len - i);
+}
+
+static const uint8_t *
+_byte_sse2(const uint8_t *s, size_t len, uint8_t c)
+{
+    __m128i n = _mm_set1_epi8((char)c);
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16)
+    {
+        __m128i x = _mm_loadu_si128((const __m128i *)(s + i));
+        unsigned m = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(x, n));
+        if (m)
+        {
+            return s + i + __builtin_ctz(m);
+        }
+    }
+    return _byte_c(s + i, len - i, c);
+}
+
+/**
+ * Compare the first and last byte of the needle at 16 positions at once,
+ * only candidates matching both are checked in full.
+ */
+static const uint8_t *
+_find_sse2(const uint8_t *hay, size_t haylen, const uint8_t *needle, size_t nlen)
+{
+    if (nlen < 2)
+    {
+        return nlen ? _byte_sse2(hay, haylen, needle[0]) : hay;
+    }
+    if (nlen > haylen)
+    {
+        return NULL;
+    }
+
+    __m128i first = _mm_set1_epi8((char)needle[0]);
+    __m128i last = _mm_set1_epi8((char)needle[nlen - 1]);
+    size_t n = haylen - nlen + 1;
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16)
+    {
+        __m128i bf = _mm_loadu_si128((const __m128i *)(hay + i));
+        __m128i bl = _mm_loadu_si128((const __m128i *)(hay + i + nlen - 1));
+        unsigned m = (unsigned)_mm_movemask_epi8(
+            _mm_and_si128(_mm_cmpeq_epi8(first, bf), _mm_cmpeq_epi8(last, bl)));
+        while (m)
+        {
+            unsigned bit = (unsigned)__builtin_ctz(m);
+            if (!memcmp(hay + i + bit + 1, needle + 1, nlen - 2))
+            {
+                return hay + i + bit;
+            }
+            m &= m - 1;
+        }
+    }
+    return _find_c(hay + i, haylen - i, needle, nlen);
+}
+
+/**
+ * Shift [first, first + 26) to the bottom of the signed range,
+ * so a single signed compare finds the letters to flip.
+ */
+static void
+_fold_sse2(uint8_t *dst, const uint8_t *src, size_t len, uint8_t first,
+           const uint8_t *table)
+{
+    __m128i shift = _mm_set1_epi8((char)(0x80 - first));
+    __m128i limit = _mm_set1_epi8((char)(-128 + 26));
+    __m128i flip = _mm_set1_epi8(0x20);
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *)(src + i));
+        __m128i in = _mm_cmplt_epi8(_mm_add_epi8(v, shift), limit);
+        v = _mm_xor_si128(v, _mm_and_si128(in, flip));
+        _mm_storeu_si128((__m128i *)(dst + i), v);
+    }
+    _fold_c(dst + i, src + i, len - i, first, table);
+}
+
+static const memops_t _ops_sse2 =
+{
+    MEMOPS_SSE2,
+    _mismatch_sse2,
+    _byte_sse2,
+    _find_sse2,
+    _fold_sse2,
+};
+
+
+/*******************************************************************************
+ * AVX2
+ ******************************************************************************/
+
+#define AVX2 __attribute__((target("avx2")))
+
+AVX2 static size_t
+_mismatch_avx2(const uint8_t *a, const uint8_t *b, size_t len)
+{
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32)
+    {
+        __m256i x = _mm256_loadu_si256((const __m256i *)(a + i));
+        __m256i y = _mm256_loadu_si256((const __m256i *)(b + i));
+        uint32_t m = ~(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(x, y));
+        if (m)
+        {
+            return i + (size_t)__builtin_ctz(m);
+        }
+    }
+    return i + _mismatch_sse2(a + i, b + i, len - i);
+}
+
+AVX2 static const uint8_t *
+_byte_avx2(const uint8_t *s, size_t len, uint8_t c)
+{
+    __m256i n = _mm256_set1_epi8((char)c);
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32)
+    {
+        __m256i x = _mm256_loadu_si256((const __m256i *)(s + i));
+        uint32_t m = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(x, n));
+        if (m)
+        {
+            return s + i + __builtin_ctz(m);
+        }
+    }
+    return _byte_sse2(s + i, len - i, c);
+}
+
+AVX2 static const uint8_t *
+_find_avx2(const uint8_t *hay, size_t haylen, const uint8_t *needle, size_t nlen)
+{
+    if (nlen < 2)
+    {
+        return nlen ? _byte_avx2(hay, haylen, needle[0]) : hay;
+    }
+    if (nlen > haylen)
+    {
+        return NULL;
+    }
+
+    __m256i first = _mm256_set1_epi8((char)needle[0]);
+    __m256i last = _mm256_set1_epi8((char)needle[nlen - 1]);
+    size_t n = haylen - nlen + 1;
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32)
+    {
+        __m256i bf = _mm256_loadu_si256((const __m256i *)(hay + i));
+        __m256i bl = _mm256_loadu_si256((const __m256i *)(hay + i + nlen - 1));
+        uint32_t m = (uint32_t)_mm256_movemask_epi8(
+            _mm256_and_si256(_mm256_cmpeq_epi8(first, bf),
+                             _mm256_cmpeq_epi8(last, bl)));
+        while (m)
+        {
+            unsigned bit = (unsigned)__builtin_ctz(m);
+            if (!memcmp(hay + i + bit + 1, needle + 1, nlen - 2))
+            {
+                return hay + i + bit;
+            }
+            m &= m - 1;
+        }
+    }
+    return _find_sse2(hay + i, haylen - i, needle, nlen);
+}
+
+AVX2 static void
+_fold_avx2(uint8_t *dst, const uint8_t *src, size_t len, uint8_t first,
+           const uint8_t *table)
+{
+    __m256i shift = _mm256_set1_epi8((char)(0x80 - first));
+    __m256i limit = _mm256_set1_epi8((char)(-128 + 26));
+    __m256i flip = _mm256_set1_epi8(0x20);
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(src + i));
+        __m256i in = _mm256_cmpgt_epi8(limit, _mm256_add_epi8(v, shift));
+        v = _mm256_xor_si256(v, _mm256_and_si256(in, flip));
+        _mm256_storeu_si256((__m256i *)(dst + i), v);
+    }
+    _fold_sse2(dst + i, src + i, len - i, first, table);
+}
+
+static const memops_t _ops_avx2 =
+{
+    MEMOPS_AVX2,
+    _mismatch_avx2,
+    _byte_avx2,
+    _find_avx2,
+    _fold_avx2,
+};
+#endif
+
+
+/*******************************************************************************
+ * DISPATCH
+ ******************************************************************************/
+
+static _Atomic(const memops_t *) _ops;
+
+static const memops_t *
+_ops_for(enum memops_isa isa)
+{
+    switch (isa)
+    {
+#ifdef MEMOPS_X86
+        case MEMOPS_AVX2:
+            __builtin_cpu_init();
+            return __builtin_cpu_supports("avx2") ? &_ops_avx2 : NULL;
+        case MEMOPS_SSE2:
+            return &_ops_sse2;
+#endif
+        case MEMOPS_SCALAR:
+            return &_ops_scalar;
+        default:
+            return NULL;
+    }
+}
+
+static const memops_t *
+_ops_get(void)
+{
+    const memops_t *ops = atomic_load_explicit(&_ops, memory_order_relaxed);
+    if (!ops)
+    {
+        ops = _ops_for(MEMOPS_AVX2);
+        if (!ops)
+        {
+            ops = _ops_for(MEMOPS_SSE2);
+        }
+        if (!ops)
+        {
+            ops = &_ops_scalar;
+        }
+        atomic_store_explicit(&_ops, ops, memory_order_relaxed);
+    }
+    return ops;
+}
+
+enum memops_isa
+memops_isa(void)
+{
+    return _ops_get()->isa;
+}
+
+bool
+memops_set_isa(enum memops_isa isa)
+{
+    const memops_t *ops = _ops_for(isa);
+    if (ops)
+    {
+        atomic_store_explicit(&_ops, ops, memory_order_relaxed);
+    }
+    return NULL != ops;
+}
+
+bool
+memeq(const void *a, const void *b, size_t len)
+{
+    return len == _ops_get()->mismatch(a, b, len);
+}
+
+int
+memorder(const void *a, size_t alen, const void *b, size_t blen)
+{
+    size_t len = alen < blen ? alen : blen;
+    size_t i = _ops_get()->mismatch(a, b, len);
+    if (i < len)
+    {
+        return (int)((const uint8_t *)a)[i] - (int)((const uint8_t *)b)[i];
+    }
+    return (alen > blen) - (alen < blen);
+}
+
+const uint8_t *
+membyte(const uint8_t *s, size_t len, uint8_t c)
+{
+    return _ops_get()->byte(s, len, c);
+}
+
+const uint8_t *
+memfind(const uint8_t *hay, size_t haylen, const uint8_t *needle, size_t nlen)
+{
+    return _ops_get()->find(hay, haylen, needle, nlen);
+}
+
+void
+memlower(uint8_t *dst, const uint8_t *src, size_t len)
+{
+    _ops_get()->fold(dst, src, len, 'A', _ascii_lower);
+}
+
+void
+memupper(uint8_t *dst, const uint8_t *src, size_t len)
+{
+    _ops_get()->fold(dst, src, len, 'a', _ascii_upper);
+}
+
+
+/*******************************************************************************
+ * UTF-8
+ *
+ * Source is nearly all ASCII, which is skipped a word at a time.
+ * The first continuation byte's range depends on the lead byte; that's
+ * where overlong forms, surrogates and code points past U+10FFFF show.
+ ******************************************************************************/
+
+bool
+memutf8(const uint8_t *s, size_t len)
+{
+    size_t i = 0;
+    while (i < len)
+    {
+        uint64_t w;
+        if (len - i >= sizeof(w))
+        {
+            memcpy(&w, s + i, sizeof(w));
+            if (!(w & 0x8080808080808080ULL))
+            {
+                i += sizeof(w);
+                continue;
+            }
+        }
+
+        uint8_t c = s[i];
+        if (c < 0x80)
+        {
+            ++i;
+            continue;
+        }
+
+        size_t n;
+        uint8_t lo = 0x80;
+        uint8_t hi = 0xBF;
+        if (c >= 0xC2 && c <= 0xDF)
+        {
+            n = 1;
+        }
+        else if (c >= 0xE0 && c <= 0xEF)
+        {
+            n = 2;
+            lo = 0xE0 == c ? 0xA0 : lo;
+            hi = 0xED == c ? 0x9F : hi;
+        }
+        else if (c >= 0xF0 && c <= 0xF4)
+        {
+            n = 3;
+            lo = 0xF0 == c ? 0x90 : lo;
+            hi = 0xF4 == c ? 0x8F : hi;
+        }
+        else
+        {
+            return false;
+        }
+
+        if (len - i <= n || s[i + 1] < lo || s[i + 1] > hi)
+        {
+            return false;
+        }
+        for (size_t k = 2; k <= n; ++k)
+        {
+            if (0x80 != (s[i + k] & 0xC0))
+            {
+                return false;
+            }
+        }
+        i += n + 1;
+    }
+    return true;
+}
+
+
+/*******************************************************************************
+ * HASH
+ *
+ * Multiply-fold hash in the style of wyhash.
+ * A 64x64->128 multiply mixes eight bytes per step, which is as fast as
+ * a vector hash at the sizes we see and gives the same value everywhere.
+ ******************************************************************************/
+
+#define HASH_P0 0xa0761d6478bd642fULL
+#define HASH_P1 0xe7037ed1a0b428dbULL
+#define HASH_P2 0x8ebc6af09c88c6e3ULL
+#define HASH_P3 0x589965cc75374cc3ULL
+
+static inline void
+_mul128(uint64_t *a, uint64_t *b)
+{
+#ifdef __SIZEOF_INT128__
+    __uint128_t r = (__uint128_t)*a * *b;
+    *a = (uint64_t)r;
+    *b = (uint64_t)(r >> 64);
+#else
+    uint64_t ha = *a >> 32, hb = *b >> 32, la = (uint32_t)*a, lb = (uint32_t)*b;
+    uint64_t rh = ha * hb, rm0 = ha * lb, rm1 = hb * la, rl = la * lb;
+    uint64_t t = rl + (rm0 << 32);
+    uint64_t c = t < rl;
+    uint64_t lo = t + (rm1 << 32);
+    c += lo < t;
+    *a = lo;
+    *b = rh + (rm0 >> 32) + (rm1 >> 32) + c;
+#endif
+}
+
+static inline uint64_t
+_mix(uint64_t a, uint64_t b)
+{
+    _mul128(&a, &b);
+    return a ^ b;
+}
+
+static inline uint64_t
+_r8(const uint8_t *p)
+{
+    uint64_t v;
+    memcpy(&v, p, 8);
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    v = __builtin_bswap64(v);
+#endif
+    return v;
+}
+
+static inline uint64_t
+_r4(const uint8_t *p)
+{
+    uint32_t v;
+    memcpy(&v, p, 4);
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    v = __builtin_bswap32(v);
+#endif
+    return v;
+}
+
+uint64_t
+memhash(const void *s, size_t len, uint64_t seed)
+{
+    const uint8_t *p = s;
+    uint64_t a;
+    uint64_t b;
+
+    seed ^= _mix(seed ^ HASH_P0, HASH_P1);
+    if (len <= 16)
+    {
+        if (len >= 4)
+        {
+            size_t q = (len >> 3) << 2;
+            a = (_r4(p) << 32) | _r4(p + q);
+            b = (_r4(p + len - 4) << 32) | _r4(p + len - 4 - q);
+        }
+        else if (len > 0)
+        {
+            a = ((uint64_t)p[0] << 16) | ((uint64_t)p[len >> 1] << 8) | p[len - 1];
+            b = 0;
+        }
+        else
+        {
+            a = b = 0;
+        }
+    }
+    else
+    {
+        size_t i = len;
+        if (i > 48)
+        {
+            uint64_t see1 = seed;
+            uint64_t see2 = seed;
+            do
+            {
+                seed = _mix(_r8(p) ^ HASH_P1, _r8(p + 8) ^ seed);
+                see1 = _mix(_r8(p + 16) ^ HASH_P2, _r8(p + 24) ^ see1);
+                see2 = _mix(_r8(p + 32) ^ HASH_P3, _r8(p + 40) ^ see2);
+                p += 48;
+                i -= 48;
+            } while (i > 48);
+            seed ^= see1 ^ see2;
+        }
+        while (i > 16)
+        {
+            seed = _mix(_r8(p) ^ HASH_P1, _r8(p + 8) ^ seed);
+            i -= 16;
+            p += 16;
+        }
+        a = _r8(p + i - 16);
+        b = _r8(p + i - 8);
+    }
+
+    a ^= HASH_P1;
+    b ^= seed;
+    _mul128(&a, &b);
+    return _mix(a ^ HASH_P0 ^ len, b ^ HASH_P1);
+}
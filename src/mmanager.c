@@ -24,10 +24,656 @@
  * @author Craig Jacobson
  * @brief Symbol Script memory manager.
  */
+#include <errno.h>
+#include <pthread.h>
+
+#include "machine.h"
 #include "mmanager.h"
+#include "symmem.h"
+
+
+struct regionblock
+{
+    struct regionblock *prev;
+    size_t cap;
+    size_t maplen; // Bytes from mempages_get, 0 if from memget
+    _Alignas(REGION_ALIGN) uint8_t s[];
+};
+
+struct regioncleanup
+{
+    struct regioncleanup *prev;
+    void (*fn)(void *);
+    void *arg;
+};
+
+
+/*******************************************************************************
+ * REGION
+ ******************************************************************************/
+
+static size_t
+_round(size_t size)
+{
+    return (size + REGION_ALIGN - 1) & ~(size_t)(REGION_ALIGN - 1);
+}
+
+/**
+ * The first block fills L1, so short lived regions stay in it.
+ */
+static size_t
+_first_block(void)
+{
+    size_t size = REGION_BLOCK;
+    while (size < machine()->l1d && size < REGION_BLOCK_MAX)
+    {
+        size <<= 1;
+    }
+    return size;
+}
+
+void
+region_init(region_t *r)
+{
+    r->block = NULL;
+    r->spare = NULL;
+    r->cleanups = NULL;
+    r->top = NULL;
+    r->end = NULL;
+    r->next = _first_block();
+}
+
+static void
+_free_blocks(struct regionblock *b)
+{
+    while (b)
+    {
+        struct regionblock *prev = b->prev;
+        if (b->maplen)
+        {
+            mempages_put(b, b->maplen);
+        }
+        else
+        {
+            memput(b);
+        }
+        b = prev;
+    }
+}
+
+void
+region_destroy(region_t *r)
+{
+    region_reset(r, (region_mark_t){ NULL, NULL, NULL });
+    _free_blocks(r->spare);
+    region_init(r);
+}
+
+/**
+ * Start a new block that fits size, reusing a spare one if it is big enough.
+ */
+static error_t
+_grow(region_t *r, size_t size)
+{
+    struct regionblock **link = &r->spare;
+    struct regionblock *b = NULL;
+    for (; *link; link = &(*link)->prev)
+    {
+        if ((*link)->cap >= size)
+        {
+            b = *link;
+            *link = b->prev;
+            break;
+        }
+    }
+
+    if (!b)
+    {
+        size_t cap = size > r->next ? _round(size) : r->next;
+        if (cap >= REGION_BLOCK_MAX && (mempages() & MEMPAGES_HUGE))
+        {
+            // Full size blocks fill whole huge pages
+            size_t len = sizeof(*b) + cap;
+            b = mempages_get(&len);
+            if (!b)
+            {
+                return ENOMEM;
+            }
+            b->maplen = len;
+            cap = len - sizeof(*b);
+        }
+        else
+        {
+            b = memget(sizeof(*b) + cap);
+            if (!b)
+            {
+                return ENOMEM;
+            }
+            b->maplen = 0;
+        }
+        b->cap = cap;
+        if (r->next < REGION_BLOCK_MAX)
+        {
+            r->next <<= 1;
+        }
+    }
+
+    b->prev = r->block;
+    r->block = b;
+    r->top = b->s;
+    r->end = b->s + b->cap;
+    return 0;
+}
+
+void *
+region_get(region_t *r, size_t size)
+{
+    if (size > SIZE_MAX / 2)
+    {
+        return NULL;
+    }
+    size = _round(size ? size : 1);
+    if ((!r->top || size > (size_t)(r->end - r->top)) && _grow(r, size))
+    {
+        return NULL;
+    }
+    void *p = r->top;
+    r->top += size;
+    return p;
+}
+
+void *
+region_dup(region_t *r, const void *s, size_t len)
+{
+    void *p = region_get(r, len);
+    if (p)
+    {
+        memcpy(p, s, len);
+    }
+    return p;
+}
+
+region_mark_t
+region_mark(const region_t *r)
+{
+    return (region_mark_t){ r->block, r->cleanups, r->top };
+}
+
+void
+region_reset(region_t *r, region_mark_t m)
+{
+    while (r->cleanups != m.cleanups)
+    {
+        struct regioncleanup *c = r->cleanups;
+        r->cleanups = c->prev;
+        c->fn(c->arg);
+    }
+
+    // Blocks newer than the mark go to the spares
+    while (r->block != m.block)
+    {
+        struct regionblock *b = r->block;
+        r->block = b->prev;
+        b->prev = r->spare;
+        r->spare = b;
+    }
+
+    if (m.block)
+    {
+        r->top = m.top;
+        r->end = m.block->s + m.block->cap;
+    }
+    else
+    {
+        r->top = NULL;
+        r->end = NULL;
+    }
+}
+
+error_t
+region_defer(region_t *r, void (*fn)(void *), void *arg)
+{
+    struct regioncleanup *c = region_get(r, sizeof(*c));
+    if (!c)
+    {
+        return ENOMEM;
+    }
+    c->prev = r->cleanups;
+    c->fn = fn;
+    c->arg = arg;
+    r->cleanups = c;
+    return 0;
+}
+
+
+/*******************************************************************************
+ * CYCLES
+ ******************************************************************************/
+
+enum
+{
+    GC_IDLE,
+    GC_REACHABLE, // In the generation being collected
+    GC_TENTATIVE, // Not reached yet, maybe garbage
+};
+
+static const gctype_t *_gctypes[DATA_MAP + 1];
+static gcheap_t _default; // Only when a thread can't have its own
+static pthread_once_t _default_once = PTHREAD_ONCE_INIT;
+static pthread_key_t _own_key;
+static _Thread_local gcheap_t *_heap;
+static _Thread_local gcheap_t *_own;
+
+static void
+_list_init(gcnode_t *head)
+{
+    head->prev = head;
+    head->next = head;
+}
+
+static void
+_list_remove(gcnode_t *n)
+{
+    n->prev->next = n->next;
+    n->next->prev = n->prev;
+}
+
+static void
+_list_append(gcnode_t *head, gcnode_t *n)
+{
+    n->prev = head->prev;
+    n->next = head;
+    head->prev->next = n;
+    head->prev = n;
+}
+
+/**
+ * Append all of from onto to, leaving from empty.
+ */
+static void
+_list_merge(gcnode_t *to, gcnode_t *from)
+{
+    if (from->next != from)
+    {
+        from->next->prev = to->prev;
+        to->prev->next = from->next;
+        from->prev->next = to;
+        to->prev = from->prev;
+        _list_init(from);
+    }
+}
+
+void
+gcheap_init(gcheap_t *h)
+{
+    pthread_mutex_init(&h->lock, NULL);
+    for (unsigned g = 0; g < GC_GENS; ++g)
+    {
+        _list_init(&h->gens[g].head);
+        h->gens[g].count = 0;
+        h->gens[g].collections = 0;
+    }
+    h->young_made = 0;
+    h->collecting = false;
+}
+
+static size_t
+_collect(gcheap_t *h, unsigned gen);
+
+/**
+ * A thread's own heap goes when it exits, unless containers it made
+ * live on elsewhere; those still untrack from it but aren't collected.
+ */
+static void
+_own_release(void *arg)
+{
+    gcheap_t *h = arg;
+    _own = NULL;
+    _collect(h, GC_GENS - 1);
+    pthread_mutex_lock(&h->lock);
+    size_t left = 0;
+    for (unsigned g = 0; g < GC_GENS; ++g)
+    {
+        left += h->gens[g].count;
+    }
+    pthread_mutex_unlock(&h->lock);
+    if (!left)
+    {
+        pthread_mutex_destroy(&h->lock);
+        memput(h);
+    }
+}
+
+static void
+_default_init(void)
+{
+    gcheap_init(&_default);
+    pthread_key_create(&_own_key, _own_release);
+}
+
+static gcheap_t *
+_current(void)
+{
+    if (_heap)
+    {
+        return _heap;
+    }
+    if (!_own)
+    {
+        pthread_once(&_default_once, _default_init);
+        gcheap_t *h = memget(sizeof(*h));
+        if (!h)
+        {
+            return &_default;
+        }
+        gcheap_init(h);
+        _own = h;
+        pthread_setspecific(_own_key, h);
+    }
+    return _own;
+}
+
+gcheap_t *
+gc_use(gcheap_t *h)
+{
+    gcheap_t *prev = _heap;
+    _heap = h;
+    return prev;
+}
+
+static gcnode_t *
+_node(dataobj_t *o)
+{
+    const gctype_t *t = NULL;
+    if (o->type <= DATA_MAP)
+    {
+        t = __atomic_load_n(&_gctypes[o->type], __ATOMIC_ACQUIRE);
+    }
+    return t ? (gcnode_t *)((uint8_t *)o + t->offset) : NULL;
+}
+
+static dataobj_t *
+_obj(gcnode_t *n, const gctype_t **type)
+{
+    // Every registered type places its node at its own offset
+    for (size_t t = 0; t <= DATA_MAP; ++t)
+    {
+        const gctype_t *ops = __atomic_load_n(&_gctypes[t], __ATOMIC_ACQUIRE);
+        if (ops)
+        {
+            dataobj_t *o = (dataobj_t *)((uint8_t *)n - ops->offset);
+            if (o->type == t)
+            {
+                *type = ops;
+                return o;
+            }
+        }
+    }
+    *type = NULL;
+    return NULL;
+}
+
+void
+gc_register(enum data_type type, const gctype_t *ops)
+{
+    if (__atomic_load_n(&_gctypes[type], __ATOMIC_ACQUIRE) != ops)
+    {
+        __atomic_store_n(&_gctypes[type], ops, __ATOMIC_RELEASE);
+    }
+}
+
+/**
+ * Oldest generation due for collection, or GC_GENS for none.
+ */
+static unsigned
+_due(gcheap_t *h)
+{
+    if (h->collecting || ++h->young_made < GC_THRESHOLD)
+    {
+        return GC_GENS;
+    }
+    unsigned gen = 0;
+    while (gen + 1 < GC_GENS && h->gens[gen + 1].collections + 1 >= GC_RATIO)
+    {
+        ++gen;
+    }
+    return gen;
+}
+
+void
+gc_track(dataobj_t *o)
+{
+    gcheap_t *h = _current();
+    pthread_mutex_lock(&h->lock);
+    unsigned gen = _due(h);
+    pthread_mutex_unlock(&h->lock);
+    if (gen < GC_GENS)
+    {
+        _collect(h, gen);
+    }
+
+    gcnode_t *n = _node(o);
+    n->heap = h;
+    n->gen = 0;
+    n->state = GC_IDLE;
+    pthread_mutex_lock(&h->lock);
+    _list_append(&h->gens[0].head, n);
+    ++h->gens[0].count;
+    pthread_mutex_unlock(&h->lock);
+}
+
+void
+gc_untrack(dataobj_t *o)
+{
+    gcnode_t *n = _node(o);
+    gcheap_t *h = n->heap;
+    if (h)
+    {
+        pthread_mutex_lock(&h->lock);
+        _list_remove(n);
+        --h->gens[n->gen].count;
+        pthread_mutex_unlock(&h->lock);
+    }
+    else
+    {
+        _list_remove(n);
+    }
+}
+
+static void
+_subtract(data_t child, void *ctx)
+{
+    (void)ctx;
+    if (data_isobj(child))
+    {
+        gcnode_t *n = _node(data_obj(child));
+        if (n && GC_REACHABLE == n->state)
+        {
+            --n->gcrefs;
+        }
+    }
+}
+
+/**
+ * Child of a reachable container is reachable; back onto the live list.
+ */
+static void
+_reach(data_t child, void *live)
+{
+    if (data_isobj(child))
+    {
+        gcnode_t *n = _node(data_obj(child));
+        if (!n)
+        {
+            return;
+        }
+        if (GC_TENTATIVE == n->state)
+        {
+            _list_remove(n);
+            _list_append(live, n);
+            n->state = GC_REACHABLE;
+            n->gcrefs = 1;
+        }
+        else if (GC_REACHABLE == n->state && !n->gcrefs)
+        {
+            n->gcrefs = 1;
+        }
+    }
+}
+
+static size_t
+_collect(gcheap_t *h, unsigned gen)
+{
+    pthread_mutex_lock(&h->lock);
+    if (h->collecting)
+    {
+        pthread_mutex_unlock(&h->lock);
+        return 0;
+    }
+    if (gen >= GC_GENS)
+    {
+        gen = GC_GENS - 1;
+    }
+    h->collecting = true;
+
+    gcnode_t live;
+    gcnode_t dead;
+    _list_init(&live);
+    _list_init(&dead);
+    for (unsigned g = 0; g <= gen; ++g)
+    {
+        _list_merge(&live, &h->gens[g].head);
+        h->gens[g].count = 0;
+        h->gens[g].collections = 0;
+    }
+    if (gen + 1 < GC_GENS)
+    {
+        ++h->gens[gen + 1].collections;
+    }
+    h->young_made = 0;
+
+    // Those already let go of are being freed by whoever did it, who
+    // waits on the lock to untrack them; leave them be
+    const gctype_t *type;
+    gcnode_t dying;
+    _list_init(&dying);
+    for (gcnode_t *n = live.next, *next; n != &live; n = next)
+    {
+        next = n->next;
+        n->gcrefs = refs_get(&_obj(n, &type)->refs);
+        n->state = n->gcrefs ? GC_REACHABLE : GC_IDLE;
+        if (!n->gcrefs)
+        {
+            _list_remove(n);
+            _list_append(&dying, n);
+        }
+    }
+
+    // Refcounts less references from inside leaves the outside ones
+    for (gcnode_t *n = live.next; n != &live; n = n->next)
+    {
+        dataobj_t *o = _obj(n, &type);
+        type->traverse(o, _subtract, NULL);
+    }
+
+    // Anything reached from outside survives, along with what it holds
+    gcnode_t *n = live.next;
+    while (n != &live)
+    {
+        gcnode_t *next = n->next;
+        if (n->gcrefs)
+        {
+            dataobj_t *o = _obj(n, &type);
+            type->traverse(o, _reach, &live);
+            next = n->next;
+        }
+        else
+        {
+            _list_remove(n);
+            _list_append(&dead, n);
+            n->state = GC_TENTATIVE;
+        }
+        n = next;
+    }
+
+    // Survivors move up a generation
+    unsigned to = gen + 1 < GC_GENS ? gen + 1 : gen;
+    _list_merge(&live, &dying);
+    for (n = live.next; n != &live; n = n->next)
+    {
+        n->state = GC_IDLE;
+        n->gen = (uint8_t)to;
+        ++h->gens[to].count;
+    }
+    _list_merge(&h->gens[to].head, &live);
 
+    // The garbage leaves the heap. Keep it alive while emptying it,
+    // which breaks the cycles, then let go; other heaps may be locked
+    // as what it held is freed, so this one is released first.
+    size_t freed = 0;
+    for (n = dead.next; n != &dead; n = n->next)
+    {
+        refs_inc(&_obj(n, &type)->refs);
+        n->state = GC_IDLE;
+        n->heap = NULL;
+        ++freed;
+    }
+    h->collecting = false;
+    pthread_mutex_unlock(&h->lock);
 
+    for (n = dead.next; n != &dead; n = n->next)
+    {
+        dataobj_t *o = _obj(n, &type);
+        type->clear(o);
+    }
+    while (dead.next != &dead)
+    {
+        n = dead.next;
+        _list_remove(n);
+        _list_init(n);
+        un_data(data_box(DATA_TAG_PTR, (uint64_t)(uintptr_t)_obj(n, &type)));
+    }
+    return freed;
+}
 
+size_t
+gc_collect(unsigned gen)
+{
+    return _collect(_current(), gen);
+}
 
+size_t
+gc_count(unsigned gen)
+{
+    gcheap_t *h = _current();
+    pthread_mutex_lock(&h->lock);
+    size_t count = gen < GC_GENS ? h->gens[gen].count : 0;
+    pthread_mutex_unlock(&h->lock);
+    return count;
+}
 
+void
+gcheap_destroy(gcheap_t *h)
+{
+    if (_heap == h)
+    {
+        _heap = NULL;
+    }
+    _collect(h, GC_GENS - 1);
+    pthread_mutex_lock(&h->lock);
 
+    // Whatever is still referenced is no longer tracked
+    for (unsigned g = 0; g < GC_GENS; ++g)
+    {
+        gcnode_t *n = h->gens[g].head.next;
+        while (n != &h->gens[g].head)
+        {
+            gcnode_t *next = n->next;
+            _list_init(n);
+            n->heap = NULL;
+            n = next;
+        }
+    }
+    pthread_mutex_unlock(&h->lock);
+    pthread_mutex_destroy(&h->lock);
+}
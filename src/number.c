@@ -0,0 +1,1229 @@
+/*******************************************************************************
+ * Copyright (c) 2022 Craig Jacobson
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ ******************************************************************************/
+/**
+ * @file number.c
+ * @author Craig Jacobson
+ * @brief Parsing and printing numbers.
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <locale.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdlib.h>
+
+#include "number.h"
+#include "numtab.h"
+#include "symmem.h"
+
+
+typedef unsigned __int128 u128_t;
+
+static const uint64_t _pow10_u64[20] =
+{
+    1ULL, 10ULL, 100ULL, 1000ULL, 10000ULL, 100000ULL, 1000000ULL,
+    10000000ULL, 100000000ULL, 1000000000ULL, 10000000000ULL,
+    100000000000ULL, 1000000000000ULL, 10000000000000ULL,
+    100000000000000ULL, 1000000000000000ULL, 10000000000000000ULL,
+    100000000000000000ULL, 1000000000000000000ULL,
+    10000000000000000000ULL,
+};
+
+static const double _pow10_f8[23] =
+{
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+};
+
+static const float _pow10_f4[11] =
+{
+    1e0f, 1e1f, 1e2f, 1e3f, 1e4f, 1e5f, 1e6f, 1e7f, 1e8f, 1e9f, 1e10f,
+};
+
+static const char _digits2[200] =
+    "0001020304050607080910111213141516171819202122232425262728293031323334353637383940414243444546474849"
+    "5051525354555657585960616263646566676869707172737475767778798081828384858687888990919293949596979899";
+
+
+/*******************************************************************************
+ * INTEGER PARSING
+ ******************************************************************************/
+
+static bool
+_isdigit(uint8_t c)
+{
+    return (uint8_t)(c - '0') < 10;
+}
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define NUMBER_SWAR 1
+#endif
+
+#ifdef NUMBER_SWAR
+static bool
+_isdigits8(const uint8_t *s)
+{
+    uint64_t v;
+    memcpy(&v, s, 8);
+    return 0 == (((v & 0xF0F0F0F0F0F0F0F0ULL)
+                  | (((v + 0x0606060606060606ULL) & 0xF0F0F0F0F0F0F0F0ULL) >> 4))
+                 ^ 0x3333333333333333ULL);
+}
+
+/**
+ * Eight ASCII digits to their value with three multiplies.
+ */
+static uint32_t
+_digits8(const uint8_t *s)
+{
+    uint64_t v;
+    memcpy(&v, s, 8);
+    v -= 0x3030303030303030ULL;
+    v = (v * 10) + (v >> 8);
+    v = (((v & 0x000000FF000000FFULL) * (100 + (1000000ULL << 32)))
+         + (((v >> 16) & 0x000000FF000000FFULL) * (1 + (10000ULL << 32)))) >> 32;
+    return (uint32_t)v;
+}
+#endif
+
+/**
+ * Accumulate up to max digits into m.
+ * @return Number of digits consumed.
+ */
+static size_t
+_digits(const uint8_t *s, size_t len, size_t max, uint64_t *m)
+{
+    size_t i = 0;
+    uint64_t v = *m;
+#ifdef NUMBER_SWAR
+    for (; i + 8 <= len && i + 8 <= max && _isdigits8(s + i); i += 8)
+    {
+        v = v * 100000000ULL + _digits8(s + i);
+    }
+#endif
+    for (; i < len && i < max && _isdigit(s[i]); ++i)
+    {
+        v = v * 10 + (s[i] - '0');
+    }
+    *m = v;
+    return i;
+}
+
+static size_t
+_skipzeros(const uint8_t *s, size_t len)
+{
+    size_t i = 0;
+    for (; i < len && '0' == s[i]; ++i);
+    return i;
+}
+
+/**
+ * Plain digits, no sign.
+ */
+static error_t
+_parse_mag(uint64_t *v, size_t len, const uint8_t *s)
+{
+    if (!len)
+    {
+        return EINVAL;
+    }
+
+    size_t z = _skipzeros(s, len);
+    s += z;
+    len -= z;
+
+    uint64_t m = 0;
+    size_t n = _digits(s, len, 19, &m);
+    if (n < len)
+    {
+        if (!_isdigit(s[n]))
+        {
+            return EINVAL;
+        }
+        uint64_t d = s[n] - '0';
+        if (n + 1 < len || __builtin_mul_overflow(m, 10, &m)
+            || __builtin_add_overflow(m, d, &m))
+        {
+            for (++n; n < len && _isdigit(s[n]); ++n);
+            return n < len ? EINVAL : ERANGE;
+        }
+    }
+
+    *v = m;
+    return 0;
+}
+
+static size_t
+_sign(const uint8_t *s, size_t len, bool *neg)
+{
+    *neg = len && '-' == s[0];
+    return len && ('-' == s[0] || '+' == s[0]);
+}
+
+error_t
+parse_u8(uint64_t *v, size_t len, const uint8_t *s)
+{
+    bool neg;
+    size_t i = _sign(s, len, &neg);
+    if (neg)
+    {
+        return EINVAL;
+    }
+    return _parse_mag(v, len - i, s + i);
+}
+
+error_t
+parse_i8(int64_t *v, size_t len, const uint8_t *s)
+{
+    bool neg;
+    size_t i = _sign(s, len, &neg);
+    uint64_t m;
+    error_t err = _parse_mag(&m, len - i, s + i);
+    if (err)
+    {
+        return err;
+    }
+    if (m > (uint64_t)INT64_MAX + neg)
+    {
+        return ERANGE;
+    }
+    *v = neg ? (int64_t)-m : (int64_t)m;
+    return 0;
+}
+
+/**
+ * Arbitrary precision, 19 digits at a time.
+ */
+static error_t
+_parse_big(data_t *d, enum data_type type, size_t len, const uint8_t *s)
+{
+    bool neg;
+    size_t i = _sign(s, len, &neg);
+    if (i == len)
+    {
+        return EINVAL;
+    }
+    if (DATA_U == type && neg)
+    {
+        return EINVAL;
+    }
+    i += _skipzeros(s + i, len - i);
+
+    data_t acc = data_box(DATA_U == type ? DATA_TAG_UINT : DATA_TAG_INT, 0);
+    while (i < len)
+    {
+        uint64_t chunk = 0;
+        size_t n = _digits(s + i, len - i, 19, &chunk);
+        if (!n)
+        {
+            un_data(acc);
+            return EINVAL;
+        }
+
+        // acc * 10^n + chunk, with chunk carrying the sign
+        data_t scale;
+        data_t part;
+        data_t next;
+        error_t err = mk_int_limbs(&scale, type, false, 1, &_pow10_u64[n]);
+        if (!err)
+        {
+            err = mk_int_limbs(&part, type, neg, 1, &chunk);
+            if (err)
+            {
+                un_data(scale);
+            }
+        }
+        if (err)
+        {
+            un_data(acc);
+            return err;
+        }
+
+        err = data_int_mul(&next, acc, scale);
+        un_data(acc);
+        un_data(scale);
+        if (err)
+        {
+            un_data(part);
+            return err;
+        }
+        err = data_int_add(&acc, next, part);
+        un_data(next);
+        un_data(part);
+        if (err)
+        {
+            return err;
+        }
+        i += n;
+    }
+
+    *d = acc;
+    return 0;
+}
+
+
+/*******************************************************************************
+ * FLOAT PARSING
+ ******************************************************************************/
+
+typedef struct
+{
+    bool neg;
+    bool special; // inf or nan, in value
+    bool trunc; // Nonzero digits past the 19th were dropped
+    uint64_t man;
+    int64_t exp;
+    double value;
+} decimal_t;
+
+static bool
+_word(const uint8_t *s, size_t len, const char *word)
+{
+    size_t n = strlen(word);
+    if (len != n)
+    {
+        return false;
+    }
+    uint8_t low[8];
+    memlower(low, s, len);
+    return !memcmp(low, word, n);
+}
+
+static error_t
+_parse_decimal(decimal_t *dec, size_t len, const uint8_t *s)
+{
+    size_t i = _sign(s, len, &dec->neg);
+    if (i == len)
+    {
+        return EINVAL;
+    }
+    dec->special = false;
+    dec->trunc = false;
+    dec->man = 0;
+    dec->exp = 0;
+
+    if (len - i <= 8 && !_isdigit(s[i]) && '.' != s[i])
+    {
+        if (_word(s + i, len - i, "inf") || _word(s + i, len - i, "infinity"))
+        {
+            dec->special = true;
+            dec->value = dec->neg ? -INFINITY : INFINITY;
+            return 0;
+        }
+        if (_word(s + i, len - i, "nan"))
+        {
+            dec->special = true;
+            dec->value = NAN;
+            return 0;
+        }
+        return EINVAL;
+    }
+
+    bool any = false;
+    size_t n = _skipzeros(s + i, len - i);
+    any = n > 0;
+    i += n;
+
+    // Integer part
+    size_t nd = _digits(s + i, len - i, 19, &dec->man);
+    any = any || nd;
+    i += nd;
+    for (; i < len && _isdigit(s[i]); ++i)
+    {
+        dec->trunc |= '0' != s[i];
+        ++dec->exp;
+    }
+
+    // Fraction
+    if (i < len && '.' == s[i])
+    {
+        ++i;
+        if (!nd)
+        {
+            n = _skipzeros(s + i, len - i);
+            any = any || n;
+            dec->exp -= (int64_t)n;
+            i += n;
+        }
+        n = _digits(s + i, len - i, 19 - nd, &dec->man);
+        any = any || n;
+        dec->exp -= (int64_t)n;
+        i += n;
+        for (; i < len && _isdigit(s[i]); ++i)
+        {
+            dec->trunc |= '0' != s[i];
+            any = true;
+        }
+    }
+
+    if (!any)
+    {
+        return EINVAL;
+    }
+
+    // Exponent, saturated well past any meaningful value
+    if (i < len && ('e' == s[i] || 'E' == s[i]))
+    {
+        bool eneg;
+        ++i;
+        i += _sign(s + i, len - i, &eneg);
+        if (i == len || !_isdigit(s[i]))
+        {
+            return EINVAL;
+        }
+        int64_t e = 0;
+        for (; i < len && _isdigit(s[i]); ++i)
+        {
+            if (e < 100000)
+            {
+                e = e * 10 + (s[i] - '0');
+            }
+        }
+        dec->exp += eneg ? -e : e;
+    }
+
+    return i == len ? 0 : EINVAL;
+}
+
+/**
+ * Eisel-Lemire: multiply the normalized mantissa by a 128-bit
+ * approximation of 10^exp; fails on the rare inputs where the
+ * truncation could change the rounding.
+ */
+static bool
+_eisel_lemire(uint64_t man, int64_t exp10, unsigned mantbits, uint64_t bias,
+              uint64_t *mant, uint64_t *exp2)
+{
+    if (exp10 < POW10_MIN_EXP || exp10 > POW10_MAX_EXP)
+    {
+        return false;
+    }
+
+    const unsigned shift = 64 - mantbits - 3;
+    const uint64_t mask = (1ULL << shift) - 1;
+    const uint64_t *pow = _pow10[exp10 - POW10_MIN_EXP];
+
+    unsigned clz = (unsigned)__builtin_clzll(man);
+    man <<= clz;
+    uint64_t e2 = (uint64_t)(((217706 * exp10) >> 16) + 64 + (int64_t)bias) - clz;
+
+    u128_t x = (u128_t)man * pow[1];
+    uint64_t xhi = (uint64_t)(x >> 64);
+    uint64_t xlo = (uint64_t)x;
+
+    // Wider approximation only if the low bits could carry into the result
+    if ((xhi & mask) == mask && xlo + man < man)
+    {
+        u128_t y = (u128_t)man * pow[0];
+        uint64_t yhi = (uint64_t)(y >> 64);
+        uint64_t ylo = (uint64_t)y;
+        uint64_t mhi = xhi;
+        uint64_t mlo = xlo + yhi;
+        if (mlo < xlo)
+        {
+            ++mhi;
+        }
+        if ((mhi & mask) == mask && mlo + 1 == 0 && ylo + man < man)
+        {
+            return false;
+        }
+        xhi = mhi;
+        xlo = mlo;
+    }
+
+    uint64_t msb = xhi >> 63;
+    uint64_t m = xhi >> (msb + shift);
+    e2 -= 1 ^ msb;
+
+    // Exactly half way between two floats, let the slow path decide
+    if (!xlo && !(xhi & mask) && 1 == (m & 3))
+    {
+        return false;
+    }
+
+    m += m & 1;
+    m >>= 1;
+    if (m >> (mantbits + 1))
+    {
+        m >>= 1;
+        ++e2;
+    }
+
+    // Subnormal, infinite
+    uint64_t emax = (bias << 1) + 1;
+    if (e2 - 1 >= emax - 1)
+    {
+        return false;
+    }
+
+    *mant = m & ((1ULL << mantbits) - 1);
+    *exp2 = e2;
+    return true;
+}
+
+static locale_t _c_locale;
+static pthread_once_t _c_once = PTHREAD_ONCE_INIT;
+
+static void
+_c_init(void)
+{
+    _c_locale = newlocale(LC_ALL_MASK, "C", (locale_t)0);
+}
+
+/**
+ * Rare inputs go to libc, which is exact but slow. It parses in the "C"
+ * locale, as the program's LC_NUMERIC may not use '.' for the point.
+ */
+static error_t
+_fallback(double *v, size_t len, const uint8_t *s, bool f4)
+{
+    pthread_once(&_c_once, _c_init);
+    if (!_c_locale)
+    {
+        return ENOMEM;
+    }
+
+    char stack[64];
+    char *buf = len < sizeof(stack) ? stack : memget(len + 1);
+    if (!buf)
+    {
+        return ENOMEM;
+    }
+    memcpy(buf, s, len);
+    buf[len] = '\0';
+    *v = f4 ? strtof_l(buf, NULL, _c_locale)
+            : strtod_l(buf, NULL, _c_locale);
+    if (buf != stack)
+    {
+        memput(buf);
+    }
+    return 0;
+}
+
+error_t
+parse_f8(double *v, size_t len, const uint8_t *s)
+{
+    decimal_t dec;
+    error_t err = _parse_decimal(&dec, len, s);
+    if (err)
+    {
+        return err;
+    }
+    if (dec.special)
+    {
+        *v = dec.value;
+        return 0;
+    }
+
+    double r;
+    if (!dec.man || dec.exp < POW10_MIN_EXP - 19)
+    {
+        r = 0.0;
+    }
+    else if (dec.exp > POW10_MAX_EXP)
+    {
+        r = INFINITY;
+    }
+    else if (!dec.trunc && dec.man <= (1ULL << 53) && dec.exp >= -22 && dec.exp <= 22)
+    {
+        // Both exact, so one rounding
+        r = (double)dec.man;
+        r = dec.exp < 0 ? r / _pow10_f8[-dec.exp] : r * _pow10_f8[dec.exp];
+    }
+    else
+    {
+        uint64_t m1, e1, m2, e2;
+        bool ok = _eisel_lemire(dec.man, dec.exp, 52, 1023, &m1, &e1);
+        // Dropped digits: the answer holds if man and man + 1 agree
+        if (ok && dec.trunc)
+        {
+            ok = _eisel_lemire(dec.man + 1, dec.exp, 52, 1023, &m2, &e2)
+                 && m1 == m2 && e1 == e2;
+        }
+        if (!ok)
+        {
+            return _fallback(v, len, s, false);
+        }
+        uint64_t bits = (e1 << 52) | m1;
+        memcpy(&r, &bits, sizeof(r));
+    }
+
+    *v = dec.neg ? -r : r;
+    return 0;
+}
+
+error_t
+parse_f4(float *v, size_t len, const uint8_t *s)
+{
+    decimal_t dec;
+    error_t err = _parse_decimal(&dec, len, s);
+    if (err)
+    {
+        return err;
+    }
+    if (dec.special)
+    {
+        *v = (float)dec.value;
+        return 0;
+    }
+
+    float r;
+    if (!dec.man || dec.exp < POW10_MIN_EXP - 19)
+    {
+        r = 0.0f;
+    }
+    else if (dec.exp > POW10_MAX_EXP)
+    {
+        r = INFINITY;
+    }
+    else if (!dec.trunc && dec.man <= (1ULL << 24) && dec.exp >= -10 && dec.exp <= 10)
+    {
+        r = (float)dec.man;
+        r = dec.exp < 0 ? r / _pow10_f4[-dec.exp] : r * _pow10_f4[dec.exp];
+    }
+    else
+    {
+        uint64_t m1, e1, m2, e2;
+        bool ok = _eisel_lemire(dec.man, dec.exp, 23, 127, &m1, &e1);
+        if (ok && dec.trunc)
+        {
+            ok = _eisel_lemire(dec.man + 1, dec.exp, 23, 127, &m2, &e2)
+                 && m1 == m2 && e1 == e2;
+        }
+        if (!ok)
+        {
+            double f;
+            err = _fallback(&f, len, s, true);
+            *v = (float)f;
+            return err;
+        }
+        uint32_t bits = (uint32_t)((e1 << 23) | m1);
+        memcpy(&r, &bits, sizeof(r));
+    }
+
+    *v = dec.neg ? -r : r;
+    return 0;
+}
+
+error_t
+parse_data(data_t *d, enum data_type type, size_t len, const uint8_t *s)
+{
+    static const int64_t lim[] =
+    {
+        [DATA_I1] = INT8_MAX, [DATA_I2] = INT16_MAX, [DATA_I4] = INT32_MAX,
+        [DATA_U1] = UINT8_MAX, [DATA_U2] = UINT16_MAX, [DATA_U4] = UINT32_MAX,
+    };
+    error_t err;
+    int64_t i;
+    uint64_t u;
+
+    switch (type)
+    {
+        case DATA_I1:
+        case DATA_I2:
+        case DATA_I4:
+            err = parse_i8(&i, len, s);
+            if (!err && (i > lim[type] || i < -lim[type] - 1))
+            {
+                err = ERANGE;
+            }
+            if (!err)
+            {
+                *d = mk_imm(type, (uint32_t)(int32_t)i);
+            }
+            return err;
+        case DATA_U1:
+        case DATA_U2:
+        case DATA_U4:
+            err = parse_u8(&u, len, s);
+            if (!err && u > (uint64_t)lim[type])
+            {
+                err = ERANGE;
+            }
+            if (!err)
+            {
+                *d = mk_imm(type, (uint32_t)u);
+            }
+            return err;
+        case DATA_I8:
+            err = parse_i8(&i, len, s);
+            return err ? err : mk_i8(d, i);
+        case DATA_U8:
+            err = parse_u8(&u, len, s);
+            return err ? err : mk_u8(d, u);
+        case DATA_I:
+            err = parse_i8(&i, len, s);
+            if (ERANGE == err)
+            {
+                return _parse_big(d, type, len, s);
+            }
+            return err ? err : mk_int(d, i);
+        case DATA_U:
+            err = parse_u8(&u, len, s);
+            if (ERANGE == err)
+            {
+                return _parse_big(d, type, len, s);
+            }
+            return err ? err : mk_uint(d, u);
+        case DATA_F4:
+            {
+                float f;
+                err = parse_f4(&f, len, s);
+                if (!err)
+                {
+                    *d = mk_f4(f);
+                }
+                return err;
+            }
+        case DATA_F8:
+            {
+                double f;
+                err = parse_f8(&f, len, s);
+                if (!err)
+                {
+                    *d = mk_f8(f);
+                }
+                return err;
+            }
+        default:
+            return EINVAL;
+    }
+}
+
+
+/*******************************************************************************
+ * INTEGER PRINTING
+ ******************************************************************************/
+
+/**
+ * Digit count from the bit length; v | 1 keeps zero at one digit.
+ */
+static size_t
+_ndigits(uint64_t v)
+{
+    uint64_t w = v | 1;
+    size_t t = ((64 - (size_t)__builtin_clzll(w)) * 1233) >> 12;
+    return t + (w >= _pow10_u64[t]);
+}
+
+/**
+ * Write exactly n digits of v ending at buf + n, two at a time.
+ */
+static void
+_put_digits(uint8_t *buf, size_t n, uint64_t v)
+{
+    uint8_t *p = buf + n;
+    while (v >= 100)
+    {
+        unsigned r = (unsigned)(v % 100);
+        v /= 100;
+        p -= 2;
+        memcpy(p, _digits2 + 2 * r, 2);
+    }
+    if (v >= 10)
+    {
+        p -= 2;
+        memcpy(p, _digits2 + 2 * v, 2);
+    }
+    else
+    {
+        *--p = (uint8_t)('0' + v);
+    }
+    // Leading zeros, if n was wider than v
+    while (p > buf)
+    {
+        *--p = '0';
+    }
+}
+
+size_t
+fmt_u8(uint8_t *buf, uint64_t v)
+{
+    size_t n = _ndigits(v);
+    _put_digits(buf, n, v);
+    return n;
+}
+
+size_t
+fmt_i8(uint8_t *buf, int64_t v)
+{
+    if (v < 0)
+    {
+        *buf = '-';
+        return 1 + fmt_u8(buf + 1, -(uint64_t)v);
+    }
+    return fmt_u8(buf, (uint64_t)v);
+}
+
+
+/*******************************************************************************
+ * FLOAT PRINTING
+ *
+ * Ryu: compute the interval of decimals that read back to the value, then
+ * drop digits while both ends still agree.
+ ******************************************************************************/
+
+typedef struct
+{
+    uint64_t digits;
+    int32_t exp;
+} shortest_t;
+
+static uint32_t
+_pow5bits(int32_t e)
+{
+    return (((uint32_t)e * 1217359) >> 19) + 1;
+}
+
+static uint32_t
+_log10pow2(int32_t e)
+{
+    return ((uint32_t)e * 78913) >> 18;
+}
+
+static uint32_t
+_log10pow5(int32_t e)
+{
+    return ((uint32_t)e * 732923) >> 20;
+}
+
+static bool
+_multipleofpow5(uint64_t v, uint32_t p)
+{
+    uint32_t count = 0;
+    for (; v && 0 == v % 5; v /= 5)
+    {
+        ++count;
+    }
+    return count >= p;
+}
+
+static bool
+_multipleofpow2(uint64_t v, uint32_t p)
+{
+    return 0 == (v & ((1ULL << p) - 1));
+}
+
+static uint64_t
+_mulshift(uint64_t m, const uint64_t *mul, int32_t j)
+{
+    u128_t b0 = (u128_t)m * mul[0];
+    u128_t b2 = (u128_t)m * mul[1];
+    return (uint64_t)(((b0 >> 64) + b2) >> (j - 64));
+}
+
+static shortest_t
+_shortest(uint64_t ieeemant, uint32_t ieeeexp, int32_t mantbits, int32_t bias)
+{
+    int32_t e2;
+    uint64_t m2;
+    if (!ieeeexp)
+    {
+        e2 = 1 - bias - mantbits - 2;
+        m2 = ieeemant;
+    }
+    else
+    {
+        e2 = (int32_t)ieeeexp - bias - mantbits - 2;
+        m2 = (1ULL << mantbits) | ieeemant;
+    }
+
+    const bool accept = 0 == (m2 & 1);
+    const uint64_t mv = 4 * m2;
+    const uint32_t mmshift = ieeemant || ieeeexp <= 1;
+
+    uint64_t vr;
+    uint64_t vp;
+    uint64_t vm;
+    int32_t e10;
+    bool vmzeros = false;
+    bool vrzeros = false;
+
+    if (e2 >= 0)
+    {
+        uint32_t q = _log10pow2(e2) - (e2 > 3);
+        int32_t k = POW5_INV_BITS + (int32_t)_pow5bits((int32_t)q) - 1;
+        int32_t i = -e2 + (int32_t)q + k;
+        e10 = (int32_t)q;
+        vr = _mulshift(4 * m2, _pow5_inv[q], i);
+        vp = _mulshift(4 * m2 + 2, _pow5_inv[q], i);
+        vm = _mulshift(4 * m2 - 1 - mmshift, _pow5_inv[q], i);
+        if (q <= 21)
+        {
+            if (0 == mv % 5)
+            {
+                vrzeros = _multipleofpow5(mv, q);
+            }
+            else if (accept)
+            {
+                vmzeros = _multipleofpow5(mv - 1 - mmshift, q);
+            }
+            else
+            {
+                vp -= _multipleofpow5(mv + 2, q);
+            }
+        }
+    }
+    else
+    {
+        uint32_t q = _log10pow5(-e2) - (-e2 > 1);
+        int32_t i = -e2 - (int32_t)q;
+        int32_t k = (int32_t)_pow5bits(i) - POW5_BITS;
+        int32_t j = (int32_t)q - k;
+        e10 = (int32_t)q + e2;
+        vr = _mulshift(4 * m2, _pow5[i], j);
+        vp = _mulshift(4 * m2 + 2, _pow5[i], j);
+        vm = _mulshift(4 * m2 - 1 - mmshift, _pow5[i], j);
+        if (q <= 1)
+        {
+            vrzeros = true;
+            if (accept)
+            {
+                vmzeros = 1 == mmshift;
+            }
+            else
+            {
+                --vp;
+            }
+        }
+        else if (q < 63)
+        {
+            vrzeros = _multipleofpow2(mv, q);
+        }
+    }
+
+    int32_t removed = 0;
+    uint8_t last = 0;
+    uint64_t out;
+
+    if (vmzeros || vrzeros)
+    {
+        // Exact ends matter, track the removed digits
+        while (vp / 10 > vm / 10)
+        {
+            vmzeros &= 0 == vm % 10;
+            vrzeros &= 0 == last;
+            last = (uint8_t)(vr % 10);
+            vr /= 10;
+            vp /= 10;
+            vm /= 10;
+            ++removed;
+        }
+        if (vmzeros)
+        {
+            while (0 == vm % 10)
+            {
+                vrzeros &= 0 == last;
+                last = (uint8_t)(vr % 10);
+                vr /= 10;
+                vp /= 10;
+                vm /= 10;
+                ++removed;
+            }
+        }
+        // Round half to even
+        if (vrzeros && 5 == last && 0 == vr % 2)
+        {
+            last = 4;
+        }
+        out = vr + ((vr == vm && (!accept || !vmzeros)) || last >= 5);
+    }
+    else
+    {
+        bool up = false;
+        while (vp / 10 > vm / 10)
+        {
+            up = vr % 10 >= 5;
+            vr /= 10;
+            vp /= 10;
+            vm /= 10;
+            ++removed;
+        }
+        out = vr + (vr == vm || up);
+    }
+
+    return (shortest_t){ out, e10 + removed };
+}
+
+/**
+ * Plain notation for exponents in [-4, 16), like Python's repr.
+ */
+static size_t
+_render(uint8_t *buf, bool neg, shortest_t s)
+{
+    uint8_t digits[20];
+    size_t n = fmt_u8(digits, s.digits);
+    int32_t x = s.exp + (int32_t)n - 1;
+    uint8_t *p = buf;
+
+    if (neg)
+    {
+        *p++ = '-';
+    }
+
+    if (x >= -4 && x < 16)
+    {
+        if (s.exp >= 0)
+        {
+            memcpy(p, digits, n);
+            p += n;
+            memset(p, '0', (size_t)s.exp);
+            p += s.exp;
+            memcpy(p, ".0", 2);
+            p += 2;
+        }
+        else if (x >= 0)
+        {
+            memcpy(p, digits, (size_t)x + 1);
+            p += x + 1;
+            *p++ = '.';
+            memcpy(p, digits + x + 1, n - (size_t)x - 1);
+            p += n - (size_t)x - 1;
+        }
+        else
+        {
+            memcpy(p, "0.", 2);
+            p += 2;
+            memset(p, '0', (size_t)(-x - 1));
+            p += -x - 1;
+            memcpy(p, digits, n);
+            p += n;
+        }
+    }
+    else
+    {
+        *p++ = digits[0];
+        if (n > 1)
+        {
+            *p++ = '.';
+            memcpy(p, digits + 1, n - 1);
+            p += n - 1;
+        }
+        *p++ = 'e';
+        *p++ = x < 0 ? '-' : '+';
+        uint32_t ax = (uint32_t)(x < 0 ? -x : x);
+        if (ax < 10)
+        {
+            *p++ = '0';
+        }
+        p += fmt_u8(p, ax);
+    }
+
+    return (size_t)(p - buf);
+}
+
+static size_t
+_special(uint8_t *buf, bool neg, bool nan)
+{
+    if (nan)
+    {
+        memcpy(buf, "nan", 3);
+        return 3;
+    }
+    if (neg)
+    {
+        memcpy(buf, "-inf", 4);
+        return 4;
+    }
+    memcpy(buf, "inf", 3);
+    return 3;
+}
+
+size_t
+fmt_f8(uint8_t *buf, double v)
+{
+    uint64_t bits;
+    memcpy(&bits, &v, sizeof(bits));
+    bool neg = bits >> 63;
+    uint64_t mant = bits & ((1ULL << 52) - 1);
+    uint32_t exp = (uint32_t)((bits >> 52) & 0x7FF);
+
+    if (0x7FF == exp)
+    {
+        return _special(buf, neg, 0 != mant);
+    }
+    if (!exp && !mant)
+    {
+        return _render(buf, neg, (shortest_t){ 0, 0 });
+    }
+    return _render(buf, neg, _shortest(mant, exp, 52, 1023));
+}
+
+size_t
+fmt_f4(uint8_t *buf, float v)
+{
+    uint32_t bits;
+    memcpy(&bits, &v, sizeof(bits));
+    bool neg = bits >> 31;
+    uint64_t mant = bits & ((1U << 23) - 1);
+    uint32_t exp = (bits >> 23) & 0xFF;
+
+    if (0xFF == exp)
+    {
+        return _special(buf, neg, 0 != mant);
+    }
+    if (!exp && !mant)
+    {
+        return _render(buf, neg, (shortest_t){ 0, 0 });
+    }
+    return _render(buf, neg, _shortest(mant, exp, 23, 127));
+}
+
+
+/*******************************************************************************
+ * VALUES
+ ******************************************************************************/
+
+/**
+ * Big integers by 19 digit chunks, least significant first.
+ */
+static error_t
+_format_big(bin_t *out, data_t d)
+{
+    binbuilder_t bb;
+    uint64_t *chunks = NULL;
+    size_t len = 0;
+    size_t cap = 0;
+    bool neg;
+    const uint64_t *limbs;
+    uint64_t one;
+    error_t err = 0;
+
+    data_int_limbs(&d, &neg, &limbs, &one);
+    const bool sign = neg;
+    data_t q = data_ref(d);
+    do
+    {
+        data_t next;
+        uint64_t rem;
+        err = data_int_divmod_small(&next, &rem, q, _pow10_u64[19]);
+        un_data(q);
+        if (err)
+        {
+            memput(chunks);
+            return err;
+        }
+        q = next;
+
+        if (len == cap)
+        {
+            cap = cap ? meminc(cap) : 8;
+            uint64_t *c = memreget(chunks, cap * sizeof(*c));
+            if (!c)
+            {
+                un_data(q);
+                memput(chunks);
+                return ENOMEM;
+            }
+            chunks = c;
+        }
+        chunks[len++] = rem;
+    } while (data_int_limbs(&q, &neg, &limbs, &one));
+    un_data(q);
+
+    binbuilder_init(&bb);
+    uint8_t buf[FMT_MAX];
+    size_t n = 0;
+    if (sign)
+    {
+        buf[n++] = '-';
+    }
+    n += fmt_u8(buf + n, chunks[--len]);
+    err = binbuilder_add(&bb, n, buf);
+    while (!err && len)
+    {
+        _put_digits(buf, 19, chunks[--len]);
+        err = binbuilder_add(&bb, 19, buf);
+    }
+    if (!err)
+    {
+        err = binbuilder_finish(&bb, out);
+    }
+    binbuilder_destroy(&bb);
+    memput(chunks);
+    return err;
+}
+
+error_t
+data_format(bin_t *out, data_t d)
+{
+    uint8_t buf[FMT_MAX];
+    size_t n;
+    enum data_type type = data_typeof(d);
+
+    switch (type)
+    {
+        case DATA_I1:
+        case DATA_I2:
+        case DATA_I4:
+            n = fmt_i8(buf, data_i4(d));
+            break;
+        case DATA_U1:
+        case DATA_U2:
+        case DATA_U4:
+            n = fmt_u8(buf, data_u4(d));
+            break;
+        case DATA_I8:
+            n = fmt_i8(buf, data_i8(d));
+            break;
+        case DATA_U8:
+            n = fmt_u8(buf, data_u8(d));
+            break;
+        case DATA_I:
+        case DATA_U:
+            if (data_isobj(d))
+            {
+                return _format_big(out, d);
+            }
+            n = DATA_I == type ? fmt_i8(buf, data_payload_signed(d))
+                               : fmt_u8(buf, d.bits & DATA_PAYLOAD);
+            break;
+        case DATA_F4:
+            n = fmt_f4(buf, data_f4(d));
+            break;
+        case DATA_F8:
+            n = fmt_f8(buf, data_f8(d));
+            break;
+        case DATA_BOOL:
+            return data_bool(d) ? mk_bin(out, 4, (const uint8_t *)"true")
+                                : mk_bin(out, 5, (const uint8_t *)"false");
+        case DATA_SYM:
+            {
+                const uint8_t *s = data_sym(&d, &n);
+                return mk_bin(out, n, s);
+            }
+        case DATA_BIN:
+            {
+                const bin_t *b = data_bin(d);
+                if (!b)
+                {
+                    return ENOMEM;
+                }
+                *out = bin_ref(*b);
+                return 0;
+            }
+        default:
+            return EINVAL;
+    }
+
+    return mk_bin(out, n, buf);
+}
@@ -0,0 +1,442 @@
+/*******************************************************************************
+ * Copyright (c) 2022 Craig Jacobson
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ ******************************************************************************/
+/**
+ * @file pipeline.c
+ * @author Craig Jacobson
+ * @brief Spawning and reaping pipelines, and zero-copy forwarding.
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <spawn.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "pipeline.h"
+#include "symmem.h"
+
+
+#define PIPE_CHUNK (64 * 1024)
+
+extern char **environ;
+
+
+/*******************************************************************************
+ * PROCESSES
+ ******************************************************************************/
+
+static void
+_close(int *fd)
+{
+    if (*fd >= 0)
+    {
+        close(*fd);
+        *fd = -1;
+    }
+}
+
+static int
+_code(int status)
+{
+    if (WIFSIGNALED(status))
+    {
+        return 128 + WTERMSIG(status);
+    }
+    return WEXITSTATUS(status);
+}
+
+static error_t
+_reap(evloop_t *ev, pid_t pid, int *code)
+{
+    int status;
+    error_t err = 0;
+    if (ev)
+    {
+        err = ev_waitpid(ev, pid, &status);
+    }
+    else
+    {
+        while (waitpid(pid, &status, 0) < 0)
+        {
+            if (EINTR != errno)
+            {
+                err = errno;
+                break;
+            }
+        }
+    }
+    *code = err ? -1 : _code(status);
+    return err;
+}
+
+/**
+ * Spawn argv reading from in and writing to out; our pipes are all
+ * close-on-exec so only these two are inherited.
+ */
+static error_t
+_spawn(pid_t *pid, char *const *argv, int in, int out)
+{
+    posix_spawn_file_actions_t fa;
+    error_t err = posix_spawn_file_actions_init(&fa);
+    if (err)
+    {
+        return err;
+    }
+    if (in >= 0 && STDIN_FILENO != in)
+    {
+        err = posix_spawn_file_actions_adddup2(&fa, in, STDIN_FILENO);
+    }
+    if (!err && out >= 0 && STDOUT_FILENO != out)
+    {
+        err = posix_spawn_file_actions_adddup2(&fa, out, STDOUT_FILENO);
+    }
+    if (!err)
+    {
+        err = posix_spawnp(pid, argv[0], &fa, NULL, argv, environ);
+    }
+    posix_spawn_file_actions_destroy(&fa);
+    return err;
+}
+
+error_t
+pipeline_start(pipeline_t *p, size_t n, char *const *const *argvs, int in, int out)
+{
+    p->n = 0;
+    p->in = -1;
+    p->out = -1;
+    if (!n)
+    {
+        return EINVAL;
+    }
+    p->pids = memget(n * sizeof(p->pids[0]));
+    p->codes = memget(n * sizeof(p->codes[0]));
+    if (!p->pids || !p->codes)
+    {
+        memput(p->pids);
+        memput(p->codes);
+        return ENOMEM;
+    }
+
+    error_t err = 0;
+    int fds[2];
+    int first_in = in;
+    int last_out = out;
+    if (PIPELINE_PIPE == in)
+    {
+        if (pipe2(fds, O_CLOEXEC))
+        {
+            err = errno;
+        }
+        else
+        {
+            first_in = fds[0];
+            p->in = fds[1];
+        }
+    }
+    if (!err && PIPELINE_PIPE == out)
+    {
+        if (pipe2(fds, O_CLOEXEC))
+        {
+            err = errno;
+        }
+        else
+        {
+            last_out = fds[1];
+            p->out = fds[0];
+        }
+    }
+
+    // Read end for the next stage
+    int next = first_in;
+    for (size_t i = 0; i < n && !err; ++i)
+    {
+        int stage_in = next;
+        int stage_out = last_out;
+        next = -1;
+        if (i + 1 < n)
+        {
+            if (pipe2(fds, O_CLOEXEC))
+            {
+                err = errno;
+                if (i)
+                {
+                    close(stage_in);
+                }
+                break;
+            }
+            stage_out = fds[1];
+            next = fds[0];
+        }
+        err = _spawn(&p->pids[i], argvs[i], stage_in, stage_out);
+        if (!err)
+        {
+            p->n = i + 1;
+        }
+        // The children have their own copies of the ends made for them
+        if (i)
+        {
+            close(stage_in);
+        }
+        if (i + 1 < n)
+        {
+            close(stage_out);
+        }
+    }
+    if (next != first_in)
+    {
+        _close(&next);
+    }
+    if (PIPELINE_PIPE == in)
+    {
+        _close(&first_in);
+    }
+    if (PIPELINE_PIPE == out)
+    {
+        _close(&last_out);
+    }
+
+    if (err)
+    {
+        // Those started may never touch the broken pipes; stop them
+        _close(&p->in);
+        _close(&p->out);
+        for (size_t i = 0; i < p->n; ++i)
+        {
+            kill(p->pids[i], SIGTERM);
+            _reap(NULL, p->pids[i], &p->codes[i]);
+        }
+        memput(p->pids);
+        memput(p->codes);
+        p->n = 0;
+    }
+    return err;
+}
+
+error_t
+pipeline_wait(pipeline_t *p, evloop_t *ev, bool pipefail, int *code)
+{
+    error_t err = 0;
+    *code = 0;
+    for (size_t i = 0; i < p->n; ++i)
+    {
+        error_t e = _reap(ev, p->pids[i], &p->codes[i]);
+        err = err ? err : e;
+        if (pipefail ? 0 != p->codes[i] : i + 1 == p->n)
+        {
+            *code = p->codes[i];
+        }
+    }
+    return err;
+}
+
+void
+pipeline_destroy(pipeline_t *p)
+{
+    _close(&p->in);
+    _close(&p->out);
+    if (p->n)
+    {
+        memput(p->pids);
+        memput(p->codes);
+    }
+    p->n = 0;
+}
+
+
+/*******************************************************************************
+ * FORWARDING
+ ******************************************************************************/
+
+/**
+ * Write all of buf, for when the kernel cannot move it for us.
+ */
+static error_t
+_write(int to, const uint8_t *buf, size_t len)
+{
+    while (len)
+    {
+        ssize_t put = write(to, buf, len);
+        if (put < 0)
+        {
+            if (EINTR == errno)
+            {
+                continue;
+            }
+            return errno;
+        }
+        buf += put;
+        len -= (size_t)put;
+    }
+    return 0;
+}
+
+/**
+ * Copy through a buffer, writing to copy as well when it is not -1.
+ */
+static error_t
+_copy(int from, int to, int copy, size_t *moved)
+{
+    uint8_t *buf = memget(PIPE_CHUNK);
+    if (!buf)
+    {
+        return ENOMEM;
+    }
+    error_t err = 0;
+    for (;;)
+    {
+        ssize_t got = read(from, buf, PIPE_CHUNK);
+        if (got < 0 && EINTR == errno)
+        {
+            continue;
+        }
+        if (got <= 0)
+        {
+            err = got ? errno : 0;
+            break;
+        }
+        err = _write(to, buf, (size_t)got);
+        if (!err && copy >= 0)
+        {
+            err = _write(copy, buf, (size_t)got);
+        }
+        if (err)
+        {
+            break;
+        }
+        *moved += (size_t)got;
+    }
+    memput(buf);
+    return err;
+}
+
+/**
+ * Move exactly len bytes already waiting in the pipe from.
+ */
+static error_t
+_drain(int from, int to, size_t len)
+{
+    uint8_t buf[4096];
+    bool spliced = true;
+    while (len)
+    {
+        ssize_t n;
+        if (spliced)
+        {
+            n = splice(from, NULL, to, NULL, len, SPLICE_F_MOVE);
+            if (n < 0 && EINVAL == errno)
+            {
+                spliced = false;
+                continue;
+            }
+        }
+        else
+        {
+            n = read(from, buf, len < sizeof(buf) ? len : sizeof(buf));
+            if (n > 0)
+            {
+                error_t err = _write(to, buf, (size_t)n);
+                if (err)
+                {
+                    return err;
+                }
+            }
+        }
+        if (n < 0)
+        {
+            if (EINTR == errno)
+            {
+                continue;
+            }
+            return errno;
+        }
+        if (!n)
+        {
+            return EIO;
+        }
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+error_t
+pipe_forward(int from, int to, size_t *moved)
+{
+    *moved = 0;
+    for (;;)
+    {
+        ssize_t n = splice(from, NULL, to, NULL, PIPE_CHUNK, SPLICE_F_MOVE | SPLICE_F_MORE);
+        if (n > 0)
+        {
+            *moved += (size_t)n;
+            continue;
+        }
+        if (!n)
+        {
+            return 0;
+        }
+        if (EINTR == errno)
+        {
+            continue;
+        }
+        // Neither side a pipe, or a file system that cannot splice
+        if (EINVAL == errno && !*moved)
+        {
+            return _copy(from, to, -1, moved);
+        }
+        return errno;
+    }
+}
+
+error_t
+pipe_tee(int from, int to, int copy, size_t *moved)
+{
+    *moved = 0;
+    for (;;)
+    {
+        ssize_t n = tee(from, to, PIPE_CHUNK, 0);
+        if (!n)
+        {
+            return 0;
+        }
+        if (n < 0)
+        {
+            if (EINTR == errno)
+            {
+                continue;
+            }
+            if (EINVAL == errno && !*moved)
+            {
+                return _copy(from, to, copy, moved);
+            }
+            return errno;
+        }
+        // What tee duplicated is still in from; drain it into copy
+        error_t err = _drain(from, copy, (size_t)n);
+        if (err)
+        {
+            return err;
+        }
+        *moved += (size_t)n;
+    }
+}
+
@@ -0,0 +1,764 @@
+/*******************************************************************************
+ * Copyright (c) 2022 Craig Jacobson
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ ******************************************************************************/
+/**
+ * @file scheduler.c
+ * @author Craig Jacobson
+ * @brief Work-stealing scheduler with Chase-Lev deques.
+ */
+#include <errno.h>
+
+#include "machine.h"
+#include "scheduler.h"
+#include "symmem.h"
+
+
+#define DEQUE_MIN 64
+#define FOR_SPLITS 64
+#define SPARES_MAX 256
+
+struct task
+{
+    struct task *next; // In the central queue
+    sched_t *sched;
+    task_fn_t fn;
+    sched_body_t body; // Instead of fn, over [lo, hi)
+    void *arg;
+    size_t lo;
+    size_t hi;
+    size_t grain;
+    data_t result;
+    error_t err;
+    uint32_t refs; // The queue's and the handle's
+    bool done;
+    size_t ncaptured;
+    data_t captured[];
+};
+
+typedef struct dequebuf
+{
+    struct dequebuf *prev; // Outgrown, kept until the deque goes
+    size_t mask;
+    task_t *slots[];
+} dequebuf_t;
+
+typedef struct
+{
+    int64_t top;
+    int64_t bottom;
+    dequebuf_t *buf;
+} deque_t;
+
+struct worker
+{
+    sched_t *sched;
+    pthread_t thread;
+    deque_t deque;
+    uint64_t rng;
+};
+
+/**
+ * Stands in for a pool thread blocked in sched_wait. Spare i runs tasks
+ * while more than i pool threads are blocked, and sleeps otherwise.
+ */
+struct spare
+{
+    struct spare *next;
+    sched_t *sched;
+    pthread_t thread;
+    size_t index;
+};
+
+static _Thread_local struct worker *_self;
+static _Thread_local sched_t *_pool; // Whose worker or spare we are
+
+
+/*******************************************************************************
+ * DEQUE
+ *
+ * Only the owner pushes and pops, at the bottom; thieves take from the
+ * top. The owner and a thief only contend for the last task, which the
+ * compare and swap on top settles.
+ ******************************************************************************/
+
+static dequebuf_t *
+_dequebuf(size_t cap, dequebuf_t *prev)
+{
+    dequebuf_t *buf = memget(sizeof(*buf) + cap * sizeof(buf->slots[0]));
+    if (buf)
+    {
+        buf->prev = prev;
+        buf->mask = cap - 1;
+    }
+    return buf;
+}
+
+static error_t
+_deque_init(deque_t *d)
+{
+    d->top = 0;
+    d->bottom = 0;
+    d->buf = _dequebuf(DEQUE_MIN, NULL);
+    return d->buf ? 0 : ENOMEM;
+}
+
+static void
+_deque_destroy(deque_t *d)
+{
+    dequebuf_t *buf = d->buf;
+    while (buf)
+    {
+        dequebuf_t *prev = buf->prev;
+        memput(buf);
+        buf = prev;
+    }
+}
+
+static error_t
+_deque_push(deque_t *d, task_t *t)
+{
+    int64_t b = __atomic_load_n(&d->bottom, __ATOMIC_RELAXED);
+    int64_t top = __atomic_load_n(&d->top, __ATOMIC_ACQUIRE);
+    dequebuf_t *buf = __atomic_load_n(&d->buf, __ATOMIC_RELAXED);
+
+    if ((size_t)(b - top) > buf->mask)
+    {
+        dequebuf_t *grown = _dequebuf(2 * (buf->mask + 1), buf);
+        if (!grown)
+        {
+            return ENOMEM;
+        }
+        for (int64_t i = top; i < b; ++i)
+        {
+            task_t *x = __atomic_load_n(&buf->slots[i & buf->mask], __ATOMIC_RELAXED);
+            __atomic_store_n(&grown->slots[i & grown->mask], x, __ATOMIC_RELAXED);
+        }
+        __atomic_store_n(&d->buf, grown, __ATOMIC_RELEASE);
+        buf = grown;
+    }
+    __atomic_store_n(&buf->slots[b & buf->mask], t, __ATOMIC_RELAXED);
+    __atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+static task_t *
+_deque_pop(deque_t *d)
+{
+    int64_t b = __atomic_load_n(&d->bottom, __ATOMIC_RELAXED) - 1;
+    dequebuf_t *buf = __atomic_load_n(&d->buf, __ATOMIC_RELAXED);
+    __atomic_store_n(&d->bottom, b, __ATOMIC_SEQ_CST);
+    int64_t top = __atomic_load_n(&d->top, __ATOMIC_SEQ_CST);
+
+    if (top > b)
+    {
+        __atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+    task_t *t = __atomic_load_n(&buf->slots[b & buf->mask], __ATOMIC_RELAXED);
+    if (top == b)
+    {
+        // Last one, race the thieves for it
+        if (!__atomic_compare_exchange_n(&d->top, &top, top + 1, false,
+                                         __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+        {
+            t = NULL;
+        }
+        __atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELAXED);
+    }
+    return t;
+}
+
+static task_t *
+_deque_steal(deque_t *d)
+{
+    int64_t top = __atomic_load_n(&d->top, __ATOMIC_SEQ_CST);
+    int64_t b = __atomic_load_n(&d->bottom, __ATOMIC_SEQ_CST);
+    if (top >= b)
+    {
+        return NULL;
+    }
+    dequebuf_t *buf = __atomic_load_n(&d->buf, __ATOMIC_ACQUIRE);
+    task_t *t = __atomic_load_n(&buf->slots[top & buf->mask], __ATOMIC_RELAXED);
+    if (!__atomic_compare_exchange_n(&d->top, &top, top + 1, false,
+                                     __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+    {
+        return NULL;
+    }
+    return t;
+}
+
+
+/*******************************************************************************
+ * TASKS
+ ******************************************************************************/
+
+static void
+_task_release(task_t *t)
+{
+    if (refs_dec(&t->refs))
+    {
+        memput(t);
+    }
+}
+
+/**
+ * Note new work or a finished task, waking whoever sleeps.
+ */
+static void
+_kick(sched_t *s)
+{
+    __atomic_add_fetch(&s->epoch, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&s->sleepers, __ATOMIC_SEQ_CST))
+    {
+        pthread_mutex_lock(&s->lock);
+        pthread_cond_broadcast(&s->wake);
+        pthread_mutex_unlock(&s->lock);
+    }
+}
+
+/**
+ * Sleep until the epoch moves on from seen, or for pool threads, until
+ * the scheduler stops.
+ */
+static void
+_sleep(sched_t *s, uint64_t seen, bool pooled)
+{
+    pthread_mutex_lock(&s->lock);
+    __atomic_add_fetch(&s->sleepers, 1, __ATOMIC_SEQ_CST);
+    while (seen == __atomic_load_n(&s->epoch, __ATOMIC_SEQ_CST)
+           && !(pooled && s->stop))
+    {
+        pthread_cond_wait(&s->wake, &s->lock);
+    }
+    __atomic_sub_fetch(&s->sleepers, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&s->lock);
+}
+
+static error_t
+_for(sched_t *s, size_t lo, size_t hi, size_t grain, sched_body_t body, void *arg);
+
+static void
+_run(task_t *t)
+{
+    if (t->body)
+    {
+        t->err = _for(t->sched, t->lo, t->hi, t->grain, t->body, t->arg);
+    }
+    else
+    {
+        t->err = t->fn(&t->result, t->ncaptured, t->captured);
+    }
+    for (size_t i = 0; i < t->ncaptured; ++i)
+    {
+        un_data(t->captured[i]);
+    }
+    sched_t *s = t->sched;
+    __atomic_store_n(&t->done, true, __ATOMIC_RELEASE);
+    _task_release(t);
+    _kick(s);
+}
+
+static uint64_t
+_next(uint64_t *rng)
+{
+    *rng ^= *rng << 13;
+    *rng ^= *rng >> 7;
+    *rng ^= *rng << 17;
+    return *rng;
+}
+
+/**
+ * Some task to run: our own newest, else the oldest queued, else stolen.
+ */
+static task_t *
+_find(sched_t *s, struct worker *self)
+{
+    task_t *t = NULL;
+    if (self)
+    {
+        t = _deque_pop(&self->deque);
+        if (t)
+        {
+            return t;
+        }
+    }
+
+    if (__atomic_load_n(&s->queue, __ATOMIC_RELAXED))
+    {
+        pthread_mutex_lock(&s->lock);
+        t = s->queue;
+        if (t)
+        {
+            __atomic_store_n(&s->queue, t->next, __ATOMIC_RELAXED);
+            if (!t->next)
+            {
+                s->queue_tail = NULL;
+            }
+        }
+        pthread_mutex_unlock(&s->lock);
+        if (t)
+        {
+            return t;
+        }
+    }
+
+    uint64_t seed = (uint64_t)(uintptr_t)&t;
+    uint64_t *rng = self ? &self->rng : &seed;
+    size_t start = (size_t)(_next(rng) % s->nworkers);
+    for (size_t i = 0; i < s->nworkers && !t; ++i)
+    {
+        struct worker *victim = &s->workers[(start + i) % s->nworkers];
+        if (victim != self)
+        {
+            t = _deque_steal(&victim->deque);
+        }
+    }
+    return t;
+}
+
+static void *
+_work(void *arg)
+{
+    struct worker *self = arg;
+    sched_t *s = self->sched;
+    _self = self;
+    _pool = s;
+
+    for (;;)
+    {
+        uint64_t seen = __atomic_load_n(&s->epoch, __ATOMIC_SEQ_CST);
+        task_t *t = _find(s, self);
+        if (t)
+        {
+            _run(t);
+            continue;
+        }
+
+        pthread_mutex_lock(&s->lock);
+        bool stop = s->stop && !s->queue;
+        pthread_mutex_unlock(&s->lock);
+        if (stop)
+        {
+            break;
+        }
+        _sleep(s, seen, true);
+    }
+    _self = NULL;
+    _pool = NULL;
+    return NULL;
+}
+
+static void *
+_spare(void *arg)
+{
+    struct spare *sp = arg;
+    sched_t *s = sp->sched;
+    _pool = s;
+
+    for (;;)
+    {
+        uint64_t seen = __atomic_load_n(&s->epoch, __ATOMIC_SEQ_CST);
+        bool needed = sp->index < __atomic_load_n(&s->blocked, __ATOMIC_SEQ_CST);
+        task_t *t = needed ? _find(s, NULL) : NULL;
+        if (t)
+        {
+            _run(t);
+            continue;
+        }
+
+        pthread_mutex_lock(&s->lock);
+        bool stop = s->stop && !needed;
+        pthread_mutex_unlock(&s->lock);
+        if (stop)
+        {
+            break;
+        }
+        _sleep(s, seen, !needed);
+    }
+    _pool = NULL;
+    return NULL;
+}
+
+/**
+ * Count a pool thread as blocked, starting a spare to cover for it.
+ */
+static void
+_block(sched_t *s)
+{
+    pthread_mutex_lock(&s->lock);
+    size_t blocked = __atomic_add_fetch(&s->blocked, 1, __ATOMIC_SEQ_CST);
+    if (s->nspares < blocked && s->nspares < SPARES_MAX)
+    {
+        struct spare *sp = memget(sizeof(*sp));
+        if (sp)
+        {
+            sp->sched = s;
+            sp->index = s->nspares;
+            if (pthread_create(&sp->thread, NULL, _spare, sp))
+            {
+                memput(sp);
+            }
+            else
+            {
+                sp->next = s->spares;
+                s->spares = sp;
+                ++s->nspares;
+            }
+        }
+    }
+    pthread_mutex_unlock(&s->lock);
+    _kick(s);
+}
+
+
+/*******************************************************************************
+ * SCHEDULER
+ ******************************************************************************/
+
+error_t
+sched_init(sched_t *s, size_t workers)
+{
+    if (!workers)
+    {
+        workers = machine()->cores;
+    }
+
+    s->workers = memget(workers * sizeof(s->workers[0]));
+    if (!s->workers)
+    {
+        return ENOMEM;
+    }
+    s->nworkers = workers;
+    __atomic_store_n(&s->queue, NULL, __ATOMIC_RELAXED);
+    s->queue_tail = NULL;
+    s->epoch = 0;
+    s->sleepers = 0;
+    s->blocked = 0;
+    s->spares = NULL;
+    s->nspares = 0;
+    s->stop = false;
+    pthread_mutex_init(&s->lock, NULL);
+    pthread_cond_init(&s->wake, NULL);
+
+    size_t ready;
+    error_t err = 0;
+    for (ready = 0; ready < workers && !err; ++ready)
+    {
+        struct worker *w = &s->workers[ready];
+        w->sched = s;
+        w->rng = 0x9E3779B97F4A7C15ULL * (ready + 1);
+        err = _deque_init(&w->deque);
+    }
+    if (err)
+    {
+        for (size_t i = 0; i + 1 < ready; ++i)
+        {
+            _deque_destroy(&s->workers[i].deque);
+        }
+        memput(s->workers);
+        pthread_cond_destroy(&s->wake);
+        pthread_mutex_destroy(&s->lock);
+        return err;
+    }
+
+    // Deques all exist before any thread can steal from them
+    for (size_t i = 0; i < workers; ++i)
+    {
+        err = pthread_create(&s->workers[i].thread, NULL, _work, &s->workers[i]);
+        if (err)
+        {
+            pthread_mutex_lock(&s->lock);
+            s->stop = true;
+            pthread_cond_broadcast(&s->wake);
+            pthread_mutex_unlock(&s->lock);
+            for (size_t j = 0; j < workers; ++j)
+            {
+                if (j < i)
+                {
+                    pthread_join(s->workers[j].thread, NULL);
+                }
+            }
+            for (size_t j = 0; j < workers; ++j)
+            {
+                _deque_destroy(&s->workers[j].deque);
+            }
+            memput(s->workers);
+            pthread_cond_destroy(&s->wake);
+            pthread_mutex_destroy(&s->lock);
+            return err;
+        }
+    }
+    return 0;
+}
+
+void
+sched_destroy(sched_t *s)
+{
+    pthread_mutex_lock(&s->lock);
+    s->stop = true;
+    pthread_cond_broadcast(&s->wake);
+    pthread_mutex_unlock(&s->lock);
+
+    for (size_t i = 0; i < s->nworkers; ++i)
+    {
+        pthread_join(s->workers[i].thread, NULL);
+    }
+    while (s->spares)
+    {
+        struct spare *sp = s->spares;
+        s->spares = sp->next;
+        pthread_join(sp->thread, NULL);
+        memput(sp);
+    }
+    for (size_t i = 0; i < s->nworkers; ++i)
+    {
+        _deque_destroy(&s->workers[i].deque);
+    }
+    memput(s->workers);
+    pthread_cond_destroy(&s->wake);
+    pthread_mutex_destroy(&s->lock);
+}
+
+static task_t *
+_task(sched_t *s, size_t ncaptured)
+{
+    if (ncaptured > (SIZE_MAX - sizeof(task_t)) / sizeof(data_t))
+    {
+        return NULL;
+    }
+    task_t *task = memget(sizeof(*task) + ncaptured * sizeof(data_t));
+    if (task)
+    {
+        task->next = NULL;
+        task->sched = s;
+        task->fn = NULL;
+        task->body = NULL;
+        task->result = mk_bool(false);
+        task->err = 0;
+        task->refs = 2;
+        task->done = false;
+        task->ncaptured = ncaptured;
+    }
+    return task;
+}
+
+/**
+ * On our own deque if we're one of s's workers, else the central queue.
+ */
+static void
+_push(sched_t *s, task_t *task)
+{
+    struct worker *self = _self;
+    if (!self || self->sched != s || _deque_push(&self->deque, task))
+    {
+        pthread_mutex_lock(&s->lock);
+        if (s->queue_tail)
+        {
+            s->queue_tail->next = task;
+        }
+        else
+        {
+            __atomic_store_n(&s->queue, task, __ATOMIC_RELAXED);
+        }
+        s->queue_tail = task;
+        pthread_mutex_unlock(&s->lock);
+    }
+    _kick(s);
+}
+
+/**
+ * Whether a split would likely be picked up: someone is idle, or our
+ * own deque has nothing left for thieves.
+ */
+static bool
+_wanted(sched_t *s)
+{
+    if (__atomic_load_n(&s->sleepers, __ATOMIC_RELAXED))
+    {
+        return true;
+    }
+    struct worker *self = _self;
+    if (!self || self->sched != s)
+    {
+        return false;
+    }
+    deque_t *d = &self->deque;
+    return __atomic_load_n(&d->bottom, __ATOMIC_RELAXED)
+           <= __atomic_load_n(&d->top, __ATOMIC_RELAXED);
+}
+
+/**
+ * Lazy binary splitting: work through [lo, hi) a grain at a time,
+ * handing off the upper half whenever it looks like someone would
+ * take it.
+ */
+static error_t
+_for(sched_t *s, size_t lo, size_t hi, size_t grain, sched_body_t body, void *arg)
+{
+    task_t *kids[FOR_SPLITS];
+    size_t nkids = 0;
+    error_t err = 0;
+
+    while (lo < hi)
+    {
+        if (hi - lo > 2 * grain && nkids < FOR_SPLITS && _wanted(s))
+        {
+            task_t *t = _task(s, 0);
+            if (t)
+            {
+                size_t mid = lo + (hi - lo) / 2;
+                t->body = body;
+                t->arg = arg;
+                t->lo = mid;
+                t->hi = hi;
+                t->grain = grain;
+                kids[nkids++] = t;
+                _push(s, t);
+                hi = mid;
+                continue;
+            }
+        }
+
+        size_t end = hi - lo > grain ? lo + grain : hi;
+        if (!err)
+        {
+            err = body(lo, end, arg);
+        }
+        lo = end;
+    }
+
+    // Nearest ranges first, so the error is from the lowest one
+    while (nkids)
+    {
+        data_t unused;
+        error_t kid = sched_await(kids[--nkids], &unused);
+        if (!err)
+        {
+            err = kid;
+        }
+    }
+    return err;
+}
+
+error_t
+sched_spawn(sched_t *s, task_t **t, task_fn_t fn, size_t ncaptured, const data_t *captured)
+{
+    task_t *task = _task(s, ncaptured);
+    if (!task)
+    {
+        return ENOMEM;
+    }
+    task->fn = fn;
+    for (size_t i = 0; i < ncaptured; ++i)
+    {
+        task->captured[i] = data_ref(captured[i]);
+    }
+    *t = task;
+    _push(s, task);
+    return 0;
+}
+
+error_t
+sched_for(sched_t *s, size_t n, size_t grain, sched_body_t body, void *arg)
+{
+    return _for(s, 0, n, grain ? grain : 1, body, arg);
+}
+
+error_t
+sched_await(task_t *t, data_t *result)
+{
+    sched_t *s = t->sched;
+    struct worker *self = _self && _self->sched == s ? _self : NULL;
+    bool pooled = _pool == s;
+    for (;;)
+    {
+        // Before looking, so a finish in between still wakes us
+        uint64_t seen = __atomic_load_n(&s->epoch, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&t->done, __ATOMIC_ACQUIRE))
+        {
+            break;
+        }
+        task_t *other = pooled ? _find(s, self) : NULL;
+        if (other)
+        {
+            _run(other);
+        }
+        else
+        {
+            _sleep(s, seen, false);
+        }
+    }
+
+    error_t err = t->err;
+    if (!err)
+    {
+        *result = t->result;
+    }
+    else
+    {
+        un_data(t->result);
+    }
+    _task_release(t);
+    return err;
+}
+
+void
+sched_wait(sched_t *s, bool (*done)(void *arg), void *arg)
+{
+    if (done(arg))
+    {
+        return;
+    }
+
+    bool pooled = _pool == s;
+    if (pooled)
+    {
+        _block(s);
+    }
+    for (;;)
+    {
+        uint64_t seen = __atomic_load_n(&s->epoch, __ATOMIC_SEQ_CST);
+        if (done(arg))
+        {
+            break;
+        }
+        _sleep(s, seen, false);
+    }
+    if (pooled)
+    {
+        // Let the spare that covered for us go back to sleep
+        __atomic_sub_fetch(&s->blocked, 1, __ATOMIC_SEQ_CST);
+        _kick(s);
+    }
+}
+
+void
+sched_notify(sched_t *s)
+{
+    _kick(s);
+}
+
+size_t
+sched_workers(const sched_t *s)
+{
+    return s->nworkers;
+}
+
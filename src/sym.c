@@ -30,122 +30,96 @@
 #include "symcore.h"
 #include "symio.h"
 
+#include "interp.h"
 #include "liner.h"
-#include "tokenizer.h"
+#include "symmem.h"
 
 
-/**
- * @brief Chop the line up into tokens.
- */
-static error_t
-tokenize_line(tokenizer_t *tokenizer, line_t line)
-{
-    printf("here\n");
-
-
-
-    token_t token;
-    tokenizer_set_line(tokenizer, line.len, line.s);
-    while (tokenize(tokenizer, &token))
-    {
-        printf("Token: type:%s, c:%lu, l:%lu, value:\"%.*s\"\n",
-               toktype_name(token.type), token.col, token.line,
-               (int)token.toklen, (const char *)token.tok);
-    }
-    return 0;
-}
-
-/**
- * @brief Reads lines from the liner and feeds them into the tokenizer.
- */
-static error_t
-read_lines(tokenizer_t *tokenizer, liner_t liner, void *lexer, void *context)
+int
+main(int argc, char *argv[])
 {
-    error_t err = liner.open(liner.src);
-    if (err)
-    {
-        return err;
-    }
+    const char *path = NULL;
+    const char *snapshot = NULL;
+    bool mem_stats = false;
+    sym_config_t config = { 0, 0, NULL, NULL, false };
+    unsigned pages = mempages();
 
-    bool done = false;
-    while (!done)
+    for (int i = 1; i < argc; ++i)
     {
-        line_io_t either_line = liner.get_line(liner.src, context);
-
-        switch (either_line.type)
+        if (!strcmp("--mem-stats", argv[i]))
         {
-            case LINER_LINE:
-                {
-                    line_t line = either_line.u.line;
-                    printf("Line: %.*s\n", (int)line.len, (char *)line.s);
-                    err = tokenize_line(tokenizer, line);
-                    if (err)
-                    {
-                        done = true;
-                    }
-                    liner.free_line(liner.src, line);
-                }
-                break;
-            case LINER_ERROR:
-                err = either_line.u.error;
-                if (EOF == err)
-                {
-                    done = true;
-                    err = 0;
-                }
-                else if (err)
-                {
-                    done = true;
-                }
-                break;
-            default:
-                {
-                    fputs("Fatal error: unknown type in either_line\n", stderr);
-                    err = EIO;
-                }
-                break;
+            mem_stats = true;
+        }
+        else if (!strncmp("--mem-snapshot=", argv[i], 15))
+        {
+            snapshot = argv[i] + 15;
+        }
+        else if (!strcmp("--huge-pages", argv[i]))
+        {
+            pages |= MEMPAGES_HUGE;
+        }
+        else if (!strcmp("--populate", argv[i]))
+        {
+            pages |= MEMPAGES_POPULATE;
+        }
+        else if (!strcmp("--pipeline", argv[i]))
+        {
+            config.pipelined = true;
+        }
+        else if (path)
+        {
+            fputs("Max of one argument allowed\n", stderr);
+            return -1;
+        }
+        else
+        {
+            path = argv[i];
         }
     }
 
-    error_t err2 = liner.close(liner.src);
-    if (!err)
-    {
-        err = err2;
-    }
-
-    return err;
-}
+    mempages_set(pages);
+    // Prompts and output would interleave
+    config.pipelined = config.pipelined && path;
 
-int
-main(int argc, char *argv[])
-{
-    if (argc > 3)
+    sym_interp_t interp;
+    error_t err = sym_interp_init(&interp, &config);
+    if (err)
     {
-        fputs("Max of one argument allowed\n", stderr);
-        return -1;
+        return err;
     }
 
     liner_t liner;
-    tokenizer_t tokenizer;
-
-    if (argc < 2)
+    if (!path)
     {
+        sym_interp_banner(&interp);
         liner = mk_liner_from_command_line();
     }
-    else if (!strcmp("-", argv[1]))
+    else if (!strcmp("-", path))
     {
         liner = mk_liner_from_stdin();
     }
     else
     {
-        liner = mk_liner_from_file(argv[1]);
+        liner = mk_liner_from_file(path);
     }
 
-    tokenizer_init(&tokenizer);
+    err = sym_interp_run(&interp, liner);
 
-    error_t err = read_lines(&tokenizer, liner, NULL, NULL);
+    if (mem_stats)
+    {
+        memstats_report(stderr);
+    }
+    if (snapshot)
+    {
+        error_t serr = memstats_dump(snapshot);
+        if (serr)
+        {
+            fprintf(stderr, "Could not write %s: %s\n", snapshot, strerror(serr));
+            err = err ? err : serr;
+        }
+    }
 
-    tokenizer_destroy(&tokenizer);
+    sym_interp_destroy(&interp);
 
     return err;
 }
@@ -1,28 +1,1182 @@
 
+#include <errno.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#define SYMMEM_RAW
 #include "symmem.h"
 
 
+#ifdef SYM_MEM_STATS
+// The allocator below becomes the layer under the accounting
+#define memget _raw_get
+#define memreget _raw_reget
+#define memput _raw_put
+static void *memget(size_t);
+static void *memreget(void *, size_t);
+static void memput(void *);
+#endif
+
+
+/*******************************************************************************
+ * PAGES
+ ******************************************************************************/
+
+static unsigned _pages_flags;
+static pthread_once_t _pages_once = PTHREAD_ONCE_INIT;
+static size_t _pages_mapped;
+
+static bool
+_env_on(const char *name)
+{
+    const char *v = getenv(name);
+    return v && *v && strcmp(v, "0");
+}
+
+static void
+_pages_init(void)
+{
+    _pages_flags = (_env_on("SYM_HUGEPAGES") ? MEMPAGES_HUGE : 0)
+                 | (_env_on("SYM_POPULATE") ? MEMPAGES_POPULATE : 0);
+}
+
+unsigned
+mempages(void)
+{
+    pthread_once(&_pages_once, _pages_init);
+    return __atomic_load_n(&_pages_flags, __ATOMIC_RELAXED);
+}
+
+void
+mempages_set(unsigned flags)
+{
+    pthread_once(&_pages_once, _pages_init);
+    __atomic_store_n(&_pages_flags, flags, __ATOMIC_RELAXED);
+}
+
+static size_t
+_round_to(size_t size, size_t to)
+{
+    return size > SIZE_MAX - (to - 1) ? 0 : (size + to - 1) & ~(to - 1);
+}
+
+void *
+mempages_get(size_t *size)
+{
+    bool huge = mempages() & MEMPAGES_HUGE;
+    size_t align = huge ? MEMPAGES_HUGE_SIZE : (size_t)sysconf(_SC_PAGESIZE);
+    size_t len = _round_to(*size ? *size : 1, align);
+    size_t over = huge ? len + align : len;
+    if (!len || over < len)
+    {
+        return NULL;
+    }
+
+    uint8_t *p = mmap(NULL, over, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (MAP_FAILED == p)
+    {
+        return NULL;
+    }
+    if (huge)
+    {
+        // Trim to an aligned run so the kernel can back it with huge pages
+        uint8_t *start = (uint8_t *)_round_to((uintptr_t)p, align);
+        if (start > p)
+        {
+            munmap(p, (size_t)(start - p));
+        }
+        if (start + len < p + over)
+        {
+            munmap(start + len, (size_t)(p + over - (start + len)));
+        }
+        p = start;
+#ifdef MADV_HUGEPAGE
+        madvise(p, len, MADV_HUGEPAGE);
+#endif
+    }
+    __atomic_add_fetch(&_pages_mapped, len, __ATOMIC_RELAXED);
+    *size = len;
+    return p;
+}
+
+void
+mempages_put(void *p, size_t size)
+{
+    if (p)
+    {
+        munmap(p, size);
+        __atomic_sub_fetch(&_pages_mapped, size, __ATOMIC_RELAXED);
+    }
+}
+
+size_t
+mempages_mapped(void)
+{
+    return __atomic_load_n(&_pages_mapped, __ATOMIC_RELAXED);
+}
+
+
+/*******************************************************************************
+ * BUDGETS
+ ******************************************************************************/
+
+static _Thread_local budget_t *_budget;
+
+/**
+ * Take n bytes from b unless that passes its limit.
+ */
+static bool
+_charge(budget_t *b, size_t n)
+{
+    size_t used = __atomic_load_n(&b->used, __ATOMIC_RELAXED);
+    do
+    {
+        if (n > b->limit - used)
+        {
+            return false;
+        }
+    }
+    while (!__atomic_compare_exchange_n(&b->used, &used, used + n, true,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    return true;
+}
+
+static void
+_uncharge(budget_t *b, size_t n)
+{
+    __atomic_sub_fetch(&b->used, n, __ATOMIC_RELAXED);
+}
+
+static void
+_release(budget_t *b);
+
+error_t
+budget_init(budget_t *b, size_t limit, uint64_t fuel)
+{
+    memset(b, 0, sizeof(*b));
+    b->limit = limit;
+    b->fuel = fuel;
+    return pthread_mutex_init(&b->lock, NULL);
+}
+
+void
+budget_destroy(budget_t *b)
+{
+    if (_budget == b)
+    {
+        _budget = NULL;
+    }
+    _release(b);
+    pthread_mutex_destroy(&b->lock);
+}
+
+budget_t *
+budget_use(budget_t *b)
+{
+    budget_t *prev = _budget;
+    _budget = b;
+    return prev;
+}
+
+size_t
+budget_used(budget_t *b)
+{
+    return __atomic_load_n(&b->used, __ATOMIC_RELAXED);
+}
+
+
+#if defined(SYM_LIBC_MALLOC) || defined(__SANITIZE_ADDRESS__)
+
+/*******************************************************************************
+ * LIBC
+ *
+ * Every block gets a header so memput can tell which budget, if any, to
+ * give it back to. Budgeted blocks are also listed for budget_destroy.
+ ******************************************************************************/
+
+typedef struct blockhdr
+{
+    struct blockhdr *prev;
+    struct blockhdr *next;
+    budget_t *budget;
+    size_t size;
+} blockhdr_t;
+
+static void
+_link(budget_t *b, blockhdr_t *h)
+{
+    h->prev = NULL;
+    h->next = b->spans;
+    if (h->next)
+    {
+        h->next->prev = h;
+    }
+    b->spans = h;
+}
+
+static void
+_unlink(budget_t *b, blockhdr_t *h)
+{
+    if (h->prev)
+    {
+        h->prev->next = h->next;
+    }
+    else
+    {
+        b->spans = h->next;
+    }
+    if (h->next)
+    {
+        h->next->prev = h->prev;
+    }
+}
+
+static void
+_release(budget_t *b)
+{
+    blockhdr_t *h = b->spans;
+    while (h)
+    {
+        blockhdr_t *next = h->next;
+        free(h);
+        h = next;
+    }
+    b->spans = NULL;
+    b->used = 0;
+}
+
 void *
 memget(size_t x)
 {
-    return malloc(x);
+    budget_t *b = _budget;
+    if (x > SIZE_MAX - sizeof(blockhdr_t) || (b && !_charge(b, x)))
+    {
+        return NULL;
+    }
+    blockhdr_t *h = malloc(sizeof(*h) + x);
+    if (!h)
+    {
+        if (b)
+        {
+            _uncharge(b, x);
+        }
+        return NULL;
+    }
+    h->budget = b;
+    h->size = x;
+    if (b)
+    {
+        pthread_mutex_lock(&b->lock);
+        _link(b, h);
+        pthread_mutex_unlock(&b->lock);
+    }
+    return h + 1;
 }
 
 void *
 memreget(void *p, size_t l)
 {
-    return realloc(p, l);
+    if (!p)
+    {
+        return memget(l);
+    }
+    if (l > SIZE_MAX - sizeof(blockhdr_t))
+    {
+        return NULL;
+    }
+
+    blockhdr_t *h = (blockhdr_t *)p - 1;
+    budget_t *b = h->budget;
+    size_t size = h->size;
+    if (!b)
+    {
+        h = realloc(h, sizeof(*h) + l);
+        if (h)
+        {
+            h->size = l;
+        }
+        return h ? h + 1 : NULL;
+    }
+
+    if (l > size && !_charge(b, l - size))
+    {
+        return NULL;
+    }
+    pthread_mutex_lock(&b->lock);
+    _unlink(b, h);
+    blockhdr_t *q = realloc(h, sizeof(*h) + l);
+    _link(b, q ? q : h);
+    pthread_mutex_unlock(&b->lock);
+    if (!q)
+    {
+        if (l > size)
+        {
+            _uncharge(b, l - size);
+        }
+        return NULL;
+    }
+    if (l < size)
+    {
+        _uncharge(b, size - l);
+    }
+    q->size = l;
+    return q + 1;
 }
 
 void
 memput(void *p)
 {
-    free(p);
+    if (!p)
+    {
+        return;
+    }
+    blockhdr_t *h = (blockhdr_t *)p - 1;
+    budget_t *b = h->budget;
+    if (b)
+    {
+        pthread_mutex_lock(&b->lock);
+        _unlink(b, h);
+        pthread_mutex_unlock(&b->lock);
+        _uncharge(b, h->size);
+    }
+    free(h);
+}
+
+#else
+
+/*******************************************************************************
+ * POOL
+ *
+ * Small sizes are rounded up to a size class and carved out of slabs,
+ * POOL_SPAN aligned blocks with a header at the base, so memput finds
+ * the class of any pointer by masking it.
+ * Each thread frees onto and allocates from its own list per class
+ * without locking; lists that grow too long spill a batch into the
+ * class's central depot, which is also where empty lists refill from.
+ * Frees from another thread just land in that thread's lists.
+ * Large sizes get a span of their own from the system.
+ * A budget keeps its own slabs and lists, under its lock, and is charged
+ * a whole slab at a time; the slabs and large spans it owns are listed
+ * in their headers so budget_destroy can free them all.
+ ******************************************************************************/
+
+#define POOL_SPAN (64 * 1024)
+#define POOL_HDR 64
+#define POOL_SMALL_MAX 4096
+#define POOL_CLASSES BUDGET_CLASSES
+#define POOL_LARGE UINT32_MAX
+#define POOL_BATCH_BYTES (16 * 1024)
+
+typedef struct span
+{
+    uint32_t cls;
+    uint32_t pad;
+    size_t size; // Usable bytes of a large span
+    size_t maplen; // Bytes from mempages_get, 0 if from the heap
+    budget_t *budget; // Owner, NULL for the shared pool
+    struct span *prev;
+    struct span *next;
+} span_t;
+
+typedef struct
+{
+    void *head;
+    size_t count;
+} freelist_t;
+
+typedef struct
+{
+    pthread_mutex_t lock;
+    freelist_t list;
+} depot_t;
+
+static _Thread_local freelist_t _cache[POOL_CLASSES];
+static _Thread_local bool _registered;
+
+static depot_t _depot[POOL_CLASSES];
+static pthread_once_t _once = PTHREAD_ONCE_INIT;
+static pthread_key_t _key;
+
+/**
+ * Classes are 16 byte steps to 128, then four per power of two.
+ */
+static unsigned
+_class(size_t size)
+{
+    size_t s = size ? size - 1 : 0;
+    if (s < 128)
+    {
+        return (unsigned)(s >> 4);
+    }
+    unsigned b = 63 - (unsigned)__builtin_clzll(s);
+    unsigned shift = b - 2;
+    return 8 + (b - 7) * 4 + (unsigned)((s >> shift) & 3);
+}
+
+static size_t
+_class_size(unsigned cls)
+{
+    if (cls < 8)
+    {
+        return (cls + 1) * 16;
+    }
+    unsigned k = (cls - 8) / 4;
+    unsigned j = (cls - 8) % 4;
+    return (size_t)(5 + j) << (k + 5);
+}
+
+static size_t
+_batch(unsigned cls)
+{
+    size_t n = POOL_BATCH_BYTES / _class_size(cls);
+    return n < 4 ? 4 : n > 64 ? 64 : n;
+}
+
+static span_t *
+_span_of(const void *p)
+{
+    return (span_t *)((uintptr_t)p & ~(uintptr_t)(POOL_SPAN - 1));
+}
+
+static void *
+_span_alloc(size_t size)
+{
+    void *p = NULL;
+    return posix_memalign(&p, POOL_SPAN, size) ? NULL : p;
+}
+
+static pthread_mutex_t _chunk_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint8_t *_chunk_top;
+static uint8_t *_chunk_end;
+
+/**
+ * A slab for the shared pool, which never gives them back.
+ * With huge pages they are cut from huge page aligned chunks.
+ */
+static span_t *
+_slab_alloc(void)
+{
+    if (!(mempages() & MEMPAGES_HUGE))
+    {
+        return _span_alloc(POOL_SPAN);
+    }
+
+    pthread_mutex_lock(&_chunk_lock);
+    if (_chunk_top == _chunk_end)
+    {
+        size_t len = MEMPAGES_HUGE_SIZE;
+        _chunk_top = mempages_get(&len);
+        _chunk_end = _chunk_top ? _chunk_top + len : NULL;
+    }
+    span_t *span = (span_t *)_chunk_top;
+    if (span)
+    {
+        _chunk_top += POOL_SPAN;
+    }
+    pthread_mutex_unlock(&_chunk_lock);
+    return span;
+}
+
+static void
+_span_free(span_t *span)
+{
+    if (span->maplen)
+    {
+        mempages_put(span, span->maplen);
+    }
+    else
+    {
+        free(span);
+    }
+}
+
+/**
+ * Move up to n objects from the front of src to dst.
+ */
+static void
+_move(freelist_t *dst, freelist_t *src, size_t n)
+{
+    while (n-- && src->head)
+    {
+        void *p = src->head;
+        src->head = *(void **)p;
+        --src->count;
+        *(void **)p = dst->head;
+        dst->head = p;
+        ++dst->count;
+    }
+}
+
+/**
+ * Hand the cache of an exiting thread to the depot.
+ */
+static void
+_flush(void *arg)
+{
+    (void)arg;
+    // Later destructors may still free; that registers us again
+    _registered = false;
+    for (unsigned cls = 0; cls < POOL_CLASSES; ++cls)
+    {
+        freelist_t *c = &_cache[cls];
+        if (c->count)
+        {
+            pthread_mutex_lock(&_depot[cls].lock);
+            _move(&_depot[cls].list, c, c->count);
+            pthread_mutex_unlock(&_depot[cls].lock);
+        }
+    }
+}
+
+static void
+_init(void)
+{
+    for (unsigned cls = 0; cls < POOL_CLASSES; ++cls)
+    {
+        pthread_mutex_init(&_depot[cls].lock, NULL);
+    }
+    pthread_key_create(&_key, _flush);
+}
+
+static void
+_register(void)
+{
+    pthread_once(&_once, _init);
+    // Any non-NULL value, so the destructor runs at thread exit
+    pthread_setspecific(_key, _cache);
+    _registered = true;
+}
+
+/**
+ * Thread a new slab's blocks onto list.
+ */
+static void
+_carve(span_t *span, unsigned cls, freelist_t *list)
+{
+    size_t size = _class_size(cls);
+    uint8_t *end = (uint8_t *)span + POOL_SPAN;
+    for (uint8_t *p = (uint8_t *)span + POOL_HDR; p + size <= end; p += size)
+    {
+        *(void **)p = list->head;
+        list->head = p;
+        ++list->count;
+    }
+}
+
+/**
+ * Refill an empty cache from the depot, else from a new slab.
+ */
+static bool
+_refill(unsigned cls)
+{
+    freelist_t *c = &_cache[cls];
+    if (!_registered)
+    {
+        _register();
+    }
+
+    depot_t *d = &_depot[cls];
+    pthread_mutex_lock(&d->lock);
+    _move(c, &d->list, _batch(cls));
+    pthread_mutex_unlock(&d->lock);
+    if (c->head)
+    {
+        return true;
+    }
+
+    span_t *span = _slab_alloc();
+    if (!span)
+    {
+        return false;
+    }
+    span->cls = cls;
+    span->maplen = 0;
+    span->size = 0;
+    span->budget = NULL;
+    _carve(span, cls, c);
+    return true;
+}
+
+static void
+_link(budget_t *b, span_t *span)
+{
+    span->budget = b;
+    span->prev = NULL;
+    span->next = b->spans;
+    if (span->next)
+    {
+        span->next->prev = span;
+    }
+    b->spans = span;
+}
+
+static void
+_unlink(budget_t *b, span_t *span)
+{
+    if (span->prev)
+    {
+        span->prev->next = span->next;
+    }
+    else
+    {
+        b->spans = span->next;
+    }
+    if (span->next)
+    {
+        span->next->prev = span->prev;
+    }
+}
+
+static void
+_release(budget_t *b)
+{
+    span_t *span = b->spans;
+    while (span)
+    {
+        span_t *next = span->next;
+        _span_free(span);
+        span = next;
+    }
+    b->spans = NULL;
+    memset(b->free, 0, sizeof(b->free));
+    b->used = 0;
 }
 
+static void *
+_large(budget_t *b, size_t x)
+{
+    if (x > SIZE_MAX - POOL_HDR || (b && !_charge(b, POOL_HDR + x)))
+    {
+        return NULL;
+    }
+    // Big enough for huge pages to pay, and to map whole
+    span_t *span;
+    size_t len = POOL_HDR + x;
+    size_t maplen = 0;
+    if (len >= MEMPAGES_HUGE_SIZE && (mempages() & MEMPAGES_HUGE))
+    {
+        span = mempages_get(&len);
+        maplen = len;
+    }
+    else
+    {
+        span = _span_alloc(len);
+    }
+    if (!span)
+    {
+        if (b)
+        {
+            _uncharge(b, POOL_HDR + x);
+        }
+        return NULL;
+    }
+    span->cls = POOL_LARGE;
+    span->maplen = maplen;
+    span->size = x;
+    span->budget = NULL;
+    if (b)
+    {
+        pthread_mutex_lock(&b->lock);
+        _link(b, span);
+        pthread_mutex_unlock(&b->lock);
+    }
+    return (uint8_t *)span + POOL_HDR;
+}
+
+static void *
+_budget_get(budget_t *b, size_t x)
+{
+    if (x > POOL_SMALL_MAX)
+    {
+        return _large(b, x);
+    }
+
+    unsigned cls = _class(x);
+    pthread_mutex_lock(&b->lock);
+    void *p = b->free[cls];
+    if (!p && _charge(b, POOL_SPAN))
+    {
+        span_t *span = _span_alloc(POOL_SPAN);
+        if (span)
+        {
+            span->cls = cls;
+            span->maplen = 0;
+            span->size = 0;
+            _link(b, span);
+            freelist_t list = { NULL, 0 };
+            _carve(span, cls, &list);
+            p = list.head;
+        }
+        else
+        {
+            _uncharge(b, POOL_SPAN);
+        }
+    }
+    if (p)
+    {
+        b->free[cls] = *(void **)p;
+    }
+    pthread_mutex_unlock(&b->lock);
+    return p;
+}
+
+static void
+_budget_put(budget_t *b, span_t *span, void *p)
+{
+    pthread_mutex_lock(&b->lock);
+    if (POOL_LARGE == span->cls)
+    {
+        _unlink(b, span);
+        pthread_mutex_unlock(&b->lock);
+        _uncharge(b, POOL_HDR + span->size);
+        _span_free(span);
+        return;
+    }
+    *(void **)p = b->free[span->cls];
+    b->free[span->cls] = p;
+    pthread_mutex_unlock(&b->lock);
+}
+
+/**
+ * From the shared pool, whatever budget is in use.
+ */
+static void *
+_get(size_t x)
+{
+    if (x > POOL_SMALL_MAX)
+    {
+        return _large(NULL, x);
+    }
+
+    unsigned cls = _class(x);
+    freelist_t *c = &_cache[cls];
+    if (!c->head && !_refill(cls))
+    {
+        return NULL;
+    }
+    void *p = c->head;
+    c->head = *(void **)p;
+    --c->count;
+    return p;
+}
+
+void *
+memget(size_t x)
+{
+    budget_t *b = _budget;
+    return b ? _budget_get(b, x) : _get(x);
+}
+
+void
+memput(void *p)
+{
+    if (!p)
+    {
+        return;
+    }
+
+    span_t *span = _span_of(p);
+    if (span->budget)
+    {
+        _budget_put(span->budget, span, p);
+        return;
+    }
+    if (POOL_LARGE == span->cls)
+    {
+        _span_free(span);
+        return;
+    }
+
+    if (!_registered)
+    {
+        _register();
+    }
+
+    unsigned cls = span->cls;
+    freelist_t *c = &_cache[cls];
+    size_t batch = _batch(cls);
+    // Spill before pushing so p stays first, it is likely still in cache
+    if (c->count >= 2 * batch)
+    {
+        depot_t *d = &_depot[cls];
+        pthread_mutex_lock(&d->lock);
+        _move(&d->list, c, batch);
+        pthread_mutex_unlock(&d->lock);
+    }
+    *(void **)p = c->head;
+    c->head = p;
+    ++c->count;
+}
+
+void *
+memreget(void *p, size_t l)
+{
+    if (!p)
+    {
+        return memget(l);
+    }
+
+    span_t *span = _span_of(p);
+    size_t have = POOL_LARGE == span->cls ? span->size : _class_size(span->cls);
+    // Keep the block unless it is more than twice what is needed
+    if (l <= have && (l > have / 2 || have <= 16))
+    {
+        return p;
+    }
+
+    // The new block comes from where the old one did
+    void *q = span->budget ? _budget_get(span->budget, l) : _get(l);
+    if (q)
+    {
+        memcpy(q, p, l < have ? l : have);
+        memput(p);
+    }
+    return q;
+}
+
+#endif
+
 size_t
 meminc(size_t x)
 {
     return x * 2;
 }
 
+
+/*******************************************************************************
+ * ACCOUNTING
+ ******************************************************************************/
+
+static void
+_report_pages(FILE *out)
+{
+    unsigned flags = mempages();
+    fprintf(out, "pages: huge %s, populate %s, %zu bytes mapped\n",
+            flags & MEMPAGES_HUGE ? "on" : "off",
+            flags & MEMPAGES_POPULATE ? "on" : "off",
+            mempages_mapped());
+}
+
+#ifdef SYM_MEM_STATS
+
+#undef memget
+#undef memreget
+#undef memput
+
+#define STATS_HDR 16
+#define STATS_TOP 10
+
+typedef struct
+{
+    memsite_t *site;
+    size_t size;
+} stathdr_t;
+
+static memsite_t _unknown = { "?", 0, MEMTAG_OTHER, NULL, { 0, 0, 0 }, true };
+static memsite_t *_sites = &_unknown;
+static pthread_mutex_t _sites_lock = PTHREAD_MUTEX_INITIALIZER;
+static memstat_t _tags[MEMTAG_COUNT];
+
+static const struct
+{
+    const char *name;
+    enum memtag tag;
+} _tagfiles[] =
+{
+    { "liner", MEMTAG_LINER },
+    { "tokenizer", MEMTAG_TOKENIZER },
+    { "context", MEMTAG_CONTEXT },
+    { "array", MEMTAG_DATA },
+    { "bigint", MEMTAG_DATA },
+    { "data", MEMTAG_DATA },
+    { "map", MEMTAG_DATA },
+    { "number", MEMTAG_DATA },
+    { "vm", MEMTAG_VM },
+};
+
+static unsigned
+_tag_of(const char *file)
+{
+    const char *base = strrchr(file, '/');
+    base = base ? base + 1 : file;
+    size_t len = strcspn(base, ".");
+    for (size_t i = 0; i < sizeof(_tagfiles) / sizeof(_tagfiles[0]); ++i)
+    {
+        if (len == strlen(_tagfiles[i].name) && !memcmp(base, _tagfiles[i].name, len))
+        {
+            return _tagfiles[i].tag;
+        }
+    }
+    return MEMTAG_OTHER;
+}
+
+static void
+_list(memsite_t *site)
+{
+    pthread_mutex_lock(&_sites_lock);
+    if (!site->listed)
+    {
+        site->tag = _tag_of(site->file);
+        site->next = _sites;
+        _sites = site;
+        __atomic_store_n(&site->listed, true, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&_sites_lock);
+}
+
+static void
+_grow(memstat_t *s, size_t size)
+{
+    size_t live = __atomic_add_fetch(&s->live, size, __ATOMIC_RELAXED);
+    size_t peak = __atomic_load_n(&s->peak, __ATOMIC_RELAXED);
+    while (live > peak
+           && !__atomic_compare_exchange_n(&s->peak, &peak, live, true,
+                                           __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    {
+    }
+    __atomic_add_fetch(&s->count, 1, __ATOMIC_RELAXED);
+}
+
+static void
+_shrink(memstat_t *s, size_t size)
+{
+    __atomic_sub_fetch(&s->live, size, __ATOMIC_RELAXED);
+}
+
+static void *
+_account(stathdr_t *h, size_t size, memsite_t *site)
+{
+    if (!__atomic_load_n(&site->listed, __ATOMIC_ACQUIRE))
+    {
+        _list(site);
+    }
+    h->site = site;
+    h->size = size;
+    _grow(&site->stat, size);
+    _grow(&_tags[site->tag], size);
+    return (uint8_t *)h + STATS_HDR;
+}
+
+static void
+_unaccount(stathdr_t *h)
+{
+    _shrink(&h->site->stat, h->size);
+    _shrink(&_tags[h->site->tag], h->size);
+}
+
+void *
+memget_at(size_t x, memsite_t *site)
+{
+    if (x > SIZE_MAX - STATS_HDR)
+    {
+        return NULL;
+    }
+    stathdr_t *h = _raw_get(STATS_HDR + x);
+    return h ? _account(h, x, site) : NULL;
+}
+
+void *
+memreget_at(void *p, size_t l, memsite_t *site)
+{
+    if (!p)
+    {
+        return memget_at(l, site);
+    }
+    if (l > SIZE_MAX - STATS_HDR)
+    {
+        return NULL;
+    }
+
+    stathdr_t *h = (stathdr_t *)((uint8_t *)p - STATS_HDR);
+    stathdr_t old = *h;
+    _unaccount(h);
+    stathdr_t *q = _raw_reget(h, STATS_HDR + l);
+    if (!q)
+    {
+        // The block is untouched, put it back as it was
+        _grow(&old.site->stat, old.size);
+        _grow(&_tags[old.site->tag], old.size);
+        return NULL;
+    }
+    return _account(q, l, site);
+}
+
+void *
+memget(size_t x)
+{
+    return memget_at(x, &_unknown);
+}
+
+void *
+memreget(void *p, size_t l)
+{
+    return memreget_at(p, l, &_unknown);
+}
+
+void
+memput(void *p)
+{
+    if (p)
+    {
+        stathdr_t *h = (stathdr_t *)((uint8_t *)p - STATS_HDR);
+        _unaccount(h);
+        _raw_put(h);
+    }
+}
+
+bool
+memstats_enabled(void)
+{
+    return true;
+}
+
+memstat_t
+memstats_tag(enum memtag tag)
+{
+    memstat_t s = { 0, 0, 0 };
+    if (tag < MEMTAG_COUNT)
+    {
+        s.live = __atomic_load_n(&_tags[tag].live, __ATOMIC_RELAXED);
+        s.peak = __atomic_load_n(&_tags[tag].peak, __ATOMIC_RELAXED);
+        s.count = __atomic_load_n(&_tags[tag].count, __ATOMIC_RELAXED);
+    }
+    return s;
+}
+
+static int
+_by_peak(const void *a, const void *b)
+{
+    const memsite_t *x = *(memsite_t *const *)a;
+    const memsite_t *y = *(memsite_t *const *)b;
+    return x->stat.peak < y->stat.peak ? 1 : x->stat.peak > y->stat.peak ? -1 : 0;
+}
+
+void
+memstats_report(FILE *out)
+{
+    _report_pages(out);
+    fprintf(out, "%-10s %14s %14s %12s\n", "subsystem", "live", "peak", "count");
+    for (unsigned t = 0; t < MEMTAG_COUNT; ++t)
+    {
+        memstat_t s = memstats_tag(t);
+        fprintf(out, "%-10s %14zu %14zu %12zu\n", memtag_name(t), s.live, s.peak, s.count);
+    }
+
+    pthread_mutex_lock(&_sites_lock);
+    size_t n = 0;
+    for (memsite_t *site = _sites; site; site = site->next)
+    {
+        ++n;
+    }
+    memsite_t **all = _raw_get(n * sizeof(*all));
+    if (all)
+    {
+        n = 0;
+        for (memsite_t *site = _sites; site; site = site->next)
+        {
+            all[n++] = site;
+        }
+    }
+    pthread_mutex_unlock(&_sites_lock);
+    if (!all)
+    {
+        return;
+    }
+
+    qsort(all, n, sizeof(*all), _by_peak);
+    fprintf(out, "\n%-32s %14s %14s %12s\n", "site", "live", "peak", "count");
+    for (size_t i = 0; i < n && i < STATS_TOP; ++i)
+    {
+        char where[64];
+        const char *base = strrchr(all[i]->file, '/');
+        snprintf(where, sizeof(where), "%s:%u", base ? base + 1 : all[i]->file, all[i]->line);
+        fprintf(out, "%-32s %14zu %14zu %12zu\n", where,
+                all[i]->stat.live, all[i]->stat.peak, all[i]->stat.count);
+    }
+    _raw_put(all);
+}
+
+error_t
+memstats_dump(const char *path)
+{
+    FILE *f = fopen(path, "w");
+    if (!f)
+    {
+        return errno;
+    }
+
+    fputs("file\tline\tsubsystem\tlive\tpeak\tcount\n", f);
+    pthread_mutex_lock(&_sites_lock);
+    for (memsite_t *site = _sites; site; site = site->next)
+    {
+        fprintf(f, "%s\t%u\t%s\t%zu\t%zu\t%zu\n", site->file, site->line,
+                memtag_name(site->tag),
+                __atomic_load_n(&site->stat.live, __ATOMIC_RELAXED),
+                __atomic_load_n(&site->stat.peak, __ATOMIC_RELAXED),
+                __atomic_load_n(&site->stat.count, __ATOMIC_RELAXED));
+    }
+    pthread_mutex_unlock(&_sites_lock);
+
+    error_t err = ferror(f) ? EIO : 0;
+    if (fclose(f) && !err)
+    {
+        err = errno;
+    }
+    return err;
+}
+
+#else
+
+void *
+memget_at(size_t x, memsite_t *site)
+{
+    (void)site;
+    return memget(x);
+}
+
+void *
+memreget_at(void *p, size_t l, memsite_t *site)
+{
+    (void)site;
+    return memreget(p, l);
+}
+
+bool
+memstats_enabled(void)
+{
+    return false;
+}
+
+memstat_t
+memstats_tag(enum memtag tag)
+{
+    (void)tag;
+    return (memstat_t){ 0, 0, 0 };
+}
+
+void
+memstats_report(FILE *out)
+{
+    _report_pages(out);
+    fputs("memory statistics need a build with SYM_MEM_STATS\n", out);
+}
+
+error_t
+memstats_dump(const char *path)
+{
+    (void)path;
+    return ENOTSUP;
+}
+
+#endif
+
+const char *
+memtag_name(enum memtag tag)
+{
+    static const char *names[MEMTAG_COUNT] =
+    {
+        "other", "liner", "tokenizer", "context", "data", "vm",
+    };
+    return tag < MEMTAG_COUNT ? names[tag] : "?";
+}
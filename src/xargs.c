@@ -0,0 +1,459 @@
+/*******************************************************************************
+ * Copyright (c) 2022 Craig Jacobson
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ ******************************************************************************/
+/**
+ * @file xargs.c
+ * @author Craig Jacobson
+ * @brief Batching records into jobs and polling their output.
+ *
+ * The calling thread does everything: it starts jobs while there are
+ * free slots, then polls the running ones' stdout, and once that ends,
+ * a pidfd to know when each has exited.
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "machine.h"
+#include "pipeline.h"
+#include "symmem.h"
+#include "xargs.h"
+
+
+#define XARGS_CHUNK (64 * 1024)
+/// Pages in the longest single argument Linux takes, its MAX_ARG_STRLEN.
+#define XARGS_ARGPAGES 32
+
+extern char **environ;
+
+typedef struct
+{
+    pipeline_t p;
+    size_t id;
+    char **argv; // One block, the strings after the pointers
+    uint8_t *buf; // Output held back until it is this job's turn
+    size_t len;
+    size_t cap;
+    int pidfd;
+    bool eof;
+    bool exited;
+    int code;
+} job_t;
+
+typedef struct
+{
+    const xargs_t *x;
+    size_t room; // Bytes of command line left for records
+    size_t argmax; // Bytes in one record, with its NUL
+    size_t ncmd;
+    ssize_t slot; // Index of "{}" in the command, or -1
+    const char *held; // Read but did not fit in the last job
+    bool more;
+    size_t *offs; // Of the records in bytes
+    size_t capoffs;
+    char *bytes; // Records taken for the next job
+    size_t capbytes;
+} feed_t;
+
+
+/*******************************************************************************
+ * BATCHING
+ ******************************************************************************/
+
+static size_t
+_cost(const char *s)
+{
+    return strlen(s) + 1 + sizeof(char *);
+}
+
+static void
+_feed_init(feed_t *f, const xargs_t *x)
+{
+    memset(f, 0, sizeof(*f));
+    f->x = x;
+    f->more = true;
+    f->slot = -1;
+
+    long max = sysconf(_SC_ARG_MAX);
+    size_t used = XARGS_HEADROOM;
+    for (char **e = environ; e && *e; ++e)
+    {
+        used += _cost(*e);
+    }
+    for (; x->cmd[f->ncmd]; ++f->ncmd)
+    {
+        used += _cost(x->cmd[f->ncmd]);
+        if (!strcmp("{}", x->cmd[f->ncmd]))
+        {
+            f->slot = (ssize_t)f->ncmd;
+        }
+    }
+    max = max > 0 ? max : _POSIX_ARG_MAX;
+    f->room = used < (size_t)max ? (size_t)max - used : 0;
+
+    long page = sysconf(_SC_PAGESIZE);
+    f->argmax = XARGS_ARGPAGES * (size_t)(page > 0 ? page : 4096);
+}
+
+static const char *
+_peek(feed_t *f)
+{
+    if (!f->held && f->more)
+    {
+        f->held = f->x->next(f->x->arg);
+        f->more = NULL != f->held;
+    }
+    return f->held;
+}
+
+/**
+ * Copy a record for the job being laid out.
+ */
+static error_t
+_take(feed_t *f, size_t nrecs, size_t used, const char *rec, size_t len)
+{
+    if (nrecs == f->capoffs)
+    {
+        size_t cap = f->capoffs ? f->capoffs * 2 : 64;
+        size_t *offs = memreget(f->offs, cap * sizeof(offs[0]));
+        if (!offs)
+        {
+            return ENOMEM;
+        }
+        f->offs = offs;
+        f->capoffs = cap;
+    }
+    if (used + len > f->capbytes)
+    {
+        size_t cap = f->capbytes ? f->capbytes : 4096;
+        while (cap < used + len)
+        {
+            cap *= 2;
+        }
+        char *bytes = memreget(f->bytes, cap);
+        if (!bytes)
+        {
+            return ENOMEM;
+        }
+        f->bytes = bytes;
+        f->capbytes = cap;
+    }
+    f->offs[nrecs] = used;
+    memcpy(f->bytes + used, rec, len);
+    return 0;
+}
+
+/**
+ * Lay out the argv for the records taken.
+ */
+static error_t
+_lay(feed_t *f, job_t **job, size_t nrecs, size_t used)
+{
+    size_t nargs = f->slot >= 0 ? f->ncmd : f->ncmd + nrecs;
+    job_t *j = memget(sizeof(*j));
+    char **argv = memget((nargs + 1) * sizeof(argv[0]) + used);
+    if (!j || !argv)
+    {
+        memput(j);
+        memput(argv);
+        return ENOMEM;
+    }
+    char *bytes = memcpy(argv + nargs + 1, f->bytes, used);
+    size_t r = 0;
+    for (size_t i = 0; i < nargs; ++i)
+    {
+        bool rec = f->slot >= 0 ? (ssize_t)i == f->slot : i >= f->ncmd;
+        argv[i] = rec ? bytes + f->offs[r++] : f->x->cmd[i];
+    }
+    argv[nargs] = NULL;
+
+    memset(j, 0, sizeof(*j));
+    j->argv = argv;
+    j->pidfd = -1;
+    *job = j;
+    return 0;
+}
+
+/**
+ * Take the records for one job.
+ */
+static error_t
+_batch(feed_t *f, job_t **job)
+{
+    *job = NULL;
+    size_t max = f->x->max_args ? f->x->max_args : SIZE_MAX;
+    if (f->slot >= 0)
+    {
+        max = 1;
+    }
+
+    size_t room = f->room;
+    size_t used = 0;
+    size_t nrecs = 0;
+    const char *rec;
+    while (nrecs < max && (rec = _peek(f)))
+    {
+        size_t len = strlen(rec) + 1;
+        size_t cost = len + sizeof(char *);
+        if (cost > room || len > f->argmax)
+        {
+            // Held for the next job, unless no job could take it
+            if (!nrecs)
+            {
+                return E2BIG;
+            }
+            break;
+        }
+        error_t err = _take(f, nrecs, used, rec, len);
+        if (err)
+        {
+            return err;
+        }
+        f->held = NULL;
+        room -= cost;
+        used += len;
+        ++nrecs;
+    }
+    return nrecs ? _lay(f, job, nrecs, used) : 0;
+}
+
+/*******************************************************************************
+ * JOBS
+ ******************************************************************************/
+
+static void
+_job_free(job_t *j)
+{
+    pipeline_destroy(&j->p);
+    if (j->pidfd >= 0)
+    {
+        close(j->pidfd);
+    }
+    memput(j->argv);
+    memput(j->buf);
+    memput(j);
+}
+
+static error_t
+_hold(job_t *j, const uint8_t *buf, size_t len)
+{
+    if (j->len + len > j->cap)
+    {
+        size_t cap = j->cap ? j->cap : XARGS_CHUNK;
+        while (cap < j->len + len)
+        {
+            cap *= 2;
+        }
+        uint8_t *b = memreget(j->buf, cap);
+        if (!b)
+        {
+            return ENOMEM;
+        }
+        j->buf = b;
+        j->cap = cap;
+    }
+    memcpy(j->buf + j->len, buf, len);
+    j->len += len;
+    return 0;
+}
+
+static error_t
+_output(const xargs_t *x, job_t *j, const uint8_t *buf, size_t len)
+{
+    return x->output && len ? x->output(x->arg, j->id, buf, len) : 0;
+}
+
+/**
+ * Output has ended; wait for the exit on a pidfd, or here and now
+ * where there are none.
+ */
+static void
+_ended(job_t *j)
+{
+    j->eof = true;
+#ifdef SYS_pidfd_open
+    j->pidfd = (int)syscall(SYS_pidfd_open, j->p.pids[0], 0);
+#endif
+    if (j->pidfd < 0)
+    {
+        pipeline_wait(&j->p, NULL, false, &j->code);
+        j->exited = true;
+    }
+}
+
+/**
+ * Read what one job has for us.
+ */
+static error_t
+_read(const xargs_t *x, job_t *j, bool head, uint8_t *chunk)
+{
+    ssize_t n = read(j->p.out, chunk, XARGS_CHUNK);
+    if (n < 0)
+    {
+        return EINTR == errno || EAGAIN == errno ? 0 : errno;
+    }
+    if (!n)
+    {
+        _ended(j);
+        return 0;
+    }
+    if (!x->ordered || head)
+    {
+        return _output(x, j, chunk, (size_t)n);
+    }
+    return _hold(j, chunk, (size_t)n);
+}
+
+
+/*******************************************************************************
+ * RUNNING
+ ******************************************************************************/
+
+error_t
+xargs_run(const xargs_t *x, size_t *failed)
+{
+    *failed = 0;
+    size_t jobs = x->jobs;
+    if (!jobs)
+    {
+        jobs = machine()->cores;
+    }
+    size_t window = x->ordered ? jobs * XARGS_AHEAD : jobs;
+
+    feed_t f;
+    _feed_init(&f, x);
+    job_t **pending = memget(window * sizeof(pending[0]));
+    struct pollfd *fds = memget(window * sizeof(fds[0]));
+    uint8_t *chunk = memget(XARGS_CHUNK);
+    if (!pending || !fds || !chunk)
+    {
+        memput(pending);
+        memput(fds);
+        memput(chunk);
+        return ENOMEM;
+    }
+
+    error_t err = 0;
+    size_t npending = 0;
+    size_t running = 0;
+    size_t next_id = 0;
+    for (;;)
+    {
+        while (!err && running < jobs && npending < window)
+        {
+            job_t *j;
+            err = _batch(&f, &j);
+            if (!j)
+            {
+                break;
+            }
+            char *const *argvs[] = { j->argv };
+            err = pipeline_start(&j->p, 1, argvs, PIPELINE_INHERIT, PIPELINE_PIPE);
+            if (err)
+            {
+                memput(j->argv);
+                memput(j);
+                break;
+            }
+            j->id = next_id++;
+            pending[npending++] = j;
+            ++running;
+        }
+        if (!npending)
+        {
+            break;
+        }
+
+        for (size_t i = 0; i < npending; ++i)
+        {
+            job_t *j = pending[i];
+            fds[i].fd = j->exited ? -1 : j->eof ? j->pidfd : j->p.out;
+            fds[i].events = POLLIN;
+            fds[i].revents = 0;
+        }
+        if (running && poll(fds, npending, -1) < 0 && EINTR != errno)
+        {
+            err = err ? err : errno;
+            break;
+        }
+
+        for (size_t i = 0; i < npending; ++i)
+        {
+            job_t *j = pending[i];
+            if (!fds[i].revents)
+            {
+                continue;
+            }
+            if (!j->eof)
+            {
+                // After an error we still drain, so the child can finish
+                error_t e = _read(x, j, 0 == i, chunk);
+                err = err ? err : e;
+            }
+            else
+            {
+                pipeline_wait(&j->p, NULL, false, &j->code);
+                j->exited = true;
+            }
+            running -= j->exited;
+        }
+
+        // Hand over what has finished, only from the front when ordered
+        size_t i = 0;
+        while (i < npending)
+        {
+            job_t *j = pending[i];
+            if (!j->exited || (x->ordered && i))
+            {
+                ++i;
+                continue;
+            }
+            *failed += 0 != j->code;
+            if (!err && x->done)
+            {
+                err = x->done(x->arg, j->id, j->code);
+            }
+            _job_free(j);
+            memmove(pending + i, pending + i + 1, (--npending - i) * sizeof(pending[0]));
+            if (x->ordered && npending)
+            {
+                job_t *head = pending[0];
+                if (!err)
+                {
+                    err = _output(x, head, head->buf, head->len);
+                }
+                head->len = 0;
+            }
+        }
+    }
+
+    memput(f.offs);
+    memput(f.bytes);
+    memput(pending);
+    memput(fds);
+    memput(chunk);
+    return err;
+}
+
@@ -0,0 +1,496 @@
+
+#include <errno.h>
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "bdd.h"
+#include "array.h"
+#include "symmem.h"
+
+
+#define MAXLEN 131
+
+static uint64_t rng = 0x2545F4914F6CDD1DULL;
+
+static uint64_t
+next(void)
+{
+    rng ^= rng << 13;
+    rng ^= rng >> 7;
+    rng ^= rng << 17;
+    return rng;
+}
+
+static int32_t seen[MAXLEN];
+static size_t nseen;
+
+static error_t
+triple(data_t *r, const data_t *args, const void *ctx)
+{
+    (void)ctx;
+    *r = mk_i4(data_i4(args[0]) * 3);
+    return 0;
+}
+
+static error_t
+even(data_t *r, const data_t *args, const void *ctx)
+{
+    (void)ctx;
+    *r = mk_bool(0 == data_i4(args[0]) % 2);
+    return 0;
+}
+
+static error_t
+sum(data_t *r, const data_t *args, const void *ctx)
+{
+    (void)ctx;
+    return mk_i8(r, data_i8(args[0]) + data_i4(args[1]));
+}
+
+static error_t
+merge(data_t *r, const data_t *args, const void *ctx)
+{
+    (void)ctx;
+    return mk_i8(r, data_i8(args[0]) + data_i8(args[1]));
+}
+
+static error_t
+last(data_t *r, const data_t *args, const void *ctx)
+{
+    (void)ctx;
+    *r = data_ref(args[1]);
+    return 0;
+}
+
+static error_t
+record(data_t *r, const data_t *args, const void *ctx)
+{
+    if (nseen < MAXLEN)
+    {
+        seen[nseen++] = data_i4(args[0]);
+    }
+    *r = mk_i4(0);
+    return *(const int32_t *)ctx == data_i4(args[0]) ? EDOM : 0;
+}
+
+static const enum memops_isa isas[] = { MEMOPS_SCALAR, MEMOPS_AVX2 };
+
+static data_t
+random_i4(size_t len, int32_t *v)
+{
+    data_t d;
+    for (size_t i = 0; i < len; ++i)
+    {
+        v[i] = (int32_t)next();
+    }
+    mk_arr(&d, DATA_I4, len, v);
+    return d;
+}
+
+static data_t
+random_f8(size_t len, double *v)
+{
+    data_t d;
+    for (size_t i = 0; i < len; ++i)
+    {
+        v[i] = (double)(int64_t)(next() % 2000001) / 1000.0 - 1000.0;
+    }
+    mk_arr(&d, DATA_F8, len, v);
+    return d;
+}
+
+spec("symbolscript library")
+{
+    describe("array")
+    {
+        it("should pack each fixed width type")
+        {
+            data_t a;
+            data_t v;
+            check(0 == mk_arr(&a, DATA_I2, 3, NULL));
+            check(DATA_ARR == data_typeof(a));
+            check(DATA_I2 == arr_elem(a) && 3 == arr_len(a));
+            check(0 == arr_set(&a, 1, mk_i2(-7)));
+            check(EINVAL == arr_set(&a, 1, mk_i4(-7)));
+            check(ERANGE == arr_set(&a, 3, mk_i2(1)));
+            check(0 == arr_get(&v, a, 1) && DATA_I2 == data_typeof(v) && -7 == data_i4(v));
+            check(0 == arr_get(&v, a, 0) && 0 == data_i4(v));
+            un_data(a);
+
+            check(EINVAL == mk_arr(&a, DATA_SYM, 1, NULL));
+            check(EINVAL == mk_arr(&a, DATA_I, 1, NULL));
+            check(8 == arr_width(DATA_F8) && 1 == arr_width(DATA_BOOL));
+        }
+
+        it("should grow and copy on write")
+        {
+            data_t a;
+            data_t v;
+            mk_arr(&a, DATA_U8, 0, NULL);
+            for (uint64_t i = 0; i < 1000; ++i)
+            {
+                mk_u8(&v, i * 0x100000001ULL);
+                check(0 == arr_push(&a, v));
+                un_data(v);
+            }
+            check(1000 == arr_len(a));
+            const uint64_t *p = arr_data(a);
+            check(999 * 0x100000001ULL == p[999]);
+
+            data_t b = data_ref(a);
+            mk_u8(&v, 42);
+            check(0 == arr_set(&b, 0, v));
+            check(0 == ((const uint64_t *)arr_data(a))[0]);
+            check(42 == ((const uint64_t *)arr_data(b))[0]);
+            un_data(a);
+            un_data(b);
+        }
+
+        it("should do wrapping integer arithmetic")
+        {
+            int32_t x[MAXLEN];
+            int32_t y[MAXLEN];
+            for (size_t s = 0; s < sizeof(isas) / sizeof(isas[0]); ++s)
+            {
+                if (!memops_set_isa(isas[s]))
+                {
+                    continue;
+                }
+                for (size_t len = 0; len < MAXLEN; len += 7)
+                {
+                    data_t a = random_i4(len, x);
+                    data_t b = random_i4(len, y);
+                    data_t r;
+                    const int32_t *rv;
+
+                    check(0 == arr_binop(&r, ARR_ADD, a, b));
+                    rv = arr_data(r);
+                    for (size_t i = 0; i < len; ++i)
+                    {
+                        check((int32_t)((uint32_t)x[i] + (uint32_t)y[i]) == rv[i]);
+                    }
+                    un_data(r);
+
+                    check(0 == arr_binop(&r, ARR_MUL, a, b));
+                    rv = arr_data(r);
+                    for (size_t i = 0; i < len; ++i)
+                    {
+                        check((int32_t)((uint32_t)x[i] * (uint32_t)y[i]) == rv[i]);
+                    }
+                    un_data(r);
+
+                    check(0 == arr_binop(&r, ARR_MIN, a, mk_i4(0)));
+                    rv = arr_data(r);
+                    for (size_t i = 0; i < len; ++i)
+                    {
+                        check((x[i] < 0 ? x[i] : 0) == rv[i]);
+                    }
+                    un_data(r);
+
+                    check(0 == arr_binop(&r, ARR_DIV, a, mk_i4(-1)));
+                    rv = arr_data(r);
+                    for (size_t i = 0; i < len; ++i)
+                    {
+                        check((int32_t)(0 - (uint32_t)x[i]) == rv[i]);
+                    }
+                    un_data(r);
+
+                    un_data(a);
+                    un_data(b);
+                }
+            }
+            if (!memops_set_isa(MEMOPS_AVX2))
+            {
+                memops_set_isa(MEMOPS_SSE2);
+            }
+
+            data_t a;
+            data_t r;
+            mk_arr(&a, DATA_U1, 4, (const uint8_t[]){ 250, 1, 2, 3 });
+            check(0 == arr_binop(&r, ARR_ADD, a, mk_u1(10)));
+            check(4 == ((const uint8_t *)arr_data(r))[0]);
+            un_data(r);
+            check(EDOM == arr_binop(&r, ARR_DIV, a, mk_u1(0)));
+            check(EINVAL == arr_binop(&r, ARR_ADD, a, mk_u2(1)));
+            un_data(a);
+        }
+
+        it("should do float arithmetic and propagate NaN")
+        {
+            double x[MAXLEN];
+            double y[MAXLEN];
+            for (size_t s = 0; s < sizeof(isas) / sizeof(isas[0]); ++s)
+            {
+                if (!memops_set_isa(isas[s]))
+                {
+                    continue;
+                }
+                for (size_t len = 1; len < MAXLEN; len += 5)
+                {
+                    data_t a = random_f8(len, x);
+                    data_t b = random_f8(len, y);
+                    data_t r;
+                    const double *rv;
+
+                    check(0 == arr_binop(&r, ARR_DIV, a, b));
+                    rv = arr_data(r);
+                    for (size_t i = 0; i < len; ++i)
+                    {
+                        double e = x[i] / y[i];
+                        check(!memcmp(&e, &rv[i], sizeof(e)));
+                    }
+                    un_data(r);
+
+                    check(0 == arr_binop(&r, ARR_SUB, a, b));
+                    rv = arr_data(r);
+                    for (size_t i = 0; i < len; ++i)
+                    {
+                        check(x[i] - y[i] == rv[i]);
+                    }
+                    un_data(r);
+
+                    un_data(a);
+                    un_data(b);
+                }
+
+                data_t a;
+                data_t r;
+                mk_arr(&a, DATA_F8, 5, (const double[]){ 3.0, -1.0, NAN, 7.0, 2.0 });
+                check(0 == arr_reduce(&r, ARR_LEAST, a) && isnan(data_f8(r)));
+                check(0 == arr_binop(&r, ARR_MAX, a, mk_f8(2.5)));
+                const double *rv = arr_data(r);
+                check(3.0 == rv[0] && 2.5 == rv[1] && isnan(rv[2]) && 7.0 == rv[3]);
+                un_data(r);
+                un_data(a);
+            }
+            if (!memops_set_isa(MEMOPS_AVX2))
+            {
+                memops_set_isa(MEMOPS_SSE2);
+            }
+        }
+
+        it("should reduce")
+        {
+            int32_t x[MAXLEN];
+            for (size_t s = 0; s < sizeof(isas) / sizeof(isas[0]); ++s)
+            {
+                if (!memops_set_isa(isas[s]))
+                {
+                    continue;
+                }
+                for (size_t len = 1; len < MAXLEN; len += 3)
+                {
+                    data_t a = random_i4(len, x);
+                    data_t r;
+                    int64_t sum = 0;
+                    int32_t least = x[0];
+                    int32_t most = x[0];
+                    for (size_t i = 0; i < len; ++i)
+                    {
+                        sum += x[i];
+                        least = x[i] < least ? x[i] : least;
+                        most = x[i] > most ? x[i] : most;
+                    }
+                    check(0 == arr_reduce(&r, ARR_SUM, a));
+                    check(DATA_I8 == data_typeof(r) && sum == data_i8(r));
+                    un_data(r);
+                    check(0 == arr_reduce(&r, ARR_LEAST, a) && least == data_i4(r));
+                    check(0 == arr_reduce(&r, ARR_MOST, a) && most == data_i4(r));
+                    un_data(a);
+                }
+            }
+            if (!memops_set_isa(MEMOPS_AVX2))
+            {
+                memops_set_isa(MEMOPS_SSE2);
+            }
+
+            data_t a;
+            data_t r;
+            mk_arr(&a, DATA_F4, 3, (const float[]){ 0.5f, 0.25f, 2.0f });
+            check(0 == arr_reduce(&r, ARR_SUM, a) && 2.75f == data_f4(r));
+            un_data(a);
+            mk_arr(&a, DATA_U2, 0, NULL);
+            check(0 == arr_reduce(&r, ARR_SUM, a) && 0 == data_u8(r));
+            check(EDOM == arr_reduce(&r, ARR_MOST, a));
+            un_data(a);
+        }
+
+        it("should compare into masks and filter")
+        {
+            int32_t x[MAXLEN];
+            int32_t y[MAXLEN];
+            for (size_t s = 0; s < sizeof(isas) / sizeof(isas[0]); ++s)
+            {
+                if (!memops_set_isa(isas[s]))
+                {
+                    continue;
+                }
+                for (size_t len = 0; len < MAXLEN; len += 11)
+                {
+                    data_t a = random_i4(len, x);
+                    data_t b = random_i4(len, y);
+                    data_t m;
+                    data_t f;
+                    data_t r;
+
+                    check(0 == arr_compare(&m, ARR_LT, a, b));
+                    check(DATA_BOOL == arr_elem(m) && len == arr_len(m));
+                    const uint8_t *mv = arr_data(m);
+                    size_t kept = 0;
+                    for (size_t i = 0; i < len; ++i)
+                    {
+                        check((x[i] < y[i]) == mv[i]);
+                        kept += x[i] < y[i];
+                    }
+
+                    check(0 == arr_filter(&f, a, m));
+                    check(kept == arr_len(f));
+                    const int32_t *fv = arr_data(f);
+                    for (size_t i = 0, j = 0; i < len; ++i)
+                    {
+                        if (x[i] < y[i])
+                        {
+                            check(x[i] == fv[j++]);
+                        }
+                    }
+
+                    check(0 == arr_reduce(&r, ARR_SUM, m) && kept == data_u8(r));
+                    check(0 == arr_reduce(&r, ARR_MOST, m) || 0 == len);
+                    if (len)
+                    {
+                        check((kept > 0) == data_bool(r));
+                    }
+
+                    un_data(f);
+                    un_data(m);
+                    un_data(a);
+                    un_data(b);
+                }
+            }
+            if (!memops_set_isa(MEMOPS_AVX2))
+            {
+                memops_set_isa(MEMOPS_SSE2);
+            }
+
+            data_t a;
+            data_t m;
+            mk_arr(&a, DATA_U1, 3, (const uint8_t[]){ 1, 2, 3 });
+            mk_arr(&m, DATA_BOOL, 2, NULL);
+            data_t r;
+            check(ERANGE == arr_filter(&r, a, m));
+            check(EINVAL == arr_filter(&r, a, a));
+            un_data(m);
+            check(0 == arr_compare(&m, ARR_GE, a, mk_u1(2)));
+            check(!memcmp(arr_data(m), (const uint8_t[]){ 0, 1, 1 }, 3));
+            un_data(m);
+            un_data(a);
+        }
+
+        it("should gather")
+        {
+            data_t a;
+            data_t idx;
+            data_t r;
+            mk_arr(&a, DATA_F8, 4, (const double[]){ 1.5, 2.5, 3.5, 4.5 });
+            mk_arr(&idx, DATA_I2, 5, (const int16_t[]){ 3, 0, 0, 2, 1 });
+            check(0 == arr_gather(&r, a, idx));
+            check(!memcmp(arr_data(r), (const double[]){ 4.5, 1.5, 1.5, 3.5, 2.5 }, 5 * sizeof(double)));
+            un_data(r);
+            un_data(idx);
+
+            mk_arr(&idx, DATA_I4, 1, (const int32_t[]){ -1 });
+            check(ERANGE == arr_gather(&r, a, idx));
+            un_data(idx);
+            mk_arr(&idx, DATA_U8, 1, (const uint64_t[]){ 4 });
+            check(ERANGE == arr_gather(&r, a, idx));
+            un_data(idx);
+            check(EINVAL == arr_gather(&r, a, a));
+            un_data(a);
+        }
+
+        it("should map, filter and reduce in parallel")
+        {
+            sched_t s;
+            check(0 == sched_init(&s, 4));
+            size_t n = 100000;
+            int32_t *x = memget(n * sizeof(int32_t));
+            int64_t total = 0;
+            for (size_t i = 0; i < n; ++i)
+            {
+                // Large enough that the sum leaves int32
+                x[i] = 2000000 + (int32_t)(next() % 1000);
+                total += x[i];
+            }
+            data_t a;
+            data_t r;
+            mk_arr(&a, DATA_I4, n, x);
+
+            const arr_fn_t tri = { triple, NULL, true, NULL };
+            check(0 == arr_pmap(&r, &s, DATA_I4, a, &tri));
+            check(n == arr_len(r));
+            const int32_t *rv = arr_data(r);
+            size_t wrong = 0;
+            for (size_t i = 0; i < n; ++i)
+            {
+                wrong += x[i] * 3 != rv[i];
+            }
+            check(0 == wrong);
+            un_data(r);
+            check(EINVAL == arr_pmap(&r, &s, DATA_I8, a, &tri));
+
+            const arr_fn_t ev = { even, NULL, true, NULL };
+            check(0 == arr_pfilter(&r, &s, a, &ev));
+            rv = arr_data(r);
+            size_t j = 0;
+            for (size_t i = 0; i < n; ++i)
+            {
+                if (0 == x[i] % 2)
+                {
+                    wrong += j >= arr_len(r) || x[i] != rv[j];
+                    ++j;
+                }
+            }
+            check(0 == wrong && j == arr_len(r));
+            un_data(r);
+            check(EINVAL == arr_pfilter(&r, &s, a, &tri));
+
+            data_t init;
+            data_t serial;
+            mk_i8(&init, 0);
+            const arr_fn_t add = { sum, NULL, true, merge };
+            check(0 == arr_preduce(&serial, NULL, a, init, &add) && total == data_i8(serial));
+            check(0 == arr_preduce(&r, &s, a, init, &add) && data_i8(serial) == data_i8(r));
+            un_data(serial);
+            un_data(r);
+            un_data(init);
+            // Without combine the fold runs in order, so init need not be 0
+            mk_i8(&init, 5);
+            const arr_fn_t ordered = { sum, NULL, true, NULL };
+            check(0 == arr_preduce(&r, &s, a, init, &ordered) && total + 5 == data_i8(r));
+            un_data(r);
+            const arr_fn_t lst = { last, NULL, true, NULL };
+            check(0 == arr_preduce(&r, &s, a, init, &lst) && x[n - 1] == data_i4(r));
+            un_data(init);
+            un_data(a);
+
+            // Impure functions see every element in order, on this thread
+            mk_arr(&a, DATA_I4, MAXLEN, x);
+            int32_t stop = -1;
+            const arr_fn_t rec = { record, &stop, false, NULL };
+            nseen = 0;
+            check(0 == arr_pmap(&r, &s, DATA_I4, a, &rec));
+            check(MAXLEN == nseen && !memcmp(seen, x, sizeof(seen)));
+            un_data(r);
+            stop = x[MAXLEN / 2];
+            check(EDOM == arr_pmap(&r, &s, DATA_I4, a, &rec));
+            check(EDOM == arr_pmap(&r, NULL, DATA_I4, a, &(arr_fn_t){ record, &stop, true, NULL }));
+            mk_arr(&r, DATA_I4, 0, NULL);
+            check(0 == arr_preduce(&init, &s, r, mk_i4(9), &lst) && 9 == data_i4(init));
+            un_data(r);
+            un_data(a);
+            memput(x);
+            sched_destroy(&s);
+        }
+    }
+}
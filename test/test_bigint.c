@@ -0,0 +1,221 @@
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "bdd.h"
+#include "data.h"
+
+
+#define TEN19 10000000000000000000ULL
+
+/**
+ * Decimal string of an integer, by 19 digit chunks.
+ */
+static void
+decimal(data_t d, char *out, size_t outlen)
+{
+    uint64_t chunks[64];
+    size_t n = 0;
+    data_t zero;
+    mk_int(&zero, 0);
+    bool neg = data_int_cmp(d, zero) < 0;
+    data_t q = data_ref(d);
+
+    bool more = true;
+    while (more)
+    {
+        data_t next;
+        uint64_t rem;
+        data_int_divmod_small(&next, &rem, q, TEN19);
+        un_data(q);
+        q = next;
+        chunks[n++] = rem;
+
+        uint64_t one;
+        bool qneg;
+        const uint64_t *limbs;
+        more = 0 != data_int_limbs(&q, &qneg, &limbs, &one);
+    }
+    un_data(q);
+
+    size_t at = 0;
+    if (neg)
+    {
+        at += snprintf(out + at, outlen - at, "-");
+    }
+    at += snprintf(out + at, outlen - at, "%llu", (unsigned long long)chunks[--n]);
+    while (n)
+    {
+        at += snprintf(out + at, outlen - at, "%019llu", (unsigned long long)chunks[--n]);
+    }
+}
+
+static data_t
+power(int64_t base, int exp)
+{
+    data_t r;
+    data_t b;
+    mk_int(&r, 1);
+    mk_int(&b, base);
+    while (exp--)
+    {
+        data_t next;
+        data_int_mul(&next, r, b);
+        un_data(r);
+        r = next;
+    }
+    return r;
+}
+
+spec("symbolscript library")
+{
+    describe("bigint")
+    {
+        it("should keep small arithmetic inline")
+        {
+            data_t a;
+            data_t b;
+            data_t r;
+            check(0 == mk_int(&a, 3));
+            check(0 == mk_int(&b, -4));
+            check(0 == data_int_add(&r, a, b));
+            check(!data_isobj(r));
+            check(DATA_I == data_typeof(r));
+            int64_t v;
+            check(data_int_i8(r, &v) && -1 == v);
+            check(0 == data_int_mul(&r, a, b));
+            check(data_int_i8(r, &v) && -12 == v);
+        }
+
+        it("should promote on overflow and demote back")
+        {
+            data_t max;
+            data_t one;
+            data_t big;
+            data_t back;
+            char buf[64];
+            mk_int(&max, DATA_INLINE_MAX);
+            mk_int(&one, 1);
+            check(0 == data_int_add(&big, max, one));
+            check(data_isobj(big));
+            check(DATA_I == data_typeof(big));
+            check(data_int_cmp(big, max) > 0);
+            check(0 == data_int_sub(&back, big, one));
+            check(!data_isobj(back));
+            check(back.bits == max.bits);
+            un_data(big);
+
+            data_t min;
+            mk_int(&min, DATA_INLINE_MIN);
+            check(0 == data_int_sub(&big, min, one));
+            check(data_isobj(big));
+            decimal(big, buf, sizeof(buf));
+            check(0 == strcmp("-140737488355329", buf), "%s", buf);
+            un_data(big);
+        }
+
+        it("should multiply past 64 bits")
+        {
+            char buf[256];
+            data_t r = power(2, 80);
+            decimal(r, buf, sizeof(buf));
+            check(0 == strcmp("1208925819614629174706176", buf), "%s", buf);
+            un_data(r);
+
+            data_t f;
+            mk_int(&f, 1);
+            int64_t i;
+            for (i = 2; i <= 60; ++i)
+            {
+                data_t k;
+                data_t next;
+                mk_int(&k, i);
+                data_int_mul(&next, f, k);
+                un_data(f);
+                f = next;
+            }
+            decimal(f, buf, sizeof(buf));
+            check(0 == strcmp("8320987112741390144276341183223364380754172606361245952449277696409600000000000000", buf), "%s", buf);
+            un_data(f);
+        }
+
+        it("should agree between Karatsuba and schoolbook")
+        {
+            // 3^4000 is ~100 limbs, squaring it takes the Karatsuba path,
+            // building 3^8000 one factor at a time never does
+            data_t x = power(3, 4000);
+            data_t y = power(3, 8000);
+            data_t sq;
+            check(0 == data_int_mul(&sq, x, x));
+            check(0 == data_int_cmp(sq, y));
+
+            // Unbalanced operands
+            data_t z = power(7, 300);
+            data_t a;
+            data_t b;
+            data_t w = power(7, 301);
+            check(0 == data_int_mul(&a, y, z));
+            data_t seven;
+            mk_int(&seven, 7);
+            check(0 == data_int_mul(&b, a, seven));
+            data_t c;
+            check(0 == data_int_mul(&c, y, w));
+            check(0 == data_int_cmp(b, c));
+
+            un_data(x);
+            un_data(y);
+            un_data(z);
+            un_data(w);
+            un_data(sq);
+            un_data(a);
+            un_data(b);
+            un_data(c);
+        }
+
+        it("should handle signs")
+        {
+            data_t a = power(-2, 65);
+            data_t b = power(2, 65);
+            data_t r;
+            check(data_int_cmp(a, b) < 0);
+            check(0 == data_int_add(&r, a, b));
+            check(!data_isobj(r));
+            int64_t v;
+            check(data_int_i8(r, &v) && 0 == v);
+            un_data(a);
+            un_data(b);
+        }
+
+        it("should reject mixed types and negative unsigned")
+        {
+            data_t i;
+            data_t u;
+            data_t r;
+            mk_int(&i, 1);
+            mk_uint(&u, 1);
+            check(DATA_U == data_typeof(u));
+            check(EINVAL == data_int_add(&r, i, u));
+            check(EINVAL == data_int_add(&r, i, mk_i4(1)));
+            uint64_t rem;
+            check(EINVAL == data_int_divmod_small(&r, &rem, mk_i4(1), 10));
+            check(EINVAL == data_int_divmod_small(&r, &rem, mk_f8(1.0), 10));
+
+            data_t two;
+            mk_uint(&two, 2);
+            check(ERANGE == data_int_sub(&r, u, two));
+
+            data_t big;
+            mk_uint(&big, UINT64_MAX);
+            check(data_isobj(big));
+            check(0 == data_int_mul(&r, big, two));
+            check(DATA_U == data_typeof(r));
+            uint64_t v;
+            check(!data_int_u8(r, &v));
+            un_data(r);
+            un_data(big);
+        }
+    }
+}
+
@@ -0,0 +1,247 @@
+
+#include <errno.h>
+#include <stdint.h>
+
+#include "bdd.h"
+#include "channel.h"
+
+
+#define COUNT 20000
+#define PRODUCERS 4
+#define CONSUMERS 4
+
+static sched_t s;
+static chan_t stages[3];
+static chan_t mpmc;
+
+static error_t
+produce(data_t *result, size_t ncaptured, const data_t *captured)
+{
+    (void)ncaptured;
+    int32_t id = data_i4(captured[0]);
+    for (uint64_t i = 0; i < COUNT; ++i)
+    {
+        data_t v;
+        error_t err = mk_u8(&v, (1ULL << 60) + i * PRODUCERS + id);
+        if (!err)
+        {
+            err = chan_send(&mpmc, v);
+            un_data(v);
+        }
+        if (err)
+        {
+            return err;
+        }
+    }
+    *result = mk_bool(true);
+    return 0;
+}
+
+static error_t
+consume(data_t *result, size_t ncaptured, const data_t *captured)
+{
+    (void)ncaptured;
+    (void)captured;
+    uint64_t sum = 0;
+    data_t v;
+    error_t err;
+    while (!(err = chan_recv(&mpmc, &v)))
+    {
+        sum += data_u8(v) - (1ULL << 60);
+        un_data(v);
+    }
+    if (EPIPE != err)
+    {
+        return err;
+    }
+    return mk_u8(result, sum);
+}
+
+/**
+ * Stage i reads stage i - 1's channel and writes its own.
+ */
+static error_t
+stage(data_t *result, size_t ncaptured, const data_t *captured)
+{
+    (void)ncaptured;
+    int32_t i = data_i4(captured[0]);
+    error_t err = 0;
+    int64_t sum = 0;
+    if (0 == i)
+    {
+        for (int32_t n = 0; n < COUNT && !err; ++n)
+        {
+            err = chan_send(&stages[0], mk_i4(n));
+        }
+        chan_close(&stages[0]);
+    }
+    else
+    {
+        data_t v;
+        while (!(err = chan_recv(&stages[i - 1], &v)))
+        {
+            if (i < 3)
+            {
+                chan_send(&stages[i], mk_i4(data_i4(v) * 2 + (1 == i)));
+            }
+            else
+            {
+                sum += data_i4(v);
+            }
+        }
+        if (i < 3)
+        {
+            chan_close(&stages[i]);
+        }
+        err = EPIPE == err ? 0 : err;
+    }
+    *result = mk_i4((int32_t)(sum % 1000000007));
+    return err;
+}
+
+spec("symbolscript library")
+{
+    describe("channel")
+    {
+        it("should queue in order up to its size")
+        {
+            check(0 == sched_init(&s, 1));
+            chan_t c;
+            data_t v;
+            check(EINVAL == chan_init(&c, &s, 0));
+            check(0 == chan_init(&c, &s, 3));
+            check(EAGAIN == chan_tryrecv(&c, &v));
+            for (int32_t i = 0; i < 4; ++i)
+            {
+                check(0 == chan_trysend(&c, mk_i4(i)));
+            }
+            check(EAGAIN == chan_trysend(&c, mk_i4(4)));
+            check(0 == chan_recv(&c, &v) && 0 == data_i4(v));
+            check(0 == chan_send(&c, mk_i4(4)));
+
+            chan_close(&c);
+            check(EPIPE == chan_send(&c, mk_i4(5)));
+            for (int32_t i = 1; i < 5; ++i)
+            {
+                check(0 == chan_recv(&c, &v) && i == data_i4(v));
+            }
+            check(EPIPE == chan_recv(&c, &v));
+            chan_destroy(&c);
+
+            // Values left behind are released
+            check(0 == chan_init(&c, &s, 2));
+            check(0 == mk_u8(&v, UINT64_MAX));
+            check(0 == chan_send(&c, v));
+            un_data(v);
+            chan_destroy(&c);
+            sched_destroy(&s);
+        }
+
+        it("should run a pipeline with more stages than workers")
+        {
+            check(0 == sched_init(&s, 2));
+            for (int i = 0; i < 3; ++i)
+            {
+                check(0 == chan_init(&stages[i], &s, 4));
+            }
+            task_t *tasks[4];
+            for (int32_t i = 0; i < 4; ++i)
+            {
+                check(0 == sched_spawn(&s, &tasks[i], stage, 1, (data_t[]){ mk_i4(i) }));
+            }
+            data_t r;
+            int64_t expect = 0;
+            for (int64_t n = 0; n < COUNT; ++n)
+            {
+                expect += (n * 2 + 1) * 2;
+            }
+            for (int i = 3; i >= 0; --i)
+            {
+                check(0 == sched_await(tasks[i], &r));
+                if (3 == i)
+                {
+                    check(expect % 1000000007 == data_i4(r));
+                }
+            }
+            for (int i = 0; i < 3; ++i)
+            {
+                chan_destroy(&stages[i]);
+            }
+            sched_destroy(&s);
+        }
+
+        it("should hand off between many senders and receivers")
+        {
+            check(0 == sched_init(&s, 0));
+            check(0 == chan_init(&mpmc, &s, 16));
+            task_t *producers[PRODUCERS];
+            task_t *consumers[CONSUMERS];
+            for (int32_t i = 0; i < CONSUMERS; ++i)
+            {
+                check(0 == sched_spawn(&s, &consumers[i], consume, 0, NULL));
+            }
+            for (int32_t i = 0; i < PRODUCERS; ++i)
+            {
+                check(0 == sched_spawn(&s, &producers[i], produce, 1, (data_t[]){ mk_i4(i) }));
+            }
+            data_t r;
+            for (int i = 0; i < PRODUCERS; ++i)
+            {
+                check(0 == sched_await(producers[i], &r));
+            }
+            chan_close(&mpmc);
+            uint64_t sum = 0;
+            for (int i = 0; i < CONSUMERS; ++i)
+            {
+                check(0 == sched_await(consumers[i], &r));
+                sum += data_u8(r);
+                un_data(r);
+            }
+            uint64_t n = (uint64_t)COUNT * PRODUCERS;
+            check(n * (n - 1) / 2 == sum);
+            chan_destroy(&mpmc);
+            sched_destroy(&s);
+        }
+
+        it("should select whichever operation is ready")
+        {
+            check(0 == sched_init(&s, 1));
+            chan_t a;
+            chan_t b;
+            check(0 == chan_init(&a, &s, 1));
+            check(0 == chan_init(&b, &s, 1));
+            check(0 == chan_send(&b, mk_i4(7)));
+
+            size_t which;
+            chan_op_t ops[2] = { { &a, false, mk_bool(false) }, { &b, false, mk_bool(false) } };
+            check(0 == chan_select(2, ops, &which) && 1 == which && 7 == data_i4(ops[1].v));
+
+            // b still has room for one more, a is full
+            check(0 == chan_send(&a, mk_i4(1)));
+            check(0 == chan_send(&a, mk_i4(2)));
+            check(0 == chan_send(&b, mk_i4(3)));
+            chan_op_t sends[2] = { { &a, true, mk_i4(8) }, { &b, true, mk_i4(9) } };
+            check(0 == chan_select(2, sends, &which) && 1 == which);
+            check(EAGAIN == chan_trysend(&b, mk_i4(10)));
+
+            // One select waits through one scheduler
+            sched_t other;
+            chan_t c;
+            check(0 == sched_init(&other, 1));
+            check(0 == chan_init(&c, &other, 1));
+            chan_op_t mixed[2] = { { &a, false, mk_bool(false) }, { &c, false, mk_bool(false) } };
+            check(EINVAL == chan_select(2, mixed, &which));
+            chan_destroy(&c);
+            sched_destroy(&other);
+
+            chan_close(&a);
+            check(0 == chan_recv(&a, &ops[0].v) && 0 == chan_recv(&a, &ops[0].v));
+            ops[1].chan = &a;
+            check(EPIPE == chan_select(1, &ops[1], &which) && 0 == which);
+            chan_destroy(&a);
+            chan_destroy(&b);
+            sched_destroy(&s);
+        }
+    }
+}
+
@@ -0,0 +1,433 @@
+
+#include <errno.h>
+#include <float.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "bdd.h"
+#include "data.h"
+
+
+#define TOBUF (const uint8_t *)
+#define READERS 8
+
+static void *
+flatten(void *arg)
+{
+    const bin_t *flat = data_bin(*(data_t *)arg);
+    return (void *)(uintptr_t)(flat ? bin_len(flat) : 0);
+}
+
+spec("symbolscript library")
+{
+    describe("data")
+    {
+        it("should fit in one word")
+        {
+            check(sizeof(data_t) == sizeof(uint64_t));
+        }
+
+        it("should store doubles inline")
+        {
+            const double values[] = { 0.0, -0.0, 1.5, -3.25, DBL_MAX, DBL_MIN, INFINITY, -INFINITY };
+            size_t i;
+            for (i = 0; i < sizeof(values)/sizeof(*values); ++i)
+            {
+                data_t d = mk_f8(values[i]);
+                check(DATA_F8 == data_typeof(d));
+                check(!data_isobj(d));
+                check(0 == memcmp(&values[i], &d.bits, sizeof(double)));
+            }
+        }
+
+        it("should canonicalize NaN")
+        {
+            data_t d = mk_f8(-NAN);
+            check(DATA_F8 == data_typeof(d));
+            check(DATA_NAN == d.bits);
+            check(isnan(data_f8(d)));
+            check(data_eq(d, mk_f8(NAN)));
+            check(data_hash(d) == data_hash(mk_f8(NAN)));
+
+            data_t f = mk_f4(-NAN);
+            check(DATA_F4 == data_typeof(f));
+            check(DATA_NAN4 == data_imm(f));
+            check(isnan(data_f4(f)));
+            check(f.bits == mk_f4(NAN).bits);
+            check(data_eq(f, mk_f4(NAN)));
+            check(data_hash(f) == data_hash(mk_f4(NAN)));
+        }
+
+        it("should store small scalars inline")
+        {
+            check(DATA_I4 == data_typeof(mk_i4(-7)));
+            check(-7 == data_i4(mk_i4(-7)));
+            check(INT32_MIN == data_i4(mk_i4(INT32_MIN)));
+            check(DATA_U4 == data_typeof(mk_u4(UINT32_MAX)));
+            check(UINT32_MAX == data_u4(mk_u4(UINT32_MAX)));
+            check(DATA_I1 == data_typeof(mk_i1(-1)));
+            check(-1 == data_i4(mk_i1(-1)));
+            check(DATA_BOOL == data_typeof(mk_bool(true)));
+            check(data_bool(mk_bool(true)));
+            check(!data_bool(mk_bool(false)));
+            check(DATA_F4 == data_typeof(mk_f4(2.5f)));
+            check(2.5f == data_f4(mk_f4(2.5f)));
+        }
+
+        it("should box only large 64-bit integers")
+        {
+            data_t d;
+            check(0 == mk_i8(&d, -12345));
+            check(!data_isobj(d));
+            check(DATA_I8 == data_typeof(d));
+            check(-12345 == data_i8(d));
+
+            check(0 == mk_i8(&d, DATA_INLINE_MIN));
+            check(!data_isobj(d));
+            check(DATA_INLINE_MIN == data_i8(d));
+
+            check(0 == mk_i8(&d, INT64_MIN));
+            check(data_isobj(d));
+            check(DATA_I8 == data_typeof(d));
+            check(INT64_MIN == data_i8(d));
+            un_data(d);
+
+            check(0 == mk_u8(&d, DATA_INLINE_UMAX));
+            check(!data_isobj(d));
+            check(DATA_INLINE_UMAX == data_u8(d));
+
+            check(0 == mk_u8(&d, UINT64_MAX));
+            check(data_isobj(d));
+            check(DATA_U8 == data_typeof(d));
+            check(UINT64_MAX == data_u8(d));
+            un_data(d);
+        }
+
+        it("should store small symbols inline")
+        {
+            data_t a;
+            data_t b;
+            size_t len;
+            check(0 == mk_sym(&a, 5, TOBUF "value"));
+            check(0 == mk_sym(&b, 5, TOBUF "value"));
+            check(!data_isobj(a));
+            check(DATA_SYM == data_typeof(a));
+            check(a.bits == b.bits);
+            check(0 == memcmp("value", data_sym(&a, &len), 5));
+            check(5 == len);
+
+            check(0 == mk_sym(&a, 0, TOBUF ""));
+            data_sym(&a, &len);
+            check(0 == len);
+        }
+
+        it("should box long symbols and compare by content")
+        {
+            data_t a;
+            data_t b;
+            data_t c;
+            size_t len;
+            check(0 == mk_sym(&a, 10, TOBUF "headerKey1"));
+            check(0 == mk_sym(&b, 10, TOBUF "headerKey1"));
+            check(0 == mk_sym(&c, 6, TOBUF "header"));
+            check(data_isobj(a));
+            check(DATA_SYM == data_typeof(a));
+            check(data_sym_eq(a, b));
+            check(!data_sym_eq(a, c));
+            check(0 == memcmp("headerKey1", data_sym(&a, &len), 10));
+            check(10 == len);
+
+            data_t shared = data_ref(a);
+            un_data(a);
+            check(data_sym_eq(shared, b));
+            un_data(shared);
+            un_data(b);
+            un_data(c);
+        }
+    }
+
+    describe("binary")
+    {
+        it("should store short payloads inline")
+        {
+            bin_t b;
+            check(0 == mk_bin(&b, 5, TOBUF "hello"));
+            check(bin_issmall(&b));
+            check(5 == bin_len(&b));
+            check(0 == memcmp("hello", bin_bytes(&b), 5));
+            check(sizeof(bin_t) == 16);
+            un_bin(b);
+        }
+
+        it("should share storage between substrings")
+        {
+            const char *text = "the quick brown fox jumps over the lazy dog";
+            bin_t b;
+            bin_t sub;
+            bin_t tiny;
+            check(0 == mk_bin(&b, strlen(text), TOBUF text));
+            check(!bin_issmall(&b));
+
+            check(0 == bin_sub(&sub, &b, 4, 15));
+            check(!bin_issmall(&sub));
+            check(sub.big.buf == b.big.buf);
+            check(0 == memcmp("quick brown fox", bin_bytes(&sub), 15));
+
+            check(0 == bin_sub(&tiny, &sub, 6, 5));
+            check(bin_issmall(&tiny));
+            check(0 == memcmp("brown", bin_bytes(&tiny), 5));
+
+            check(ERANGE == bin_sub(&tiny, &b, 40, 10));
+
+            un_bin(b);
+            check(0 == memcmp("quick brown fox", bin_bytes(&sub), 15));
+            un_bin(sub);
+        }
+
+        it("should copy on write when shared")
+        {
+            const char *text = "copy on write is lazy";
+            bin_t a;
+            bin_t b;
+            uint8_t *s;
+            check(0 == mk_bin(&a, strlen(text), TOBUF text));
+            b = bin_ref(a);
+
+            check(0 == bin_mut(&b, &s));
+            s[0] = 'C';
+            check(a.big.buf != b.big.buf);
+            check('c' == bin_bytes(&a)[0]);
+            check('C' == bin_bytes(&b)[0]);
+
+            // Unique now, so no further copy
+            binbuf_t *buf = b.big.buf;
+            check(0 == bin_mut(&b, &s));
+            check(buf == b.big.buf);
+
+            un_bin(a);
+            un_bin(b);
+        }
+
+        it("should box as DATA_BIN")
+        {
+            bin_t b;
+            data_t d;
+            check(0 == mk_bin(&b, 20, TOBUF "twenty bytes of text"));
+            check(0 == mk_bin_data(&d, b));
+            check(DATA_BIN == data_typeof(d));
+            check(20 == bin_len(data_bin(d)));
+            un_data(d);
+        }
+    }
+
+    describe("builder")
+    {
+        it("should append in place when unique")
+        {
+            bin_t b;
+            size_t i;
+            check(0 == mk_bin(&b, 0, TOBUF ""));
+            for (i = 0; i < 1000; ++i)
+            {
+                check(0 == bin_cat(&b, 3, TOBUF "abc"));
+            }
+            check(3000 == bin_len(&b));
+            check(b.big.buf->cap < 6000);
+            check(0 == memcmp("abcabc", bin_bytes(&b) + 2994, 6));
+
+            bin_t shared = bin_ref(b);
+            check(0 == bin_cat(&b, 1, TOBUF "!"));
+            check(shared.big.buf != b.big.buf);
+            check(3000 == bin_len(&shared));
+            un_bin(shared);
+            un_bin(b);
+        }
+
+        it("should concatenate pieces in order")
+        {
+            binbuilder_t bb;
+            bin_t big;
+            bin_t out;
+            char text[300];
+            memset(text, 'x', sizeof(text));
+
+            binbuilder_init(&bb);
+            check(0 == mk_bin(&big, sizeof(text), TOBUF text));
+            check(0 == binbuilder_add(&bb, 6, TOBUF "head: "));
+            check(0 == binbuilder_add_bin(&bb, &big));
+            check(0 == binbuilder_add(&bb, 5, TOBUF " tail"));
+            check(311 == bb.len);
+            // Large binaries are shared, not copied
+            check(2 == big.big.buf->refs);
+
+            check(0 == binbuilder_finish(&bb, &out));
+            check(311 == bin_len(&out));
+            check(0 == memcmp("head: xxx", bin_bytes(&out), 9));
+            check(0 == memcmp("x tail", bin_bytes(&out) + 305, 6));
+            check(1 == big.big.buf->refs);
+            check(0 == bb.len);
+
+            binbuilder_destroy(&bb);
+            un_bin(big);
+            un_bin(out);
+        }
+
+        it("should build many small appends")
+        {
+            binbuilder_t bb;
+            bin_t out;
+            size_t i;
+            binbuilder_init(&bb);
+            for (i = 0; i < 10000; ++i)
+            {
+                uint8_t c = (uint8_t)('a' + i % 26);
+                check(0 == binbuilder_add(&bb, 1, &c));
+            }
+            check(0 == binbuilder_finish(&bb, &out));
+            check(10000 == bin_len(&out));
+            for (i = 0; i < 10000; ++i)
+            {
+                if (bin_bytes(&out)[i] != (uint8_t)('a' + i % 26))
+                {
+                    break;
+                }
+            }
+            check(10000 == i);
+            binbuilder_destroy(&bb);
+            un_bin(out);
+        }
+
+        it("should flatten DATA_BIN ropes lazily")
+        {
+            bin_t part;
+            data_t d;
+            data_t shared;
+            check(0 == mk_bin(&part, 0, TOBUF ""));
+            check(0 == mk_bin_data(&d, part));
+            check(0 == mk_bin(&part, 4, TOBUF "line"));
+            size_t i;
+            for (i = 0; i < 100; ++i)
+            {
+                check(0 == data_bin_cat(&d, &part));
+            }
+            shared = data_ref(d);
+            check(0 == data_bin_cat(&d, &part));
+            check(shared.bits != d.bits);
+
+            const bin_t *flat = data_bin(d);
+            check(404 == bin_len(flat));
+            check(0 == memcmp("lineline", bin_bytes(flat) + 396, 8));
+            check(400 == bin_len(data_bin(shared)));
+
+            un_bin(part);
+            un_data(shared);
+            un_data(d);
+        }
+
+        it("should append a binary to itself")
+        {
+            const size_t lens[] = { 5, 300 };
+            uint8_t text[300];
+            size_t i;
+            for (i = 0; i < sizeof(text); ++i)
+            {
+                text[i] = (uint8_t)('a' + i % 26);
+            }
+            for (i = 0; i < sizeof(lens)/sizeof(*lens); ++i)
+            {
+                size_t n = lens[i];
+                bin_t b;
+                data_t d;
+                check(0 == mk_bin(&b, n, text));
+                check(0 == mk_bin_data(&d, b));
+                check(0 == data_bin_cat(&d, data_bin(d)), "%zu", n);
+                const bin_t *flat = data_bin(d);
+                check(2 * n == bin_len(flat), "%zu", n);
+                check(!memcmp(text, bin_bytes(flat), n), "%zu", n);
+                check(!memcmp(text, bin_bytes(flat) + n, n), "%zu", n);
+
+                // Shared, so the append goes to a copy
+                data_t shared = data_ref(d);
+                check(0 == data_bin_cat(&d, data_bin(d)), "%zu", n);
+                check(4 * n == bin_len(data_bin(d)), "%zu", n);
+                check(!memcmp(text, bin_bytes(data_bin(d)) + 3 * n, n), "%zu", n);
+                check(2 * n == bin_len(data_bin(shared)), "%zu", n);
+                un_data(shared);
+                un_data(d);
+            }
+        }
+
+        it("should flatten a shared rope once across threads")
+        {
+            bin_t part;
+            data_t d;
+            check(0 == mk_bin(&part, 0, TOBUF ""));
+            check(0 == mk_bin_data(&d, part));
+            check(0 == mk_bin(&part, 4, TOBUF "line"));
+            size_t i;
+            for (i = 0; i < 100; ++i)
+            {
+                check(0 == data_bin_cat(&d, &part));
+            }
+            data_t shared[READERS];
+            pthread_t t[READERS];
+            for (i = 0; i < READERS; ++i)
+            {
+                shared[i] = data_ref(d);
+                check(0 == pthread_create(&t[i], NULL, flatten, &shared[i]));
+            }
+            for (i = 0; i < READERS; ++i)
+            {
+                void *len;
+                pthread_join(t[i], &len);
+                check(400 == (uintptr_t)len);
+                un_data(shared[i]);
+            }
+            check(0 == memcmp("lineline", bin_bytes(data_bin(d)) + 392, 8));
+
+            un_bin(part);
+            un_data(d);
+        }
+    }
+
+    describe("binary ops")
+    {
+        it("should compare, find and fold binaries")
+        {
+            const char *text = "GET /index.html HTTP/1.1 Host: example.com";
+            bin_t hay;
+            bin_t needle;
+            bin_t other;
+            bin_t lower;
+            check(0 == mk_bin(&hay, strlen(text), TOBUF text));
+            check(0 == mk_bin(&needle, 4, TOBUF "HTTP"));
+            check(0 == mk_bin(&other, strlen(text), TOBUF text));
+
+            check(bin_eq(&hay, &other));
+            check(!bin_eq(&hay, &needle));
+            check(0 == bin_cmp(&hay, &other));
+            check(bin_cmp(&needle, &hay) > 0);
+            check(bin_hash(&hay) == bin_hash(&other));
+
+            check(16 == bin_find(&hay, &needle, 0));
+            check(BIN_NPOS == bin_find(&hay, &needle, 17));
+            check(4 == bin_findbyte(&hay, '/', 0));
+            check(20 == bin_findbyte(&hay, '/', 5));
+            check(BIN_NPOS == bin_findbyte(&hay, '#', 0));
+
+            check(0 == bin_lower(&lower, &hay));
+            check(0 == memcmp("get /index.html http/1.1", bin_bytes(&lower), 24));
+
+            un_bin(hay);
+            un_bin(needle);
+            un_bin(other);
+            un_bin(lower);
+        }
+    }
+}
+
+
+
+
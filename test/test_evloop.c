@@ -0,0 +1,226 @@
+
+#include <errno.h>
+#include <spawn.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "bdd.h"
+#include "evloop.h"
+
+
+#define CLIENTS 8
+#define CHILDREN 24
+
+extern char **environ;
+
+static sched_t s;
+static evloop_t ev;
+static int pipefd[2];
+static int listener;
+static struct sockaddr_un addr;
+
+static double
+now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static error_t
+reader(data_t *result, size_t ncaptured, const data_t *captured)
+{
+    (void)ncaptured;
+    (void)captured;
+    char buf[16];
+    size_t n;
+    error_t err = ev_read(&ev, pipefd[0], buf, sizeof(buf), &n);
+    *result = mk_i4(err ? -1 : (int32_t)n);
+    return err;
+}
+
+static error_t
+quick(data_t *result, size_t ncaptured, const data_t *captured)
+{
+    (void)ncaptured;
+    (void)captured;
+    *result = mk_i4(7);
+    return 0;
+}
+
+/**
+ * Accept one connection and echo it until the client hangs up.
+ */
+static error_t
+echo(data_t *result, size_t ncaptured, const data_t *captured)
+{
+    (void)ncaptured;
+    (void)captured;
+    int conn;
+    error_t err = ev_accept(&ev, listener, &conn);
+    if (err)
+    {
+        return err;
+    }
+    char buf[64];
+    size_t n;
+    size_t total = 0;
+    while (!(err = ev_read(&ev, conn, buf, sizeof(buf), &n)) && n)
+    {
+        err = ev_write(&ev, conn, buf, n, &n);
+        if (err)
+        {
+            break;
+        }
+        total += n;
+    }
+    close(conn);
+    *result = mk_i4((int32_t)total);
+    return err;
+}
+
+static error_t
+client(data_t *result, size_t ncaptured, const data_t *captured)
+{
+    (void)ncaptured;
+    int32_t id = data_i4(captured[0]);
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+    {
+        return errno;
+    }
+    error_t err = 0;
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)))
+    {
+        err = errno;
+    }
+    char msg[32];
+    int len = snprintf(msg, sizeof(msg), "hello from %d", (int)id);
+    size_t n;
+    if (!err)
+    {
+        err = ev_write(&ev, fd, msg, (size_t)len, &n);
+    }
+    char back[32];
+    size_t got = 0;
+    while (!err && got < (size_t)len)
+    {
+        err = ev_read(&ev, fd, back + got, sizeof(back) - got, &n);
+        err = !err && !n ? EPIPE : err;
+        got += n;
+    }
+    close(fd);
+    *result = mk_bool(!err && !memcmp(msg, back, (size_t)len));
+    return err;
+}
+
+static error_t
+reap(data_t *result, size_t ncaptured, const data_t *captured)
+{
+    (void)ncaptured;
+    int status;
+    error_t err = ev_waitpid(&ev, (pid_t)data_i4(captured[0]), &status);
+    *result = mk_i4(err ? -1 : WEXITSTATUS(status));
+    return err;
+}
+
+spec("symbolscript library")
+{
+    describe("event loop")
+    {
+        it("should wait for a pipe without holding up other tasks")
+        {
+            check(0 == sched_init(&s, 1));
+            check(0 == evloop_init(&ev, &s));
+            check(0 == pipe(pipefd));
+            check(0 == ev_nonblock(pipefd[0]));
+
+            task_t *t;
+            task_t *other;
+            data_t r;
+            check(0 == sched_spawn(&s, &t, reader, 0, NULL));
+            usleep(20000);
+            // The one worker is waiting in the reader, yet this still runs
+            check(0 == sched_spawn(&s, &other, quick, 0, NULL));
+            check(0 == sched_await(other, &r) && 7 == data_i4(r));
+            check(1 == write(pipefd[1], "x", 1));
+            check(0 == sched_await(t, &r) && 1 == data_i4(r));
+
+            close(pipefd[1]);
+            size_t n = 1;
+            check(0 == ev_read(&ev, pipefd[0], &r, 1, &n) && 0 == n);
+            close(pipefd[0]);
+            evloop_destroy(&ev);
+            sched_destroy(&s);
+        }
+
+        it("should echo over local sockets")
+        {
+            check(0 == sched_init(&s, 2));
+            check(0 == evloop_init(&ev, &s));
+            listener = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+            check(listener >= 0);
+            memset(&addr, 0, sizeof(addr));
+            addr.sun_family = AF_UNIX;
+            // Abstract name, nothing left on disk
+            snprintf(addr.sun_path + 1, sizeof(addr.sun_path) - 1, "sym-evloop-%d", (int)getpid());
+            check(0 == bind(listener, (struct sockaddr *)&addr, sizeof(addr)));
+            check(0 == listen(listener, CLIENTS));
+
+            task_t *servers[CLIENTS];
+            task_t *clients[CLIENTS];
+            for (int32_t i = 0; i < CLIENTS; ++i)
+            {
+                check(0 == sched_spawn(&s, &servers[i], echo, 0, NULL));
+                check(0 == sched_spawn(&s, &clients[i], client, 1, (data_t[]){ mk_i4(i) }));
+            }
+            data_t r;
+            for (int i = 0; i < CLIENTS; ++i)
+            {
+                check(0 == sched_await(clients[i], &r) && data_bool(r));
+            }
+            for (int i = 0; i < CLIENTS; ++i)
+            {
+                check(0 == sched_await(servers[i], &r) && data_i4(r) >= 12);
+            }
+            close(listener);
+            evloop_destroy(&ev);
+            sched_destroy(&s);
+        }
+
+        it("should wait for many children at once")
+        {
+            check(0 == sched_init(&s, 1));
+            check(0 == evloop_init(&ev, &s));
+            double start = now();
+            task_t *tasks[CHILDREN];
+            for (int32_t i = 0; i < CHILDREN; ++i)
+            {
+                char code[32];
+                snprintf(code, sizeof(code), "sleep 0.2; exit %d", (int)i);
+                char *argv[] = { "sh", "-c", code, NULL };
+                pid_t pid;
+                check(0 == posix_spawn(&pid, "/bin/sh", NULL, NULL, argv, environ));
+                check(0 == sched_spawn(&s, &tasks[i], reap, 1, (data_t[]){ mk_i4(pid) }));
+            }
+            data_t r;
+            for (int32_t i = 0; i < CHILDREN; ++i)
+            {
+                check(0 == sched_await(tasks[i], &r) && i == data_i4(r));
+            }
+            // One after another would take CHILDREN * 0.2s
+            check(now() - start < CHILDREN * 0.2 / 2);
+
+            int status;
+            check(ECHILD == ev_waitpid(&ev, getpid(), &status));
+            evloop_destroy(&ev);
+            sched_destroy(&s);
+        }
+    }
+}
+
@@ -0,0 +1,125 @@
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "bdd.h"
+#include "frontend.h"
+
+
+#define COUNT 200000
+#define TOBUF (const uint8_t *)
+
+static ring_t ring;
+
+static void *
+produce(void *arg)
+{
+    (void)arg;
+    uintptr_t i;
+    for (i = 1; i <= COUNT; ++i)
+    {
+        if (!ring_push(&ring, (void *)i))
+        {
+            break;
+        }
+    }
+    ring_close(&ring);
+    return (void *)i;
+}
+
+typedef struct
+{
+    size_t lines;
+    size_t tokens;
+    size_t batches;
+    size_t stop_at;
+} counts_t;
+
+static error_t
+count(const linebatch_t *batch, void *arg)
+{
+    counts_t *c = arg;
+    ++c->batches;
+    c->lines += batch->nlines;
+    c->tokens += batch->nlines ? batch->ends[batch->nlines - 1] : 0;
+    return c->stop_at && c->lines >= c->stop_at ? ECANCELED : 0;
+}
+
+static error_t
+run(const char *src, size_t len, counts_t *c)
+{
+    tokenizer_t t;
+    tokenizer_init(&t);
+    liner_t liner = mk_liner_from_buffer(len, TOBUF src);
+    frontend_t f = { liner, NULL, &t, NULL };
+    error_t err = liner.open(liner.src);
+    err = err ? err : frontend_run(&f, count, c);
+    liner.close(liner.src);
+    tokenizer_destroy(&t);
+    return err;
+}
+
+spec("symbolscript library")
+{
+    describe("frontend")
+    {
+        it("should hand off through the ring in order")
+        {
+            check(0 == ring_init(&ring, 3));
+            pthread_t thread;
+            check(0 == pthread_create(&thread, NULL, produce, NULL));
+            void *p;
+            uintptr_t expect = 1;
+            while (ring_pop(&ring, &p))
+            {
+                if ((uintptr_t)p != expect)
+                {
+                    break;
+                }
+                ++expect;
+            }
+            check(COUNT + 1 == expect);
+            pthread_join(thread, &p);
+            ring_destroy(&ring);
+
+            // Cancelling stops the producer
+            check(0 == ring_init(&ring, 4));
+            check(0 == pthread_create(&thread, NULL, produce, NULL));
+            check(ring_pop(&ring, &p) && 1 == (uintptr_t)p);
+            ring_cancel(&ring);
+            pthread_join(thread, &p);
+            check((uintptr_t)p <= COUNT);
+            ring_destroy(&ring);
+        }
+
+        it("should feed every line and token to the sink")
+        {
+            static char src[1 << 20];
+            size_t len = 0;
+            for (int i = 0; i < 10000; ++i)
+            {
+                len += (size_t)snprintf(src + len, sizeof(src) - len, "a b c\n");
+            }
+            counts_t c = { 0, 0, 0, 0 };
+            check(0 == run(src, len, &c));
+            check(10000 == c.lines);
+            check(10000 * 7 == c.tokens);
+            check(c.batches >= 10000 / 256);
+
+            counts_t none = { 0, 0, 0, 0 };
+            check(0 == run(src, 0, &none) && 0 == none.lines);
+
+            counts_t early = { 0, 0, 0, 300 };
+            check(ECANCELED == run(src, len, &early));
+            check(early.lines >= 300 && early.lines < 10000);
+
+            counts_t bad = { 0, 0, 0, 0 };
+            src[6 * 5000] = '\xFF';
+            check(EILSEQ == run(src, len, &bad) && 5000 == bad.lines);
+        }
+    }
+}
+
@@ -0,0 +1,194 @@
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bdd.h"
+#include "interp.h"
+#include "map.h"
+
+
+#define THREADS 8
+#define RUNS 50
+#define TOBUF (const uint8_t *)
+
+static const char *script = "a b \"c\"\nd e\n\nlast";
+
+typedef struct
+{
+    size_t tokens;
+    error_t err;
+} result_t;
+
+/**
+ * Everything the interpreter wrote for src, and how it ended.
+ */
+static char *
+output_of(const char *src, size_t len, uint64_t fuel, bool pipelined, error_t *err,
+          size_t *outlen)
+{
+    FILE *out = tmpfile();
+    sym_config_t config = { 0, fuel, out, out, pipelined };
+    sym_interp_t in;
+    *err = sym_interp_init(&in, &config);
+    *err = *err ? *err : sym_interp_eval(&in, len, TOBUF src);
+    sym_interp_destroy(&in);
+
+    *outlen = (size_t)ftell(out);
+    char *text = malloc(*outlen + 1);
+    rewind(out);
+    *outlen = fread(text, 1, *outlen, out);
+    fclose(out);
+    return text;
+}
+
+static bool
+same_output(const char *src, size_t len, uint64_t fuel, error_t expect)
+{
+    error_t err1;
+    error_t err2;
+    size_t len1;
+    size_t len2;
+    char *one = output_of(src, len, fuel, false, &err1, &len1);
+    char *two = output_of(src, len, fuel, true, &err2, &len2);
+    bool same = expect == err1 && expect == err2 && len1 == len2 && !memcmp(one, two, len1);
+    free(one);
+    free(two);
+    return same;
+}
+
+static size_t
+count_lines(FILE *f, const char *prefix)
+{
+    char line[256];
+    size_t n = 0;
+    rewind(f);
+    while (fgets(line, sizeof(line), f))
+    {
+        n += !strncmp(line, prefix, strlen(prefix));
+    }
+    return n;
+}
+
+static void *
+run(void *arg)
+{
+    result_t *r = arg;
+    r->tokens = 0;
+    r->err = 0;
+    for (int i = 0; i < RUNS && !r->err; ++i)
+    {
+        FILE *out = tmpfile();
+        sym_config_t config = { 1 << 20, 0, out, out, false };
+        sym_interp_t in;
+        r->err = sym_interp_init(&in, &config);
+        r->err = r->err ? r->err : sym_interp_eval(&in, strlen(script), TOBUF script);
+
+        // Containers made inside stay in this interpreter
+        for (int j = 0; j < 1000 && !r->err; ++j)
+        {
+            data_t m;
+            gcheap_t *prev = gc_use(&in.heap);
+            budget_t *bprev = budget_use(&in.budget);
+            r->err = mk_map(&m);
+            if (!r->err)
+            {
+                map_set(data_map(m), mk_i4(0), m);
+                un_data(m);
+            }
+            budget_use(bprev);
+            gc_use(prev);
+        }
+
+        sym_interp_destroy(&in);
+        size_t tokens = count_lines(out, "Token:");
+        r->tokens = r->tokens ? (r->tokens == tokens ? tokens : 0) : tokens;
+        fclose(out);
+    }
+    return NULL;
+}
+
+spec("symbolscript library")
+{
+    describe("interp")
+    {
+        it("should run instances on many threads at once")
+        {
+            pthread_t t[THREADS];
+            result_t r[THREADS];
+            for (int i = 0; i < THREADS; ++i)
+            {
+                pthread_create(&t[i], NULL, run, &r[i]);
+            }
+            for (int i = 0; i < THREADS; ++i)
+            {
+                pthread_join(t[i], NULL);
+            }
+            for (int i = 0; i < THREADS; ++i)
+            {
+                check(0 == r[i].err, "%d", r[i].err);
+                check(r[i].tokens && r[i].tokens == r[0].tokens);
+            }
+        }
+
+        it("should write to its own streams")
+        {
+            FILE *out = tmpfile();
+            sym_config_t config = { 0, 0, out, NULL, false };
+            sym_interp_t in;
+            check(0 == sym_interp_init(&in, &config));
+            sym_interp_banner(&in);
+            check(0 == sym_interp_eval(&in, strlen(script), TOBUF script));
+            check(1 == count_lines(out, "Welcome"));
+            check(4 == count_lines(out, "Line:"));
+            sym_interp_destroy(&in);
+            fclose(out);
+        }
+
+        it("should stop at its limits")
+        {
+            FILE *out = tmpfile();
+            sym_config_t config = { 0, 3, out, out, false };
+            sym_interp_t in;
+            check(0 == sym_interp_init(&in, &config));
+            check(ETIME == sym_interp_eval(&in, strlen(script), TOBUF script));
+            check(3 == count_lines(out, "Token:"));
+            sym_interp_destroy(&in);
+
+            config.mem_limit = 1;
+            config.fuel = 0;
+            check(0 == sym_interp_init(&in, &config));
+            check(ENOMEM == sym_interp_eval(&in, strlen(script), TOBUF script));
+            sym_interp_destroy(&in);
+            config.pipelined = true;
+            check(0 == sym_interp_init(&in, &config));
+            check(ENOMEM == sym_interp_eval(&in, strlen(script), TOBUF script));
+            sym_interp_destroy(&in);
+            fclose(out);
+        }
+
+        it("should give the same output pipelined")
+        {
+            size_t cap = 1 << 20;
+            char *src = malloc(cap);
+            size_t len = 0;
+            for (int i = 0; i < 20000; ++i)
+            {
+                len += (size_t)snprintf(src + len, cap - len, "%*sword%d \"str %d\" x\n",
+                                        i % 4, "", i, i * 7);
+            }
+            check(same_output(src, len, 0, 0));
+            check(same_output(src, len, 12345, ETIME));
+            check(same_output(src, 0, 0, 0));
+
+            // Stops at the first line that isn't UTF-8
+            memcpy(src + len / 2, "\xC0\xAF", 2);
+            check(same_output(src, len, 0, EILSEQ));
+            free(src);
+        }
+    }
+}
+
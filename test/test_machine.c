@@ -0,0 +1,87 @@
+
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "bdd.h"
+#include "interp.h"
+#include "machine.h"
+#include "map.h"
+#include "scheduler.h"
+
+
+static bool
+pow2(size_t n)
+{
+    return n && !(n & (n - 1));
+}
+
+static data_t
+field(data_t module, const char *name)
+{
+    data_t k;
+    data_t v = mk_bool(false);
+    if (!mk_sym(&k, strlen(name), (const uint8_t *)name))
+    {
+        map_get(data_map(module), k, &v);
+        un_data(k);
+    }
+    return v;
+}
+
+spec("symbolscript library")
+{
+    describe("machine")
+    {
+        it("should find cores, caches and memory")
+        {
+            machine_t m;
+            check(0 == machine_probe(&m));
+            check(m.cores >= 1 && m.physical >= 1 && m.physical <= m.cores);
+            check(pow2(m.line) && pow2(m.page));
+            check(m.l1d > 0 && m.l2 > 0);
+            check(m.memory > 0 && m.available <= m.memory);
+            check(!m.huge_page || m.huge_page > m.page);
+
+            const machine_t *cached = machine();
+            check(cached == machine());
+            check(cached->cores == m.cores && cached->l1d == m.l1d);
+        }
+
+        it("should size work from the caches")
+        {
+            const machine_t *m = machine();
+            check(machine_grain(8, 1, SIZE_MAX) == m->l1d / 16);
+            check(machine_grain(0, 1, SIZE_MAX) == m->l1d / 2);
+            check(100 == machine_grain(SIZE_MAX, 100, 200));
+            check(200 == machine_grain(1, 100, 200));
+            check(machine_batch() == m->l2 / 2);
+
+            sched_t s;
+            check(0 == sched_init(&s, 0));
+            check(m->cores == sched_workers(&s));
+            sched_destroy(&s);
+        }
+
+        it("should give scripts the machine module")
+        {
+            const machine_t *m = machine();
+            data_t module;
+            check(0 == machine_data(&module));
+            check(m->cores == data_u8(field(module, "cores")));
+            check(m->l1d == data_u8(field(module, "l1d")));
+            check(m->memory == data_u8(field(module, "memory")));
+            check(!!(m->features & MACHINE_AVX2) == data_bool(field(module, "avx2")));
+            check(DATA_BIN == data_typeof(field(module, "vendor")));
+            un_data(module);
+
+            sym_interp_t in;
+            check(0 == sym_interp_init(&in, NULL));
+            binding_t *b = context_lookup(&in.context, 7, (const uint8_t *)"machine");
+            check(b && DATA_MAP == data_typeof(*(data_t *)b->bound));
+            check(m->page == data_u8(field(*(data_t *)b->bound, "page")));
+            sym_interp_destroy(&in);
+        }
+    }
+}
+
@@ -0,0 +1,228 @@
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "bdd.h"
+#include "context.h"
+#include "map.h"
+
+
+#define TOBUF (const uint8_t *)
+#define COUNT 20000
+
+static data_t
+key_of(size_t i)
+{
+    char buf[32];
+    int n = snprintf(buf, sizeof(buf), "key-%zu", i);
+    bin_t b;
+    data_t d;
+    mk_bin(&b, (size_t)n, TOBUF buf);
+    mk_bin_data(&d, b);
+    return d;
+}
+
+spec("symbolscript library")
+{
+    describe("map")
+    {
+        it("should set, get and replace")
+        {
+            map_t m;
+            data_t k;
+            data_t v;
+            map_init(&m);
+            check(!map_get(&m, mk_i4(1), &v));
+            check(0 == map_set(&m, mk_i4(1), mk_f8(1.5)));
+            check(0 == map_set(&m, mk_i4(2), mk_f8(2.5)));
+            check(0 == map_set(&m, mk_i4(1), mk_f8(3.5)));
+            check(2 == map_len(&m));
+            check(map_get(&m, mk_i4(1), &v) && 3.5 == data_f8(v));
+            check(!map_get(&m, mk_u4(1), &v));
+
+            size_t it = 0;
+            check(map_next(&m, &it, &k, &v) && 1 == data_i4(k));
+            check(map_next(&m, &it, &k, &v) && 2 == data_i4(k));
+            check(!map_next(&m, &it, &k, &v));
+            map_destroy(&m);
+        }
+
+        it("should find binary keys by content")
+        {
+            map_t m;
+            data_t v;
+            map_init(&m);
+            for (size_t i = 0; i < COUNT; ++i)
+            {
+                data_t k = key_of(i);
+                check(0 == map_set(&m, k, mk_u4((uint32_t)i)));
+                un_data(k);
+            }
+            check(COUNT == map_len(&m));
+            for (size_t i = 0; i < COUNT; ++i)
+            {
+                data_t k = key_of(i);
+                check(map_get(&m, k, &v) && i == data_u4(v));
+                un_data(k);
+            }
+            data_t k = key_of(COUNT);
+            check(!map_get(&m, k, &v));
+            un_data(k);
+            map_destroy(&m);
+        }
+
+        it("should keep insertion order across removals")
+        {
+            map_t m;
+            data_t k;
+            data_t v;
+            map_init(&m);
+            for (uint32_t i = 0; i < COUNT; ++i)
+            {
+                check(0 == map_set(&m, mk_u4(i), mk_u4(i * 2)));
+            }
+            for (uint32_t i = 0; i < COUNT; i += 2)
+            {
+                check(map_del(&m, mk_u4(i)));
+            }
+            check(!map_del(&m, mk_u4(0)));
+            check(COUNT / 2 == map_len(&m));
+
+            // Churn through the holes, forcing rebuilds
+            for (uint32_t round = 0; round < 4; ++round)
+            {
+                for (uint32_t i = 0; i < COUNT; ++i)
+                {
+                    check(0 == map_set(&m, mk_u4(COUNT + i), mk_u4(0)));
+                }
+                for (uint32_t i = 0; i < COUNT; ++i)
+                {
+                    check(map_del(&m, mk_u4(COUNT + i)));
+                }
+            }
+
+            size_t it = 0;
+            uint32_t expect = 1;
+            while (map_next(&m, &it, &k, &v))
+            {
+                check(expect == data_u4(k) && expect * 2 == data_u4(v));
+                expect += 2;
+            }
+            check(COUNT + 1 == expect);
+            map_destroy(&m);
+        }
+
+        it("should keep empty slots while one key comes and goes")
+        {
+            map_t m;
+            data_t v;
+            map_init(&m);
+            check(0 == map_set(&m, mk_i4(-1), mk_i4(0)));
+            for (int32_t i = 0; i < COUNT; ++i)
+            {
+                check(0 == map_set(&m, mk_i4(i), mk_i4(i)));
+                check(map_del(&m, mk_i4(i)));
+                check(!map_get(&m, mk_i4(i), &v));
+            }
+            check(1 == map_len(&m) && map_get(&m, mk_i4(-1), &v));
+            check(m.cap == MAP_GROUP);
+            map_destroy(&m);
+        }
+
+        it("should replace a value with one it owns")
+        {
+            map_t m;
+            data_t v;
+            map_init(&m);
+            data_t k = key_of(1);
+            data_t held = key_of(2);
+            check(0 == map_set(&m, k, held));
+            un_data(held);
+            check(map_get(&m, k, &v));
+            check(0 == map_set(&m, k, v));
+            check(map_get(&m, k, &v) && !memcmp("key-2", bin_bytes(data_bin(v)), 5));
+
+            // Only the old value, a map, holds the new one
+            data_t inner;
+            check(0 == mk_map(&inner));
+            check(0 == map_set(data_map(inner), mk_i4(0), v));
+            check(0 == map_set(&m, k, inner));
+            un_data(inner);
+            check(map_get(&m, k, &v));
+            check(map_get(data_map(v), mk_i4(0), &v));
+            check(0 == map_set(&m, k, v));
+            check(map_get(&m, k, &v) && DATA_BIN == data_typeof(v));
+            check(5 == bin_len(data_bin(v)) && !memcmp("key-2", bin_bytes(data_bin(v)), 5));
+            un_data(k);
+            map_destroy(&m);
+        }
+
+        it("should treat equal values as one key")
+        {
+            map_t m;
+            data_t v;
+            data_t big;
+            data_t big2;
+            map_init(&m);
+            mk_i8(&big, INT64_MIN);
+            mk_i8(&big2, INT64_MIN);
+            check(0 == map_set(&m, big, mk_bool(true)));
+            check(map_get(&m, big2, &v) && data_bool(v));
+            check(0 == map_set(&m, mk_f8(0.0), mk_bool(true)));
+            check(map_get(&m, mk_f8(-0.0), &v));
+            data_t sym;
+            data_t sym2;
+            mk_sym(&sym, 11, TOBUF "long symbol");
+            mk_sym(&sym2, 11, TOBUF "long symbol");
+            check(0 == map_set(&m, sym, mk_bool(false)));
+            check(map_get(&m, sym2, &v) && !data_bool(v));
+            check(3 == map_len(&m));
+            un_data(big);
+            un_data(big2);
+            un_data(sym);
+            un_data(sym2);
+            map_destroy(&m);
+        }
+
+        it("should box maps by reference and refuse mutable keys")
+        {
+            data_t outer;
+            data_t inner;
+            data_t v;
+            check(0 == mk_map(&outer));
+            check(0 == mk_map(&inner));
+            check(DATA_MAP == data_typeof(outer));
+            check(EINVAL == map_set(data_map(outer), inner, mk_bool(true)));
+            check(0 == map_set(data_map(outer), mk_i4(1), inner));
+            check(0 == map_set(data_map(inner), mk_i4(2), mk_i4(3)));
+            un_data(inner);
+            check(map_get(data_map(outer), mk_i4(1), &v));
+            check(map_get(data_map(v), mk_i4(2), &v) && 3 == data_i4(v));
+            check(NULL == data_map(mk_i4(1)));
+            un_data(outer);
+        }
+    }
+
+    describe("context")
+    {
+        it("should bind and look up symbols")
+        {
+            context_t c;
+            int x = 1;
+            int y = 2;
+            context_init(&c);
+            check(0 == context_bind(&c, 1, TOBUF "x", BINDFLAG_LET, &x, NULL));
+            check(0 == context_bind(&c, 10, TOBUF "longer_one", BINDFLAG_LET, &y, NULL));
+            check(EEXIST == context_bind(&c, 1, TOBUF "x", BINDFLAG_LET, &y, NULL));
+            binding_t *b = context_lookup(&c, 10, TOBUF "longer_one");
+            check(b && &y == b->bound);
+            b = context_lookup(&c, 1, TOBUF "x");
+            check(b && &x == b->bound);
+            check(NULL == context_lookup(&c, 1, TOBUF "z"));
+            context_destroy(&c);
+        }
+    }
+}
+
@@ -0,0 +1,199 @@
+#define _GNU_SOURCE
+
+#include <stdint.h>
+#include <string.h>
+
+#include "bdd.h"
+#include "symmem.h"
+
+
+#define TOBUF (const uint8_t *)
+#define BUFLEN 300
+
+static const enum memops_isa _isas[] = { MEMOPS_SCALAR, MEMOPS_SSE2, MEMOPS_AVX2 };
+
+static uint64_t _seed = 0x9E3779B97F4A7C15ULL;
+
+static uint8_t
+rnd(uint8_t range)
+{
+    _seed ^= _seed << 13;
+    _seed ^= _seed >> 7;
+    _seed ^= _seed << 17;
+    return (uint8_t)(_seed % range);
+}
+
+/**
+ * Run every kernel on every available ISA and compare to a naive version.
+ */
+static bool
+agrees(enum memops_isa isa)
+{
+    uint8_t a[BUFLEN];
+    uint8_t b[BUFLEN];
+    uint8_t out[BUFLEN];
+    size_t round;
+
+    if (!memops_set_isa(isa))
+    {
+        return true;
+    }
+
+    for (round = 0; round < 2000; ++round)
+    {
+        size_t len = rnd(255) + rnd(45);
+        size_t i;
+        for (i = 0; i < len; ++i)
+        {
+            // Small alphabet so matches are common
+            a[i] = (uint8_t)('A' + rnd(4) + (rnd(2) ? 32 : 0));
+            b[i] = a[i];
+        }
+        if (len && rnd(2))
+        {
+            b[rnd((uint8_t)(len < 255 ? len : 255))] ^= 1;
+        }
+
+        size_t diff = 0;
+        for (; diff < len && a[diff] == b[diff]; ++diff);
+        if (memeq(a, b, len) != (diff == len))
+        {
+            return false;
+        }
+        int order = memorder(a, len, b, len);
+        int expect = diff == len ? 0 : (int)a[diff] - (int)b[diff];
+        if ((order < 0) != (expect < 0) || (order > 0) != (expect > 0))
+        {
+            return false;
+        }
+
+        uint8_t c = (uint8_t)('A' + rnd(4));
+        const uint8_t *p = membyte(a, len, c);
+        if (p != memchr(a, c, len))
+        {
+            return false;
+        }
+
+        size_t nlen = rnd(6);
+        size_t at = len > nlen ? rnd((uint8_t)(len - nlen < 255 ? len - nlen : 255)) : 0;
+        if (nlen <= len)
+        {
+            const uint8_t *f = memfind(a, len, a + at, nlen);
+            const uint8_t *e = memmem(a, len, a + at, nlen);
+            if (f != e)
+            {
+                return false;
+            }
+        }
+
+        memlower(out, a, len);
+        for (i = 0; i < len; ++i)
+        {
+            uint8_t l = (a[i] >= 'A' && a[i] <= 'Z') ? a[i] + 32 : a[i];
+            if (out[i] != l)
+            {
+                return false;
+            }
+        }
+        memupper(out, a, len);
+        for (i = 0; i < len; ++i)
+        {
+            uint8_t u = (a[i] >= 'a' && a[i] <= 'z') ? a[i] - 32 : a[i];
+            if (out[i] != u)
+            {
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+spec("symbolscript library")
+{
+    describe("memops")
+    {
+        it("should pick an implementation")
+        {
+            check(memops_set_isa(MEMOPS_SCALAR));
+            check(MEMOPS_SCALAR == memops_isa());
+        }
+
+        it("should agree with the naive kernels on every ISA")
+        {
+            size_t i;
+            for (i = 0; i < sizeof(_isas)/sizeof(*_isas); ++i)
+            {
+                check(agrees(_isas[i]), "ISA %d disagrees", (int)_isas[i]);
+            }
+        }
+
+        it("should leave non-ASCII bytes alone when folding")
+        {
+            const char *text = "Grüße, WORLD! ÀÉ";
+            uint8_t out[32];
+            size_t len = strlen(text);
+            size_t i;
+            for (i = 0; i < sizeof(_isas)/sizeof(*_isas); ++i)
+            {
+                if (memops_set_isa(_isas[i]))
+                {
+                    memlower(out, TOBUF text, len);
+                    check(0 == memcmp("grüße, world! ÀÉ", out, len));
+                }
+            }
+        }
+
+        it("should check UTF-8")
+        {
+            static const char *good[] =
+            {
+                "", "plain ascii, long enough for a word or two", "Grüße",
+                "\xE2\x82\xAC", "\xED\x9F\xBF", "\xEE\x80\x80", "\xF0\x90\x80\x80",
+                "\xF4\x8F\xBF\xBF", "0123456\xC2\x80",
+            };
+            static const char *bad[] =
+            {
+                "\x80", "\xC0\xAF", "\xC1\xBF", "\xE0\x80\xAF", "\xED\xA0\x80",
+                "\xF0\x80\x80\xAF", "\xF4\x90\x80\x80", "\xF5\x80\x80\x80",
+                "\xFF", "\xE2\x82", "0123456\xC2", "\xC2\x41", "\xE2\x28\xA1",
+            };
+            size_t i;
+            for (i = 0; i < sizeof(good)/sizeof(*good); ++i)
+            {
+                check(memutf8(TOBUF good[i], strlen(good[i])), "%zu", i);
+            }
+            for (i = 0; i < sizeof(bad)/sizeof(*bad); ++i)
+            {
+                check(!memutf8(TOBUF bad[i], strlen(bad[i])), "%zu", i);
+            }
+        }
+
+        it("should order by length on a common prefix")
+        {
+            check(memorder("abc", 3, "abcd", 4) < 0);
+            check(memorder("abd", 3, "abcd", 4) > 0);
+            check(0 == memorder("", 0, "", 0));
+        }
+
+        it("should hash the same on every ISA")
+        {
+            uint8_t buf[BUFLEN];
+            uint64_t hashes[BUFLEN];
+            size_t len;
+            for (len = 0; len < BUFLEN; ++len)
+            {
+                buf[len] = (uint8_t)len;
+                hashes[len] = memhash(buf, len, 0);
+            }
+            // Distinct for distinct inputs, and seeded
+            for (len = 1; len < BUFLEN; ++len)
+            {
+                check(hashes[len] != hashes[len - 1]);
+            }
+            check(memhash(buf, 10, 0) != memhash(buf, 10, 1));
+            check(memhash("key", 3, 0) == memhash("key", 3, 0));
+        }
+    }
+}
+
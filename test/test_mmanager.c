@@ -0,0 +1,271 @@
+
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "bdd.h"
+#include "map.h"
+#include "mmanager.h"
+#include "symmem.h"
+
+
+#define CYCLES 10000
+
+static int order[8];
+static int ordered;
+
+static void
+note(void *arg)
+{
+    order[ordered++] = (int)(intptr_t)arg;
+}
+
+#define THREADS 4
+#define HANDOFF 256
+
+static data_t handed[HANDOFF];
+static bool handed_ready[HANDOFF];
+
+/**
+ * Make, fill and drop containers, some in cycles, on a thread's own heap.
+ */
+static void *
+churn(void *arg)
+{
+    (void)arg;
+    intptr_t bad = 0;
+    for (int i = 0; i < CYCLES; ++i)
+    {
+        data_t a;
+        data_t b;
+        if (mk_map(&a) || mk_map(&b))
+        {
+            return (void *)1;
+        }
+        bad |= map_set(data_map(a), mk_i4(i), b);
+        bad |= map_set(data_map(b), mk_i4(0), a);
+        bad |= map_set(data_map(b), mk_i4(1), mk_i4(i));
+        un_data(a);
+        un_data(b);
+    }
+    gc_collect(GC_GENS - 1);
+    bad |= 0 != gc_count(GC_GENS - 1);
+    return (void *)bad;
+}
+
+/**
+ * Free the containers another thread makes while it keeps collecting.
+ */
+static void *
+take(void *arg)
+{
+    (void)arg;
+    for (int i = 0; i < HANDOFF; ++i)
+    {
+        while (!__atomic_load_n(&handed_ready[i], __ATOMIC_ACQUIRE))
+        {
+        }
+        un_data(handed[i]);
+    }
+    return NULL;
+}
+
+spec("symbolscript library")
+{
+    describe("region")
+    {
+        it("should bump allocate aligned memory")
+        {
+            region_t r;
+            region_init(&r);
+            uint8_t *a = region_get(&r, 1);
+            uint8_t *b = region_get(&r, 3);
+            uint8_t *c = region_get(&r, 0);
+            check(a && b && c);
+            check(0 == (uintptr_t)a % REGION_ALIGN);
+            check(0 == (uintptr_t)b % REGION_ALIGN);
+            check(b == a + REGION_ALIGN);
+            check(c == b + REGION_ALIGN);
+
+            char *s = region_dup(&r, "hello", 6);
+            check(0 == strcmp("hello", s));
+
+            // Bigger than any block
+            uint8_t *big = region_get(&r, 4 * REGION_BLOCK_MAX);
+            check(big);
+            memset(big, 1, 4 * REGION_BLOCK_MAX);
+            check(0 == strcmp("hello", s));
+            check(NULL == region_get(&r, SIZE_MAX));
+            region_destroy(&r);
+        }
+
+        it("should release to a mark and reuse the memory")
+        {
+            region_t r;
+            region_init(&r);
+            region_get(&r, 100);
+            region_mark_t outer = region_mark(&r);
+            uint8_t *first = region_get(&r, 100);
+
+            for (int line = 0; line < 100; ++line)
+            {
+                region_mark_t m = region_mark(&r);
+                for (int i = 0; i < 1000; ++i)
+                {
+                    uint8_t *p = region_get(&r, 64);
+                    check(p);
+                    memset(p, line, 64);
+                }
+                region_reset(&r, m);
+            }
+            region_reset(&r, outer);
+            check(first == region_get(&r, 100));
+            region_destroy(&r);
+        }
+
+        it("should run cleanups newest first when released")
+        {
+            region_t r;
+            region_init(&r);
+            ordered = 0;
+            check(0 == region_defer(&r, note, (void *)1));
+            region_mark_t m = region_mark(&r);
+            check(0 == region_defer(&r, note, (void *)2));
+            check(0 == region_defer(&r, note, (void *)3));
+            region_reset(&r, m);
+            check(2 == ordered && 3 == order[0] && 2 == order[1]);
+            region_destroy(&r);
+            check(3 == ordered && 1 == order[2]);
+        }
+
+        it("should map full size blocks as huge pages on request")
+        {
+            unsigned flags = mempages();
+            mempages_set(flags | MEMPAGES_HUGE);
+            size_t before = mempages_mapped();
+            region_t r;
+            region_init(&r);
+            for (int i = 0; i < 64; ++i)
+            {
+                uint8_t *p = region_get(&r, 64 * 1024);
+                check(p);
+                memset(p, i, 64 * 1024);
+            }
+            check(mempages_mapped() >= before + MEMPAGES_HUGE_SIZE);
+            region_destroy(&r);
+            check(mempages_mapped() == before);
+
+            size_t len = 1;
+            uint8_t *p = mempages_get(&len);
+            check(p && MEMPAGES_HUGE_SIZE == len);
+            check(0 == (uintptr_t)p % MEMPAGES_HUGE_SIZE);
+            check(0 == p[0] && 0 == p[len - 1]);
+            mempages_put(p, len);
+            mempages_set(flags & ~MEMPAGES_HUGE);
+            len = 1;
+            p = mempages_get(&len);
+            check(p && len < MEMPAGES_HUGE_SIZE);
+            mempages_put(p, len);
+            mempages_set(flags);
+        }
+    }
+
+    describe("cycles")
+    {
+        it("should free containers that only hold each other")
+        {
+            gc_collect(GC_GENS - 1);
+            data_t a;
+            data_t b;
+            check(0 == mk_map(&a));
+            check(0 == mk_map(&b));
+            check(0 == map_set(data_map(a), mk_i4(0), a));
+            check(0 == map_set(data_map(a), mk_i4(1), b));
+            check(0 == map_set(data_map(b), mk_i4(0), a));
+            check(2 == gc_count(0));
+            un_data(a);
+            un_data(b);
+            check(2 == gc_collect(0));
+            check(0 == gc_count(0) && 0 == gc_count(1));
+        }
+
+        it("should keep what is reachable from outside")
+        {
+            gc_collect(GC_GENS - 1);
+            data_t root;
+            data_t v;
+            check(0 == mk_map(&root));
+            for (int32_t i = 0; i < 10; ++i)
+            {
+                data_t m;
+                check(0 == mk_map(&m));
+                check(0 == map_set(data_map(m), mk_i4(0), m));
+                check(0 == map_set(data_map(m), mk_i4(1), root));
+                check(0 == map_set(data_map(m), mk_i4(2), mk_i4(i)));
+                check(0 == map_set(data_map(root), mk_i4(i), m));
+                un_data(m);
+            }
+            check(0 == gc_collect(0));
+            check(0 == gc_count(0) && 11 == gc_count(1));
+            check(0 == gc_collect(GC_GENS - 1));
+            check(11 == gc_count(GC_GENS - 1));
+            check(map_get(data_map(root), mk_i4(7), &v));
+            check(map_get(data_map(v), mk_i4(2), &v) && 7 == data_i4(v));
+
+            un_data(root);
+            check(0 == gc_collect(0));
+            check(11 == gc_collect(GC_GENS - 1));
+            check(0 == gc_count(GC_GENS - 1));
+        }
+
+        it("should collect on many threads at once")
+        {
+            pthread_t threads[THREADS];
+            for (int i = 0; i < THREADS; ++i)
+            {
+                check(0 == pthread_create(&threads[i], NULL, churn, NULL));
+            }
+            for (int i = 0; i < THREADS; ++i)
+            {
+                void *bad;
+                check(0 == pthread_join(threads[i], &bad) && !bad);
+            }
+
+            pthread_t taker;
+            check(0 == pthread_create(&taker, NULL, take, NULL));
+            for (int i = 0; i < HANDOFF; ++i)
+            {
+                check(0 == mk_map(&handed[i]));
+                check(0 == map_set(data_map(handed[i]), mk_i4(0), mk_i4(i)));
+                __atomic_store_n(&handed_ready[i], true, __ATOMIC_RELEASE);
+                for (int j = 0; j < 100; ++j)
+                {
+                    data_t m;
+                    check(0 == mk_map(&m));
+                    un_data(m);
+                }
+                gc_collect(GC_GENS - 1);
+            }
+            check(0 == pthread_join(taker, NULL));
+            gc_collect(GC_GENS - 1);
+            check(0 == gc_count(0) && 0 == gc_count(GC_GENS - 1));
+        }
+
+        it("should collect as containers are made")
+        {
+            gc_collect(GC_GENS - 1);
+            for (int i = 0; i < CYCLES; ++i)
+            {
+                data_t m;
+                check(0 == mk_map(&m));
+                check(0 == map_set(data_map(m), mk_i4(0), m));
+                un_data(m);
+            }
+            check(gc_count(0) < GC_THRESHOLD);
+            check(gc_count(1) < GC_THRESHOLD * GC_RATIO);
+            gc_collect(GC_GENS - 1);
+            check(0 == gc_count(0) && 0 == gc_count(GC_GENS - 1));
+        }
+    }
+}
+
@@ -0,0 +1,319 @@
+
+#include <errno.h>
+#include <locale.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bdd.h"
+#include "number.h"
+
+
+#define TOBUF (const uint8_t *)
+#define ROUNDS 100000
+
+static uint64_t rng = 0x9E3779B97F4A7C15ULL;
+
+static uint64_t
+next(void)
+{
+    rng ^= rng << 13;
+    rng ^= rng >> 7;
+    rng ^= rng << 17;
+    return rng;
+}
+
+static bool
+fmt_is(double v, const char *expect)
+{
+    uint8_t buf[FMT_MAX];
+    size_t n = fmt_f8(buf, v);
+    return n == strlen(expect) && !memcmp(buf, expect, n);
+}
+
+/**
+ * Significant digits in the shortest %e text that reads back, the oracle.
+ */
+static int
+shortest_digits(double v, bool f4)
+{
+    char buf[64];
+    for (int p = 0; p < 17; ++p)
+    {
+        snprintf(buf, sizeof(buf), "%.*e", p, v);
+        if (f4 ? strtof(buf, NULL) == (float)v : strtod(buf, NULL) == v)
+        {
+            return p + 1;
+        }
+    }
+    return 17;
+}
+
+static int
+sig_digits(const uint8_t *s, size_t n)
+{
+    int digits = 0;
+    int zeros = 0;
+    bool lead = true;
+    for (size_t i = 0; i < n && 'e' != s[i]; ++i)
+    {
+        if (s[i] < '0' || s[i] > '9')
+        {
+            continue;
+        }
+        if ('0' == s[i])
+        {
+            if (!lead)
+            {
+                ++zeros;
+            }
+            continue;
+        }
+        lead = false;
+        digits += zeros + 1;
+        zeros = 0;
+    }
+    return digits;
+}
+
+spec("symbolscript library")
+{
+    describe("number")
+    {
+        it("should parse integers")
+        {
+            int64_t i;
+            uint64_t u;
+            check(0 == parse_i8(&i, 3, TOBUF "-42") && -42 == i);
+            check(0 == parse_i8(&i, 20, TOBUF "-9223372036854775808") && INT64_MIN == i);
+            check(ERANGE == parse_i8(&i, 19, TOBUF "9223372036854775808"));
+            check(0 == parse_u8(&u, 20, TOBUF "18446744073709551615") && UINT64_MAX == u);
+            check(ERANGE == parse_u8(&u, 20, TOBUF "18446744073709551616"));
+            check(0 == parse_u8(&u, 24, TOBUF "000000000000000000000007") && 7 == u);
+            check(EINVAL == parse_u8(&u, 0, TOBUF ""));
+            check(EINVAL == parse_u8(&u, 1, TOBUF "-"));
+            check(EINVAL == parse_u8(&u, 2, TOBUF "-1"));
+            check(EINVAL == parse_u8(&u, 11, TOBUF "12345678x90"));
+            check(EINVAL == parse_u8(&u, 25, TOBUF "1234567890123456789012x45"));
+        }
+
+        it("should parse integers of each width")
+        {
+            data_t d;
+            check(0 == parse_data(&d, DATA_I1, 4, TOBUF "-128") && -128 == data_i4(d));
+            check(ERANGE == parse_data(&d, DATA_I1, 3, TOBUF "128"));
+            check(0 == parse_data(&d, DATA_U2, 5, TOBUF "65535") && 65535 == data_u4(d));
+            check(ERANGE == parse_data(&d, DATA_U2, 5, TOBUF "65536"));
+            check(0 == parse_data(&d, DATA_I8, 3, TOBUF "-77") && -77 == data_i8(d));
+            check(EINVAL == parse_data(&d, DATA_BOOL, 1, TOBUF "1"));
+        }
+
+        it("should parse arbitrary precision integers")
+        {
+            const char *big = "-123456789012345678901234567890123456789";
+            data_t d;
+            bin_t b;
+            check(0 == parse_data(&d, DATA_I, strlen(big), TOBUF big));
+            check(DATA_I == data_typeof(d));
+            check(0 == data_format(&b, d));
+            check(bin_len(&b) == strlen(big) && !memcmp(bin_bytes(&b), big, strlen(big)));
+            un_bin(b);
+            un_data(d);
+
+            const char *ubig = "100000000000000000000000000000000000000000000000000";
+            check(0 == parse_data(&d, DATA_U, strlen(ubig), TOBUF ubig));
+            check(0 == data_format(&b, d));
+            check(bin_len(&b) == strlen(ubig) && !memcmp(bin_bytes(&b), ubig, strlen(ubig)));
+            un_bin(b);
+            un_data(d);
+
+            check(EINVAL == parse_data(&d, DATA_U, 21, TOBUF "-100000000000000000000"));
+            check(0 == parse_data(&d, DATA_I, 2, TOBUF "-5"));
+            check(0 == data_format(&b, d));
+            check(2 == bin_len(&b) && !memcmp(bin_bytes(&b), "-5", 2));
+            un_bin(b);
+        }
+
+        it("should print integers")
+        {
+            uint8_t buf[FMT_MAX];
+            char expect[FMT_MAX];
+            check(1 == fmt_u8(buf, 0) && '0' == buf[0]);
+            check(20 == fmt_u8(buf, UINT64_MAX) && !memcmp(buf, "18446744073709551615", 20));
+            check(20 == fmt_i8(buf, INT64_MIN) && !memcmp(buf, "-9223372036854775808", 20));
+            for (int i = 0; i < ROUNDS; ++i)
+            {
+                uint64_t v = next() >> (next() % 64);
+                size_t n = fmt_u8(buf, v);
+                snprintf(expect, sizeof(expect), "%llu", (unsigned long long)v);
+                check(n == strlen(expect) && !memcmp(buf, expect, n), "%s", expect);
+            }
+        }
+
+        it("should print floats like repr")
+        {
+            check(fmt_is(0.0, "0.0"));
+            check(fmt_is(-0.0, "-0.0"));
+            check(fmt_is(1.0, "1.0"));
+            check(fmt_is(0.1, "0.1"));
+            check(fmt_is(0.1 + 0.2, "0.30000000000000004"));
+            check(fmt_is(123.456, "123.456"));
+            check(fmt_is(1e15, "1000000000000000.0"));
+            check(fmt_is(1e16, "1e+16"));
+            check(fmt_is(1.5e300, "1.5e+300"));
+            check(fmt_is(0.0001, "0.0001"));
+            check(fmt_is(1e-05, "1e-05"));
+            check(fmt_is(5e-324, "5e-324"));
+            check(fmt_is(1.7976931348623157e308, "1.7976931348623157e+308"));
+            check(fmt_is(INFINITY, "inf"));
+            check(fmt_is(-INFINITY, "-inf"));
+            check(fmt_is(NAN, "nan"));
+
+            uint8_t buf[FMT_MAX];
+            size_t n = fmt_f4(buf, 0.1f);
+            check(3 == n && !memcmp(buf, "0.1", 3));
+            n = fmt_f4(buf, 16777216.0f);
+            check(10 == n && !memcmp(buf, "16777216.0", 10));
+            n = fmt_f4(buf, 3.4028235e38f);
+            check(13 == n && !memcmp(buf, "3.4028235e+38", 13));
+        }
+
+        it("should print the shortest text that reads back")
+        {
+            uint8_t buf[FMT_MAX];
+            for (int i = 0; i < ROUNDS; ++i)
+            {
+                uint64_t bits = next();
+                double v;
+                memcpy(&v, &bits, sizeof(v));
+                if (isnan(v) || isinf(v))
+                {
+                    continue;
+                }
+                size_t n = fmt_f8(buf, v);
+                double back;
+                check(0 == parse_f8(&back, n, buf));
+                check(back == v, "%.17g", v);
+                check(sig_digits(buf, n) <= shortest_digits(v, false), "%.17g", v);
+            }
+
+            for (int i = 0; i < ROUNDS; ++i)
+            {
+                uint32_t bits = (uint32_t)next();
+                float v;
+                memcpy(&v, &bits, sizeof(v));
+                if (isnan(v) || isinf(v))
+                {
+                    continue;
+                }
+                size_t n = fmt_f4(buf, v);
+                float back;
+                check(0 == parse_f4(&back, n, buf));
+                check(back == v, "%.9g", v);
+                check(sig_digits(buf, n) <= shortest_digits(v, true), "%.9g", v);
+            }
+        }
+
+        it("should parse floats like strtod")
+        {
+            static const char *cases[] =
+            {
+                "0", "-0", "1", ".5", "5.", "1e10", "1E-10", "+3.25",
+                "0.000000000000000000000000000001", "2.2250738585072014e-308",
+                "2.2250738585072011e-308", "4.9e-324", "2.4e-324", "1e-400",
+                "1.7976931348623157e308", "1.7976931348623159e308", "1e400",
+                "9007199254740993", "9007199254740992.5",
+                "123456789012345678901234567890e-10",
+                "0.1000000000000000055511151231257827021181583404541015625",
+                "0.10000000000000000555111512312578270211815834045410156251",
+                "7.2057594037927933e16", "3.0000000000000004",
+            };
+            for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); ++i)
+            {
+                double v;
+                check(0 == parse_f8(&v, strlen(cases[i]), TOBUF cases[i]), "%s", cases[i]);
+                double expect = strtod(cases[i], NULL);
+                check(!memcmp(&v, &expect, sizeof(v)), "%s", cases[i]);
+
+                float f;
+                check(0 == parse_f4(&f, strlen(cases[i]), TOBUF cases[i]), "%s", cases[i]);
+                float fexpect = strtof(cases[i], NULL);
+                check(!memcmp(&f, &fexpect, sizeof(f)), "%s", cases[i]);
+            }
+
+            char text[64];
+            for (int i = 0; i < ROUNDS; ++i)
+            {
+                int digits = 1 + (int)(next() % 25);
+                int at = 0;
+                for (int j = 0; j < digits; ++j)
+                {
+                    text[at++] = (char)('0' + next() % 10);
+                }
+                at += snprintf(text + at, sizeof(text) - at, "e%d", (int)(next() % 700) - 350);
+                double v;
+                check(0 == parse_f8(&v, at, TOBUF text), "%s", text);
+                check(v == strtod(text, NULL), "%s", text);
+                float f;
+                check(0 == parse_f4(&f, at, TOBUF text), "%s", text);
+                check(f == strtof(text, NULL), "%s", text);
+            }
+        }
+
+        it("should parse special floats")
+        {
+            double v;
+            check(0 == parse_f8(&v, 3, TOBUF "inf") && isinf(v) && v > 0);
+            check(0 == parse_f8(&v, 9, TOBUF "-Infinity") && isinf(v) && v < 0);
+            check(0 == parse_f8(&v, 3, TOBUF "NaN") && isnan(v));
+            check(EINVAL == parse_f8(&v, 0, TOBUF ""));
+            check(EINVAL == parse_f8(&v, 1, TOBUF "."));
+            check(EINVAL == parse_f8(&v, 2, TOBUF "1e"));
+            check(EINVAL == parse_f8(&v, 4, TOBUF "1.2x"));
+            check(EINVAL == parse_f8(&v, 4, TOBUF "info"));
+        }
+
+        it("should parse hard floats the same in any locale")
+        {
+            // Just past halfway, so only the slow path rounds these up
+            const char *f8 = "1.00000000000000011102230246251565404236316680908203125001";
+            const char *f4 = "1.000000059604644775390625001";
+            const char *names[] = { "de_DE.UTF-8", "fr_FR.UTF-8", "de_DE", "C" };
+            size_t i;
+            for (i = 0; i < sizeof(names)/sizeof(*names); ++i)
+            {
+                if (!setlocale(LC_NUMERIC, names[i]))
+                {
+                    continue;
+                }
+                double v;
+                check(0 == parse_f8(&v, strlen(f8), TOBUF f8), "%s", names[i]);
+                check(nextafter(1.0, 2.0) == v, "%s", names[i]);
+                float f;
+                check(0 == parse_f4(&f, strlen(f4), TOBUF f4), "%s", names[i]);
+                check(nextafterf(1.0f, 2.0f) == f, "%s", names[i]);
+            }
+            setlocale(LC_NUMERIC, "C");
+        }
+
+        it("should format any value")
+        {
+            bin_t b;
+            data_t d = mk_bool(true);
+            check(0 == data_format(&b, d) && 4 == bin_len(&b));
+            un_bin(b);
+            d = mk_f8(2.5);
+            check(0 == data_format(&b, d) && 3 == bin_len(&b));
+            check(!memcmp(bin_bytes(&b), "2.5", 3));
+            un_bin(b);
+            check(0 == mk_sym(&d, 5, TOBUF "hello"));
+            check(0 == data_format(&b, d) && 5 == bin_len(&b));
+            check(!memcmp(bin_bytes(&b), "hello", 5));
+            un_bin(b);
+            un_data(d);
+        }
+    }
+}
+
@@ -0,0 +1,170 @@
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "bdd.h"
+#include "pipeline.h"
+
+
+// Bytes in the lines 1 to 100000
+#define SEQ_BYTES 588895
+
+#define ARGV(...) ((char *[]){ __VA_ARGS__, NULL })
+
+static bool
+read_is(int fd, const char *expect)
+{
+    char buf[256];
+    size_t got = 0;
+    ssize_t n;
+    while (got < sizeof(buf) && (n = read(fd, buf + got, sizeof(buf) - got)) > 0)
+    {
+        got += (size_t)n;
+    }
+    return got == strlen(expect) && !memcmp(buf, expect, got);
+}
+
+spec("symbolscript library")
+{
+    describe("pipeline")
+    {
+        it("should connect the stages in order")
+        {
+            pipeline_t p;
+            int code;
+            char *const *argvs[] =
+            {
+                ARGV("printf", "b\\na\\nc\\n"),
+                ARGV("sort"),
+                ARGV("tr", "a-z", "A-Z"),
+            };
+            check(0 == pipeline_start(&p, 3, argvs, PIPELINE_INHERIT, PIPELINE_PIPE));
+            check(read_is(p.out, "A\nB\nC\n"));
+            check(0 == pipeline_wait(&p, NULL, false, &code) && 0 == code);
+            pipeline_destroy(&p);
+
+            // Fed from our end
+            char *const *cat[] = { ARGV("cat") };
+            check(0 == pipeline_start(&p, 1, cat, PIPELINE_PIPE, PIPELINE_PIPE));
+            check(5 == write(p.in, "hello", 5));
+            close(p.in);
+            p.in = -1;
+            check(read_is(p.out, "hello"));
+            check(0 == pipeline_wait(&p, NULL, false, &code) && 0 == code);
+            pipeline_destroy(&p);
+
+            check(EINVAL == pipeline_start(&p, 0, argvs, PIPELINE_INHERIT, PIPELINE_INHERIT));
+        }
+
+        it("should report exit codes with and without pipefail")
+        {
+            pipeline_t p;
+            int code;
+            char *const *argvs[] =
+            {
+                ARGV("sh", "-c", "exit 3"),
+                ARGV("sh", "-c", "exit 2"),
+                ARGV("true"),
+            };
+            check(0 == pipeline_start(&p, 3, argvs, PIPELINE_INHERIT, PIPELINE_INHERIT));
+            check(0 == pipeline_wait(&p, NULL, false, &code) && 0 == code);
+            check(3 == p.codes[0] && 2 == p.codes[1] && 0 == p.codes[2]);
+            pipeline_destroy(&p);
+
+            check(0 == pipeline_start(&p, 3, argvs, PIPELINE_INHERIT, PIPELINE_INHERIT));
+            check(0 == pipeline_wait(&p, NULL, true, &code) && 2 == code);
+            pipeline_destroy(&p);
+
+            char *const *killed[] = { ARGV("sh", "-c", "kill -9 $$") };
+            check(0 == pipeline_start(&p, 1, killed, PIPELINE_INHERIT, PIPELINE_INHERIT));
+            check(0 == pipeline_wait(&p, NULL, true, &code) && 128 + 9 == code);
+            pipeline_destroy(&p);
+
+            char *const *missing[] = { ARGV("true"), ARGV("sym-no-such-program") };
+            check(ENOENT == pipeline_start(&p, 2, missing, PIPELINE_INHERIT, PIPELINE_INHERIT));
+
+            // A stage that never writes isn't left to run its course
+            time_t start = time(NULL);
+            char *const *stuck[] = { ARGV("sleep", "30"), ARGV("sym-no-such-program") };
+            check(ENOENT == pipeline_start(&p, 2, stuck, PIPELINE_INHERIT, PIPELINE_INHERIT));
+            check(time(NULL) - start < 10);
+        }
+
+        it("should forward between pipelines without copying")
+        {
+            pipeline_t from;
+            pipeline_t to;
+            int code;
+            size_t moved;
+            char *const *seq[] = { ARGV("seq", "1", "100000") };
+            char *const *wc[] = { ARGV("wc", "-l") };
+            check(0 == pipeline_start(&from, 1, seq, PIPELINE_INHERIT, PIPELINE_PIPE));
+            check(0 == pipeline_start(&to, 1, wc, PIPELINE_PIPE, PIPELINE_PIPE));
+            check(0 == pipe_forward(from.out, to.in, &moved) && SEQ_BYTES == moved);
+            close(to.in);
+            to.in = -1;
+            check(read_is(to.out, "100000\n"));
+            check(0 == pipeline_wait(&from, NULL, true, &code) && 0 == code);
+            check(0 == pipeline_wait(&to, NULL, true, &code) && 0 == code);
+            pipeline_destroy(&from);
+            pipeline_destroy(&to);
+
+            // Between plain files it copies
+            FILE *a = tmpfile();
+            FILE *b = tmpfile();
+            check(a && b);
+            check(3 == write(fileno(a), "abc", 3));
+            lseek(fileno(a), 0, SEEK_SET);
+            check(0 == pipe_forward(fileno(a), fileno(b), &moved) && 3 == moved);
+            fclose(a);
+            fclose(b);
+        }
+
+        it("should tee a stream to a stage and a file")
+        {
+            pipeline_t from;
+            pipeline_t to;
+            int code;
+            size_t moved;
+            FILE *copy = tmpfile();
+            check(copy);
+            char *const *seq[] = { ARGV("seq", "1", "100000") };
+            char *const *wc[] = { ARGV("wc", "-l") };
+            check(0 == pipeline_start(&from, 1, seq, PIPELINE_INHERIT, PIPELINE_PIPE));
+            check(0 == pipeline_start(&to, 1, wc, PIPELINE_PIPE, PIPELINE_PIPE));
+            check(0 == pipe_tee(from.out, to.in, fileno(copy), &moved) && SEQ_BYTES == moved);
+            close(to.in);
+            to.in = -1;
+            check(read_is(to.out, "100000\n"));
+            struct stat st;
+            check(0 == fstat(fileno(copy), &st) && SEQ_BYTES == st.st_size);
+            check(0 == pipeline_wait(&from, NULL, true, &code) && 0 == code);
+            check(0 == pipeline_wait(&to, NULL, true, &code) && 0 == code);
+            pipeline_destroy(&from);
+            pipeline_destroy(&to);
+            fclose(copy);
+        }
+
+        it("should wait on the event loop")
+        {
+            sched_t s;
+            evloop_t ev;
+            pipeline_t p;
+            int code;
+            check(0 == sched_init(&s, 1));
+            check(0 == evloop_init(&ev, &s));
+            char *const *argvs[] = { ARGV("sh", "-c", "sleep 0.05; exit 4"), ARGV("cat") };
+            check(0 == pipeline_start(&p, 2, argvs, PIPELINE_INHERIT, PIPELINE_INHERIT));
+            check(0 == pipeline_wait(&p, &ev, true, &code) && 4 == code);
+            pipeline_destroy(&p);
+            evloop_destroy(&ev);
+            sched_destroy(&s);
+        }
+    }
+}
+
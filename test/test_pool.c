@@ -0,0 +1,287 @@
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "bdd.h"
+#include "map.h"
+#include "symmem.h"
+
+
+#define THREADS 4
+#define OBJECTS 20000
+#define LIMIT (1024 * 1024)
+
+static void *handoff[THREADS][OBJECTS];
+
+static void *
+produce(void *arg)
+{
+    void **slots = arg;
+    for (size_t i = 0; i < OBJECTS; ++i)
+    {
+        size_t size = 1 + i % 300;
+        uint8_t *p = memget(size);
+        if (p)
+        {
+            memset(p, (int)(i & 0xFF), size);
+        }
+        slots[i] = p;
+    }
+    return NULL;
+}
+
+static void *
+give_back(void *arg)
+{
+    memput(arg);
+    return NULL;
+}
+
+static void *
+consume(void *arg)
+{
+    void **slots = arg;
+    bool ok = true;
+    for (size_t i = 0; i < OBJECTS; ++i)
+    {
+        uint8_t *p = slots[i];
+        size_t size = 1 + i % 300;
+        ok = ok && p && p[0] == (i & 0xFF) && p[size - 1] == (i & 0xFF);
+        memput(p);
+    }
+    return ok ? arg : NULL;
+}
+
+spec("symbolscript library")
+{
+    describe("pool")
+    {
+        it("should give aligned, distinct, writable blocks of every size")
+        {
+            static void *ptrs[9000];
+            for (size_t size = 0; size < 9000; ++size)
+            {
+                uint8_t *p = memget(size);
+                check(p);
+                check(0 == (uintptr_t)p % 16);
+                memset(p, (int)(size & 0xFF), size);
+                ptrs[size] = p;
+            }
+            for (size_t size = 1; size < 9000; ++size)
+            {
+                uint8_t *p = ptrs[size];
+                check(p[0] == (size & 0xFF) && p[size - 1] == (size & 0xFF));
+                check(ptrs[size] != ptrs[size - 1]);
+            }
+            for (size_t size = 0; size < 9000; ++size)
+            {
+                memput(ptrs[size]);
+            }
+            memput(NULL);
+        }
+
+        it("should keep contents across memreget")
+        {
+            uint8_t *p = memget(10);
+            memcpy(p, "0123456789", 10);
+            for (size_t size = 10; size < 100000; size = size * 3 / 2)
+            {
+                p = memreget(p, size);
+                check(p && !memcmp(p, "0123456789", 10));
+            }
+            p = memreget(p, 5);
+            check(p && !memcmp(p, "01234", 5));
+            memput(p);
+            p = memreget(NULL, 32);
+            check(p);
+            memput(p);
+        }
+
+#if !defined(SYM_LIBC_MALLOC) && !defined(__SANITIZE_ADDRESS__)
+        it("should reuse freed blocks")
+        {
+            void *a = memget(48);
+            memput(a);
+            void *b = memget(40);
+            check(a == b);
+            memput(b);
+        }
+#endif
+
+        it("should take frees from other threads")
+        {
+            pthread_t t[THREADS];
+            for (int round = 0; round < 3; ++round)
+            {
+                for (int i = 0; i < THREADS; ++i)
+                {
+                    pthread_create(&t[i], NULL, produce, handoff[i]);
+                }
+                for (int i = 0; i < THREADS; ++i)
+                {
+                    pthread_join(t[i], NULL);
+                }
+                // Each thread frees what another allocated
+                for (int i = 0; i < THREADS; ++i)
+                {
+                    pthread_create(&t[i], NULL, consume, handoff[(i + 1) % THREADS]);
+                }
+                for (int i = 0; i < THREADS; ++i)
+                {
+                    void *ok;
+                    pthread_join(t[i], &ok);
+                    check(NULL != ok);
+                }
+            }
+        }
+    }
+    describe("budget")
+    {
+        it("should refuse memory past the limit")
+        {
+            static void *blocks[LIMIT / 1000 + 1];
+            budget_t b;
+            check(0 == budget_init(&b, LIMIT, 0));
+            budget_t *prev = budget_use(&b);
+            check(NULL == prev);
+
+            size_t n = 0;
+            while (n < sizeof(blocks) / sizeof(blocks[0]) && (blocks[n] = memget(1000)))
+            {
+                memset(blocks[n++], 0xAB, 1000);
+            }
+            check(n * 1000 <= LIMIT && n * 1000 > LIMIT / 2, "%zu", n);
+            check(budget_used(&b) <= LIMIT);
+            check(NULL == memget(2 * LIMIT));
+
+            for (size_t i = 0; i < n; ++i)
+            {
+                memput(blocks[i]);
+            }
+            for (size_t i = 0; i < n; ++i)
+            {
+                blocks[i] = memget(1000);
+                check(blocks[i]);
+            }
+
+            // Outside the budget again
+            budget_use(prev);
+            void *free_range = memget(2 * LIMIT);
+            check(free_range);
+            memput(free_range);
+            budget_destroy(&b);
+        }
+
+        it("should give a clean error to callers")
+        {
+            budget_t b;
+            data_t m;
+            budget_init(&b, 0, 0);
+            budget_t *prev = budget_use(&b);
+            check(ENOMEM == mk_map(&m));
+            budget_use(prev);
+            budget_destroy(&b);
+        }
+
+        it("should keep blocks charged to their budget")
+        {
+            budget_t b;
+            budget_init(&b, LIMIT, 0);
+            budget_t *prev = budget_use(&b);
+            uint8_t *p = memget(100);
+            uint8_t *big = memget(100000);
+            budget_use(prev);
+            check(p && big);
+            size_t used = budget_used(&b);
+
+            // Grown outside the budget, still charged to it
+            memset(p, 7, 100);
+            p = memreget(p, 5000);
+            check(p && 7 == p[99]);
+            check(budget_used(&b) > used);
+
+            pthread_t t;
+            pthread_create(&t, NULL, give_back, big);
+            pthread_join(t, NULL);
+            check(budget_used(&b) < used + 5000);
+
+            // Still holds p, destroy frees it
+            budget_destroy(&b);
+        }
+
+        it("should burn fuel")
+        {
+            budget_t b;
+            budget_init(&b, 0, 10);
+            check(budget_burn(&b, 4));
+            check(budget_burn(&b, 6));
+            check(!budget_burn(&b, 1));
+            check(0 == b.fuel);
+            budget_destroy(&b);
+        }
+    }
+
+    describe("accounting")
+    {
+        it("should count blocks against their subsystem and call site")
+        {
+            if (memstats_enabled())
+            {
+                memstat_t before = memstats_tag(MEMTAG_OTHER);
+                void *p = memget(1000);
+                memstat_t during = memstats_tag(MEMTAG_OTHER);
+                check(during.live == before.live + 1000);
+                check(during.count == before.count + 1);
+                check(during.peak >= during.live);
+                p = memreget(p, 3000);
+                check(memstats_tag(MEMTAG_OTHER).live == before.live + 3000);
+                memput(p);
+                check(memstats_tag(MEMTAG_OTHER).live == before.live);
+
+                memstat_t data = memstats_tag(MEMTAG_DATA);
+                data_t m;
+                check(0 == mk_map(&m));
+                check(0 == map_set(data_map(m), mk_i4(1), mk_i4(2)));
+                check(memstats_tag(MEMTAG_DATA).live > data.live);
+                un_data(m);
+                check(memstats_tag(MEMTAG_DATA).live == data.live);
+                check(0 == memstats_tag(MEMTAG_VM).count);
+            }
+            else
+            {
+                check(0 == memstats_tag(MEMTAG_DATA).count);
+                check(ENOTSUP == memstats_dump("/dev/null"));
+            }
+        }
+
+        it("should write a snapshot with a line per call site")
+        {
+            if (memstats_enabled())
+            {
+                void *keep = memget(77);
+                char path[] = "/tmp/test_pool_snapshotXXXXXX";
+                int fd = mkstemp(path);
+                check(fd >= 0);
+                close(fd);
+                check(0 == memstats_dump(path));
+
+                FILE *f = fopen(path, "r");
+                check(f);
+                char line[512];
+                bool found = false;
+                while (fgets(line, sizeof(line), f))
+                {
+                    found = found || (strstr(line, "test_pool.c") && strstr(line, "\tother\t77\t"));
+                }
+                fclose(f);
+                remove(path);
+                check(found);
+                memput(keep);
+            }
+        }
+    }
+}
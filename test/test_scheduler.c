@@ -0,0 +1,213 @@
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+
+#include "bdd.h"
+#include "map.h"
+#include "scheduler.h"
+
+
+#define TASKS 10000
+
+static sched_t s;
+
+static error_t
+fib(data_t *result, size_t ncaptured, const data_t *captured)
+{
+    (void)ncaptured;
+    int32_t n = data_i4(captured[0]);
+    if (n < 2)
+    {
+        *result = mk_i4(n);
+        return 0;
+    }
+
+    task_t *t;
+    data_t a;
+    data_t b;
+    error_t err = sched_spawn(&s, &t, fib, 1, (data_t[]){ mk_i4(n - 1) });
+    if (err)
+    {
+        return err;
+    }
+    fib(&b, 1, (data_t[]){ mk_i4(n - 2) });
+    err = sched_await(t, &a);
+    if (!err)
+    {
+        *result = mk_i4(data_i4(a) + data_i4(b));
+    }
+    return err;
+}
+
+static int32_t
+fib_of(int32_t n)
+{
+    return n < 2 ? n : fib_of(n - 1) + fib_of(n - 2);
+}
+
+static error_t
+lookup(data_t *result, size_t ncaptured, const data_t *captured)
+{
+    (void)ncaptured;
+    data_t v;
+    if (!map_get(data_map(captured[0]), captured[1], &v))
+    {
+        return ENOENT;
+    }
+    *result = mk_i4(data_i4(v) * 2);
+    return 0;
+}
+
+static error_t
+fail(data_t *result, size_t ncaptured, const data_t *captured)
+{
+    (void)result;
+    (void)ncaptured;
+    (void)captured;
+    return EDOM;
+}
+
+static error_t
+square(size_t lo, size_t hi, void *arg)
+{
+    int64_t *v = arg;
+    for (size_t i = lo; i < hi; ++i)
+    {
+        if (v[i] < 0)
+        {
+            return (error_t)-v[i];
+        }
+        v[i] = v[i] * v[i];
+    }
+    return 0;
+}
+
+static void *
+outside(void *arg)
+{
+    (void)arg;
+    data_t r;
+    int32_t sum = 0;
+    for (int32_t i = 0; i < 100; ++i)
+    {
+        task_t *t;
+        if (sched_spawn(&s, &t, fib, 1, (data_t[]){ mk_i4(i % 15) }))
+        {
+            return NULL;
+        }
+        if (!sched_await(t, &r))
+        {
+            sum += data_i4(r);
+        }
+    }
+    return (void *)(intptr_t)sum;
+}
+
+spec("symbolscript library")
+{
+    describe("scheduler")
+    {
+        it("should spawn and await recursively")
+        {
+            check(0 == sched_init(&s, 4));
+            check(4 == sched_workers(&s));
+            task_t *t;
+            data_t r;
+            check(0 == sched_spawn(&s, &t, fib, 1, (data_t[]){ mk_i4(24) }));
+            check(0 == sched_await(t, &r) && fib_of(24) == data_i4(r));
+            sched_destroy(&s);
+        }
+
+        it("should share captured values between tasks")
+        {
+            check(0 == sched_init(&s, 0));
+            check(sched_workers(&s) >= 1);
+            data_t m;
+            check(0 == mk_map(&m));
+            for (int32_t i = 0; i < 100; ++i)
+            {
+                check(0 == map_set(data_map(m), mk_i4(i), mk_i4(i)));
+            }
+
+            static task_t *tasks[TASKS];
+            for (int32_t i = 0; i < TASKS; ++i)
+            {
+                check(0 == sched_spawn(&s, &tasks[i], lookup, 2, (data_t[]){ m, mk_i4(i % 101) }));
+            }
+            un_data(m);
+            size_t missing = 0;
+            for (int32_t i = 0; i < TASKS; ++i)
+            {
+                data_t r;
+                error_t err = sched_await(tasks[i], &r);
+                if (ENOENT == err)
+                {
+                    ++missing;
+                }
+                else
+                {
+                    check(0 == err && (i % 101) * 2 == data_i4(r));
+                }
+            }
+            check(TASKS / 101 == missing);
+
+            task_t *t;
+            data_t r = mk_i4(7);
+            check(0 == sched_spawn(&s, &t, fail, 0, NULL));
+            check(EDOM == sched_await(t, &r) && 7 == data_i4(r));
+            sched_destroy(&s);
+        }
+
+        it("should split loops across the workers")
+        {
+            check(0 == sched_init(&s, 4));
+            static int64_t v[TASKS * 10];
+            size_t n = sizeof(v) / sizeof(v[0]);
+            for (size_t i = 0; i < n; ++i)
+            {
+                v[i] = (int64_t)i;
+            }
+            check(0 == sched_for(&s, n, 64, square, v));
+            size_t wrong = 0;
+            for (size_t i = 0; i < n; ++i)
+            {
+                wrong += (int64_t)(i * i) != v[i];
+            }
+            check(0 == wrong);
+
+            for (size_t i = 0; i < n; ++i)
+            {
+                v[i] = (int64_t)i;
+            }
+            v[100] = -EDOM;
+            v[n - 5] = -ERANGE;
+            check(EDOM == sched_for(&s, n, 1, square, v));
+            check(0 == sched_for(&s, 0, 0, square, v));
+            sched_destroy(&s);
+        }
+
+        it("should take tasks from threads that are not workers")
+        {
+            check(0 == sched_init(&s, 2));
+            pthread_t threads[4];
+            for (int i = 0; i < 4; ++i)
+            {
+                check(0 == pthread_create(&threads[i], NULL, outside, NULL));
+            }
+            int32_t expect = 0;
+            for (int32_t i = 0; i < 100; ++i)
+            {
+                expect += fib_of(i % 15);
+            }
+            for (int i = 0; i < 4; ++i)
+            {
+                void *sum;
+                pthread_join(threads[i], &sum);
+                check(expect == (int32_t)(intptr_t)sum);
+            }
+            sched_destroy(&s);
+        }
+    }
+}
+
@@ -0,0 +1,214 @@
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "bdd.h"
+#include "symmem.h"
+#include "xargs.h"
+
+
+#define RECORDS 5000
+#define SLOW 10
+
+typedef struct
+{
+    size_t at;
+    size_t n;
+    const char *big; // Returned once after the others, when set
+    char rec[32];
+    char out[65536];
+    size_t len;
+    size_t order[RECORDS];
+    int codes[RECORDS];
+    size_t ndone;
+} run_t;
+
+static const char *
+count_up(void *arg)
+{
+    run_t *r = arg;
+    if (r->at == r->n)
+    {
+        const char *big = r->big;
+        r->big = NULL;
+        return big;
+    }
+    // Reused each call, as a stream reader would
+    snprintf(r->rec, sizeof(r->rec), "%zu", ++r->at);
+    return r->rec;
+}
+
+static error_t
+output(void *arg, size_t job, const uint8_t *buf, size_t len)
+{
+    (void)job;
+    run_t *r = arg;
+    if (r->len + len > sizeof(r->out))
+    {
+        return ENOSPC;
+    }
+    memcpy(r->out + r->len, buf, len);
+    r->len += len;
+    return 0;
+}
+
+static error_t
+done(void *arg, size_t job, int code)
+{
+    run_t *r = arg;
+    r->codes[job] = code;
+    r->order[r->ndone++] = job;
+    return 0;
+}
+
+static void
+run_init(run_t *r, size_t n)
+{
+    memset(r, 0, sizeof(*r));
+    r->n = n;
+}
+
+/**
+ * Output holds the numbers 1 to n in order, whatever the line breaks.
+ */
+static bool
+counts_up(run_t *r)
+{
+    char *at = r->out;
+    char *end = r->out + r->len;
+    for (size_t i = 1; i <= r->n; ++i)
+    {
+        char *stop;
+        if (at >= end || i != strtoul(at, &stop, 10))
+        {
+            return false;
+        }
+        at = stop;
+        while (at < end && (' ' == *at || '\n' == *at))
+        {
+            ++at;
+        }
+    }
+    return at == end;
+}
+
+static double
+now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+spec("symbolscript library")
+{
+    describe("xargs")
+    {
+        it("should batch records into as few commands as fit")
+        {
+            run_t r;
+            size_t failed;
+            run_init(&r, RECORDS);
+            xargs_t x = { (char *[]){ "echo", NULL }, 4, 0, true, count_up, output, done, &r };
+            check(0 == xargs_run(&x, &failed) && 0 == failed);
+            check(counts_up(&r));
+            check(1 == r.ndone && 0 == r.codes[0]);
+
+            run_init(&r, RECORDS);
+            x.max_args = 7;
+            check(0 == xargs_run(&x, &failed) && 0 == failed);
+            check(counts_up(&r));
+            check((RECORDS + 6) / 7 == r.ndone);
+            for (size_t i = 0; i < r.ndone; ++i)
+            {
+                check(i == r.order[i]);
+            }
+        }
+
+        it("should keep order or hand over as jobs finish")
+        {
+            run_t r;
+            size_t failed;
+            // Later records finish sooner
+            char *cmd[] = { "sh", "-c", "sleep 0.$((10 - $1)); echo $1", "sh", NULL };
+            run_init(&r, SLOW);
+            xargs_t x = { cmd, SLOW, 1, true, count_up, output, done, &r };
+            check(0 == xargs_run(&x, &failed) && 0 == failed);
+            check(counts_up(&r));
+            check(0 == r.order[0] && SLOW - 1 == r.order[SLOW - 1]);
+
+            run_init(&r, SLOW);
+            x.ordered = false;
+            check(0 == xargs_run(&x, &failed) && 0 == failed);
+            check(SLOW == r.ndone && SLOW - 1 == r.order[0] && 0 == r.order[SLOW - 1]);
+            check(0 == strncmp("10\n", r.out, 3));
+        }
+
+        it("should put each record in place of {}")
+        {
+            run_t r;
+            size_t failed;
+            char *cmd[] = { "sh", "-c", "echo x; exit $(($0 % 3))", "{}", NULL };
+            run_init(&r, 9);
+            xargs_t x = { cmd, 0, 0, true, count_up, output, done, &r };
+            check(0 == xargs_run(&x, &failed) && 6 == failed);
+            check(9 == r.ndone && 18 == r.len);
+            check(1 == r.codes[0] && 2 == r.codes[1] && 0 == r.codes[2]);
+        }
+
+        it("should run jobs side by side")
+        {
+            run_t r;
+            size_t failed;
+            double start = now();
+            run_init(&r, SLOW);
+            xargs_t x = { (char *[]){ "sh", "-c", "sleep 0.2", "{}", NULL }, SLOW, 0, false, count_up, NULL, NULL, &r };
+            check(0 == xargs_run(&x, &failed) && 0 == failed);
+            check(now() - start < SLOW * 0.2 / 2);
+        }
+
+        it("should refuse a record no command line can hold")
+        {
+            run_t r;
+            size_t failed;
+            size_t len = (size_t)sysconf(_SC_ARG_MAX) + 1;
+            char *big = memget(len + 1);
+            check(big);
+            memset(big, 'x', len);
+            big[len] = 0;
+            run_init(&r, 3);
+            r.big = big;
+            xargs_t x = { (char *[]){ "echo", NULL }, 1, 0, true, count_up, output, done, &r };
+            check(E2BIG == xargs_run(&x, &failed));
+            check(1 == r.ndone && 6 == r.len && !memcmp("1 2 3\n", r.out, 6));
+
+            // Fits in ARG_MAX, but not in one argument
+            x.cmd = (char *[]){ "true", NULL };
+            len = 32 * (size_t)sysconf(_SC_PAGESIZE);
+            big[len] = 0;
+            run_init(&r, 3);
+            r.big = big;
+            check(E2BIG == xargs_run(&x, &failed));
+            check(1 == r.ndone && 0 == r.codes[0]);
+            len -= 1;
+            big[len] = 0;
+            run_init(&r, 3);
+            r.big = big;
+            check(0 == xargs_run(&x, &failed) && 0 == failed);
+            check(1 == r.ndone && 0 == r.codes[0]);
+            memput(big);
+
+            // Jobs already started are finished
+            run_init(&r, 3);
+            x.max_args = 1;
+            x.cmd = (char *[]){ "sym-no-such-program", NULL };
+            check(ENOENT == xargs_run(&x, &failed) && 0 == r.ndone);
+        }
+    }
+}
+